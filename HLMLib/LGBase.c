@@ -43,6 +43,7 @@ char *lgbase_vc_id = "$Id: LGBase.c,v 1.1.1.1 2006/10/11 09:54:43 jal58 Exp $";
 #include "LUtil.h"
 #include "LWMap.h"
 #include "LGBase.h"
+#include <pthread.h>
 
 /* ------------------------ Trace Flags --------------------- */
 
@@ -63,6 +64,7 @@ static int sqOffset;                    /* squash offset, this depends on byte *
 static Boolean checkOrder = FALSE;      /* Check n-gram ordering */
 static Boolean natReadOrder = FALSE;    /* Preserve natural read byte order */
 static Boolean natWriteOrder = FALSE;   /* Preserve natural write byte order */
+static NGFormat gramFormat = NG_PACKED; /* format of gram files written */
 extern Boolean vaxOrder;                /* True if byteswapping needed to preserve SUNSO */
 
 /* --------------------- Initialisation --------------------- */
@@ -72,6 +74,7 @@ void InitGBase(void)
 {
    int i;
    Boolean b;
+   char buf[MAXSTRLEN];
 
    Register(lgbase_version,lgbase_vc_id);
    /* get config variables for this module */
@@ -81,6 +84,7 @@ void InitGBase(void)
       if (GetConfBool(cParm,nParm,"NATURALREADORDER",&b)) natReadOrder = b;
       if (GetConfBool(cParm,nParm,"NATURALWRITEORDER",&b)) natWriteOrder = b;
       if (GetConfBool(cParm,nParm,"CHECKORDER",&b)) checkOrder = b;
+      if (GetConfStr(cParm,nParm,"GRAMFORMAT",buf)) gramFormat = NGFormatByName(buf);
    }
    /* Set byte order */
    sqOffset =  sizeof(UInt) - SQUASH;
@@ -277,6 +281,279 @@ static void SetNext(NGSource *ngs, Byte ngRawBuf[GSIZE])
    }
 }
 
+/* ------------------ Delta Coded Gram Files ------------------- */
+
+/* 
+   An NG_DELTA gram file body is a sequence of blocks of at most
+   blkSize N-grams.  Each block starts with a header of varints
+   {nGrams, nBytes, w1 .. wN} giving the number of N-grams, the byte
+   size of the block and the last N-gram, so that blocks can be
+   skipped without decoding.  Within a block each N-gram is a tag
+   byte holding the length p of the prefix shared with the previous
+   N-gram (low 3 bits) and the count if it is less than 32 (else 0),
+   followed by zig-zag varint deltas of words p..N-1 and, if not in
+   the tag, a varint count.  The count is coded as the raw UInt held
+   in the N-gram, so float counts (LM_FLOAT_COUNT) are stored as
+   their bit patterns.  The first N-gram of a block is coded
+   against zeros so blocks decode independently.
+*/
+
+#define NGBLOCK     256   /* N-grams per NG_DELTA block on output */
+#define MAXVARBYTES 5     /* max bytes in a varint UInt */
+#define MAXINLCOUNT 32    /* counts below this are held in the tag */
+
+static char *ngFmtName[] = { "PACKED", "DELTA" };
+
+/* EXPORT->NGFormatByName: return format with given name */
+NGFormat NGFormatByName(char *name)
+{
+   char buf[MAXSTRLEN];
+
+   strcpy(buf,name); UpperCase(buf);
+   if (strcmp(buf,ngFmtName[NG_PACKED]) == 0) return NG_PACKED;
+   if (strcmp(buf,ngFmtName[NG_DELTA]) == 0) return NG_DELTA;
+   HError(15390,"NGFormatByName: Unknown gram file format %s",name);
+   return NG_PACKED;
+}
+
+/* EXPORT->NGFormatName: return name of given format */
+char *NGFormatName(NGFormat fmt)
+{
+   return ngFmtName[fmt];
+}
+
+/* PutVarUInt: store v as a varint at b, return next free byte */
+static Byte *PutVarUInt(Byte *b, UInt v)
+{
+   while (v >= 0x80) {
+      *b++ = (Byte) (v | 0x80); v >>= 7;
+   }
+   *b++ = (Byte) v;
+   return b;
+}
+
+/* GetVarUInt: get varint at b into v, return next byte or NULL if
+   it runs past e or is longer than MAXVARBYTES */
+static Byte *GetVarUInt(Byte *b, Byte *e, UInt *v)
+{
+   UInt x;
+   int s;
+
+   if (b < e && *b < 0x80) {   /* most ids and deltas fit in 1 or 2 */
+      *v = *b; return b+1;
+   }
+   for (x=0,s=0; s<7*MAXVARBYTES && b<e; s+=7) {
+      x |= (UInt)(*b & 0x7f) << s;
+      if (*b++ < 0x80) {
+         *v = x; return b;
+      }
+   }
+   return NULL;
+}
+
+/* ReadVarUInt: read a varint from gram file source */
+static UInt ReadVarUInt(NGSource *ngs)
+{
+   int c,s;
+   UInt x;
+
+   for (x=0,s=0; s<8*sizeof(UInt); s+=7) {
+      if ((c = getc(ngs->src.f)) == EOF)
+         HError(15313,"ReadVarUInt: Unexpected end of gram file %s",ngs->src.name);
+      x |= (UInt)(c & 0x7f) << s;
+      if (c < 0x80) return x;
+   }
+   HError(15313,"ReadVarUInt: Bad block header in gram file %s",ngs->src.name);
+   return 0;
+}
+
+/* ZigZag: map signed difference onto unsigned small values */
+static UInt ZigZag(UInt d)
+{
+   return (d << 1) ^ (UInt)((int)d >> 31);
+}
+
+/* UnZigZag: inverse of ZigZag */
+static UInt UnZigZag(UInt z)
+{
+   return (z >> 1) ^ (UInt)(-(int)(z & 1));
+}
+
+/* WriteDeltaGrams: write used N-grams from pool in NG_DELTA blocks */
+static void WriteDeltaGrams(FILE *f, int N, UInt *pool, int used)
+{
+   Byte buf[NGBLOCK*((MAXNG+1)*MAXVARBYTES+1)],hdr[(MAXNG+2)*MAXVARBYTES];
+   Byte *b,*h;
+   UInt prev[MAXNG],count,c,*p;
+   int i,j,k,n;
+
+   for (k=0,p=pool; k<used; k+=n) {
+      n = (used-k < NGBLOCK) ? used-k : NGBLOCK;
+      memset(prev,0,N*sizeof(UInt)); b = buf;
+      for (i=0; i<n; i++,p+=N+1) {
+         count = p[N];
+         for (j=0; j<N-1 && p[j]==prev[j]; j++);
+         c = (count > 0 && count < MAXINLCOUNT) ? count : 0;
+         *b++ = (Byte) (j | (c << 3));
+         for (; j<N; j++) {
+            b = PutVarUInt(b,ZigZag(p[j]-prev[j])); prev[j] = p[j];
+         }
+         if (c == 0) b = PutVarUInt(b,count);
+      }
+      h = PutVarUInt(hdr,n); h = PutVarUInt(h,b-buf);
+      for (j=0; j<N; j++) h = PutVarUInt(h,prev[j]);
+      fwrite(hdr,1,h-hdr,f);
+      fwrite(buf,1,b-buf,f);
+   }
+}
+
+/* ReadBlockHeader: read the header of the next block in ngs */
+static void ReadBlockHeader(NGSource *ngs)
+{
+   int i;
+
+   if (ngs->blkLeft <= 0)
+      HError(15313,"ReadBlockHeader: No blocks left in gram file %s",ngs->src.name);
+   ngs->blkNGrams = ReadVarUInt(ngs);
+   ngs->blkBytes = ReadVarUInt(ngs);
+   for (i=0; i<ngs->info.N; i++)
+      ngs->blkLast[i] = ReadVarUInt(ngs);
+   if (ngs->blkNGrams <= 0 || ngs->blkNGrams > ngs->blkSize ||
+       ngs->blkNGrams > ngs->blkLeft || ngs->blkBytes <= 0 ||
+       ngs->blkBytes > ngs->blkSize*((ngs->info.N+1)*MAXVARBYTES+1))
+      HError(15313,"ReadBlockHeader: Bad block header in gram file %s",
+             ngs->src.name);
+   ngs->blkLeft -= ngs->blkNGrams;
+}
+
+/* DecodeBlock: decode the nGrams N-grams in ngs->blk into ngs->dec */
+static void DecodeBlock(NGSource *ngs, int nGrams, int nBytes)
+{
+   int i,j,N;
+   UInt v,c,prev[MAXNG],*q;
+   Byte *b,*e;
+
+   N = ngs->info.N;
+   memset(prev,0,N*sizeof(UInt));
+   b = ngs->blk; e = b + nBytes;
+   for (i=0,q=ngs->dec; i<nGrams && b<e; i++,q+=N+1) {
+      c = *b >> 3; j = *b++ & 7;
+      if (j >= N) break;
+      memcpy(q,prev,j*sizeof(UInt));
+      for (; j<N; j++) {
+         if ((b = GetVarUInt(b,e,&v)) == NULL) break;
+         q[j] = prev[j] = prev[j] + UnZigZag(v);
+      }
+      if (b == NULL || (c == 0 && (b = GetVarUInt(b,e,&c)) == NULL)) break;
+      q[N] = c;
+   }
+   if (i < nGrams || b != e)
+      HError(15313,"DecodeBlock: Corrupt block in gram file %s",ngs->src.name);
+}
+
+/* LoadBlock: read and decode the next block of ngs */
+static void LoadBlock(NGSource *ngs)
+{
+   if (ngs->blkNGrams == 0) ReadBlockHeader(ngs);
+   if (fread(ngs->blk,1,ngs->blkBytes,ngs->src.f) != ngs->blkBytes)
+      HError(15313,"LoadBlock: Unexpected end of gram file %s",ngs->src.name);
+   DecodeBlock(ngs,ngs->blkNGrams,ngs->blkBytes);
+   ngs->blkUsed = ngs->blkNGrams; ngs->blkNext = 0;
+   ngs->blkNGrams = 0;
+}
+
+/* SkipBlock: skip the next block of ngs without decoding it */
+static void SkipBlock(NGSource *ngs)
+{
+   if (ngs->blkNGrams == 0) ReadBlockHeader(ngs);
+   if (ngs->src.isPipe || fseek(ngs->src.f,ngs->blkBytes,SEEK_CUR) != 0)
+      if (fread(ngs->blk,1,ngs->blkBytes,ngs->src.f) != ngs->blkBytes)
+         HError(15313,"SkipBlock: Unexpected end of gram file %s",ngs->src.name);
+   ngs->nItems -= ngs->blkNGrams;
+   ngs->blkUsed = ngs->blkNext = 0;
+   ngs->blkNGrams = 0;
+}
+
+/* SetNextDelta: as SetNext for NG_DELTA files */
+static void SetNextDelta(NGSource *ngs)
+{
+   UInt *p;
+   int i,N;
+
+   N = ngs->info.N;
+   while (ngs->nItems > 0) {
+      if (ngs->blkNext == ngs->blkUsed) LoadBlock(ngs);
+      p = ngs->dec + ngs->blkNext*(N+1);
+      for (i=0; i<N; i++)
+         if (GetMEIndex(ngs->wm,p[i]) < 0) break;
+      if (i == N) {
+         memcpy(ngs->nxt,p,N*sizeof(UInt));
+         break;
+      }
+      ngs->nItems--; ngs->blkNext++;   /* skip N-gram with OOM word */
+   }
+}
+
+/* OpenDeltaGrams: set up block decoding and read the first block */
+static void OpenDeltaGrams(NGSource *ngs, char *fn)
+{
+   int N = ngs->info.N;
+
+   ngs->blk = (Byte *) New(&gcheap,ngs->blkSize*((N+1)*MAXVARBYTES+1) +
+                           (MAXNG+2)*MAXVARBYTES);
+   ngs->dec = (UInt *) New(&gcheap,ngs->blkSize*(N+1)*sizeof(UInt));
+   ngs->blkLeft = ngs->nItems;
+   ngs->blkUsed = ngs->blkNext = ngs->blkNGrams = 0;
+   LoadBlock(ngs);
+   if (!SameHGrams(N,ngs->dec,ngs->firstGram)) {
+      WriteTxtHGram(stdout,"Gram1",N,ngs->firstGram);
+      WriteRawHGram(stdout,"gram1",N,ngs->dec,ngs->wm);
+      HError(15330, "OpenNGramFile: Header-specified 1st gram is not equal to the actual 1st gram in file %s\n", fn);
+   }
+   SetNextDelta(ngs);
+}
+
+/* GramBefore: true if p is known to precede ng in the map order */
+static Boolean GramBefore(WordMap *wm, int N, UInt *p, UInt *ng)
+{
+   int i1,i2,j;
+
+   for (j=0; j<N; j++) {
+      if ((i1 = GetMEIndex(wm,p[j])) < 0)
+         return FALSE;      /* cannot place words not in map */
+      if ((i2 = GetMEIndex(wm,ng[j])) < 0)
+         HError(15395,"GramBefore: Index %d not found in wordmap",ng[j]);
+      if (wm->me[i1].sort != wm->me[i2].sort)
+         return wm->me[i1].sort < wm->me[i2].sort;
+   }
+   return FALSE;
+}
+
+/* EXPORT->SeekNGram: skip to first N-gram in ngs not less than ng */
+Boolean SeekNGram(NGSource *ngs, NGram ng)
+{
+   UInt buf[MAXNG+1];
+   int N;
+
+   N = ngs->info.N;
+   SortWordMap(ngs->wm);
+   if (ngs->fmt == NG_DELTA && ngs->nItems > 0) {
+      if (GramBefore(ngs->wm,N,ngs->dec+(ngs->blkUsed-1)*(N+1),ng)) {
+         ngs->nItems -= ngs->blkUsed - ngs->blkNext;
+         ngs->blkNext = ngs->blkUsed;
+         while (ngs->nItems > 0) {
+            if (ngs->blkNGrams == 0) ReadBlockHeader(ngs);
+            if (!GramBefore(ngs->wm,N,ngs->blkLast,ng)) break;
+            SkipBlock(ngs);
+         }
+         SetNextDelta(ngs);
+      }
+   }
+   while (ngs->nItems > 0 && GramBefore(ngs->wm,N,ngs->nxt,ng))
+      ReadNGram(ngs,buf);
+   return ngs->nItems > 0;
+}
+
 /* EXPORT->OpenNGramFile: open an ngram file and init NGSource */
 void OpenNGramFile(NGSource *ngs, char *fn, WordMap *wm)
 {
@@ -323,10 +600,21 @@ void OpenNGramFile(NGSource *ngs, char *fn, WordMap *wm)
    ReadHGram("GRAM1",hdr,N,ngs->firstGram,fn);
    ReadHGram("GRAMN",hdr,N,ngs->lastGram,fn);
    ngs->wm = wm;
+   s = GetLMHdrStr("FORMAT",hdr,FALSE);
+   ngs->fmt = (s==NULL) ? NG_PACKED : NGFormatByName(s);
+   ngs->blk = NULL; ngs->dec = NULL;
    if (trace&T_TOP) {
-      printf("Read Header for %s, [%d grams, size %d]\n",fn,ngs->nItems,N);
+      printf("Read Header for %s, [%d grams, size %d, %s]\n",
+             fn,ngs->nItems,N,NGFormatName(ngs->fmt));
       fflush(stdout);
    }
+   if (ngs->fmt == NG_DELTA) {
+      if (!GetLMHdrInt("BLOCKSIZE",&ngs->blkSize,hdr) || ngs->blkSize <= 0)
+         HError(15350,"OpenNGramFile: No valid BlockSize field in %s",fn);
+      OpenDeltaGrams(ngs,fn);
+      DeleteHeap(&mem);
+      return;
+   }
    /* initialise the source by reading the first gram */
    if (fread(ngRawBuf,ngs->info.ng_size,1,ngs->src.f) !=1 )
       HError(15350, "OpenNGramFile: Empty file %s\n", fn);
@@ -344,6 +632,11 @@ void OpenNGramFile(NGSource *ngs, char *fn, WordMap *wm)
 void CloseNGramFile(NGSource *ngs)
 {
    CloseSource(&(ngs->src));
+   if (ngs->blk != NULL) {
+      Dispose(&gcheap,ngs->dec);
+      Dispose(&gcheap,ngs->blk);
+      ngs->blk = NULL; ngs->dec = NULL;
+   }
 }
 
 /* EXPORT->ReadNGram: read the next ngram from given source.
@@ -357,6 +650,12 @@ void ReadNGram(NGSource *ngs, NGram ng)
    if (ngs->nItems <= 0)
       HError(15313,"ReadNGram: Gram file %s is empty",ngs->src.name);
    ngs->nItems--;
+   if (ngs->fmt == NG_DELTA) {
+      memcpy(ng,ngs->dec+ngs->blkNext*(ngs->info.N+1),ngs->info.ng_full);
+      ngs->blkNext++;
+      SetNextDelta(ngs);
+      return;
+   }
    oc = 0; a = 1; N = ngs->info.N;
    ng_size = ngs->info.ng_size;
    c = ngs->buf[ng_size-1];
@@ -378,12 +677,12 @@ int WriteNGram(FILE *f, int N, NGram ng)
 {
    Byte b;
    UInt a,c,bsize,count;
-   static Byte buf[GSIZE];
+   Byte buf[GSIZE];
 
    NGramSquash(N, ng,buf);
    bsize = N*SQUASH;
 #ifdef LM_FLOAT_COUNT
-   count = (UInt) *((float *)(ng + N))
+   count = (UInt) *((float *)(ng + N));
 #else
    count = ng[N];
 #endif
@@ -405,10 +704,12 @@ NGBuffer *CreateNGBuffer(MemHeap *mem, int N, int size, char *fn, WordMap *wm)
 
    ngb = (NGBuffer *)New(mem,sizeof(NGBuffer));
    ngb->info = SetNGInfo(N);
-   ngb->poolsize = size; ngb->wm = wm;
+   ngb->poolsize = size; ngb->wm = wm; ngb->mem = mem;
    ngb->used = 0; ngb->fn = CopyString(mem,fn); ngb->fndx = 0;
    poolbytes = ngb->info.ng_full*size;
    ngb->next = ngb->pool = (UInt *) New(mem,poolbytes);
+   ngb->htab = NULL; ngb->hsize = 0; ngb->hashed = FALSE;
+   ngb->fmt = gramFormat;
    return ngb;
 }
 
@@ -417,6 +718,63 @@ Boolean StoreNGram(NGBuffer *ngb, NGram ng)
 {
    memcpy(ngb->next, ng, ngb->info.ng_full);
    ngb->used++; ngb->next += ngb->info.N+1;
+   ngb->hashed = FALSE;
+   return (ngb->used==ngb->poolsize);
+}
+
+/* HashNGram: hash the words of ng */
+static UInt HashNGram(int N, NGram ng)
+{
+   int i;
+   UInt h = 0;
+
+   for (i=0; i<N; i++)
+      h = (h ^ ng[i]) * 0x9E3779B1;
+   return h ^ (h >> 16);
+}
+
+/* IndexNGBuffer: rebuild the hash of the used slots of ngb */
+static void IndexNGBuffer(NGBuffer *ngb)
+{
+   int i,N,isize;
+   UInt h,mask,*p;
+
+   if (ngb->htab == NULL) {   /* keep the load factor below 0.5 */
+      for (ngb->hsize=1; ngb->hsize < 2*ngb->poolsize; ngb->hsize *= 2);
+      ngb->htab = (int *) New(ngb->mem,ngb->hsize*sizeof(int));
+   }
+   for (i=0; i<ngb->hsize; i++) ngb->htab[i] = -1;
+   N = ngb->info.N; isize = N+1; mask = ngb->hsize-1;
+   for (i=0,p=ngb->pool; i<ngb->used; i++,p+=isize) {
+      for (h=HashNGram(N,p)&mask; ngb->htab[h]>=0; h=(h+1)&mask)
+         if (SameGrams(N,ngb->pool+ngb->htab[h]*isize,p)) break;
+      if (ngb->htab[h] < 0) ngb->htab[h] = i;
+   }
+   ngb->hashed = TRUE;
+}
+
+/* EXPORT->CountNGram: add ngram into ngb, return TRUE if ngb is full */
+Boolean CountNGram(NGBuffer *ngb, NGram ng)
+{
+   int N,isize;
+   UInt h,mask,*p;
+
+   if (!ngb->hashed) IndexNGBuffer(ngb);
+   N = ngb->info.N; isize = N+1; mask = ngb->hsize-1;
+   for (h=HashNGram(N,ng)&mask; ngb->htab[h]>=0; h=(h+1)&mask) {
+      p = ngb->pool + ngb->htab[h]*isize;
+      if (SameGrams(N,p,ng)) {
+#ifdef LM_FLOAT_COUNT
+         *((float *)(p+N)) += *((float *)(ng+N));
+#else
+         p[N] += ng[N];
+#endif
+         return FALSE;
+      }
+   }
+   ngb->htab[h] = ngb->used;
+   memcpy(ngb->next, ng, ngb->info.ng_full);
+   ngb->used++; ngb->next += isize;
    return (ngb->used==ngb->poolsize);
 }
 
@@ -444,51 +802,123 @@ static int CmpNGram(WordMap *wm, int N, UInt *ng1, UInt *ng2)
    return 0;
 }
 
-static int        qs_cmpSize;   /* must set before using this routine */
-static WordMap    *qs_wmap;     /* word list to access mapentries */
-static NGInputSet *qs_inset;    /* input set */
+/* 
+   Buffers are sorted on word sort ranks rather than on word indices.
+   RankNGBuffer replaces each index by its rank in the (sorted) map,
+   the ranked grams are radix sorted and merged, and UnrankNGBuffer
+   maps them back via smap[rank] = map entry index.  The map entries
+   of words already in the map never change, so the last two steps
+   may run on a writer thread while the map is being extended.
+*/
 
-/* qs_CmpNGram: compare two N-grams, used in qsort */
-static int qs_CmpNGram(const void *p1, const void *p2)
+#define RADIXMIN 32    /* smaller buckets are insertion sorted */
+
+/* RankNGBuffer: replace word indices in ngb by their sort ranks */
+static void RankNGBuffer(NGBuffer *ngb)
 {
-   return CmpNGram(qs_wmap,qs_cmpSize,(UInt *)p1,(UInt *)p2);
+   int i,j,k,N;
+   UInt *p;
+   WordMap *wm = ngb->wm;
+
+   N = ngb->info.N;
+   for (i=0,p=ngb->pool; i<ngb->used; i++,p+=N+1)
+      for (j=0; j<N; j++) {
+         if ((k = GetMEIndex(wm,p[j])) < 0)
+            HError(15395,"RankNGBuffer: Index %d not found in wordmap",p[j]);
+         p[j] = wm->me[k].sort;
+      }
 }
 
-/* qs_CmpGFile: compare two NGSources on nxt field */
-static int qs_CmpGFile(const void *p1, const void *p2)
+/* UnrankNGBuffer: restore word indices in ngb from ranks */
+static void UnrankNGBuffer(NGBuffer *ngb, int *smap)
 {
-   NGram p,q;
-   int *i1, *i2;
+   int i,j,N;
+   UInt *p;
+   MapEntry *me = ngb->wm->me;
 
-   i1 = (int *)p1; i2 = (int *)p2;
-   p = qs_inset->ngs[*i1].nxt;
-   q = qs_inset->ngs[*i2].nxt;
-   return CmpNGram(qs_inset->wm,qs_inset->N,p,q);
+   N = ngb->info.N;
+   for (i=0,p=ngb->pool; i<ngb->used; i++,p+=N+1)
+      for (j=0; j<N; j++)
+         p[j] = me[smap[p[j]]].ndx;
 }
 
-/* EXPORT->SortNGBuffer: sort+uniqe N-grams in ngb  */
-void SortNGBuffer(NGBuffer *ngb)
+/* SetSortMap: set smap[rank] to the entry index of each word in wm */
+static void SetSortMap(WordMap *wm, int *smap)
 {
-   int i, count, isize, N;
-   UInt *p, *q;
-   char fn[256];
+   int i;
 
-   if (trace&T_SRT) {
-      sprintf(fn,"%s.%d",ngb->fn,ngb->fndx);
-      printf(" Sorting %d N-grams (next write to %s)\n", ngb->used,fn);
+   for (i=0; i<wm->used; i++)
+      smap[wm->me[i].sort] = i;
+}
+
+/* CmpRankGram: compare two ranked N-grams */
+static int CmpRankGram(int N, UInt *p, UInt *q)
+{
+   int i;
+
+   for (i=0; i<N; i++)
+      if (p[i] != q[i]) return (p[i] < q[i]) ? -1 : +1;
+   return 0;
+}
+
+/* RadixSortGrams: in-place MSD radix sort of n ranked N-grams from key
+   byte d onwards, each word contributing kb bytes to the key */
+static void RadixSortGrams(UInt *base, int n, int N, int kb, int d)
+{
+   int i,j,b,c,w,shift,isize,cnt[256],pos[256],end[256];
+   UInt *p,*q,tmp[MAXNG+1];
+   size_t rsize;
+
+   isize = N+1; rsize = isize*sizeof(UInt);
+   if (n < RADIXMIN) {
+      for (i=1; i<n; i++) {
+         memcpy(tmp,base+i*isize,rsize);
+         for (j=i; j>0 && CmpRankGram(N,base+(j-1)*isize,tmp)>0; j--)
+            memcpy(base+j*isize,base+(j-1)*isize,rsize);
+         memcpy(base+j*isize,tmp,rsize);
+      }
+      return;
+   }
+   w = d / kb; shift = 8*(kb-1 - d%kb);
+   memset(cnt,0,sizeof(cnt));
+   for (i=0,p=base; i<n; i++,p+=isize)
+      cnt[(p[w]>>shift)&0xff]++;
+   for (b=0,i=0; b<256; b++) {
+      pos[b] = i; i += cnt[b]; end[b] = i;
    }
-   SortWordMap(ngb->wm);
-   qs_cmpSize = N = ngb->info.N; qs_wmap = ngb->wm;
-   usort(ngb->pool,ngb->used,ngb->info.ng_full,qs_CmpNGram);
-   p = ngb->pool; count = 1; isize = N + 1;
+   for (b=0; b<256; b++)      /* permute each record into its bucket */
+      while (pos[b] < end[b]) {
+         p = base + pos[b]*isize;
+         c = (p[w]>>shift)&0xff;
+         if (c == b) {
+            ++pos[b];
+         } else {
+            q = base + (pos[c]++)*isize;
+            memcpy(tmp,p,rsize); memcpy(p,q,rsize); memcpy(q,tmp,rsize);
+         }
+      }
+   if (++d < N*kb)
+      for (b=0,i=0; b<256; i+=cnt[b],b++)
+         if (cnt[b] > 1)
+            RadixSortGrams(base+i*isize,cnt[b],N,kb,d);
+}
+
+/* SortRankedGrams: sort+unique ranked N-grams in ngb, nRank words */
+static void SortRankedGrams(NGBuffer *ngb, int nRank)
+{
+   int i, count, isize, N, kb;
+   UInt *p, *q;
+
+   N = ngb->info.N; isize = N + 1;
+   for (kb=1; kb<4 && ((UInt)(nRank-1) >> (8*kb)) != 0; kb++);
+   RadixSortGrams(ngb->pool,ngb->used,N,kb,0);
+   p = ngb->pool; count = 1;
    for (q = ngb->pool + isize, i=1; i < ngb->used; i++, q += isize) {
-      if (CmpNGram(ngb->wm,ngb->info.N,p,q)==0) {
+      if (CmpRankGram(N,p,q)==0) {
 #ifdef LM_FLOAT_COUNT
-	pp = (float *) p+N;
-	qq = (float *) p+N;
-	*pp += *qq;
+         *((float *)(p+N)) += *((float *)(q+N));
 #else
-	p[N] += q[N];
+	 p[N] += q[N];
 #endif
       } else {
          p += isize; count++;
@@ -496,51 +926,100 @@ void SortNGBuffer(NGBuffer *ngb)
       }
    }
    ngb->used = count; ngb->next = p+isize;
+}
+
+/* EXPORT->SortNGBuffer: sort+uniqe N-grams in ngb  */
+void SortNGBuffer(NGBuffer *ngb)
+{
+   int *smap;
+   char fn[256];
+
+   if (trace&T_SRT) {
+      sprintf(fn,"%s.%d",ngb->fn,ngb->fndx);
+      printf(" Sorting %d N-grams (next write to %s)\n", ngb->used,fn);
+   }
+   if (ngb->used > 0) {
+      SortWordMap(ngb->wm);
+      smap = (int *) New(&gstack,ngb->wm->used*sizeof(int));
+      SetSortMap(ngb->wm,smap);
+      RankNGBuffer(ngb);
+      SortRankedGrams(ngb,ngb->wm->used);
+      UnrankNGBuffer(ngb,smap);
+      Dispose(&gstack,smap);
+   }
+   ngb->hashed = FALSE;
    if (trace&T_SRT) {
       printf(" N-grams sorted %d remaining\n", ngb->used);
       fflush(stdout);
    }
 }
 
+/* WriteGramHeader: write a gram file header */
+static void WriteGramHeader(FILE *f, int N, int used, WordMap *wm, int seqno,
+                            LabId *gram1, LabId *gramN, LabId chkid,
+                            int chkndx, char *source, NGFormat fmt)
+{
+   fprintf(f,"NGram = %d\n",N);
+   fprintf(f,"WMap  = %s\n",wm->name);
+   fprintf(f,"SeqNo = %d\n",seqno);
+   fprintf(f,"Entries = %d\n",used);
+   WriteTxtHGram(f,"Gram1",N,gram1);
+   WriteTxtHGram(f,"GramN",N,gramN);
+   fprintf(f,"WMCheck = %s %d\n",chkid->name,chkndx);
+   if (source != NULL)
+      fprintf(f,"Source = %s\n",source);
+   if (fmt != NG_PACKED) {
+      fprintf(f,"Format = %s\n",NGFormatName(fmt));
+      fprintf(f,"BlockSize = %d\n",NGBLOCK);
+   }
+   fprintf(f,"\\Grams\\\n");
+}
+
 /* WriteNGHeader: write a header for given NG Buffer */
 static void WriteNGHeader(FILE *f, NGBuffer *ngb, char *source)
 {
-
-   int N = ngb->info.N,chkndx;
-   LabId chkid;
+   int i,N = ngb->info.N;
+   LabId chkid,gram1[MAXNG],gramN[MAXNG];
 
    if (ngb->used == 0)
       HError(15390,"WriteNGHeader: Ngram buffer is empty");
-   fprintf(f,"NGram = %d\n",N);
-   fprintf(f,"WMap  = %s\n",ngb->wm->name);
-   fprintf(f,"SeqNo = %d\n",ngb->wm->seqno);
-   fprintf(f,"Entries = %d\n",ngb->used);
-   WriteRawHGram(f,"Gram1",N,ngb->pool,ngb->wm);
-   WriteRawHGram(f,"GramN",N,ngb->next-(N+1),ngb->wm);
+   for (i=0; i<N; i++) {
+      gram1[i] = WordLMName(ngb->pool[i],ngb->wm);
+      gramN[i] = WordLMName(ngb->next[i-(N+1)],ngb->wm);
+   }
    chkid = ngb->wm->id[ngb->wm->used / 2];
-   chkndx = WordLMIndex(chkid);
-   fprintf(f,"WMCheck = %s %d\n",chkid->name,chkndx);
-   if (source != NULL)
-      fprintf(f,"Source = %s\n",source);
-   fprintf(f,"\\Grams\\\n");
+   WriteGramHeader(f,N,ngb->used,ngb->wm,ngb->wm->seqno,gram1,gramN,
+                   chkid,WordLMIndex(chkid),source,ngb->fmt);
 }
 
-/* EXPORT->WriteNGBuffer: write ngb in compressed format to f */
-void WriteNGBuffer(NGBuffer *ngb, char *source)
+/* WriteGrams: write the body of a gram file from ngb */
+static void WriteGrams(FILE *f, NGBuffer *ngb)
 {
    int i, N;
    UInt *p;
+
+   N = ngb->info.N;
+   if (ngb->fmt == NG_DELTA) {
+      WriteDeltaGrams(f,N,ngb->pool,ngb->used);
+   } else {
+      for (i=0,p = ngb->pool; i<ngb->used; i++, p += N + 1)
+         WriteNGram(f, N, p);
+   }
+}
+
+/* EXPORT->WriteNGBuffer: write ngb in compressed format to f */
+void WriteNGBuffer(NGBuffer *ngb, char *source)
+{
    FILE *f;
    char fn[256];
    Boolean isPipe;
 
-   N = ngb->info.N;
    sprintf(fn,"%s.%d",ngb->fn,ngb->fndx);
    f = FOpen(fn, LGramOFilter, &isPipe);
    WriteNGHeader(f,ngb,source);
-   for (i=0,p = ngb->pool; i<ngb->used; i++, p += N + 1)
-      WriteNGram(f, N, p);
+   WriteGrams(f,ngb);
    ngb->used = 0; ngb->next = ngb->pool; ++ngb->fndx;
+   ngb->hashed = FALSE;
    FClose(f,isPipe);
 }
 
@@ -558,6 +1037,180 @@ void PrintNGBuffer(NGBuffer *ngb)
    printf("%d entries\n",ngb->used);
 }
 
+/* ------------- Background N-Gram Buffer Output ------------- */
+
+typedef struct _NGJob {    /* a buffer owned by an NGWriter */
+   NGBuffer *ngb;             /* the buffer, ranked when queued */
+   int fndx;                  /* output file index */
+   int nRank;                 /* words in map when queued */
+   int *smap;                 /* array[0..nRank-1] rank -> map entry */
+   int seqno;                 /* map seqno when queued */
+   LabId chkid;               /* map check word when queued ... */
+   int chkndx;                /* ... and its index */
+   char *source;              /* header source field */
+   struct _NGJob *next;       /* next in queue or free list */
+} NGJob;
+
+struct _NGWriter {
+   WordMap *wm;               /* word map shared by all buffers */
+   int nThreads;              /* number of writer threads */
+   pthread_t *thread;         /* array[0..nThreads-1] of threads */
+   NGJob *job;                /* array[0..nThreads] of buffers */
+   NGJob *head, *tail;        /* queue of buffers to write */
+   NGJob *free;               /* buffers ready for reuse */
+   int nBusy;                 /* buffers queued or being written */
+   Boolean stop;              /* threads should exit */
+   pthread_mutex_t lock;      /* guards all of the above */
+   pthread_cond_t post;       /* a buffer has been queued */
+   pthread_cond_t done;       /* a buffer has been written */
+};
+
+/* WriteNGJob: sort, merge and write a queued buffer */
+static void WriteNGJob(NGWriter *ngw, NGJob *job)
+{
+   NGBuffer *ngb = job->ngb;
+   LabId gram1[MAXNG],gramN[MAXNG];
+   int i,N;
+   FILE *f;
+   char fn[256];
+   Boolean isPipe;
+
+   N = ngb->info.N;
+   SortRankedGrams(ngb,job->nRank);
+   for (i=0; i<N; i++) {
+      gram1[i] = ngw->wm->id[job->smap[ngb->pool[i]]];
+      gramN[i] = ngw->wm->id[job->smap[ngb->next[i-(N+1)]]];
+   }
+   UnrankNGBuffer(ngb,job->smap);
+   sprintf(fn,"%s.%d",ngb->fn,job->fndx);
+   if ((f = FOpen(fn, LGramOFilter, &isPipe)) == NULL)
+      HError(15311,"WriteNGJob: Can't create gram file %s",fn);
+   WriteGramHeader(f,N,ngb->used,ngw->wm,job->seqno,gram1,gramN,
+                   job->chkid,job->chkndx,job->source,ngb->fmt);
+   WriteGrams(f,ngb);
+   FClose(f,isPipe);
+   if (trace&T_TOP) {
+      printf(" %d N-grams written to %s\n",ngb->used,fn);
+      fflush(stdout);
+   }
+   ngb->used = 0; ngb->next = ngb->pool; ngb->hashed = FALSE;
+}
+
+/* NGWriterThread: write queued buffers until told to stop */
+static void *NGWriterThread(void *arg)
+{
+   NGWriter *ngw = (NGWriter *) arg;
+   NGJob *job;
+
+   pthread_mutex_lock(&ngw->lock);
+   for (;;) {
+      while (ngw->head == NULL && !ngw->stop)
+         pthread_cond_wait(&ngw->post,&ngw->lock);
+      if (ngw->head == NULL) break;
+      job = ngw->head; ngw->head = job->next;
+      if (ngw->head == NULL) ngw->tail = NULL;
+      pthread_mutex_unlock(&ngw->lock);
+      WriteNGJob(ngw,job);
+      pthread_mutex_lock(&ngw->lock);
+      job->next = ngw->free; ngw->free = job;
+      --ngw->nBusy;
+      pthread_cond_broadcast(&ngw->done);
+   }
+   pthread_mutex_unlock(&ngw->lock);
+   return NULL;
+}
+
+/* EXPORT->CreateNGWriter: create a background writer for ngb */
+NGWriter *CreateNGWriter(MemHeap *mem, NGBuffer *ngb, int nThreads)
+{
+   NGWriter *ngw;
+   NGJob *job;
+   int i;
+
+   if (nThreads < 1)
+      HError(15390,"CreateNGWriter: Bad number of threads %d",nThreads);
+   ngw = (NGWriter *) New(mem,sizeof(NGWriter));
+   ngw->wm = ngb->wm; ngw->nThreads = nThreads;
+   ngw->head = ngw->tail = ngw->free = NULL;
+   ngw->nBusy = 0; ngw->stop = FALSE;
+   ngw->job = (NGJob *) New(mem,(nThreads+1)*sizeof(NGJob));
+   for (i=0,job=ngw->job; i<=nThreads; i++,job++) {
+      job->ngb = (i==0) ? ngb :
+         CreateNGBuffer(mem,ngb->info.N,ngb->poolsize,ngb->fn,ngb->wm);
+      job->ngb->fmt = ngb->fmt;
+      job->smap = (int *) New(mem,ngb->wm->size*sizeof(int));
+      if (i > 0) {
+         job->next = ngw->free; ngw->free = job;
+      }
+   }
+   pthread_mutex_init(&ngw->lock,NULL);
+   pthread_cond_init(&ngw->post,NULL);
+   pthread_cond_init(&ngw->done,NULL);
+   ngw->thread = (pthread_t *) New(mem,nThreads*sizeof(pthread_t));
+   for (i=0; i<nThreads; i++)
+      if (pthread_create(&ngw->thread[i],NULL,NGWriterThread,ngw) != 0)
+         HError(15390,"CreateNGWriter: Can't create writer thread %d",i);
+   return ngw;
+}
+
+/* EXPORT->SubmitNGBuffer: queue ngb for writing, return an empty buffer */
+NGBuffer *SubmitNGBuffer(NGWriter *ngw, NGBuffer *ngb, char *source)
+{
+   NGJob *job,*next;
+   WordMap *wm = ngw->wm;
+   int i;
+
+   if (ngb->used == 0) return ngb;
+   for (i=0,job=ngw->job; i<=ngw->nThreads && job->ngb!=ngb; i++,job++);
+   if (i > ngw->nThreads)
+      HError(15390,"SubmitNGBuffer: Buffer %s.%d not owned by writer",
+             ngb->fn,ngb->fndx);
+   /* snapshot everything the writer needs from the map */
+   SortWordMap(wm);
+   job->nRank = wm->used;
+   SetSortMap(wm,job->smap);
+   RankNGBuffer(ngb);
+   job->fndx = ngb->fndx; job->seqno = wm->seqno;
+   job->chkid = wm->id[wm->used / 2]; job->chkndx = WordLMIndex(job->chkid);
+   job->source = source; job->next = NULL;
+   pthread_mutex_lock(&ngw->lock);
+   if (ngw->tail == NULL) ngw->head = job; else ngw->tail->next = job;
+   ngw->tail = job; ++ngw->nBusy;
+   pthread_cond_signal(&ngw->post);
+   while (ngw->free == NULL)
+      pthread_cond_wait(&ngw->done,&ngw->lock);
+   next = ngw->free; ngw->free = next->next;
+   pthread_mutex_unlock(&ngw->lock);
+   next->ngb->fndx = ngb->fndx + 1;
+   return next->ngb;
+}
+
+/* EXPORT->FlushNGWriter: wait for all queued buffers to be written */
+void FlushNGWriter(NGWriter *ngw)
+{
+   pthread_mutex_lock(&ngw->lock);
+   while (ngw->nBusy > 0)
+      pthread_cond_wait(&ngw->done,&ngw->lock);
+   pthread_mutex_unlock(&ngw->lock);
+}
+
+/* EXPORT->CloseNGWriter: flush ngw and stop its threads */
+void CloseNGWriter(NGWriter *ngw)
+{
+   int i;
+
+   FlushNGWriter(ngw);
+   pthread_mutex_lock(&ngw->lock);
+   ngw->stop = TRUE;
+   pthread_cond_broadcast(&ngw->post);
+   pthread_mutex_unlock(&ngw->lock);
+   for (i=0; i<ngw->nThreads; i++)
+      pthread_join(ngw->thread[i],NULL);
+   pthread_mutex_destroy(&ngw->lock);
+   pthread_cond_destroy(&ngw->post);
+   pthread_cond_destroy(&ngw->done);
+}
+
 
 /* ------------- Multiple N-Gram Input File Handling --------- */
 
@@ -671,36 +1324,46 @@ static void ShowInputState(char *mess, NGInputSet *inset)
    }
 }
 
-/* SortGFList: sort the list of open files into order of next
-   available N-Gram. Sort order is defined by gfsort array */
+/* CmpGFile: compare the next N-grams of open files i and j, ties
+   are broken on file position so that the merge is deterministic */
+static int CmpGFile(NGInputSet *inset, int i, int j)
+{
+   int cmp;
+
+   cmp = CmpNGram(inset->wm,inset->N,inset->ngs[i].nxt,inset->ngs[j].nxt);
+   return (cmp != 0) ? cmp : i - j;
+}
+
+/* SiftGFList: move gfsort[k] down the heap to its proper place */
+static void SiftGFList(NGInputSet *inset, int k)
+{
+   int c,n,this;
+
+   n = inset->nOpen; this = inset->gfsort[k];
+   while ((c = 2*k+1) < n) {
+      if (c+1 < n && CmpGFile(inset,inset->gfsort[c+1],inset->gfsort[c]) < 0)
+         ++c;
+      if (CmpGFile(inset,this,inset->gfsort[c]) <= 0) break;
+      inset->gfsort[k] = inset->gfsort[c]; k = c;
+   }
+   inset->gfsort[k] = this;
+}
+
+/* SortGFList: arrange the open files into a heap on their next
+   available N-Gram.  gfsort[0] is the file holding the lowest */
 static void SortGFList(NGInputSet *inset)
 {
-   qs_inset = inset;
-   usort(inset->gfsort,inset->nOpen,sizeof(int),qs_CmpGFile);
+   int k;
+
+   for (k=inset->nOpen/2-1; k>=0; k--)
+      SiftGFList(inset,k);
    if (trace&T_SRT) ShowInputState("Full sort",inset);
 }
 
-/* ReSortGFList: resort after reading topmost N-Gram */
+/* ReSortGFList: restore the heap after reading topmost N-Gram */
 static void ReSortGFList(NGInputSet *inset)
 {
-   int i,j,n,this;
-   NGram p,q;
-   Boolean found = FALSE;
-
-   n = inset->nOpen; this = inset->gfsort[0];
-   p = inset->ngs[this].nxt;
-   i = 1;
-   while ( i<n && !found){
-      q = inset->ngs[inset->gfsort[i]].nxt;
-      found = (CmpNGram(inset->wm,inset->N,p,q) <= 0 );
-      if (!found) ++i;
-   }
-   if (i==1) return;
-   --i;
-   /* i = index of new position for updated file */
-   for (j=0; j<i; j++)
-      inset->gfsort[j] = inset->gfsort[j+1];
-   inset->gfsort[i] = this;
+   SiftGFList(inset,0);
    if (trace&T_SRT) ShowInputState("Re-sorted",inset);
 }
 
@@ -740,7 +1403,6 @@ static void GetInsetGram(NGInputSet *inset, NGram ng, float *wt)
    NGSource *ngs;
    int i,cur;
    GFLink p,next,alt;
-   UInt nextng[MAXNG];
 
    if (inset->nOpen == 0 )
       HError(15390,"GetInsetGram: No grams left");;
@@ -785,8 +1447,7 @@ static void GetInsetGram(NGInputSet *inset, NGram ng, float *wt)
    if (checkOrder && inset->nOpen > 0){ /* check ordering is consistent */
       cur = inset->gfsort[0];
       ngs = &(inset->ngs[cur]);
-      NGramExpand(inset->N,ngs->buf,nextng);
-      if (CmpNGram(inset->wm,inset->N,ng,nextng) > 0)
+      if (CmpNGram(inset->wm,inset->N,ng,ngs->nxt) > 0)
          HError(15345,"GetInsetGram: n-grams out of order");
    }
 }
@@ -55,6 +55,11 @@ typedef unsigned char  Byte;
 
 typedef UInt *NGram;          /* N-gram: {w1,w2,...,wN count} */
 
+typedef enum {          /* gram file body formats */
+   NG_PACKED,              /* fixed width squashed ids + count bytes */
+   NG_DELTA                /* blocks of prefix/delta coded N-grams */
+} NGFormat;
+
 typedef struct {        /* NGram size/mapping info information */
    int N;                  /* N-gram size N (2..MAXNG)*/
    int ng_size;            /* byte size of squashed N-gram records */
@@ -71,6 +76,16 @@ typedef struct {        /* open file containing packed ngrams */
    UInt nxt[MAXNG];         /* next expanded N-gram (no count) */
    WordMap *wm;             /* word map to be used with this source */
    NGInfo info;             /* ngram size information */
+   NGFormat fmt;            /* format of the file body */
+   int blkSize;             /* max N-grams per block (NG_DELTA only) */
+   int blkLeft;             /* N-grams in blocks not yet read */
+   int blkUsed;             /* N-grams decoded from current block */
+   int blkNext;             /* next decoded N-gram in current block */
+   int blkBytes;            /* byte size of the next block */
+   int blkNGrams;           /* N-grams in the next block */
+   UInt blkLast[MAXNG];     /* last N-gram of the next block */
+   Byte *blk;               /* raw bytes of current block */
+   UInt *dec;               /* array[0..blkUsed-1] of decoded N-grams */
 }NGSource;
 
 typedef struct gramfile *GFLink;
@@ -94,7 +109,7 @@ typedef struct {        /* input N-gram file set */
    GramFile head;          /* dummy head of tree */
    NGSource ngs[MAXINF];   /* currently open sources */
    GFLink gf[MAXINF];      /* list of ptrs to gram files */
-   int gfsort[MAXINF];     /* idx's of sorted gram files */
+   int gfsort[MAXINF];     /* heap of idx's of open gram files */
    UInt nextGram[MAXNG];   /* next gram to read from inset */  
    float nextWt;           /* weight of next gram */
    Boolean nextValid;      /* true if nextGram is valid */
@@ -109,8 +124,15 @@ typedef struct {        /* N-gram buffer */
    UInt *pool;             /* array[0..used-1] of ngrams */
    UInt *next;             /* next free slot in pool */
    WordMap *wm;            /* word map for ngrams */
+   MemHeap *mem;           /* heap holding this buffer */
+   int *htab;              /* hash of pool slots used by CountNGram */
+   int hsize;              /* size of htab (a power of 2) */
+   Boolean hashed;         /* htab indexes every used slot */
+   NGFormat fmt;           /* format of output files */
 } NGBuffer;
 
+typedef struct _NGWriter NGWriter;   /* background buffer output, private to LGBase */
+
 typedef struct {        /* N-gram frequency of frequency table */
    int size;               /* size of fof table */
    int N;                  /* N-gram */
@@ -143,6 +165,12 @@ void PrintNGram(int N, NGram ng, WordMap *wm);
    Print given N-gram.
 */
 
+NGFormat NGFormatByName(char *name);
+char *NGFormatName(NGFormat fmt);
+/*
+   Convert between gram file format and its name (PACKED or DELTA).
+*/
+
 /* ------------------- N-Gram File I/O ------------------ */
 
 void OpenNGramFile(NGSource *ngs, char *fn, WordMap *wm);
@@ -164,6 +192,14 @@ void ReadNGram(NGSource *ngs, NGram ng);
    after reading this ngram.
 */  
 
+Boolean SeekNGram(NGSource *ngs, NGram ng);
+/*
+   Skip forward in ngs to the first N-gram which is not less than
+   ng in the sort order of its word map.  NG_DELTA files skip whole
+   blocks using the last N-gram stored in each block header.
+   Returns FALSE if the file has no such N-gram.
+*/
+
 int WriteNGram(FILE *f, int N, NGram ng);
 /*
    Write compressed nGram to file f.  Returns the number
@@ -175,7 +211,8 @@ int WriteNGram(FILE *f, int N, NGram ng);
 NGBuffer *CreateNGBuffer(MemHeap *mem, int N, int size, char *fn, WordMap *wm);
 /*
    Create an N-gram buffer with size slots, output file fn and 
-   word map wm.
+   word map wm.  Files are written in the format set by the
+   configuration variable LGBASE: GRAMFORMAT (default PACKED).
 */
 
 void ResetNGBuffer(NGBuffer *ngb);
@@ -189,6 +226,13 @@ Boolean StoreNGram(NGBuffer *ngb, NGram ng);
    Return TRUE if ngb is full
 */   
 
+Boolean CountNGram(NGBuffer *ngb, NGram ng);
+/*
+   As StoreNGram, but if ng is already in ngb its count is added
+   to the stored copy so that ngb only fills with distinct N-grams.
+   Return TRUE if ngb is full
+*/
+
 void SortNGBuffer(NGBuffer *ngb);
 /*
    Sort the N-grams in ngb and merge duplicates. 
@@ -207,6 +251,45 @@ void PrintNGBuffer(NGBuffer *ngb);
    Print contents of ngb.
 */
 
+/* ------------- Background N-Gram Buffer Output ------------- */
+
+/*
+   Only sorting and writing run in the background.  Tokenising and
+   counting (CountNGram) stay on the caller's thread: word indices
+   are assigned by AddWordToMap in order of first occurrence and
+   every N-gram of a buffer must be counted against the map that is
+   snapshotted when the buffer is submitted, so splitting the text
+   over several counting threads would change the word map and the
+   gram files written.
+*/
+
+NGWriter *CreateNGWriter(MemHeap *mem, NGBuffer *ngb, int nThreads);
+/*
+   Create a writer which sorts and writes full copies of ngb on
+   nThreads background threads.  nThreads spare buffers of the same
+   size are allocated from mem, so at most nThreads+1 buffers are
+   ever in use.
+*/
+
+NGBuffer *SubmitNGBuffer(NGWriter *ngw, NGBuffer *ngb, char *source);
+/*
+   Queue the writer's current buffer ngb to be sorted, merged and
+   written to its next output file, and return an empty buffer whose
+   file index follows that of ngb.  Blocks whilst every spare buffer
+   is still being written.  The word map may be extended as soon as
+   this returns.
+*/
+
+void FlushNGWriter(NGWriter *ngw);
+/*
+   Wait until every submitted buffer has been written.
+*/
+
+void CloseNGWriter(NGWriter *ngw);
+/*
+   Flush ngw and stop its threads.
+*/
+
 /* ------------- Multiple N-Gram Input File Handling --------- */
 
 void CreateInputSet(MemHeap *mem, WordMap *wm, NGInputSet *inset);
@@ -44,6 +44,8 @@ char *Cluster_vc_id = "$Id: Cluster.c,v 1.1.1.1 2006/10/11 09:54:43 jal58 Exp $"
 #include "LGBase.h"
 #include "LModel.h"
 #include "LCMap.h"
+#include <pthread.h>
+#include <time.h>
 
 /* Uncomment the following line to run integrity checks on each iteration
    to ensure that:
@@ -79,6 +81,9 @@ char *Cluster_vc_id = "$Id: Cluster.c,v 1.1.1.1 2006/10/11 09:54:43 jal58 Exp $"
 #define SORT_WMAP 1
 #define SORT_FREQ 2
 
+/* Maximum number of threads used to evaluate candidate classes */
+#define MAX_THREADS 256
+
 
 /* Type definitions */
 
@@ -98,6 +103,26 @@ bigrams;
 
 typedef UInt unigram;   /* Occurrence count */
 
+/* Class counts which result from moving the current word to class g */
+typedef struct {
+   int *c1;                 /* C(G(w),*) */
+   int *c2;                 /* C(*,G(w)) */
+   int *c3;                 /* C(g,*) */
+   int *c4;                 /* C(*,g) */
+   int  GwGw, gGw, Gwg, gg; /* Special-case class counts */
+}
+move_counts;
+
+/* Candidate class evaluation thread */
+typedef struct {
+   int          idx;        /* Thread number, evaluates classes start_class+idx+k*threads */
+   int          job;        /* Last job seen */
+   UInt         w;          /* Word being evaluated */
+   move_counts *mc;         /* Private scratch counts */
+   pthread_t    thread;
+}
+move_worker;
+
 
 /* ---------------------- Global Variables ----------------------- */
 /* DEFAULTS */
@@ -114,17 +139,14 @@ static Boolean     inCMapRaw = FALSE;       /* Input classes in raw mode */
 /* Used by core clusterer */
 static int       **clCnt=NULL;              /* Array of arrays; index with count[c1][c2]
                                                (clCnt = 'class count') */
-static int        *tmp_c1=NULL;             /* Temporary set of bigrams (1) */
-static int        *tmp_c2=NULL;             /* Temporary set of bigrams (2) */
-static int        *tmp_c3=NULL;             /* Temporary set of bigrams (3) */
-static int        *tmp_c4=NULL;             /* Temporary set of bigrams (4) */
+static move_counts *moves=NULL;             /* Move counts, one set per thread */
+static double     *move_d=NULL;             /* Change in MLV for moving word to each class */
 static int        *tmp_sum1=NULL;           /* Temporary word-class counts (1) */
 static int        *tmp_sum2=NULL;           /* Temporary word-class counts (2) */
 static int        *clSum=NULL;              /* Class unigram [classes]
                                                returns word unigram sum */
 static int	  *clMemb=NULL;             /* Class membership [words]
                                                returns class given a word */
-static int         GwGw, gGw, Gwg, gg;      /* Special-case class counts */
 static double     *mlv;                     /* ML values involving class [N] */
 static int        *bipair;                  /* Array of word bigrams (w,w) */
 static int         sum_of_all_bigram_counts;/* Sum of all bigram counts */
@@ -172,6 +194,14 @@ static int          sort_order = SORT_WMAP; /* Order words are considered in */
 static int         *sort_uni;               /* Sort unigrams by count */
 static Boolean     outCMapRawTrap = FALSE;  /* Has this been changed by config file? */
 static Boolean     inCMapRawTrap = FALSE;   /* Has this been changed by config file? */
+static int          threads = 1;            /* Threads used to evaluate candidate classes */
+static move_worker *workers = NULL;         /* Candidate evaluation threads [1..threads-1] */
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work_post = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  work_done = PTHREAD_COND_INITIALIZER;
+static int          work_job = 0;           /* Incremented for each word evaluated */
+static int          work_busy = 0;          /* Threads still evaluating current word */
+static Boolean      work_quit = FALSE;      /* Set to terminate threads */
 
 /* ---------------- Function Prototypes -------------------------- */
 
@@ -272,6 +302,7 @@ void SetConfParms(void)
       if (GetConfBool(cParm,nParm,"OUTCMAPRAW", &outCMapRaw)) {
          outCMapRawTrap = TRUE;
       }
+      if (GetConfInt(cParm,nParm,"NUMTHREADS", &i)) threads = i;
    }
 }
 
@@ -283,6 +314,7 @@ void ReportUsage(void)
    printf(" Option                                       Default\n");
    printf(" -c n    use n classes                        %d\n", classes_get_default());
    printf(" -i n    perform n iterations                 1\n");
+   printf(" -j n    evaluate classes with n threads      %d\n", threads);
    printf(" -k      put unknown word in a separate class off\n");
    printf(" -l f    start from existing classmap 'f'     off\n");
    printf(" -m      add running ML values to logfile     %s\n", show_MLV?"on":"off");
@@ -444,10 +476,14 @@ void classes_init(int numb_words)
    }
    class_sort = CNew(&global_stack, W * sizeof(UInt));
    clSum = CNew(&global_stack, N * sizeof(int));
-   tmp_c1 = CNew(&global_stack, N * sizeof(int));
-   tmp_c2 = CNew(&global_stack, N * sizeof(int));
-   tmp_c3 = CNew(&global_stack, N * sizeof(int));
-   tmp_c4 = CNew(&global_stack, N * sizeof(int));
+   moves = CNew(&global_stack, threads * sizeof(move_counts));
+   for (i=0; i<threads; i++) {
+      moves[i].c1 = CNew(&global_stack, N * sizeof(int));
+      moves[i].c2 = CNew(&global_stack, N * sizeof(int));
+      moves[i].c3 = CNew(&global_stack, N * sizeof(int));
+      moves[i].c4 = CNew(&global_stack, N * sizeof(int));
+   }
+   move_d = CNew(&global_stack, N * sizeof(double));
    tmp_sum1 = CNew(&global_stack, N * sizeof(int));
    tmp_sum2 = CNew(&global_stack, N * sizeof(int));
    mlv = CNew(&global_stack, N * sizeof(double));
@@ -476,10 +512,12 @@ void classes_init(int numb_words)
 }
 
 
-/* See what change results when word 'w' moved to class 'g' */
-static void classes_change(UInt w, int g)
+/* See what change results when word 'w' moved to class 'g', storing
+   the resulting counts in 'mc' */
+static void classes_change(UInt w, int g, move_counts *mc)
 {
    register int i;
+   int *tmp_c1 = mc->c1, *tmp_c2 = mc->c2, *tmp_c3 = mc->c3, *tmp_c4 = mc->c4;
 
    /* tmp_c1[] stores the set of class counts C(G(w),*)
       tmp_c2[] stores the set of class counts C(*,G(w))
@@ -516,49 +554,34 @@ static void classes_change(UInt w, int g)
   
    /* Calculate correct values for class-to-or-from-only pairs */
    /* (G(w),G(w)) => -C(w,G(x)) - C(G(x),w) + C(w,w) */
-   GwGw =   clCnt[curr_class][curr_class]
+   mc->GwGw = clCnt[curr_class][curr_class]
           - tmp_sum1[curr_class] - tmp_sum2[curr_class] + bipair[w];
    /* (G(w),g)    => -C(w,g) + C(G(x),w) - C(w,w) */
-   Gwg  =   clCnt[curr_class][g]
+   mc->Gwg  = clCnt[curr_class][g]
           - tmp_sum1[g] + tmp_sum2[curr_class] - bipair[w];
    /* (g,G(w))    => -C(g,w) + C(w,G(x)) - C(w,w) */
-   gGw  =   clCnt[g][curr_class]
+   mc->gGw  = clCnt[g][curr_class]
           - tmp_sum2[g] + tmp_sum1[curr_class] - bipair[w];
    /* (g,g)       => +C(w,g) + C(g,w) + C(w,w) */
-   gg   =   clCnt[g][g]
+   mc->gg   = clCnt[g][g]
           + tmp_sum1[g] + tmp_sum2[g] + bipair[w];
 }
 
 
-/* Decide on a class to move word 'w' to. Returns class index. */
-static int choose_class(UInt w)
+/* Calculate the change in optimisation value which results from moving
+   word 'w' to each of classes start_class+first, start_class+first+step,
+   ... and store it in move_d[] */
+static void evaluate_classes(UInt w, int first, int step, move_counts *mc)
 {
    register int i;
    register int j;
    double d;             /* Change in optimisation value */
    int uniGx, unig;
-   int best_class;
-   double best_change;
    double start_value;
-   
-   best_class = curr_class;
-   best_change = 0;
-
-   /* Create set of forward bigram class counts, C(w,*) and C(*,w)
-      (for * = any class) */
-   for (i=0; i<N; i++) {
-      tmp_sum1[i] = 0;
-      tmp_sum2[i] = 0;
-   }
-   for (i=0; i<forward[w].size; i++) {
-      tmp_sum1[clMemb[forward[w].bi[i].id]] += forward[w].bi[i].count;
-   }
-   for (i=0; i<backward[w].size; i++) {
-      tmp_sum2[clMemb[backward[w].bi[i].id]] += backward[w].bi[i].count;
-   }
+   int *tmp_c1 = mc->c1, *tmp_c2 = mc->c2, *tmp_c3 = mc->c3, *tmp_c4 = mc->c4;
 
   /* Try all classes */
-   for (i=start_class; i<N; i++) {
+   for (i=start_class+first; i<N; i+=step) {
       if (i==curr_class || uni[w]==0) {
          /* If we have no information about this word, or its a self-move, don't
             bother (self-move gives zero change) */
@@ -566,7 +589,7 @@ static int choose_class(UInt w)
       }
 
       d = 0;
-      classes_change(w, i);
+      classes_change(w, i, mc);
 
       /* Word has moved to class i, so see how this would change our
          optimisation equation */
@@ -599,17 +622,17 @@ static int choose_class(UInt w)
       }
 
       /* Exceptions */
-      if (GwGw) {
-         d += ((double)GwGw) * log(GwGw);
+      if (mc->GwGw) {
+         d += ((double)mc->GwGw) * log(mc->GwGw);
       }
-      if (Gwg) {
-         d += ((double)Gwg) * log(Gwg);
+      if (mc->Gwg) {
+         d += ((double)mc->Gwg) * log(mc->Gwg);
       }
-      if (gGw) {
-         d += ((double)gGw) * log(gGw);
+      if (mc->gGw) {
+         d += ((double)mc->gGw) * log(mc->gGw);
       }
-      if (gg) {
-         d += ((double)gg) * log(gg);
+      if (mc->gg) {
+         d += ((double)mc->gg) * log(mc->gg);
       }
 
       /* Now make 'd' into a difference: */
@@ -620,7 +643,131 @@ static int choose_class(UInt w)
       if (clCnt[i][curr_class])
          start_value -= clCnt[i][curr_class]*log(clCnt[i][curr_class]);
       /* And calculate 'd': */
-      d = d - start_value;
+      move_d[i] = d - start_value;
+   }
+}
+
+
+/* Thread body: wait for a word to be posted and evaluate this thread's
+   share of the candidate classes */
+static void *move_worker_thread(void *arg)
+{
+   move_worker *mw = (move_worker *) arg;
+
+   for (;;) {
+      pthread_mutex_lock(&work_lock);
+      while (!work_quit && work_job == mw->job)
+         pthread_cond_wait(&work_post, &work_lock);
+      if (work_quit) {
+         pthread_mutex_unlock(&work_lock);
+         return NULL;
+      }
+      mw->job = work_job;
+      pthread_mutex_unlock(&work_lock);
+      evaluate_classes(mw->w, mw->idx, threads, mw->mc);
+      pthread_mutex_lock(&work_lock);
+      if (--work_busy == 0)
+         pthread_cond_signal(&work_done);
+      pthread_mutex_unlock(&work_lock);
+   }
+}
+
+
+/* Start threads-1 candidate evaluation threads; the main thread takes
+   the remaining share of the classes */
+static void start_workers(void)
+{
+   int i;
+
+   if (threads<=1)
+      return;
+   workers = CNew(&global_stack, threads * sizeof(move_worker));
+   work_quit = FALSE;
+   for (i=1; i<threads; i++) {
+      workers[i].idx = i;
+      workers[i].job = work_job;
+      workers[i].mc = &moves[i];
+      if (pthread_create(&workers[i].thread, NULL, move_worker_thread, &workers[i]) != 0)
+         HError(17099, "start_workers: cannot create thread %d", i);
+   }
+}
+
+
+/* Terminate the candidate evaluation threads */
+static void stop_workers(void)
+{
+   int i;
+
+   if (!workers)
+      return;
+   pthread_mutex_lock(&work_lock);
+   work_quit = TRUE;
+   pthread_cond_broadcast(&work_post);
+   pthread_mutex_unlock(&work_lock);
+   for (i=1; i<threads; i++) {
+      if (pthread_join(workers[i].thread, NULL) != 0)
+         HError(17099, "stop_workers: cannot join thread %d", i);
+   }
+   workers = NULL;
+}
+
+
+/* Fill move_d[] for word 'w', sharing the classes between threads */
+static void evaluate_all_classes(UInt w)
+{
+   int i;
+
+   if (!workers) {
+      evaluate_classes(w, 0, 1, moves);
+      return;
+   }
+   pthread_mutex_lock(&work_lock);
+   for (i=1; i<threads; i++)
+      workers[i].w = w;
+   work_busy = threads-1;
+   work_job++;
+   pthread_cond_broadcast(&work_post);
+   pthread_mutex_unlock(&work_lock);
+   evaluate_classes(w, 0, threads, moves);
+   pthread_mutex_lock(&work_lock);
+   while (work_busy > 0)
+      pthread_cond_wait(&work_done, &work_lock);
+   pthread_mutex_unlock(&work_lock);
+}
+
+
+/* Decide on a class to move word 'w' to. Returns class index. */
+static int choose_class(UInt w)
+{
+   register int i;
+   double d;             /* Change in optimisation value */
+   int best_class;
+   double best_change;
+   
+   best_class = curr_class;
+   best_change = 0;
+
+   /* Create set of forward bigram class counts, C(w,*) and C(*,w)
+      (for * = any class) */
+   for (i=0; i<N; i++) {
+      tmp_sum1[i] = 0;
+      tmp_sum2[i] = 0;
+   }
+   for (i=0; i<forward[w].size; i++) {
+      tmp_sum1[clMemb[forward[w].bi[i].id]] += forward[w].bi[i].count;
+   }
+   for (i=0; i<backward[w].size; i++) {
+      tmp_sum2[clMemb[backward[w].bi[i].id]] += backward[w].bi[i].count;
+   }
+
+   /* Evaluate all classes, then pick the best in class order so that
+      the result does not depend on the number of threads */
+   evaluate_all_classes(w);
+   for (i=start_class; i<N; i++) {
+      if (i==curr_class || uni[w]==0) {
+         continue;
+      }
+      d = move_d[i];
 
       if (verbose && logfile) {
          fprintf(logfile, "...moving word %d to class %d from class %d gives %f change\n",
@@ -653,6 +800,16 @@ static int choose_class(UInt w)
 }
 
 
+/* Wall clock time in seconds */
+static double wall_clock(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+
 /* Define sort order for word unigrams */
 static int freq_sort_order(int *in1, int *in2)
 {
@@ -668,6 +825,12 @@ static void do_one_iteration(int w_period, int start_word)
    FILE *file;
    Boolean pipe_status;
    int total_warnings=0;
+   move_counts *mc = moves;   /* Counts for the chosen move */
+   int evaluated=0;           /* Words considered for a move */
+   double start_time, secs;
+
+   start_time = wall_clock();
+   start_workers();
 
    for (w=0; w<W; w++) {
       sort_uni[w] = w;
@@ -722,6 +885,7 @@ static void do_one_iteration(int w_period, int start_word)
 
       curr_class = clMemb[w]; /* Find out what class word is currently in */
       to = choose_class(w);   /* Work out where to move it to */
+      evaluated++;
 
       if (curr_class != to) {
          if (logfile) {
@@ -734,7 +898,7 @@ static void do_one_iteration(int w_period, int start_word)
             fflush(logfile);
          }
 
-         classes_change(w, to); /* Calculate new unigram and bigram values */
+         classes_change(w, to, mc); /* Calculate new unigram and bigram values */
 
          /* Remove influence of these two classes from MLV values */
          for (j=0; j<N; j++) {
@@ -760,20 +924,20 @@ static void do_one_iteration(int w_period, int start_word)
          for (j=0; j<N; j++) {
             if ((j!=curr_class) && (j!=to)) {
                /* (Gw, *) */
-               clCnt[curr_class][j] = tmp_c1[j];
+               clCnt[curr_class][j] = mc->c1[j];
                /* (*, Gw) */
-               clCnt[j][curr_class] = tmp_c2[j];
+               clCnt[j][curr_class] = mc->c2[j];
                /* (g, *) */
-               clCnt[to][j] = tmp_c3[j];
+               clCnt[to][j] = mc->c3[j];
                /* (*, g) */
-               clCnt[j][to] = tmp_c4[j];
+               clCnt[j][to] = mc->c4[j];
             }
          }
          /* Exceptions */
-         clCnt[curr_class][curr_class] = GwGw;
-         clCnt[curr_class][to] = Gwg;
-         clCnt[to][curr_class] = gGw;
-         clCnt[to][to] = gg;
+         clCnt[curr_class][curr_class] = mc->GwGw;
+         clCnt[curr_class][to] = mc->Gwg;
+         clCnt[to][curr_class] = mc->gGw;
+         clCnt[to][to] = mc->gg;
 
          /* Recalculate maximum-likelihood values involving this class */
          mlv[to] = 0;
@@ -855,6 +1019,13 @@ static void do_one_iteration(int w_period, int start_word)
    if (total_warnings>=10) {
       HError(-17053, "A total of %d words were found in the wordmap but not in the gram files", total_warnings);
    }
+   stop_workers();
+
+   if (trace & T_TOP) {
+      secs = wall_clock() - start_time;
+      printf("Evaluated %d words in %.1f secs (%.1f words/sec) using %d thread%s\n",
+             evaluated, secs, (secs>0)?evaluated/secs:0.0, threads, (threads>1)?"s":"");
+   }
 }
 
 
@@ -1605,15 +1776,14 @@ static void *get_space(int size)
       return New(&global_stack, size);
 
    /* Use New() again if necessary to get a new block */
-   if (((int)(unsigned long int)block+(int)size) >= (int)(unsigned long int)block_end) {
+   if ((char *)block+size >= (char *)block_end) {
       block = New(&global_heap, block_grab_size);
-      block_end = (void *)(unsigned long int)((int)(unsigned long int)block+(int)block_grab_size);
+      block_end = (char *)block+block_grab_size;
    }
 
    /* Hand back the next free space */
    ptr = block;
-   block = (void*)(unsigned long int)((int)(unsigned long int)block + (int) size);     /* Next free byte */
-   block = (void*)(unsigned long int)((((int)(unsigned long int)block)+3) & (~(int)3)); /* Word-align */
+   block = (char *)block + ((size+3) & ~3); /* Next free word-aligned byte */
 
    return ptr;
 }
@@ -1797,6 +1967,11 @@ int main(int argc, char *argv[])
                HError(17019,"Cluster: number of iterations expected for -i");
             iterations = GetIntArg();
             break;
+         case 'j':
+            if (NextArg()!=INTARG)
+               HError(17019,"Cluster: number of threads expected for -j");
+            threads = GetIntArg();
+            break;
           case 'r':
             if (NextArg()!=INTARG)
                HError(17019,"Cluster: recovery export frequency expected for -r");
@@ -1883,6 +2058,10 @@ int main(int argc, char *argv[])
    CreateWordMap(GetStrArg(), &wmap, 0);
 
 
+   if (threads<1 || threads>MAX_THREADS) {
+      HError(17019, "Cluster: number of threads must be in range 1..%d", MAX_THREADS);
+   }
+
    min_classes = 4 + (keep_unk_sep?1:0); /* Minimum number of classes */
    if (loaded_map && set_classes) {
       HError(-17019, "Ignoring -c option: when combined with -l the number of classes in the existing map must be used");
@@ -59,6 +59,8 @@ static int trace = 0;
 #define T_TOP  0001     /* Top Level tracing */
 #define T_SAV  0002     /* Monitor Buffer Saving */
 
+#define MAX_THREADS 256 /* max number of gram writer threads */
+
 /* ---------------- Configuration Parameters --------------------- */
 
 static ConfParam *cParm[MAXGLOBS];
@@ -70,12 +72,14 @@ static int nParm = 0;            /* total num params */
 static int nSize     = 0;           /* ngram size */
 static int ngbSize   = 2000000;     /* ngram buffer size */
 static int freeSlots = 100;         /* free class slots */
+static int nThreads  = 0;           /* gram file writer threads, 0=inline */
 static char *rootFN  = "data";      /* gbase root file name */
 static int dumpOfs   = 0;           /* initial numeric ext of gbase files */
 static char *dbsDir  = NULL;        /* directory to store gbase files */
 static char *mapFN   = NULL;        /* word map file name */
 static char *cmapFN  = NULL;        /* word list file name */
 static char *omapFN  = NULL;        /* output map filename */
+static char *fmtName = NULL;        /* output gram file format */
 
 static Boolean outMapped = FALSE;   /* output mapped IDs only */
 static Boolean mapWords = FALSE;    /* map words to classes */
@@ -85,6 +89,7 @@ static WordMap    wmap;             /* word map for this corpus */
 static ClassMap   cmap;             /* word list for OOV mapping */
 static NGInputSet inset;            /* input file set */
 static NGBuffer   *ngb;             /* output ngram buffer */
+static NGWriter   *ngw = NULL;      /* background writer, NULL if inline */
 static MemHeap    ngbHeap;          /* memory for NGBuffers */
 
 /* Function prototypes */
@@ -102,6 +107,7 @@ void SetConfParms(void)
    nParm = GetConfig("LGCOPY", TRUE, cParm, MAXGLOBS);
    if (nParm>0){
       if (GetConfInt(cParm,nParm,"TRACE",&i)) trace = i;
+      if (GetConfInt(cParm,nParm,"NUMTHREADS",&i)) nThreads = i;
    }
 }
 
@@ -112,7 +118,9 @@ void ReportUsage(void)
    printf(" -a n    allow up to 'n' new classes          100\n");
    printf(" -b n    set ngram buffer size to 'n'         2000000\n");
    printf(" -d s    database directory 's'               current\n");
+   printf(" -f s    write gram files in format 's'       PACKED\n");
    printf(" -i n    set output gram file start index     0\n");
+   printf(" -j n    sort and write grams on n threads    0\n");
    printf(" -m fn   save new word map to 'fn'            off\n");
    printf(" -n n    create n-grams of size 'n'           max\n");
    printf(" -o      output class mappings only           off\n");
@@ -153,8 +161,14 @@ int main(int argc, char *argv[])
             if (NextArg() != STRINGARG)
                HError(16219,"Database file directory expected");
             dbsDir = GetStrArg(); break;
+         case 'f':
+            if (NextArg() != STRINGARG)
+               HError(16219,"Gram file format (PACKED or DELTA) expected");
+            fmtName = GetStrArg(); break;
          case 'i':
             dumpOfs = GetChkedInt(0, 100000, s); break;
+         case 'j':
+            nThreads = GetChkedInt(0, MAX_THREADS, s); break;
          case 'm':
             if (NextArg()!=STRINGARG)
                HError(16219,"Output map filename expected");
@@ -179,6 +193,8 @@ int main(int argc, char *argv[])
             HError(16219,"LGCopy: Unknown switch %s",s);
       }
    }
+   if (nThreads<0 || nThreads>MAX_THREADS)
+      HError(16219,"LGCopy: number of threads must be in range 0..%d",MAX_THREADS);
    /* Look for wordmap */
    if (NextArg() != STRINGARG)
       HError(16219,"LGCopy: map file name expected");
@@ -292,6 +308,10 @@ static void Initialise(void)
    MakeFN(rootFN,dbsDir,NULL,path);
    ngb = CreateNGBuffer(&ngbHeap,nSize,ngbSize,path,(omap)?omap:&wmap);
    ngb->fndx += dumpOfs;
+   if (fmtName != NULL)
+      ngb->fmt = NGFormatByName(fmtName);
+   if (nThreads > 0)
+      ngw = CreateNGWriter(&ngbHeap,ngb,nThreads);
 }
 
 /* ----------------- File Processing -------------------- */
@@ -303,7 +323,10 @@ static void SaveOutBuffer(void)
       printf(" saving %d ngrams to file %s.%d\n",
               ngb->used, ngb->fn, ngb->fndx);
    }
-   WriteNGBuffer(ngb,"LGCopy");
+   if (ngw != NULL)
+      ngb = SubmitNGBuffer(ngw,ngb,"LGCopy");
+   else
+      WriteNGBuffer(ngb,"LGCopy");
 }
 
 /* CompressBuffer: and save if necessary or mustSave is TRUE */
@@ -312,6 +335,9 @@ static void CompressBuffer(Boolean mustSave)
    float compx;
 
    if (ngb->used == 0) return;
+   if (ngw != NULL) {   /* writer sorts, repeats are already merged */
+      SaveOutBuffer(); return;
+   }
    SortNGBuffer(ngb);  
    compx = 100.0 * (float)ngb->used / (float)ngb->poolsize;
    if (trace&T_SAV)
@@ -373,8 +399,8 @@ static void CopyFiles(void)
 
       if (outThis) {
          ++nout;
-	 /* StoreNGram returns TRUE if the NGram buffer is full */
-	 success = StoreNGram(ngb, ng);
+	 /* CountNGram returns TRUE if the NGram buffer is full */
+	 success = CountNGram(ngb, ng);
          if (success) {
             if (mapWords)      /* filtering (eg. using classmap) so need to compress */
 	       CompressBuffer(FALSE);  /* also calls SaveOutBuffer() */
@@ -387,6 +413,7 @@ static void CopyFiles(void)
       CompressBuffer(TRUE);
    else               /* otherwise assume inputs already sorted */
       SaveOutBuffer();
+   if (ngw != NULL) CloseNGWriter(ngw);
    printf("%d out of %d ngrams stored in %d files\n",nout,nin,ngb->fndx);
    CloseInputSet(&inset);
 }
@@ -51,6 +51,8 @@ static int trace = 0;
 /* ---------------------- Global Variables ----------------------- */
 
 static  WordMap wmap;            /* and the word map */
+static LabId startWord[MAXNG];   /* list from the first N-gram with this prefix */
+static int nStart = 0;           /* number of words in startWord */
 
 /* ---------------- Configuration Parameters --------------------- */
 
@@ -76,6 +78,7 @@ void ReportUsage(void)
    printf(" Option                                       Default\n\n");
    printf(" -i n    add id n to filter list              none\n");
    printf(" -f w    add word w to filter list            none\n");
+   printf(" -s w    add word w to start N-gram prefix    none\n");
    PrintStdOpts("");
    printf("\n\n");
 }
@@ -117,6 +120,13 @@ int main(int argc, char *argv[])
                HError(16119,"LGList: word index expected");
             AddWrdtoFilter(NULL,GetIntArg());
             break;
+         case 's':
+            if (NextArg()!=STRINGARG)
+               HError(16119,"LGList: start word expected");
+            if (nStart == MAXNG)
+               HError(16119,"LGList: more than %d start words",MAXNG);
+            startWord[nStart++] = GetLabId(GetStrArg(),TRUE);
+            break;
          case 'T':
             trace = GetChkedInt(0,077,s); break;
          default:
@@ -184,23 +194,45 @@ Boolean ShowNgram(int N, NGram ng)
 
 /* --------------------- Display N Grams ----------------- */
 
+/* SeekStart: skip to the first N-gram of ngs whose prefix is not
+   less than startWord[0..nStart-1] in word map order */
+void SeekStart(NGSource *ngs)
+{
+   UInt ng[MAXNG+1];
+   int i,ndx,N = ngs->info.N;
+
+   if (nStart > N)
+      HError(16119,"SeekStart: %d start words given for %d-grams",nStart,N);
+   SortWordMap(&wmap);
+   for (i=0; i<N; i++) {
+      if (i >= nStart) {      /* pad with the first word in map order */
+         ng[i] = wmap.me[wmap.firstNdx].ndx; continue;
+      }
+      if ((ndx = WordLMIndex(startWord[i])) < 0)
+         HError(16119,"SeekStart: start word %s not in word map",startWord[i]->name);
+      ng[i] = ndx;
+   }
+   SeekNGram(ngs,ng);
+}
+
 /* DisplayNGramFile: display contents of given NGram file */
 void DisplayNGramFile(char *fn)
 {
-   UInt ng[MAXNG],nPrinted,N;
+   UInt ng[MAXNG+1],nPrinted,N;
    NGSource ngs;
    
    OpenNGramFile(&ngs,fn,&wmap); N = ngs.info.N;
    printf("\n%d-Gram File %s[%d entries]:\n", N,fn, ngs.nItems);
    if (strlen(ngs.txtsrc) > 0)
       printf(" Text Source: %s\n",ngs.txtsrc);
+   if (nStart > 0) SeekStart(&ngs);
    nPrinted = 0;
-   do {
+   while (ngs.nItems > 0) {
       ReadNGram(&ngs, ng);
       if (filtList == NULL || ShowNgram(N,ng)) {
          PrintNGram(N,ng,&wmap); ++nPrinted;
       }
-   }while (ngs.nItems > 0);
+   }
    printf("%d ngram entries printed\n",nPrinted);
    CloseNGramFile(&ngs);
 }
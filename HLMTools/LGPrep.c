@@ -74,6 +74,7 @@ static int nParm = 0;            /* total num params */
 #define MAX_FIELDS   256      /* max number of fields in a rule */
 #define MAX_ITEMS    256      /* max number of items in any one set */
 #define MAX_SETS     256      /* max number sets */
+#define MAX_THREADS  256      /* max number of gram writer threads */
 
 typedef enum {             /* tags for rule fields */
    f_WORD,                    /* literal word */
@@ -124,6 +125,7 @@ typedef struct {
    int used;                  /* actual words in register */
    UInt ng[MAXNG+1];          /* ng[0] is oldest word */
    NGBuffer *ngb;             /* output ngram buffer */
+   NGWriter *ngw;             /* background writer, NULL if inline */
 } ShiftReg;
 
 /* ---------------------- Global Variables ----------------------- */
@@ -132,6 +134,7 @@ static int nSize     = 3;           /* ngram size */
 static int ngbSize   = 2000000;     /* ngram buffer size */
 static int egbSize   =  100000;     /* edited ngram buffer size */
 static int newWords  =  100000;     /* max new words to accommodate */
+static int nThreads  = 0;           /* gram file writer threads, 0=inline */
 static char *rootFN  = "gram";      /* gbase root filename */
 static int  dumpOfs  = 0;           /* initial numeric ext of gbase files */
 static char *dbsDir  = NULL;        /* directory to store gbase files */
@@ -176,6 +179,7 @@ void SetConfParms(void)
    if (nParm>0) {
       if (GetConfInt(cParm,nParm,"TRACE",&i)) trace = i;
       if (GetConfStr(cParm,nParm,"STARTWORD",b)) sstId = GetLabId(b, TRUE);
+      if (GetConfInt(cParm,nParm,"NUMTHREADS",&i)) nThreads = i;
    }
 }
 
@@ -193,6 +197,7 @@ void ReportUsage(void)
    printf(" -f s    fix text source using rules in s     off\n");
    printf(" -h      disable HTK escaping on output       %s\n", htkEscape?"off":"on");
    printf(" -i n    set output gram file start index     %d\n", dumpOfs);
+   printf(" -j n    sort and write grams on n threads    %d\n", nThreads);
    printf(" -n n    set n-gram size                      %d\n", nSize);
    printf(" -q      tag sentence start words with '_'    %s\n", tagSentStart?"on":"off");
    printf(" -r s    set root gram filename               %s\n", rootFN);
@@ -267,6 +272,8 @@ int main(int argc, char *argv[])
             htkEscape = FALSE; break;
          case 'i':
             dumpOfs = GetChkedInt(0, 100000, s); break;
+         case 'j':
+            nThreads = GetChkedInt(0, MAX_THREADS, s); break;
          case 'n':
             nSize = GetChkedInt(1, MAXNG, s); break;
          case 'q':
@@ -293,6 +300,8 @@ int main(int argc, char *argv[])
             HError(16019,"LGPrep: Unknown switch '%s'",s);
       }
    }
+   if (nThreads<0 || nThreads>MAX_THREADS)
+      HError(16019,"LGPrep: number of threads must be in range 0..%d",MAX_THREADS);
    if (NextArg() != STRINGARG)
       HError(16019,"LGPrep: word map filename expected");
    imapFN = GetStrArg();
@@ -564,6 +573,7 @@ void InitShiftReg(ShiftReg *sr, int size, char *fn)
    sr->ng[nSize] = 1;   /* count = 1 */
    sr->ngb = CreateNGBuffer(&ngbHeap,nSize,size,path,&wmap);
    sr->ngb->fndx += dumpOfs;
+   sr->ngw = (nThreads>0) ? CreateNGWriter(&ngbHeap,sr->ngb,nThreads) : NULL;
 }
 
 /* Initialise: initialise global data structures */
@@ -590,11 +600,42 @@ void Initialise(void)
 
 /* ----------------- NGram Counting Routines -------------------- */
 
+/* SaveMap: save the word map if it has changed */
+void SaveMap(void)
+{
+   if (mapUpdated) {
+      SaveWordMap(omapFN,&wmap,FALSE);
+      mapUpdated = FALSE;
+      if (trace&T_TOP) 
+         printf(" word map saved to %s\n",omapFN);
+   }
+}
+
+/* QueueBuffer: hand the register's buffer to its background writer */
+void QueueBuffer(ShiftReg *sr, Boolean mustSave)
+{
+   NGBuffer *ngb = sr->ngb;
+
+   if (mustSave) SaveMap();
+   if (ngb->used > 0) {
+      if (trace&T_TOP) {
+         printf(" saving %d ngrams to file %s.%d\n",
+                 ngb->used, ngb->fn, ngb->fndx);
+      }
+      sr->ngb = SubmitNGBuffer(sr->ngw,ngb,txtsrc);
+   }
+   if (mustSave) FlushNGWriter(sr->ngw);
+}
+
 /* CompressBuffer: and save if necessary or mustSave is TRUE */
-void CompressBuffer(NGBuffer *ngb, Boolean mustSave)
+void CompressBuffer(ShiftReg *sr, Boolean mustSave)
 {
+   NGBuffer *ngb = sr->ngb;
    float compx;
 
+   if (sr->ngw != NULL) {
+      QueueBuffer(sr,mustSave); return;
+   }
    if (ngb->used == 0) return;
    if (trace&T_MEM) {
       printf("** before buffer sort\n");
@@ -611,12 +652,7 @@ void CompressBuffer(NGBuffer *ngb, Boolean mustSave)
               ngb->fn, ngb->fndx, mustSave?"[must save]":"",compx,wordnum);
    }
    if (compx > 75.0 || mustSave) {
-      if (mustSave && mapUpdated) {
-         SaveWordMap(omapFN,&wmap,FALSE);
-         mapUpdated = FALSE;
-         if (trace&T_TOP) 
-            printf(" word map saved to %s\n",omapFN);
-      }
+      if (mustSave) SaveMap();
       if (trace&T_TOP) {
          printf(" saving %d ngrams to file %s.%d\n",
                  ngb->used, ngb->fn, ngb->fndx);
@@ -625,11 +661,13 @@ void CompressBuffer(NGBuffer *ngb, Boolean mustSave)
    }
 }
 
-/* PutShiftRegister: push word into shift register and extract ngram */
+/* PutShiftRegister: push word into shift register and extract ngram;
+   this runs on the main thread even with -j, see LGBase.h */
 void PutShiftRegister(LabId id, ShiftReg *sr)
 {
    int i;
    MapEntry *me;
+   Boolean full;
    
   if (trace&T_SHR){
       printf("   %12s --> %s\n",id->name,sr->ngb->fn);
@@ -640,16 +678,15 @@ void PutShiftRegister(LabId id, ShiftReg *sr)
    me = (MapEntry *)id->aux;
    sr->ng[sr->used++] = me->ndx;
    if (sr->used == nSize) {
-      /* record ngram */
-      StoreNGram(sr->ngb,sr->ng);
+      /* record ngram, merging repeats */
+      full = CountNGram(sr->ngb,sr->ng);
       /* shift words */
       sr->used--;
       for (i=0; i<sr->used; i++)
          sr->ng[i] = sr->ng[i+1];
       /* compress buffer if full */
-      if (sr->ngb->used == sr->ngb->poolsize)  {
-         CompressBuffer(sr->ngb,FALSE);
-      }
+      if (full)
+         CompressBuffer(sr,FALSE);
    }
 }
 
@@ -781,10 +818,10 @@ void ProcessText(char *fn, Boolean lastFile)
          SaveWordMap(omapFN,&wmap,FALSE);
       } else {
 	if (gbGen)
-	  CompressBuffer(stdBuf.ngb,TRUE);
+	  CompressBuffer(&stdBuf,TRUE);
 	if (ruleFN != NULL){
-	  CompressBuffer(negBuf.ngb,TRUE);
-	  CompressBuffer(posBuf.ngb,TRUE);
+	  CompressBuffer(&negBuf,TRUE);
+	  CompressBuffer(&posBuf,TRUE);
 	}
       }
    }
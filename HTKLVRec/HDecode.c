@@ -53,6 +53,8 @@ char *hdecode_sccs_id = "$Id: HDecode.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $";
 #include "HDict.h"
 #include "HANNet.h"
 #include "HModel.h"
+#include "HVQ.h"
+#include "HGSel.h"
 #include "HUtil.h"
 #include "HTrain.h"
 #include "HAdapt.h"
@@ -76,6 +78,7 @@ char *hdecode_sccs_id = "$Id: HDecode.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $";
 #define T_OBS 00002		/* Print Observation */
 #define T_ADP 00004		/* Adaptation */
 #define T_MEM 00010		/* Memory usage, start and finish */
+#define T_THREAD 00020		/* Report thread set-up */
 
 static int trace = 0;
 
@@ -83,6 +86,7 @@ static int trace = 0;
 
 
 static char *langfn;		/* LM filename from commandline */
+static char *lmImagefn = NULL;	/* compile LM to this image file and exit */
 static char *dictfn;		/* dict filename from commandline */
 static char *hmmListfn;		/* model list filename from commandline */
 static char *hmmDir = NULL;     /* directory to look for HMM def files */
@@ -146,6 +150,9 @@ static Boolean useHModel = FALSE; /* use standard HModel OutP functions */
 static int outpBlocksize = 1;   /* number of frames for which outP is calculated in one go */
 static Observation *obs;        /* array of Observations */
 
+static int streamChunk = 0;     /* output stable words every streamChunk frames, 0 = off */
+static int streamLatency = 0;   /* max delay of output words in frames, 0 = stable only */
+
 /* cz277 - ANN */
 /*static int batchSamples;*/
 static LabelInfo labelInfo;
@@ -170,12 +177,43 @@ static MemHeap regHeap;
 /* cz277 - ANN */
 static MemHeap cacheHeap;
 
+/* -------------------------- Parallel Decoding ------------------------- */
+
+#define MAXTHREADS 256
+#define JOBSPERTHREAD 4         /* utterances queued ahead per thread */
+
+typedef struct {                /* a queued utterance */
+   char fn[MAXFNAMELEN];        /* data file */
+   Boolean isExt;               /* fn is an extended file name: */
+   ExtFile ext;                 /* its actual name and range */
+   MemHeap heap;                /* holds trans and lat until emitted */
+   HTime sampRate;              /* frame period of the data */
+   Transcription *trans;        /* 1-best transcription */
+   Lattice *lat;                /* pruned lattice if latGen */
+} DecodeJob;
+
+typedef struct {                /* a decoding thread */
+   DecoderInst *dec;            /* private search state, shares net and lm */
+   Observation *obs;            /* private observation buffers */
+   MemHeap inputBufHeap;        /* private input buffer heap */
+} DecodeWorker;
+
+static int nThreads = 1;        /* number of decoding threads */
+static DecodeWorker *workers;   /* array[0..nThreads-1] of threads */
+static DecodeJob *jobs;         /* ring of nJobs queued utterances */
+static int nJobs = 0;
+static JobPool *pool;           /* threads decoding the queued jobs */
+
 /* -------------------------- Prototypes -------------------------------- */
 void SetConfParms (void);
 void ReportUsage (void);
 DecoderInst *Initialise (void);
 void DoRecognition (DecoderInst *dec, char *fn);
 Boolean UpdateSpkrModels (char *fn);
+void CheckThreadSetUp (void);
+void StartDecodePool (DecoderInst *dec0);
+void QueueDecode (char *fn);
+void StopDecodePool (void);
 
 /* ---------------- Configuration Parameters ---------------------------- */
 
@@ -218,6 +256,12 @@ SetConfParms (void)
       if (GetConfStr (cParm, nParm, "BESTALIGNMLF", buf))
          bestAlignMLF = CopyString (&gstack, buf);
       if (GetConfBool (cParm, nParm, "USEHMODEL",&b)) useHModel = b;
+      if (GetConfInt (cParm, nParm, "NUMTHREADS", &i))
+         nThreads = i;
+      if (GetConfInt (cParm, nParm, "STREAMCHUNK", &i))
+         streamChunk = i;
+      if (GetConfInt (cParm, nParm, "STREAMLATENCY", &i))
+         streamLatency = i;
       if (GetConfStr(cParm,nParm,"LATFILEMASK",buf)) {
          latFileMask = CopyString(&gstack, buf);
       }
@@ -240,6 +284,7 @@ ReportUsage (void)
 
    printf (" -d s    dir to find hmm definitions       current\n");
    printf (" -i s    Output transcriptions to MLF s      off\n");
+   printf (" -j i    number of decoding threads          1\n");
    /*printf (" -k i    block size for outP calculation     1\n");*/
    printf (" -l s    dir to store label files	    current\n");
    printf (" -o s    output label formating NCSTWMX      none\n");
@@ -253,6 +298,7 @@ ReportUsage (void)
    printf (" -v f    wordend beam width                  0.0\n");
    printf (" -n i    number of tokens per state          32\n");
    printf (" -w s    use language model                  none\n");
+   printf (" -W s    compile LM to image s and exit      off\n");
    printf (" -x s    extension for hmm files             none\n");
    printf (" -y s    output label file extension         rec\n");
    printf (" -z s    generate lattices with extension s  off\n");
@@ -295,6 +341,8 @@ main (int argc, char *argv[])
    InitAudio ();
    InitANNet();		/* cz277 - ANN */
    InitModel ();
+   InitVQ ();
+   InitGSel ();
    if (InitParm () < SUCCESS)
       HError (3900, "HDecode: InitParm failed");
    InitUtil ();
@@ -339,6 +387,9 @@ main (int argc, char *argv[])
 	 hmmExt = GetStrArg(); 
 	 break;
 	 
+      case 'j':
+         nThreads = GetChkedInt (1, MAXTHREADS, s);
+         break;
       case 'i':
 	 if (NextArg () != STRINGARG)
 	    HError (3919, "HDecode: Output MLF file name expected");
@@ -450,6 +501,12 @@ main (int argc, char *argv[])
             langfn = GetStrArg();
 	 break;
 
+      case 'W':
+	 if (NextArg() != STRINGARG)
+	    HError (3919, "HDecode: LM image file name expected");
+	 lmImagefn = GetStrArg();
+	 break;
+
       case 'n':
 	 nTok = GetChkedInt (0, 1024, s);
 	 break;
@@ -539,6 +596,10 @@ main (int argc, char *argv[])
 
    if (beamWidth > -LSMALL)
       HError (3919, "main beam is too wide!");
+   if (weBeamWidth > beamWidth)
+      weBeamWidth = beamWidth;
+   if (zsBeamWidth > beamWidth)
+      zsBeamWidth = beamWidth;
 
    if (xfInfo.useInXForm) {
       if (!useHModel) {
@@ -578,10 +639,18 @@ main (int argc, char *argv[])
       }
    }
 
+   CheckThreadSetUp ();
+   if (nThreads > 1)
+      StartDecodePool (dec);
+
    while (NumArgs () > 0) {
       if (NextArg () != STRINGARG)
 	 HError (3919, "HDecode: Data file name expected");
       datafn = GetStrArg ();
+      if (nThreads > 1) {
+         QueueDecode (datafn);
+         continue;
+      }
       /* cz277 - ANN */
       strcpy(fnbuf, datafn);
       if (trace & T_TOP) {
@@ -592,6 +661,8 @@ main (int argc, char *argv[])
       /*DoRecognition (dec, datafn);*/
       /* perform recognition */
    }
+   if (nThreads > 1)
+      StopDecodePool ();
 
    if (trace & T_MEM) {
       printf ("Memory State on Completion\n");
@@ -742,6 +813,12 @@ DecoderInst *Initialise (void)
       }
       
       lm = CreateLM (&lmHeap, langfn, startWord, endWord, &vocab);
+
+      /* PronIds depend on dict and models, so the image is written here */
+      if (lmImagefn) {
+         WriteLMImage (lm, lmImagefn);
+         Exit (0);
+      }
    }
    else {
       net = NULL;
@@ -976,7 +1053,7 @@ void PrintAlignBestInfo (DecoderInst *dec, BestInfo *b)
    LabId monoPhone;
    LogDouble phonePost;
 
-   inst = b->ln->inst;
+   inst = LN_INST(dec, b->ln);
    score = inst ? inst->best : LZERO;
 
    if (b->ln->type == LN_MODEL) {
@@ -1053,13 +1130,217 @@ static void LoadCacheVec(DecoderInst *dec, int frameNum, HMMSet *hset) {
     }
 }
 
+/* StreamWords: report the words of dec that became stable since the
+   last call and append them to stream (allocated in heap).  With
+   several threads the job's own output is held back until the job is
+   done, so the partial line goes straight to stdout, locked so that
+   it is not split by output from other threads */
+static void StreamWords (DecoderInst *dec, MemHeap *heap, LabList *stream)
+{
+    Transcription *part;
+    LLink lab;
+    FILE *f;
+
+    part = StreamTraceBack(heap, dec, streamLatency);
+    if (part->head->head->succ == part->head->tail)
+        return;
+    f = (nThreads > 1) ? stdout : MsgOut();
+    flockfile(f);
+    fprintf(f, "Partial %s %.2f:", dec->utterFN, dec->frame * dec->frameDur);
+    for (lab = part->head->head->succ; lab != part->head->tail; lab = lab->succ) {
+        fprintf(f, " %s", lab->labid->name);
+        AddLabel(heap, stream, lab->labid, lab->start, lab->end, lab->score);
+    }
+    fprintf(f, "\n");
+    fflush(f);
+    funlockfile(f);
+}
+
+/* JoinStream: move the streamed words in front of the final traceback */
+static void JoinStream (Transcription *trans, LabList *stream)
+{
+    LabList *ll = trans->head;
+
+    if (stream->head->succ == stream->tail)
+        return;
+    stream->tail->pred->succ = ll->head->succ;
+    ll->head->succ->pred = stream->tail->pred;
+    ll->head->succ = stream->head->succ;
+    stream->head->succ->pred = ll->head;
+    stream->head->succ = stream->tail;
+    stream->tail->pred = stream->head;
+}
+
+/* DecodeFrames: decode all frames of parmBuf with dec, reading them
+   through the outpBlocksize observations ob; returns the frame count.
+   If stream is not NULL the stable words are collected in it every
+   streamChunk frames */
+static int DecodeFrames (DecoderInst *dec, Observation *ob, ParmBuf parmBuf,
+                         BestInfo *bestAlignInfo, MemHeap *heap, LabList *stream)
+{
+    Observation *obsBlock[MAXBLOCKOBS];
+    int frameN, frameProc, i, bs;
+
+    frameN = frameProc = 0;
+    while (BufferStatus(parmBuf) != PB_CLEARED) {
+        ReadAsBuffer(parmBuf, &ob[frameN % outpBlocksize]);
+  
+#ifdef LEGACY_CUHTK2_MLLR
+        if (fvTransMat) {
+            if (trace & T_OBS)
+                printf ("apply full variance transform\n");
+
+            MultBlockMat_Vec(fvTransMat, ob[frameN % outpBlocksize].fv[1], ob[frameN % outpBlocksize].fv[1]);
+        } 
+#endif
+
+        if (frameN + 1 >= outpBlocksize) {  
+            if (trace & T_OBS)
+                PrintObservation(frameProc + 1, &ob[frameProc % outpBlocksize], 13);
+            for (i = 0; i < outpBlocksize; ++i)
+                obsBlock[i] = &ob[(frameProc + i) % outpBlocksize];
+
+#ifdef DEBUG_TRACE
+            fprintf(stdout, "\nProcessing frame %d :\n", frameProc);
+            fflush(stdout);
+#endif
+
+            ProcessFrame(dec, obsBlock, outpBlocksize, xfInfo.inXForm, -1); /* cz277 - ANN */
+
+            if(bestAlignInfo)
+                AnalyseSearchSpace(dec, bestAlignInfo);
+            ++frameProc;
+            if (stream && frameProc % streamChunk == 0)
+                StreamWords(dec, heap, stream);
+        }
+        ++frameN;
+    }
+
+    /* process remaining frames (no full blocks available anymore) */
+    for (bs = outpBlocksize - 1; bs >= 1; --bs) {
+        if (trace & T_OBS)
+            PrintObservation(frameProc + 1, &ob[frameProc % outpBlocksize], 13);
+        for (i = 0; i < bs; ++i)
+            obsBlock[i] = &ob[(frameProc + i) % outpBlocksize];
+  
+        ProcessFrame(dec, obsBlock, bs, xfInfo.inXForm, -1);    /* cz277 - ANN */
+        if (bestAlignInfo)
+            AnalyseSearchSpace(dec, bestAlignInfo);
+        ++frameProc;
+        if (stream && frameProc % streamChunk == 0)
+            StreamWords(dec, heap, stream);
+    }
+    assert(frameProc == frameN);
+    return frameN;
+}
+
+/* SaveTranscription: format and save the 1-best transcription of fn,
+   the label file name following LABOFILEMASK as in HVite */
+static void SaveTranscription (char *fn, Transcription *trans, HTime sampRate)
+{
+    char labfn[MAXSTRLEN], lfn[MAXSTRLEN];
+
+    if (labForm != NULL)
+        ReFormatTranscription(trans, sampRate, FALSE, FALSE,
+                                strchr(labForm, 'X') != NULL,
+                                strchr(labForm, 'N') != NULL, strchr(labForm, 'S') != NULL,
+                                strchr(labForm, 'C') != NULL, strchr(labForm, 'T') != NULL,
+                                strchr(labForm, 'W') != NULL, strchr(labForm, 'M') != NULL);
+
+    /* from mjfg, cz277 - 141022 */
+    if (labOFileMask) {
+        if (!MaskMatch (labOFileMask, lfn, fn))
+            HError(3919,"DoRecognition: LABOFILEMASK %s has no match with segemnt %s", labOFileMask, fn);
+    } else {     
+        strcpy (lfn, fn);
+    }
+    MakeFN(lfn, labDir, labExt, labfn);
+    /*MakeFN(fn, labDir, labExt, labfn);*/
+
+    if (LSave(labfn, trans, ofmt) < SUCCESS)
+        HError(3911, "DoRecognition: Cannot save file %s", labfn);
+    if (trace & T_TOP)
+        PrintTranscription(trans, "1-best hypothesis");
+}
+
+/* SaveLattice: write the lattice of fn in latOutForm, the file name
+   following LATOFILEMASK as in HVite */
+static void SaveLattice (char *fn, Lattice *lat)
+{
+    char latfn[MAXSTRLEN], lfn[MAXSTRLEN];
+    char *p;
+    Boolean isPipe;
+    FILE *file;
+    LatFormat form;
+         
+    /* from mjfg, cz277 - 141022 */
+    if (latOFileMask) {
+        if (!MaskMatch (latOFileMask, lfn, fn))
+            HError(3919,"DoRecognition: LATOFILEMASK %s has no match with segemnt %s", latOFileMask, fn);
+    } else {
+        strcpy (lfn, fn);
+    }
+    MakeFN(lfn, latOutDir, latOutExt, latfn);          
+    /*MakeFN(fn, latOutDir, latOutExt, latfn);*/
+ 
+    file = FOpen(latfn, NetOFilter, &isPipe);
+    if (!file) 
+        HError (3913, "DoRecognition: Could not open file %s for lattice output", latfn);
+    if (!latOutForm)
+        form = (HLAT_DEFAULT & ~HLAT_ALLIKE) | HLAT_PRLIKE;
+    else {
+        for (p = latOutForm, form=0; *p != 0; p++) {
+            switch (*p) {
+                case 'A': form |= HLAT_ALABS;   break;
+                case 'B': form |= HLAT_LBIN;    break;
+                case 't': form |= HLAT_TIMES;   break;
+                case 'v': form |= HLAT_PRON;    break;
+                case 'a': form |= HLAT_ACLIKE;  break;
+                case 'l': form |= HLAT_LMLIKE;  break;
+                case 'd': form |= HLAT_ALIGN;   break;
+                case 'm': form |= HLAT_ALDUR;   break;
+                case 'n': form |= HLAT_ALLIKE; 
+                    HError(3901, "DoRecognition: likelihoods for model alignment not supported");
+                    break;
+                case 'r': form |= HLAT_PRLIKE;  break;
+            }
+        }
+    }
+    if (WriteLattice(lat, file, form) < SUCCESS)
+        HError(3913, "DoRecognition: WriteLattice failed");
+         
+    FClose(file, isPipe);
+}
+
+/* PrintDecoderStats: print the search statistics of the last utterance */
+static void PrintDecoderStats (FILE *f, DecoderInst *dec)
+{
+#ifdef COLLECT_STATS
+    fprintf(f, "Stats: nTokSet %lu\n", dec->stats.nTokSet);
+    fprintf(f, "Stats: TokPerSet %f\n", dec->stats.sumTokPerTS / (double) dec->stats.nTokSet);
+    fprintf(f, "Stats: activePerFrame %f\n", dec->stats.nActive / (double) dec->stats.nFrames);
+    fprintf(f, "Stats: activateNodePerFrame %f\n", dec->stats.nActivate / (double) dec->stats.nFrames);
+    fprintf(f, "Stats: deActivateNodePerFrame %f\n\n", dec->stats.nDeActivate / (double) dec->stats.nFrames);
+#ifdef COLLECT_STATS_ACTIVATION
+    {
+        int i;
+        for (i = 0; i <= STATS_MAXT; ++i)
+            fprintf(f, "T %d Dead %lu Live %lu\n", i, dec->stats.lnDeadT[i], dec->stats.lnLiveT[i]);
+    }
+#endif
+#endif
+    PrintLMLAStats(f, dec);
+    ReportGSel(f, &dec->gsel);
+}
+
 void DoRecognition (DecoderInst *dec, char *fn)
 {
     char buf1[MAXSTRLEN], buf2[MAXSTRLEN];
     ParmBuf parmBuf;
     BufferInfo pbInfo;
-    int frameN, frameProc, i, bs, uttCnt;
+    int frameN, frameProc, i, uttCnt;
     Transcription *trans;
+    LabList *stream;
     Lattice *lat;
     clock_t startClock, endClock;
     double cpuSec;
@@ -1153,64 +1434,16 @@ void DoRecognition (DecoderInst *dec, char *fn)
         dec->lm = lm;
     }
 
-    if (weBeamWidth > beamWidth)
-        weBeamWidth = beamWidth;
-    if (zsBeamWidth > beamWidth)
-        zsBeamWidth = beamWidth;
-
     InitDecoderInst(dec, net, pbInfo.tgtSampRate, beamWidth, relBeamWidth, weBeamWidth, zsBeamWidth, maxModel, insPen, acScale, pronScale, lmScale, fastlmlaBeam);
 
     net->vocabFN = dictfn;
     dec->utterFN = fn;
 
+    stream = (streamChunk > 0) ? CreateLabelList(&transHeap, 0) : NULL;
     frameN = frameProc = 0;
     /* cz277 - ANN */
     if (hset.annSet == NULL) { /* use conventional way */
-        while (BufferStatus(parmBuf) != PB_CLEARED) {
-            ReadAsBuffer(parmBuf, &obs[frameN % outpBlocksize]);
-      
-#ifdef LEGACY_CUHTK2_MLLR
-            if (fvTransMat) {
-                if (trace & T_OBS)
-                    printf ("apply full variance transform\n");
-
-                MultBlockMat_Vec(fvTransMat, obs[frameN % outpBlocksize].fv[1], obs[frameN % outpBlocksize].fv[1]);
-            } 
-#endif
-
-            if (frameN + 1 >= outpBlocksize) {  
-                if (trace & T_OBS)
-                    PrintObservation(frameProc + 1, &obs[frameProc % outpBlocksize], 13);
-                for (i = 0; i < outpBlocksize; ++i)
-                    obsBlock[i] = &obs[(frameProc + i) % outpBlocksize];
-
-#ifdef DEBUG_TRACE
-                fprintf(stdout, "\nProcessing frame %d :\n", frameProc);
-                fflush(stdout);
-#endif
-
-                ProcessFrame(dec, obsBlock, outpBlocksize, xfInfo.inXForm, -1); /* cz277 - ANN */
-
-                if(bestAlignInfo)
-                    AnalyseSearchSpace(dec, bestAlignInfo);
-                ++frameProc;
-            }
-            ++frameN;
-        }
-
-        /* process remaining frames (no full blocks available anymore) */
-        for (bs = outpBlocksize - 1; bs >= 1; --bs) {
-            if (trace & T_OBS)
-                PrintObservation(frameProc + 1, &obs[frameProc % outpBlocksize], 13);
-            for (i = 0; i < bs; ++i)
-                obsBlock[i] = &obs[(frameProc + i) % outpBlocksize];
-      
-            ProcessFrame(dec, obsBlock, bs, xfInfo.inXForm, -1);    /* cz277 - ANN */
-            if (bestAlignInfo)
-                AnalyseSearchSpace(dec, bestAlignInfo);
-            ++frameProc;
-        }
-        assert(frameProc == frameN);
+        frameN = DecodeFrames(dec, obs, parmBuf, bestAlignInfo, &transHeap, stream);
     }
     else {  /* if hset.feaMix is not empty */
         /* get utterance name in cache */
@@ -1257,8 +1490,11 @@ void DoRecognition (DecoderInst *dec, char *fn)
             decStClock = clock();   /* cz277 - clock */
             LoadCacheVec(dec, nLoaded, &hset);
             /* decode these frames */
-            for (i = 0; i < nLoaded; ++i) 
+            for (i = 0; i < nLoaded; ++i) {
                 ProcessFrame(dec, obsBlock, outpBlocksize, xfInfo.inXForm, i);
+                if (stream && (frameN + i + 1) % streamChunk == 0)
+                    StreamWords(dec, &transHeap, stream);
+            }
             decClock += clock() - decStClock;   /* cz277 - clock */
             /* analyse the search space */
             if (bestAlignInfo) 
@@ -1299,33 +1535,11 @@ void DoRecognition (DecoderInst *dec, char *fn)
         fflush(stdout);
     }
     trans = TraceBack(&transHeap, dec);
+    if (trans && stream)
+        JoinStream(trans, stream);
     /* save 1-best transcription */
-    /* the following is from HVite.c */
     if (trans) {
-        char labfn[MAXSTRLEN], lfn[MAXSTRLEN];
-
-        if (labForm != NULL)
-            ReFormatTranscription(trans, pbInfo.tgtSampRate, FALSE, FALSE,
-                                    strchr(labForm, 'X') != NULL,
-                                    strchr(labForm, 'N') != NULL, strchr(labForm, 'S') != NULL,
-                                    strchr(labForm, 'C') != NULL, strchr(labForm, 'T') != NULL,
-                                    strchr(labForm, 'W') != NULL, strchr(labForm, 'M') != NULL);
-
-        /* from mjfg, cz277 - 141022 */
-        if (labOFileMask) {
-            if (!MaskMatch (labOFileMask, lfn, fn))
-                HError(3919,"DoRecognition: LABOFILEMASK %s has no match with segemnt %s", labOFileMask, fn);
-        } else {     
-            strcpy (lfn, fn);
-        }
-        MakeFN(lfn, labDir, labExt, labfn);
-        /*MakeFN(fn, labDir, labExt, labfn);*/
-
-        if (LSave(labfn, trans, ofmt) < SUCCESS)
-            HError(3911, "DoRecognition: Cannot save file %s", labfn);
-        if (trace & T_TOP)
-            PrintTranscription(trans, "1-best hypothesis");
-
+        SaveTranscription(fn, trans, pbInfo.tgtSampRate);
         Dispose(&transHeap, trans);
     }
 
@@ -1336,74 +1550,14 @@ void DoRecognition (DecoderInst *dec, char *fn)
             lat = LatPrune (&transHeap, lat, latPruneBeam, latPruneAPS);
         }
 
-        /* the following is from HVite.c */
         if (lat) {
-            char latfn[MAXSTRLEN], lfn[MAXSTRLEN];
-            char *p;
-            Boolean isPipe;
-            FILE *file;
-            LatFormat form;
-         
-            /* from mjfg, cz277 - 141022 */
-            if (latOFileMask) {
-                if (!MaskMatch (latOFileMask, lfn, fn))
-                    HError(3919,"DoRecognition: LATOFILEMASK %s has no match with segemnt %s", latOFileMask, fn);
-            } else {
-                strcpy (lfn, fn);
-            }
-            MakeFN(lfn, latOutDir, latOutExt, latfn);          
-            /*MakeFN(fn, latOutDir, latOutExt, latfn);*/
- 
-            file = FOpen(latfn, NetOFilter, &isPipe);
-            if (!file) 
-                HError (3913, "DoRecognition: Could not open file %s for lattice output", latfn);
-            if (!latOutForm)
-                form = (HLAT_DEFAULT & ~HLAT_ALLIKE) | HLAT_PRLIKE;
-            else {
-                for (p = latOutForm, form=0; *p != 0; p++) {
-                    switch (*p) {
-                        case 'A': form |= HLAT_ALABS;   break;
-                        case 'B': form |= HLAT_LBIN;    break;
-                        case 't': form |= HLAT_TIMES;   break;
-                        case 'v': form |= HLAT_PRON;    break;
-                        case 'a': form |= HLAT_ACLIKE;  break;
-                        case 'l': form |= HLAT_LMLIKE;  break;
-                        case 'd': form |= HLAT_ALIGN;   break;
-                        case 'm': form |= HLAT_ALDUR;   break;
-                        case 'n': form |= HLAT_ALLIKE; 
-                            HError(3901, "DoRecognition: likelihoods for model alignment not supported");
-                            break;
-                        case 'r': form |= HLAT_PRLIKE;  break;
-                    }
-                }
-            }
-            if (WriteLattice(lat, file, form) < SUCCESS)
-                HError(3913, "DoRecognition: WriteLattice failed");
-         
-            FClose(file, isPipe);
+            SaveLattice(fn, lat);
             Dispose(&transHeap, lat);
         }
     }
 
 
-#ifdef COLLECT_STATS
-    printf("Stats: nTokSet %lu\n", dec->stats.nTokSet);
-    printf("Stats: TokPerSet %f\n", dec->stats.sumTokPerTS / (double) dec->stats.nTokSet);
-    printf("Stats: activePerFrame %f\n", dec->stats.nActive / (double) dec->stats.nFrames);
-    printf("Stats: activateNodePerFrame %f\n", dec->stats.nActivate / (double) dec->stats.nFrames);
-    printf("Stats: deActivateNodePerFrame %f\n\n", dec->stats.nDeActivate / (double) dec->stats.nFrames);
-#if 0
-    printf ("Stats: LMlaCacheHits %ld\n", dec->stats.nLMlaCacheHit);
-    printf ("Stats: LMlaCacheMiss %ld\n", dec->stats.nLMlaCacheMiss);
-#endif
-#ifdef COLLECT_STATS_ACTIVATION
-    {
-        int i;
-        for (i = 0; i <= STATS_MAXT; ++i)
-            printf("T %d Dead %lu Live %lu\n", i, dec->stats.lnDeadT[i], dec->stats.lnLiveT[i]);
-    }
-#endif
-#endif
+    PrintDecoderStats(stdout, dec);
 
     if (trace & T_MEM) {
         printf("memory stats at end of recognition\n");
@@ -1534,6 +1688,170 @@ Boolean UpdateSpkrModels (char *fn)
 #endif
 
 
+/* --------------------- Parallel Decoding ---------------------- */
+
+/* CheckThreadSetUp: fall back to one thread if decoding an utterance
+   changes state shared by all of them (per utterance lattice LMs, ANN
+   caches, adaptation) or the coding channel is not reentrant */
+void CheckThreadSetUp (void)
+{
+   char *why = NULL;
+
+   if (nThreads < 1 || nThreads > MAXTHREADS)
+      HError (3919, "HDecode: NUMTHREADS must be in range 1..%d", MAXTHREADS);
+   if (nThreads == 1) return;
+   if (latRescore)
+      why = "lattice rescoring";
+   else if (hset.annSet != NULL)
+      why = "ANN models";
+   else if (xfInfo.useInXForm || xfInfo.usePaXForm || xfInfo.useOutXForm)
+      why = "adaptation transforms";
+   else if (bestAlignMLF)
+      why = "BESTALIGNMLF";
+   else if (trace & (T_OBS | T_MEM))
+      why = "observation or memory tracing";
+   else
+      ReentrantChannel (&why);
+   if (why != NULL) {
+      HError (-3919, "HDecode: %d threads not supported with %s, using 1",
+              nThreads, why);
+      nThreads = 1;
+   }
+}
+
+/* DecodeJobFile: decode job->fn as DoRecognition would, leaving the
+   transcription and pruned lattice in job->heap.  Output up to the
+   traceback goes to the first output segment and the rest to the
+   second so that EmitDecodeJob can save the transcription in between,
+   as the serial decoder does */
+static void DecodeJobFile (DecodeWorker *w, DecodeJob *job)
+{
+   char buf1[MAXSTRLEN], buf2[MAXSTRLEN];
+   DecoderInst *dec = w->dec;
+   ParmBuf parmBuf;
+   BufferInfo pbInfo;
+   struct timespec startClock, endClock;
+   double cpuSec;
+   int frameN;
+   LabList *stream;
+
+   /* clock() would count the CPU time of all threads */
+   clock_gettime (CLOCK_THREAD_CPUTIME_ID, &startClock);
+
+   parmBuf = OpenBuffer (&w->inputBufHeap, job->fn, 50, dataForm, TRI_UNDEF, TRI_UNDEF);
+   if (!parmBuf)
+      HError (3910, "HDecode: Opening input failed");
+   GetBufferInfo (parmBuf, &pbInfo);
+   if (pbInfo.tgtPK != hset.pkind)
+      HError (3923, "HDecode: Incompatible parm kinds %s vs. %s", ParmKind2Str (pbInfo.tgtPK, buf1), ParmKind2Str (hset.pkind, buf2));
+
+   InitDecoderInst (dec, net, pbInfo.tgtSampRate, beamWidth, relBeamWidth, weBeamWidth, zsBeamWidth, maxModel, insPen, acScale, pronScale, lmScale, fastlmlaBeam);
+   dec->utterFN = job->fn;
+   stream = (streamChunk > 0) ? CreateLabelList (&job->heap, 0) : NULL;
+   frameN = DecodeFrames (dec, w->obs, parmBuf, NULL, &job->heap, stream);
+   CloseBuffer (parmBuf);
+
+   clock_gettime (CLOCK_THREAD_CPUTIME_ID, &endClock);
+   cpuSec = (endClock.tv_sec - startClock.tv_sec) +
+      (endClock.tv_nsec - startClock.tv_nsec) * 1.0e-9;
+   fprintf (MsgOut (), "CPU time %f  utterance length %f  RT factor %f\n", cpuSec, frameN * dec->frameDur, cpuSec / (frameN * dec->frameDur));
+
+   job->sampRate = pbInfo.tgtSampRate;
+   job->trans = TraceBack (&job->heap, dec);
+   if (stream)
+      JoinStream (job->trans, stream);
+
+   NextJobOutput ();
+   if (latGen) {
+      job->lat = LatTraceBack (&job->heap, dec);
+      if (job->lat && latPruneBeam < -LSMALL)
+         job->lat = LatPrune (&job->heap, job->lat, latPruneBeam, latPruneAPS);
+   }
+   PrintDecoderStats (MsgOut (), dec);
+
+   ResetHeap (&w->inputBufHeap);
+   CleanDecoderInst (dec);
+}
+
+/* RunDecodeJob: decode queued utterance j on pool thread w */
+static void RunDecodeJob (int w, int j)
+{
+   DecodeJob *job = jobs + j;
+
+   if (job->isExt)
+      PinExtFiles (&job->ext, 1);
+   DecodeJobFile (workers + w, job);
+}
+
+/* EmitDecodeJob: save the transcription and lattice of utterance j
+   between its output segments, in script order */
+static void EmitDecodeJob (int j, int errcode)
+{
+   DecodeJob *job = jobs + j;
+
+   if (trace & T_TOP) {
+      printf ("File: %s\n", job->fn);
+      fflush (stdout);
+   }
+   EmitJobOutput (pool, 0);
+   if (job->trans)
+      SaveTranscription (job->fn, job->trans, job->sampRate);
+   EmitJobOutput (pool, 1);
+   if (errcode == 0 && job->lat)
+      SaveLattice (job->fn, job->lat);
+   ResetHeap (&job->heap);
+}
+
+/* StartDecodePool: create the job ring and start the decoding threads.
+   dec0 becomes the decoder of the first thread, the others share its
+   network, LM and state info */
+void StartDecodePool (DecoderInst *dec0)
+{
+   DecodeWorker *w;
+   Boolean eSep;
+   int i, j;
+
+   net->vocabFN = dictfn;
+   nJobs = nThreads * JOBSPERTHREAD;
+   jobs = (DecodeJob *) New (&gcheap, nJobs * sizeof (DecodeJob));
+   for (i = 0; i < nJobs; i++)
+      CreateHeap (&jobs[i].heap, "Job transcription heap", MSTAK, 1, 0, 8000, 80000);
+   workers = (DecodeWorker *) New (&gcheap, nThreads * sizeof (DecodeWorker));
+   SetStreamWidths (hset.pkind, hset.vecSize, hset.swidth, &eSep);
+   for (i = 0, w = workers; i < nThreads; i++, w++) {
+      w->dec = (i == 0) ? dec0 : CreateSharedDecoderInst (dec0);
+      w->obs = (Observation *) New (&gcheap, outpBlocksize * sizeof (Observation));
+      for (j = 0; j < outpBlocksize; ++j)
+         w->obs[j] = MakeObservation (&gcheap, hset.swidth, hset.pkind,
+                                      (hset.hsKind == DISCRETEHS), eSep);
+      CreateHeap (&w->inputBufHeap, "Input Buffer Heap", MSTAK, 1, 1.0, 80000, 800000);
+   }
+   pool = CreateJobPool (nThreads, nJobs, RunDecodeJob, EmitDecodeJob);
+   if (trace & T_THREAD)
+      printf ("HDecode: decoding with %d threads\n", nThreads);
+}
+
+/* QueueDecode: queue recognition of data file fn.  The extensions of
+   an extended file name are copied now, HShell only keeps the last few */
+void QueueDecode (char *fn)
+{
+   DecodeJob *job;
+
+   if (strlen (fn) >= MAXFNAMELEN)
+      HError (3919, "HDecode: Data file name %s too long", fn);
+   job = jobs + NextJob (pool);
+   strcpy (job->fn, fn);
+   job->isExt = CopyExtFileName (fn, &job->ext);
+   job->trans = NULL; job->lat = NULL;
+   QueueJob (pool);
+}
+
+/* StopDecodePool: finish all utterances and stop the threads */
+void StopDecodePool (void)
+{
+   StopJobPool (pool);
+}
+
 /* ----------------------------------------------------------- */
 /*                      END:  HDecode.c                        */
 /* ----------------------------------------------------------- */
@@ -49,16 +49,26 @@ char *hlvlm_vc_id = "$Id: HLVLM.c,v 1.1.1.1 2006/10/11 09:54:55 jal58 Exp $";
 #include "HLVLM.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <time.h>
 
 /* ----------------------------- Trace Flags ------------------------- */
 
 #define T_TOP 0001         /* Trace  */
 #define T_ACCESS 0002      /* trace ever lm access */
+#define T_LAIDX 0004       /* benchmark look-ahead index against scan */
 
 static int trace=0;
 static ConfParam *cParm[MAXGLOBS];      /* config parameters */
 static int nParm = 0;
 static Boolean rawMITFormat = FALSE;    /* by default do not use HTK quoting */
+static Boolean useLAIndex = TRUE;       /* build range-max look-ahead index */
+static int laIndexBlock = 16;           /* block size of range-max tables */
+static int laIndexMin = 256;            /* min successors to index an NEntry */
 
 const double LN10 = 2.30258509299404568;    /* Defined to save recalculating it */
 
@@ -73,6 +83,10 @@ LogFloat LMTransProb_ngram (FSLM *lm, LMState src, PronId pronid, LMState *dest)
 LogFloat LMLookAhead_2gram (FSLM *lm, LMState src, PronId minPron, PronId maxPron);
 LogFloat LMLookAhead_3gram (FSLM *lm, LMState src, PronId minPron, PronId maxPron);
 LogFloat LMLookAhead_ngram (FSLM *lm, LMState src, PronId minPron, PronId maxPron);
+LogFloat LMLookAhead_2gramIdx (FSLM *lm, LMState src, PronId minPron, PronId maxPron);
+LogFloat LMLookAhead_3gramIdx (FSLM *lm, LMState src, PronId minPron, PronId maxPron);
+static Boolean BuildLAIndex (FSLM *lm);
+static void BenchLAIndex (FSLM *lm, LogFloat (*scan) (FSLM *, LMState, PronId, PronId));
 LogFloat LMTransProb_latlm (FSLM *lm, LMState src, PronId pronid, LMState *dest);
 LogFloat LMLookAhead_latlm (FSLM *lm, LMState src, PronId minPron, PronId maxPron);
 LMState Fast_LMLA_LMState (FSLM *lm, LMState src);
@@ -90,6 +104,9 @@ void InitLVLM (void)
    if (nParm>0){
       if (GetConfInt (cParm, nParm, "TRACE", &i)) trace = i;
       if (GetConfBool (cParm, nParm, "RAWMITFORMAT", &b)) rawMITFormat = b;
+      if (GetConfBool (cParm, nParm, "LAINDEX", &b)) useLAIndex = b;
+      if (GetConfInt (cParm, nParm, "LAINDEXBLOCK", &i)) laIndexBlock = i;
+      if (GetConfInt (cParm, nParm, "LAINDEXMIN", &i)) laIndexMin = i;
    }
 
 #if 0
@@ -97,6 +114,9 @@ void InitLVLM (void)
    InitLM ();
 #endif
 
+   if (laIndexBlock < 1)
+      HError (7690, "InitLVLM: LAINDEXBLOCK must be positive");
+
 #ifdef LM_NGRAM_INT
    if (sizeof (SEntry) != 4)
       HError (7690, "strange size of SEntry structures (%d)", sizeof (SEntry));
@@ -528,6 +548,371 @@ FSLM *ReadARPALM(MemHeap *heap, char *lmfn, Vocab *vocab)
    return lm;
 }
 
+/* ----------- compiled LM image handling ---------- */
+
+/* A compiled LM image holds the fully built FSLM_ngram structures
+   (NEntry hash table, NEntries, PronId ordered SEntry arrays, unigrams
+   and PronId->LMId map) in one file that can be mmap()ed read-only.
+   Pointers are stored as absolute addresses relative to a preferred
+   base address. If the image can be mapped there no relocation is
+   necessary and all pages are shared between processes; otherwise the
+   pointer fields of the hash table and NEntries are relocated in a
+   private mapping while the (much larger) SEntry arrays stay shared.
+
+   PronIds depend on the dictionary and the acoustic models used to
+   build the LexNet, so the image records a fingerprint of the PronId
+   assignment and refuses to load against a different setup.
+*/
+
+#define LMIMG_MAGIC "HLVLMIMG"
+#define LMIMG_VERSION 1
+#define LMIMG_ORDER 0x01020304
+#define LMIMG_ALIGN 64
+
+#if ULONG_MAX > 0xffffffffUL
+#define LMIMG_BASE 0x200000000000UL     /* preferred mapping address */
+#else
+#define LMIMG_BASE 0UL                  /* always relocate */
+#endif
+
+typedef struct {
+   char magic[8];               /* LMIMG_MAGIC */
+   int version;                 /* LMIMG_VERSION */
+   int order;                   /* LMIMG_ORDER in native byte order */
+   int nsizeMax;                /* NSIZE */
+   int sizeNE, sizeSE;          /* sizeof(NEntry), sizeof(SEntry) */
+   int sizeProb, sizeLMId;      /* sizeof(NGLM_Prob), sizeof(LMId) */
+   int nsize;                   /* order of LM */
+   int counts[NSIZE+1];         /* Number of [n]grams, [0] = NEntries */
+   int vocSize;                 /* number of prons */
+   unsigned int hashsize;       /* size of NEntry hash table */
+   unsigned long int vocFP;     /* fingerprint of PronId assignment */
+   unsigned long int base;      /* address pointers are relative to */
+   unsigned long int size;      /* total size of image */
+   unsigned long int nNE, nSE;  /* number of NEntries/SEntries */
+   unsigned long int offHash;   /* offsets of the sections */
+   unsigned long int offNE;
+   unsigned long int offSE;
+   unsigned long int offUni;
+   unsigned long int offP2L;
+} LMImgHeader;
+
+typedef struct {                /* used to map NEntry pointers to indices */
+   NEntry *ne;
+   unsigned long int idx;
+} LMImgNEIdx;
+
+/* LMImgAlign
+
+     round offset up to next section boundary
+*/
+static unsigned long int LMImgAlign (unsigned long int off)
+{
+   return (off + LMIMG_ALIGN - 1) & ~((unsigned long int) LMIMG_ALIGN - 1);
+}
+
+/* VocabFingerprint
+
+     order independent hash of the (word,pron)->PronId assignment
+*/
+static unsigned long int VocabFingerprint (Vocab *vocab)
+{
+   unsigned long int fp, h;
+   unsigned char *s;
+   PronId pronid;
+   Word word;
+   Pron pron;
+   int i;
+
+   fp = 0;
+   for (i = 0; i < VHASHSIZE; ++i) {
+      for (word = vocab->wtab[i]; word; word = word->next) {
+         for (pron = word->pron; pron; pron = pron->next) {
+            pronid = (PronId) (unsigned long int) pron->aux;
+            if (pronid == 0)
+               continue;
+            h = 2166136261UL;
+            for (s = (unsigned char *) word->wordName->name; *s; ++s)
+               h = (h ^ *s) * 16777619UL;
+            h = h * 31 + pron->pnum;
+            fp += (h ^ ((unsigned long int) pronid * 2654435761UL)) & 0xffffffffUL;
+         }
+      }
+   }
+   return fp;
+}
+
+static int ne_idx_cmp (const void *v1, const void *v2)
+{
+   NEntry *n1 = ((LMImgNEIdx *) v1)->ne, *n2 = ((LMImgNEIdx *) v2)->ne;
+
+   return (n1 < n2) ? -1 : ((n1 > n2) ? 1 : 0);
+}
+
+/* FindNEIdx
+
+     return image index of NEntry ne
+*/
+static unsigned long int FindNEIdx (LMImgNEIdx *tab, unsigned long int n, NEntry *ne)
+{
+   LMImgNEIdx key, *r;
+
+   key.ne = ne;
+   r = (LMImgNEIdx *) bsearch (&key, tab, n, sizeof (LMImgNEIdx), ne_idx_cmp);
+   if (!r)
+      HError (7631, "WriteLMImage: back-off NEntry not in hash table");
+   return r->idx;
+}
+
+/* WriteLMPad
+
+     write zero bytes up to offset off
+*/
+static void WriteLMPad (FILE *f, unsigned long int *pos, unsigned long int off)
+{
+   for ( ; *pos < off; ++*pos)
+      fputc (0, f);
+}
+
+/* EXPORT->WriteLMImage: write n-gram LM as mmap-able image to file fn */
+void WriteLMImage (FSLM *lm, char *fn)
+{
+   FSLM_ngram *nglm;
+   LMImgHeader hdr;
+   LMImgNEIdx *tab;
+   NEntry *ne, tmp;
+   Ptr p;
+   unsigned long int i, nNE, nSE, pos, first;
+   unsigned int h;
+   FILE *f;
+
+   if (lm->type != fslm_ngram)
+      HError (7630, "WriteLMImage: only n-gram LMs can be compiled");
+   nglm = lm->data.nglm;
+
+   /* NEntries are numbered in hash chain order, so that link pointers
+      always point to the next entry in the image */
+   nNE = nSE = 0;
+   for (h = 0; h < nglm->hashsize; ++h)
+      for (ne = nglm->hashtab[h]; ne; ne = ne->link) {
+         ++nNE;
+         nSE += ne->nse;
+      }
+   tab = (LMImgNEIdx *) New (&gcheap, (nNE > 0 ? nNE : 1) * sizeof (LMImgNEIdx));
+   i = 0;
+   for (h = 0; h < nglm->hashsize; ++h)
+      for (ne = nglm->hashtab[h]; ne; ne = ne->link) {
+         tab[i].ne = ne;
+         tab[i].idx = i;
+         ++i;
+      }
+   qsort (tab, nNE, sizeof (LMImgNEIdx), ne_idx_cmp);
+
+   memset (&hdr, 0, sizeof (LMImgHeader));
+   memcpy (hdr.magic, LMIMG_MAGIC, 8);
+   hdr.version = LMIMG_VERSION;
+   hdr.order = LMIMG_ORDER;
+   hdr.nsizeMax = NSIZE;
+   hdr.sizeNE = sizeof (NEntry);
+   hdr.sizeSE = sizeof (SEntry);
+   hdr.sizeProb = sizeof (NGLM_Prob);
+   hdr.sizeLMId = sizeof (LMId);
+   hdr.nsize = nglm->nsize;
+   for (i = 0; i <= NSIZE; ++i)
+      hdr.counts[i] = nglm->counts[i];
+   hdr.vocSize = nglm->vocSize;
+   hdr.hashsize = nglm->hashsize;
+   hdr.vocFP = VocabFingerprint (nglm->vocab);
+   hdr.base = LMIMG_BASE;
+   hdr.nNE = nNE;
+   hdr.nSE = nSE;
+   hdr.offHash = LMImgAlign (sizeof (LMImgHeader));
+   hdr.offNE = LMImgAlign (hdr.offHash + nglm->hashsize * sizeof (NEntry *));
+   hdr.offSE = LMImgAlign (hdr.offNE + nNE * sizeof (NEntry));
+   hdr.offUni = LMImgAlign (hdr.offSE + nSE * sizeof (SEntry));
+   hdr.offP2L = LMImgAlign (hdr.offUni + (nglm->vocSize + 1) * sizeof (NGLM_Prob));
+   hdr.size = hdr.offP2L + (nglm->vocSize + 1) * sizeof (LMId);
+
+#define NE_ADDR(i) ((NEntry *) (hdr.base + hdr.offNE + (i) * sizeof (NEntry)))
+#define SE_ADDR(i) ((SEntry *) (hdr.base + hdr.offSE + (i) * sizeof (SEntry)))
+
+   if ((f = fopen (fn, "wb")) == NULL)
+      HError (7631, "WriteLMImage: cannot create LM image file '%s'", fn);
+   if (trace & T_TOP) {
+      printf ("Writing LM image %s: %lu NEntries, %lu SEntries, %lu bytes\n",
+              fn, nNE, nSE, hdr.size);
+      fflush (stdout);
+   }
+
+   pos = 0;
+   fwrite (&hdr, sizeof (LMImgHeader), 1, f);
+   pos += sizeof (LMImgHeader);
+
+   /* hash table */
+   WriteLMPad (f, &pos, hdr.offHash);
+   first = 0;
+   for (h = 0; h < nglm->hashsize; ++h) {
+      p = NULL;
+      if (nglm->hashtab[h]) {
+         p = NE_ADDR (first);
+         for (ne = nglm->hashtab[h]; ne; ne = ne->link)
+            ++first;
+      }
+      fwrite (&p, sizeof (NEntry *), 1, f);
+      pos += sizeof (NEntry *);
+   }
+
+   /* NEntries */
+   WriteLMPad (f, &pos, hdr.offNE);
+   i = 0; nSE = 0;
+   for (h = 0; h < nglm->hashsize; ++h)
+      for (ne = nglm->hashtab[h]; ne; ne = ne->link) {
+         memset (&tmp, 0, sizeof (NEntry));
+         memcpy (tmp.word, ne->word, sizeof (ne->word));
+         tmp.nse = ne->nse;
+         tmp.bowt = ne->bowt;
+         tmp.se = ne->se ? SE_ADDR (nSE) : NULL;
+         tmp.nebo = ne->nebo ? NE_ADDR (FindNEIdx (tab, nNE, ne->nebo)) : NULL;
+         tmp.link = ne->link ? NE_ADDR (i + 1) : NULL;
+         fwrite (&tmp, sizeof (NEntry), 1, f);
+         pos += sizeof (NEntry);
+         nSE += ne->nse;
+         ++i;
+      }
+
+   /* SEntry arrays */
+   WriteLMPad (f, &pos, hdr.offSE);
+   for (h = 0; h < nglm->hashsize; ++h)
+      for (ne = nglm->hashtab[h]; ne; ne = ne->link)
+         if (ne->nse > 0) {
+            fwrite (ne->se, sizeof (SEntry), ne->nse, f);
+            pos += ne->nse * sizeof (SEntry);
+         }
+
+   /* unigrams and PronId -> LMId map */
+   WriteLMPad (f, &pos, hdr.offUni);
+   fwrite (nglm->unigrams, sizeof (NGLM_Prob), nglm->vocSize + 1, f);
+   pos += (nglm->vocSize + 1) * sizeof (NGLM_Prob);
+   WriteLMPad (f, &pos, hdr.offP2L);
+   fwrite (nglm->pronId2LMId, sizeof (LMId), nglm->vocSize + 1, f);
+   pos += (nglm->vocSize + 1) * sizeof (LMId);
+
+#undef NE_ADDR
+#undef SE_ADDR
+
+   if (ferror (f) || fclose (f) != 0 || pos != hdr.size)
+      HError (7631, "WriteLMImage: error writing LM image file '%s'", fn);
+   Dispose (&gcheap, tab);
+}
+
+/* IsLMImage
+
+     check whether fn is a compiled LM image
+*/
+static Boolean IsLMImage (char *fn)
+{
+   FILE *f;
+   char magic[8];
+   Boolean isImg = FALSE;
+
+   if ((f = fopen (fn, "rb")) != NULL) {
+      if (fread (magic, 1, 8, f) == 8 && memcmp (magic, LMIMG_MAGIC, 8) == 0)
+         isImg = TRUE;
+      fclose (f);
+   }
+   return isImg;
+}
+
+/* ReadLMImage
+
+     map compiled LM image from file
+*/
+static FSLM *ReadLMImage (MemHeap *heap, char *lmfn, Vocab *vocab)
+{
+   FSLM *lm;
+   FSLM_ngram *nglm;
+   LMImgHeader hdr;
+   struct stat st;
+   char *img;
+   NEntry **hashtab, *ne;
+   unsigned long int i, delta;
+   int fd;
+
+   if ((fd = open (lmfn, O_RDONLY)) < 0)
+      HError (7631, "ReadLMImage: cannot open LM image file '%s'", lmfn);
+   if (read (fd, &hdr, sizeof (LMImgHeader)) != sizeof (LMImgHeader) ||
+       fstat (fd, &st) != 0)
+      HError (7631, "ReadLMImage: cannot read header of LM image '%s'", lmfn);
+
+   if (hdr.version != LMIMG_VERSION || hdr.order != LMIMG_ORDER ||
+       hdr.nsizeMax != NSIZE || hdr.sizeNE != sizeof (NEntry) ||
+       hdr.sizeSE != sizeof (SEntry) || hdr.sizeProb != sizeof (NGLM_Prob) ||
+       hdr.sizeLMId != sizeof (LMId))
+      HError (7632, "ReadLMImage: LM image '%s' was compiled for an incompatible build", lmfn);
+   if ((unsigned long int) st.st_size != hdr.size)
+      HError (7632, "ReadLMImage: LM image '%s' is truncated", lmfn);
+   if (hdr.vocSize != vocab->nprons || hdr.vocFP != VocabFingerprint (vocab))
+      HError (7633, "ReadLMImage: LM image '%s' was compiled with different dictionary or models", lmfn);
+
+   img = (char *) mmap ((void *) hdr.base, hdr.size, PROT_READ, MAP_SHARED, fd, 0);
+   if (img != MAP_FAILED && (unsigned long int) img != hdr.base) {
+      munmap (img, hdr.size);
+      img = (char *) MAP_FAILED;
+   }
+   delta = 0;
+   if (img == MAP_FAILED) {
+      /* preferred address not available: relocate private copy of the
+         pointer carrying sections, SEntry pages stay shared */
+      img = (char *) mmap (NULL, hdr.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      if (img == MAP_FAILED)
+         HError (7631, "ReadLMImage: cannot map LM image '%s'", lmfn);
+      delta = (unsigned long int) img - hdr.base;
+      hashtab = (NEntry **) (img + hdr.offHash);
+      for (i = 0; i < hdr.hashsize; ++i)
+         if (hashtab[i])
+            hashtab[i] = (NEntry *) ((unsigned long int) hashtab[i] + delta);
+      for (i = 0, ne = (NEntry *) (img + hdr.offNE); i < hdr.nNE; ++i, ++ne) {
+         if (ne->se)
+            ne->se = (SEntry *) ((unsigned long int) ne->se + delta);
+         if (ne->nebo)
+            ne->nebo = (NEntry *) ((unsigned long int) ne->nebo + delta);
+         if (ne->link)
+            ne->link = (NEntry *) ((unsigned long int) ne->link + delta);
+      }
+      mprotect (img, hdr.size, PROT_READ);
+   }
+   close (fd);
+
+   if (trace & T_TOP) {
+      printf ("Mapped LM image %s: %lu NEntries, %lu SEntries%s\n", lmfn,
+              hdr.nNE, hdr.nSE, delta ? " (relocated)" : "");
+      fflush (stdout);
+   }
+
+   lm = (FSLM *) New (heap, sizeof(FSLM));
+   lm->heap = heap;
+   lm->name = CopyString (heap, lmfn);
+   lm->type = fslm_ngram;
+
+   nglm = (FSLM_ngram *) New (heap, sizeof(FSLM_ngram));
+   nglm->heap = heap;
+   nglm->nsize = hdr.nsize;
+   nglm->hashsize = hdr.hashsize;
+   nglm->hashtab = (NEntry **) (img + hdr.offHash);
+   for (i = 0; i <= NSIZE; ++i)
+      nglm->counts[i] = hdr.counts[i];
+   nglm->vocab = vocab;
+   nglm->vocSize = hdr.vocSize;
+   nglm->unigrams = (NGLM_Prob *) (img + hdr.offUni);
+   nglm->pronId2LMId = (LMId *) (img + hdr.offP2L);
+   nglm->lablist = NULL;        /* only needed while reading ARPA files */
+   nglm->wordlist = NULL;
+   nglm->laIndex = NULL;
+   lm->data.nglm = nglm;
+
+   return lm;
+}
+
 
 void SetStartEnd (FSLM *lm, char *startWord, char *endWord, Vocab *vocab)
 {
@@ -556,7 +941,8 @@ void SetStartEnd (FSLM *lm, char *startWord, char *endWord, Vocab *vocab)
 
 /* CreateLM
 
-     Read ARPA-style language model from File and return LM structure
+     Read ARPA-style language model (or compiled LM image, see
+     WriteLMImage) from File and return LM structure
 */
 FSLM *CreateLM (MemHeap *heap, char *fn, char *startWord, char *endWord, Vocab *vocab)
 {
@@ -564,7 +950,10 @@ FSLM *CreateLM (MemHeap *heap, char *fn, char *startWord, char *endWord, Vocab *
 
    /*#### fix-up p(<s>) ?  it seems rather small... */
 
-   lm = ReadARPALM (heap, fn, vocab);
+   if (IsLMImage (fn))
+      lm = ReadLMImage (heap, fn, vocab);
+   else
+      lm = ReadARPALM (heap, fn, vocab);
 
    SetStartEnd (lm, startWord, endWord, vocab);
 
@@ -583,6 +972,13 @@ FSLM *CreateLM (MemHeap *heap, char *fn, char *startWord, char *endWord, Vocab *
       break;
    }
 
+   if (useLAIndex) {
+      LogFloat (*scan) (FSLM *, LMState, PronId, PronId) = lm->lookahead;
+
+      if (BuildLAIndex (lm) && (trace & T_LAIDX))
+         BenchLAIndex (lm, scan);
+   }
+
    return (lm);
 }
 
@@ -1346,6 +1742,519 @@ LMState Fast_LMLA_LMState (FSLM *lm, LMState src)
 }
 
 
+/* ----------- range-max look-ahead index ---------- */
+
+/* The look-ahead functions above scan every PronId in [minPron,maxPron].
+   The index answers the same queries from block sparse tables: the
+   maximum over a range of positions is taken from at most two partial
+   blocks of laIndexBlock elements and two overlapping runs of whole
+   blocks, independent of the length of the range.
+
+   Tables are kept for the unigrams and for the successor arrays of
+   NEntries with at least laIndexMin entries. For such an NEntry the
+   index also holds the maxima of the back-off distribution in the gaps
+   between its successors (unigrams for bigram histories, the back-off
+   bigrams for trigram histories), which is what the scan collects for
+   PronIds not covered by the NEntry. Smaller NEntries are handled by
+   walking their successors inside the range. Results are identical to
+   the scanning code.
+*/
+
+typedef struct {                /* block sparse table over val[0..n-1] */
+   NGLM_Prob *val;              /* values, stride elements apart */
+   int stride;
+   int n;
+   int nb;                      /* number of blocks */
+   int nlev;
+   NGLM_Prob *tab;              /* [l*nb+k] = max of blocks k..k+2^l-1 */
+} RangeMax;
+
+typedef struct {                /* index for one NEntry */
+   NEntry *ne;
+   RangeMax se;                 /* over ne->se[].prob */
+   RangeMax gap;                /* over gap maxima, see above */
+} LAIndex;
+
+struct _LAIndexTab {
+   unsigned int size;           /* hash table size (power of 2) */
+   LAIndex **tab;               /* open addressing, keyed by NEntry */
+   RangeMax uni;                /* over unigrams[0..vocSize] */
+   long nIndex;                 /* number of indexed NEntries */
+   long mem;                    /* bytes used by tables */
+};
+
+#define RM_VAL(rm,i) ((rm)->val[(long) (i) * (rm)->stride])
+#define PROB_MAX(m,x) if (NGLM_PROB_GREATER((x),(m))) (m) = (x)
+
+/* InitRangeMax
+
+     build block sparse table over n values
+*/
+static void InitRangeMax (MemHeap *heap, RangeMax *rm, NGLM_Prob *val, int stride, int n, long *mem)
+{
+   int i, k, l, B;
+   NGLM_Prob m, *prev, *cur;
+
+   B = laIndexBlock;
+   rm->val = val;
+   rm->stride = stride;
+   rm->n = n;
+   rm->nb = (n + B - 1) / B;
+   for (rm->nlev = 1; (1 << rm->nlev) <= rm->nb; ++rm->nlev)
+      ;
+   rm->tab = (NGLM_Prob *) New (heap, rm->nlev * rm->nb * sizeof (NGLM_Prob));
+   *mem += rm->nlev * rm->nb * sizeof (NGLM_Prob);
+
+   for (k = 0; k < rm->nb; ++k) {
+      m = NGLM_PROB_LZERO;
+      for (i = k * B; i < n && i < (k + 1) * B; ++i)
+         PROB_MAX (m, RM_VAL (rm, i));
+      rm->tab[k] = m;
+   }
+   for (l = 1; l < rm->nlev; ++l) {
+      prev = rm->tab + (l - 1) * rm->nb;
+      cur = rm->tab + l * rm->nb;
+      for (k = 0; k + (1 << l) <= rm->nb; ++k) {
+         m = prev[k];
+         PROB_MAX (m, prev[k + (1 << (l - 1))]);
+         cur[k] = m;
+      }
+   }
+}
+
+/* RangeMaxQuery
+
+     return max of values i..j (LZERO for empty range)
+*/
+static NGLM_Prob RangeMaxQuery (RangeMax *rm, int i, int j)
+{
+   NGLM_Prob m = NGLM_PROB_LZERO;
+   int bi, bj, k, l, B;
+
+   if (i > j)
+      return m;
+   B = laIndexBlock;
+   bi = i / B;
+   bj = j / B;
+   if (bj - bi <= 1) {
+      for (k = i; k <= j; ++k)
+         PROB_MAX (m, RM_VAL (rm, k));
+      return m;
+   }
+   for (k = i; k < (bi + 1) * B; ++k)
+      PROB_MAX (m, RM_VAL (rm, k));
+   for (k = bj * B; k <= j; ++k)
+      PROB_MAX (m, RM_VAL (rm, k));
+   ++bi; --bj;
+   for (l = 0; (2 << l) <= bj - bi + 1; ++l)
+      ;
+   PROB_MAX (m, rm->tab[l * rm->nb + bi]);
+   PROB_MAX (m, rm->tab[l * rm->nb + bj - (1 << l) + 1]);
+   return m;
+}
+
+/* FindLAIndex
+
+     return index of ne or NULL
+*/
+static LAIndex *FindLAIndex (LAIndexTab *lt, NEntry *ne)
+{
+   unsigned int h;
+   LAIndex *li;
+
+   h = (unsigned int) (((unsigned long int) ne >> 4) * 2654435761UL) & (lt->size - 1);
+   while ((li = lt->tab[h]) != NULL) {
+      if (li->ne == ne)
+         return li;
+      h = (h + 1) & (lt->size - 1);
+   }
+   return NULL;
+}
+
+/* SERange
+
+     set [*i,*j] to the positions of the successors of ne in [a,b]
+*/
+static void SERange (NEntry *ne, PronId a, PronId b, int *i, int *j)
+{
+   int l, h, c;
+
+   l = 0; h = ne->nse;
+   while (l < h) {              /* first word >= a */
+      c = (l + h) / 2;
+      if (ne->se[c].word < a) l = c + 1; else h = c;
+   }
+   *i = l;
+   h = ne->nse;
+   while (l < h) {              /* first word > b */
+      c = (l + h) / 2;
+      if (ne->se[c].word <= b) l = c + 1; else h = c;
+   }
+   *j = l - 1;
+}
+
+/* MaxSE
+
+     max prob of the successors of ne at positions i..j
+*/
+static NGLM_Prob MaxSE (LAIndexTab *lt, NEntry *ne, int i, int j)
+{
+   LAIndex *li;
+   NGLM_Prob m = NGLM_PROB_LZERO;
+
+   if (i > j)
+      return m;
+   if ((li = FindLAIndex (lt, ne)) != NULL)
+      return RangeMaxQuery (&li->se, i, j);
+   for ( ; i <= j; ++i)
+      PROB_MAX (m, ne->se[i].prob);
+   return m;
+}
+
+/* MaxUnigram
+
+     max unigram prob in [a,b] of PronIds that are no successors of
+     bigram history ne (all of them if ne is NULL)
+*/
+static NGLM_Prob MaxUnigram (LAIndexTab *lt, NEntry *ne, PronId a, PronId b)
+{
+   LAIndex *li;
+   NGLM_Prob m, x;
+   int i, j, k;
+
+   if (!ne || ne->nse == 0)
+      return RangeMaxQuery (&lt->uni, a, b);
+   SERange (ne, a, b, &i, &j);
+   if (i > j)
+      return RangeMaxQuery (&lt->uni, a, b);
+   m = RangeMaxQuery (&lt->uni, a, ne->se[i].word - 1);
+   x = RangeMaxQuery (&lt->uni, ne->se[j].word + 1, b);
+   PROB_MAX (m, x);
+   if ((li = FindLAIndex (lt, ne)) != NULL) {
+      x = RangeMaxQuery (&li->gap, i + 1, j);
+      PROB_MAX (m, x);
+   }
+   else
+      for (k = i + 1; k <= j; ++k) {
+         x = RangeMaxQuery (&lt->uni, ne->se[k-1].word + 1, ne->se[k].word - 1);
+         PROB_MAX (m, x);
+      }
+   return m;
+}
+
+/* MaxBigram
+
+     max prob in [a,b] of successors of ne_bg that are no successors of
+     trigram history ne_tg
+*/
+static NGLM_Prob MaxBigram (LAIndexTab *lt, NEntry *ne_tg, NEntry *ne_bg, PronId a, PronId b)
+{
+   LAIndex *li;
+   NGLM_Prob m, x;
+   int i, j, k, bi, bj;
+
+   SERange (ne_tg, a, b, &i, &j);
+   if (i > j) {
+      SERange (ne_bg, a, b, &bi, &bj);
+      return MaxSE (lt, ne_bg, bi, bj);
+   }
+   SERange (ne_bg, a, ne_tg->se[i].word - 1, &bi, &bj);
+   m = MaxSE (lt, ne_bg, bi, bj);
+   SERange (ne_bg, ne_tg->se[j].word + 1, b, &bi, &bj);
+   x = MaxSE (lt, ne_bg, bi, bj);
+   PROB_MAX (m, x);
+   if ((li = FindLAIndex (lt, ne_tg)) != NULL) {
+      x = RangeMaxQuery (&li->gap, i + 1, j);
+      PROB_MAX (m, x);
+   }
+   else
+      for (k = i + 1; k <= j; ++k) {
+         SERange (ne_bg, ne_tg->se[k-1].word + 1, ne_tg->se[k].word - 1, &bi, &bj);
+         x = MaxSE (lt, ne_bg, bi, bj);
+         PROB_MAX (m, x);
+      }
+   return m;
+}
+
+/* LMLookAhead_2gramIdx
+
+     indexed version of LMLookAhead_2gram
+*/
+LogFloat LMLookAhead_2gramIdx (FSLM *lm, LMState src, PronId minPron, PronId maxPron)
+{
+   LAIndexTab *lt;
+   NEntry *neSrc = NULL;
+   NGLM_Prob maxScore = NGLM_PROB_LZERO;
+   NGLM_Prob ug_maxScore;
+   NGLM_Prob bowt = 0;
+   int i, j;
+
+   lt = lm->data.nglm->laIndex;
+   if (src) {
+      neSrc = (NEntry *) src;
+      bowt = neSrc->bowt;
+      if (neSrc->nse > 0) {
+         SERange (neSrc, minPron, maxPron, &i, &j);
+         maxScore = MaxSE (lt, neSrc, i, j);
+      }
+   }
+   ug_maxScore = MaxUnigram (lt, neSrc, minPron, maxPron);
+
+   if (NGLM_PROB_GREATER(ug_maxScore,NGLM_PROB_LZERO)) {
+#ifdef LM_NGRAM_INT
+      ug_maxScore = NGLM_PROB_ADD(ug_maxScore, bowt);
+#else
+      ug_maxScore += bowt;
+#endif
+      if (NGLM_PROB_GREATER(ug_maxScore, maxScore))
+         maxScore = ug_maxScore;
+   }
+   return NGLM_PROB_TO_FLOAT(maxScore);
+}
+
+/* LMLookAhead_3gramIdx
+
+     indexed version of LMLookAhead_3gram, requires the successors of
+     each trigram history to be a subset of those of its back-off
+*/
+LogFloat LMLookAhead_3gramIdx (FSLM *lm, LMState src, PronId minPron, PronId maxPron)
+{
+   LAIndexTab *lt;
+   NEntry *ne_tg, *ne_bg;
+   NGLM_Prob maxScore = NGLM_PROB_LZERO;
+   NGLM_Prob bg_maxScore, ug_maxScore;
+   NGLM_Prob bowt_ug, bowt_bg;
+   int i, j;
+
+   if (!src)
+      return LMLookAhead_2gramIdx (lm, src, minPron, maxPron);
+   ne_tg = (NEntry *) src;
+   if (ne_tg->word[1] == 0)       /* this is a bigram NEntry */
+      return LMLookAhead_2gramIdx (lm, src, minPron, maxPron);
+
+   lt = lm->data.nglm->laIndex;
+   ne_bg = ne_tg->nebo;
+   bowt_bg = ne_tg->bowt;
+#ifdef LM_NGRAM_INT
+   bowt_ug = NGLM_PROB_ADD(bowt_bg, ne_bg->bowt);
+#else
+   bowt_ug = bowt_bg + ne_bg->bowt;
+#endif
+
+   if (ne_tg->nse > 0) {
+      SERange (ne_tg, minPron, maxPron, &i, &j);
+      maxScore = MaxSE (lt, ne_tg, i, j);
+      bg_maxScore = (ne_bg->nse > 0) ? MaxBigram (lt, ne_tg, ne_bg, minPron, maxPron) 
+         : NGLM_PROB_LZERO;
+   }
+   else if (ne_bg->nse > 0) {
+      SERange (ne_bg, minPron, maxPron, &i, &j);
+      bg_maxScore = MaxSE (lt, ne_bg, i, j);
+   }
+   else
+      bg_maxScore = NGLM_PROB_LZERO;
+   ug_maxScore = MaxUnigram (lt, ne_bg, minPron, maxPron);
+
+   if (NGLM_PROB_GREATER(bg_maxScore,NGLM_PROB_LZERO)) {
+#ifdef LM_NGRAM_INT
+      bg_maxScore = NGLM_PROB_ADD(bg_maxScore, bowt_bg);
+#else
+      bg_maxScore += bowt_bg;
+#endif
+      if (NGLM_PROB_GREATER(bg_maxScore, maxScore))
+         maxScore = bg_maxScore;
+   }
+   if (NGLM_PROB_GREATER(ug_maxScore,NGLM_PROB_LZERO)) {
+#ifdef LM_NGRAM_INT
+      ug_maxScore = NGLM_PROB_ADD(ug_maxScore, bowt_ug);
+#else
+      ug_maxScore += bowt_ug;
+#endif
+      if (NGLM_PROB_GREATER(ug_maxScore, maxScore))
+         maxScore = ug_maxScore;
+   }
+   return NGLM_PROB_TO_FLOAT(maxScore);
+}
+
+/* IsSubsetSE
+
+     TRUE if all successors of ne_tg are successors of ne_bg
+*/
+static Boolean IsSubsetSE (NEntry *ne_tg, NEntry *ne_bg)
+{
+   int i, k;
+
+   for (i = k = 0; i < ne_tg->nse; ++i) {
+      while (k < ne_bg->nse && ne_bg->se[k].word < ne_tg->se[i].word)
+         ++k;
+      if (k == ne_bg->nse || ne_bg->se[k].word != ne_tg->se[i].word)
+         return FALSE;
+   }
+   return TRUE;
+}
+
+/* AddLAIndex
+
+     build index for ne, the gap maxima are taken from the unigrams
+     (ne_bo == NULL) or from the successors of ne_bo
+*/
+static void AddLAIndex (FSLM_ngram *nglm, NEntry *ne, NEntry *ne_bo)
+{
+   LAIndexTab *lt;
+   LAIndex *li;
+   NGLM_Prob *gap;
+   PronId lo, hi;
+   unsigned int h;
+   int k, bi, bj;
+
+   lt = nglm->laIndex;
+   li = (LAIndex *) New (nglm->heap, sizeof (LAIndex));
+   li->ne = ne;
+   InitRangeMax (nglm->heap, &li->se, &ne->se[0].prob, 
+                 sizeof (SEntry) / sizeof (NGLM_Prob), ne->nse, &lt->mem);
+
+   /* gap[k] covers the PronIds between se[k-1] and se[k] */
+   gap = (NGLM_Prob *) New (nglm->heap, (ne->nse + 1) * sizeof (NGLM_Prob));
+   lt->mem += (ne->nse + 1) * sizeof (NGLM_Prob) + sizeof (LAIndex);
+   for (k = 0; k <= ne->nse; ++k) {
+      lo = (k == 0) ? 1 : ne->se[k-1].word + 1;
+      hi = (k == ne->nse) ? nglm->vocSize : ne->se[k].word - 1;
+      if (!ne_bo)
+         gap[k] = RangeMaxQuery (&lt->uni, lo, hi);
+      else {
+         SERange (ne_bo, lo, hi, &bi, &bj);
+         gap[k] = MaxSE (lt, ne_bo, bi, bj);
+      }
+   }
+   InitRangeMax (nglm->heap, &li->gap, gap, 1, ne->nse + 1, &lt->mem);
+
+   h = (unsigned int) (((unsigned long int) ne >> 4) * 2654435761UL) & (lt->size - 1);
+   while (lt->tab[h])
+      h = (h + 1) & (lt->size - 1);
+   lt->tab[h] = li;
+   ++lt->nIndex;
+}
+
+/* BuildLAIndex
+
+     build range-max index for 2 and 3gram LMs and switch lm to the
+     indexed look-ahead functions. Returns FALSE if the LM is not suitable.
+*/
+static Boolean BuildLAIndex (FSLM *lm)
+{
+   FSLM_ngram *nglm;
+   LAIndexTab *lt;
+   NEntry *ne;
+   long n, nTot;
+   unsigned int h;
+   int pass;
+
+   nglm = lm->data.nglm;
+   if (nglm->nsize != 2 && nglm->nsize != 3)
+      return FALSE;
+
+   /* trigram histories must be covered by their back-off */
+   n = nTot = 0;
+   for (h = 0; h < nglm->hashsize; ++h)
+      for (ne = nglm->hashtab[h]; ne; ne = ne->link) {
+         ++nTot;
+         if (ne->nse >= laIndexMin)
+            ++n;
+         if (ne->word[0] != 0 && ne->word[1] != 0 && 
+             (!ne->nebo || !IsSubsetSE (ne, ne->nebo))) {
+            HError (-7634, "BuildLAIndex: trigram successors not covered by back-off, using unindexed look-ahead");
+            return FALSE;
+         }
+      }
+
+   lt = (LAIndexTab *) New (nglm->heap, sizeof (LAIndexTab));
+   for (lt->size = 2; lt->size < 2 * n; lt->size *= 2)
+      ;
+   lt->tab = (LAIndex **) New (nglm->heap, lt->size * sizeof (LAIndex *));
+   memset (lt->tab, 0, lt->size * sizeof (LAIndex *));
+   lt->nIndex = 0;
+   lt->mem = lt->size * sizeof (LAIndex *);
+   InitRangeMax (nglm->heap, &lt->uni, nglm->unigrams, 1, nglm->vocSize + 1, &lt->mem);
+   nglm->laIndex = lt;
+
+   /* bigram histories first, trigram gaps are taken from them */
+   for (pass = 0; pass < 2; ++pass)
+      for (h = 0; h < nglm->hashsize; ++h)
+         for (ne = nglm->hashtab[h]; ne; ne = ne->link) {
+            if (ne->nse < laIndexMin || ne->word[0] == 0)
+               continue;
+            if (pass == 0 && ne->word[1] == 0)
+               AddLAIndex (nglm, ne, NULL);
+            else if (pass == 1 && ne->word[1] != 0)
+               AddLAIndex (nglm, ne, ne->nebo);
+         }
+
+   if (trace & T_TOP)
+      printf ("LM look-ahead index: %ld of %ld NEntries, %.1f MB\n", 
+              lt->nIndex, nTot, lt->mem / 1048576.0);
+   lm->lookahead = (nglm->nsize == 2) ? LMLookAhead_2gramIdx : LMLookAhead_3gramIdx;
+   return TRUE;
+}
+
+/* BenchLAIndex
+
+     compare indexed and scanning look-ahead on random queries,
+     report timing and abort on any difference
+*/
+static void BenchLAIndex (FSLM *lm, LogFloat (*scan) (FSLM *, LMState, PronId, PronId))
+{
+   FSLM_ngram *nglm;
+   NEntry **states, *ne;
+   PronId a, b;
+   LogFloat x, y;
+   clock_t t0;
+   double tScan, tIdx;
+   long n, k, nq;
+   unsigned int h;
+   int len, i;
+
+   nglm = lm->data.nglm;
+   n = 1;
+   for (h = 0; h < nglm->hashsize; ++h)
+      for (ne = nglm->hashtab[h]; ne; ne = ne->link)
+         ++n;
+   states = (NEntry **) New (&gcheap, n * sizeof (NEntry *));
+   n = 0;
+   states[n++] = NULL;
+   for (h = 0; h < nglm->hashsize; ++h)
+      for (ne = nglm->hashtab[h]; ne; ne = ne->link)
+         if (ne->word[0] != 0)
+            states[n++] = ne;
+
+   tScan = tIdx = 0.0;
+   nq = 0;
+   for (len = 1; len <= nglm->vocSize; len *= 4) {
+      for (k = 0; k < 2000; ++k, ++nq) {
+         ne = states[(k * 7919) % n];
+         a = 1 + (PronId) ((k * 104729L) % nglm->vocSize);
+         b = (a + len - 1 > nglm->vocSize) ? nglm->vocSize : a + len - 1;
+         t0 = clock ();
+         for (i = 0; i < 10; ++i)
+            x = scan (lm, ne, a, b);
+         tScan += clock () - t0;
+         t0 = clock ();
+         for (i = 0; i < 10; ++i)
+            y = lm->lookahead (lm, ne, a, b);
+         tIdx += clock () - t0;
+         if (x != y)
+            HError (7634, "BenchLAIndex: look-ahead mismatch %f vs %f for range %u-%u", 
+                    x, y, (unsigned int) a, (unsigned int) b);
+      }
+      printf ("LM look-ahead range %7d: scan %8.3f us  index %8.3f us\n", len, 
+              1.0e6 * tScan / CLOCKS_PER_SEC / (10.0 * nq), 
+              1.0e6 * tIdx / CLOCKS_PER_SEC / (10.0 * nq));
+      tScan = tIdx = 0.0;
+      nq = 0;
+   }
+   fflush (stdout);
+   Dispose (&gcheap, states);
+}
+
 
 void SetNEntryBO (FSLM *lm)
 {
@@ -1467,6 +2376,7 @@ FSLM_ngram *CreateBoNGramLV (MemHeap *heap, int vocSize, int counts[NSIZE])
    nglm = (FSLM_ngram *) New (heap, sizeof(FSLM_ngram));
 
    nglm->heap = heap;
+   nglm->laIndex = NULL;
 
    for (i=0;i<=NSIZE;i++) nglm->counts[i]=0;
    for (i=1;i<=NSIZE;i++)
@@ -49,6 +49,7 @@ typedef struct _FSLM FSLM;
 /* the following definitions should probably be private */
 
 typedef struct _FSLM_ngram FSLM_ngram;
+typedef struct _LAIndexTab LAIndexTab;
 typedef struct _FSLM_latlm FSLM_latlm;
 
 typedef enum {fslm_ngram, fslm_latlm} FSLMType;
@@ -164,6 +165,7 @@ struct _FSLM_ngram {
    Word *wordlist;              /* Lookup table for Words from LMId */
    LMId *pronId2LMId;           /* PronId -> LMId mapping array [1..voc->nprons] 
                                    needed for LM histories */
+   LAIndexTab *laIndex;         /* range-max look-ahead index or NULL */
 };
 
 /*------------------------*/
@@ -176,6 +178,7 @@ struct _FSLM_ngram {
 void InitLVLM (void);
 FSLM *CreateLMfromLat (MemHeap *heap, char *latfn, Lattice *lat, Vocab *vocab);
 FSLM *CreateLM (MemHeap *heap, char *fn, char *startWord, char *endWord, Vocab *vocab);
+void WriteLMImage (FSLM *lm, char *fn);
 
 LogFloat LMTransProb (FSLM *lm, LMState src, PronId word, LMState *dest); 
 
@@ -46,12 +46,15 @@ char *hlvmodel_vc_id = "$Id: HLVModel.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $";
 #include "HLVModel.h"
 #include "lvconfig.h"
 #include <assert.h>
+#include <string.h>
+#include <time.h>
 /* cz277 - ANN */
 #include "HLVRec.h"
 
 /* ----------------------------- Trace Flags ------------------------- */
 
 #define T_TOP 0001         /* top level Trace  */
+#define T_KERN 0002        /* time the OutPBlock kernels on the model */
 
 static int trace=0;
 static ConfParam *cParm[MAXGLOBS];      /* config parameters */
@@ -59,6 +62,10 @@ static int nParm = 0;
 
 /* -------------------------- Global Variables etc ---------------------- */
 
+static char outPKernel[MAXSTRLEN] = "AUTO"; /* OutPBlock kernel requested */
+
+static void SelectOutPKernels(void);
+static void TimeOutPKernels(StateInfo_lv *si);
 
 /* --------------------------- Initialisation ---------------------- */
 
@@ -66,13 +73,15 @@ static int nParm = 0;
 void InitLVModel(void)
 {
    int i;
+   char buf[MAXSTRLEN];
    
    Register(hlvmodel_version,hlvmodel_vc_id);
    nParm = GetConfig("HLVMODEL", TRUE, cParm, MAXGLOBS);
    if (nParm>0){
       if (GetConfInt(cParm,nParm,"TRACE",&i)) trace = i;
+      if (GetConfStr(cParm,nParm,"OUTPKERNEL",buf)) strcpy(outPKernel,buf);
    }
-
+   SelectOutPKernels();
 }
 
 /* --------------------------- the real code  ---------------------- */
@@ -132,6 +141,8 @@ StateInfo_lv *ConvertHSet(MemHeap *heap, HMMSet *hset, Boolean useHModel)
 
    if (!useHModel) {
       si->base = (float *) New (heap, si->nBlocks * si->floatsPerBlock * sizeof (float));
+      /* the vector kernels read the padding, so it must be zero */
+      memset (si->base, 0, si->nBlocks * si->floatsPerBlock * sizeof (float));
       HLVMODEL_BLOCK_INVVAR_OFFSET(si) = HLVMODEL_BLOCK_MEAN_OFFSET(si) + si->nVec * HLVMODEL_VEC_PAD;
       
       NewHMMScan (hset, &hss);
@@ -186,6 +197,9 @@ StateInfo_lv *ConvertHSet(MemHeap *heap, HMMSet *hset, Boolean useHModel)
    EndHMMScan (&hss);
 #endif
 
+   if (!useHModel && (trace & T_KERN))
+      TimeOutPKernels (si);
+
    return si;
 }
 
@@ -265,17 +279,350 @@ LogFloat OutP_lv (StateInfo_lv *si, unsigned short s, float *x)
     return bx;
 }
 
+/* OutPSel_lv: OutP_lv over the Gaussian selection shortlist of state s
+   for frame t of the current block */
+static LogFloat OutPSel_lv (StateInfo_lv *si, GSSel *g, int t, int s, float *x)
+{
+    int k, n, i;
+    LogDouble bx;
+    LogFloat px;
+    float *base;
+    float *mean;
+    float *invVar;
+    short *list;
+    LogFloat xmm;
+
+    list = GSelList (g, t, 1, s, &n);
+    bx = (n > 0) ? LZERO : GSelFloor (g);
+    for (k = 0; k < n; ++k) {   /* mixes are stored contiguously */
+        base = HLVMODEL_BLOCK_BASE(si, s) + (list[k] - 1) * si->floatsPerMix;
+        mean = base + HLVMODEL_BLOCK_MEAN_OFFSET(si);
+        invVar = base + HLVMODEL_BLOCK_INVVAR_OFFSET(si);
+
+        px = HLVMODEL_BLOCK_GCONST(si,base);
+        for (i = 0; i < si->nDim; ++i) {
+            xmm = x[i] - mean[i];
+            px += xmm * xmm * invVar[i];
+        }
+        px = -0.5 * px;
+
+        bx = LAdd (bx, HLVMODEL_BLOCK_MIXW(si,base) + px);
+    }
+    if (GSelCheckDue (g))
+        GSelAccError (g, OutP_lv (si, s, x), bx);
+    return bx;
+}
+
+/* ------------------- Multi-frame Output Probabilities ------------------- */
+
+/*
+   OutPBlock scores one state against all n frames of an observation
+   block in a single kernel call.  For n > 1 the frames are packed
+   dimension-major (xt[i*ldx+t]) so that each mean and inverse variance
+   is loaded once, broadcast and applied to a vector of frames, and the
+   mixture log-add is fused into the same loop as a running max and
+   sum of exponentials per frame, updated once every OUTP_MIXCHUNK
+   mixtures.  A single frame is scored with the dimensions in the
+   vector lanes instead.  The kernels are chosen in InitLVModel from
+   the CPU and HLVMODEL: OUTPKERNEL (AUTO, AVX512, AVX2 or GENERIC);
+   GENERIC is the plain OutP_lv loop.
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OUTP_X86
+#include <immintrin.h>
+#endif
+
+#define OUTP_MAXPAD 512         /* largest padded vector the kernels take */
+#define OUTP_MIXCHUNK 8         /* mixtures per max/exp update */
+
+typedef void (*FramesKernel)(StateInfo_lv *si, int s, const float *xt, int ldx, int n, LogFloat *outP);
+typedef LogFloat (*FrameKernel)(StateInfo_lv *si, int s, const float *x);
+
+static FramesKernel framesKernel = NULL;   /* NULL = GENERIC */
+static FrameKernel frameKernel = NULL;
+static int outPLanes = 1;                  /* frames per vector in framesKernel */
+static char *outPKernelName = "GENERIC";
+
+#ifdef OUTP_X86
+
+/* ExpAVX2: e^x for each lane of x <= 0 (Cephes expf polynomial) */
+__attribute__((target("avx2,fma")))
+static __m256 ExpAVX2(__m256 x)
+{
+   __m256 fx,y;
+   __m256i e;
+
+   x = _mm256_max_ps(x,_mm256_set1_ps(-87.0f));
+   e = _mm256_cvtps_epi32(_mm256_mul_ps(x,_mm256_set1_ps(1.44269504f)));
+   fx = _mm256_cvtepi32_ps(e);
+   x = _mm256_fnmadd_ps(fx,_mm256_set1_ps(0.693359375f),x);
+   x = _mm256_fnmadd_ps(fx,_mm256_set1_ps(-2.12194440e-4f),x);
+   y = _mm256_set1_ps(1.9875691500e-4f);
+   y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(1.3981999507e-3f));
+   y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(8.3334519073e-3f));
+   y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(4.1665795894e-2f));
+   y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(1.6666665459e-1f));
+   y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(5.0000001201e-1f));
+   y = _mm256_fmadd_ps(y,_mm256_mul_ps(x,x),_mm256_add_ps(x,_mm256_set1_ps(1.0f)));
+   e = _mm256_slli_epi32(_mm256_add_epi32(e,_mm256_set1_epi32(127)),23);
+   return _mm256_mul_ps(y,_mm256_castsi256_ps(e));
+}
+
+/* HSumAVX2: horizontal sum of the 8 lanes of v */
+__attribute__((target("avx2,fma")))
+static float HSumAVX2(__m256 v)
+{
+   __m128 s;
+
+   s = _mm_add_ps(_mm256_castps256_ps128(v),_mm256_extractf128_ps(v,1));
+   s = _mm_add_ps(s,_mm_movehl_ps(s,s));
+   s = _mm_add_ss(s,_mm_shuffle_ps(s,s,1));
+   return _mm_cvtss_f32(s);
+}
+
+/* OutPFramesAVX2: outP[t] for frames xt[i*ldx+t], t<n, 8 frames per vector */
+__attribute__((target("avx2,fma")))
+static void OutPFramesAVX2(StateInfo_lv *si, int s, const float *xt, int ldx, int n, LogFloat *outP)
+{
+   int t,l,m,c,nc,i,nMix,nDim;
+   float *base,*mix,*mean,*invVar;
+   const float *x;
+   __m256 p[OUTP_MIXCHUNK],a0,a1,d0,d1,mx,bmax,sum;
+   float vmax[8],vsum[8];
+
+   base = HLVMODEL_BLOCK_BASE(si,s);
+   nMix = HLVMODEL_BLOCK_NMIX(si,base);
+   nDim = si->nDim;
+   for (t=0; t<n; t+=8) {
+      x = xt + t;
+      bmax = _mm256_set1_ps(LZERO); sum = _mm256_setzero_ps();
+      mix = base;
+      for (m=0; m<nMix; m+=nc) {
+         nc = (nMix-m < OUTP_MIXCHUNK) ? nMix-m : OUTP_MIXCHUNK;
+         for (c=0; c<nc; c++, mix+=si->floatsPerMix) {
+            mean = mix + HLVMODEL_BLOCK_MEAN_OFFSET(si);
+            invVar = mix + HLVMODEL_BLOCK_INVVAR_OFFSET(si);
+            a0 = _mm256_set1_ps(HLVMODEL_BLOCK_GCONST(si,mix));
+            a1 = _mm256_setzero_ps();
+            for (i=0; i+2<=nDim; i+=2) {
+               d0 = _mm256_sub_ps(_mm256_loadu_ps(x+i*ldx),_mm256_set1_ps(mean[i]));
+               d1 = _mm256_sub_ps(_mm256_loadu_ps(x+(i+1)*ldx),_mm256_set1_ps(mean[i+1]));
+               a0 = _mm256_fmadd_ps(_mm256_mul_ps(d0,d0),_mm256_set1_ps(invVar[i]),a0);
+               a1 = _mm256_fmadd_ps(_mm256_mul_ps(d1,d1),_mm256_set1_ps(invVar[i+1]),a1);
+            }
+            if (i<nDim) {
+               d0 = _mm256_sub_ps(_mm256_loadu_ps(x+i*ldx),_mm256_set1_ps(mean[i]));
+               a0 = _mm256_fmadd_ps(_mm256_mul_ps(d0,d0),_mm256_set1_ps(invVar[i]),a0);
+            }
+            p[c] = _mm256_fmadd_ps(_mm256_add_ps(a0,a1),_mm256_set1_ps(-0.5f),
+                                   _mm256_set1_ps(HLVMODEL_BLOCK_MIXW(si,mix)));
+         }
+         mx = bmax;
+         for (c=0; c<nc; c++) mx = _mm256_max_ps(mx,p[c]);
+         sum = _mm256_mul_ps(sum,ExpAVX2(_mm256_sub_ps(bmax,mx)));
+         for (c=0; c<nc; c++) sum = _mm256_add_ps(sum,ExpAVX2(_mm256_sub_ps(p[c],mx)));
+         bmax = mx;
+      }
+      _mm256_storeu_ps(vmax,bmax); _mm256_storeu_ps(vsum,sum);
+      for (l=0; l<8 && t+l<n; l++)
+         outP[t+l] = vmax[l] + log(vsum[l]);
+   }
+}
+
+/* OutPFrameAVX2: outP for the single frame x, zero padded to nVec*4 */
+__attribute__((target("avx2,fma")))
+static LogFloat OutPFrameAVX2(StateInfo_lv *si, int s, const float *x)
+{
+   int m,c,nc,i,nMix,pad;
+   float *base,*mix,*mean,*invVar;
+   float p[OUTP_MIXCHUNK],bmax,mx,sum;
+   __m256 a0,a1,d0,d1,pv;
+   __m128 d;
+
+   base = HLVMODEL_BLOCK_BASE(si,s);
+   nMix = HLVMODEL_BLOCK_NMIX(si,base);
+   pad = si->nVec * HLVMODEL_VEC_PAD;
+   bmax = LZERO; sum = 0.0;
+   mix = base;
+   for (m=0; m<nMix; m+=nc) {
+      nc = (nMix-m < OUTP_MIXCHUNK) ? nMix-m : OUTP_MIXCHUNK;
+      for (c=0; c<nc; c++, mix+=si->floatsPerMix) {
+         mean = mix + HLVMODEL_BLOCK_MEAN_OFFSET(si);
+         invVar = mix + HLVMODEL_BLOCK_INVVAR_OFFSET(si);
+         a0 = a1 = _mm256_setzero_ps();
+         for (i=0; i+16<=pad; i+=16) {
+            d0 = _mm256_sub_ps(_mm256_loadu_ps(x+i),_mm256_loadu_ps(mean+i));
+            d1 = _mm256_sub_ps(_mm256_loadu_ps(x+i+8),_mm256_loadu_ps(mean+i+8));
+            a0 = _mm256_fmadd_ps(_mm256_mul_ps(d0,d0),_mm256_loadu_ps(invVar+i),a0);
+            a1 = _mm256_fmadd_ps(_mm256_mul_ps(d1,d1),_mm256_loadu_ps(invVar+i+8),a1);
+         }
+         if (i+8<=pad) {
+            d0 = _mm256_sub_ps(_mm256_loadu_ps(x+i),_mm256_loadu_ps(mean+i));
+            a0 = _mm256_fmadd_ps(_mm256_mul_ps(d0,d0),_mm256_loadu_ps(invVar+i),a0);
+            i += 8;
+         }
+         a0 = _mm256_add_ps(a0,a1);
+         if (i<pad) {           /* pad is a multiple of 4 */
+            d = _mm_sub_ps(_mm_loadu_ps(x+i),_mm_loadu_ps(mean+i));
+            d = _mm_mul_ps(_mm_mul_ps(d,d),_mm_loadu_ps(invVar+i));
+            a0 = _mm256_add_ps(a0,_mm256_insertf128_ps(_mm256_setzero_ps(),d,0));
+         }
+         p[c] = HLVMODEL_BLOCK_MIXW(si,mix) - 0.5f*(HLVMODEL_BLOCK_GCONST(si,mix) + HSumAVX2(a0));
+      }
+      mx = bmax;
+      for (c=0; c<nc; c++) if (p[c] > mx) mx = p[c];
+      for (c=nc; c<OUTP_MIXCHUNK; c++) p[c] = LZERO;
+      pv = _mm256_sub_ps(_mm256_loadu_ps(p),_mm256_set1_ps(mx));
+      sum = sum*exp(bmax-mx) + HSumAVX2(ExpAVX2(pv));
+      bmax = mx;
+   }
+   return bmax + log(sum);
+}
+
+/* ExpAVX512: e^x for each lane of x <= 0, as ExpAVX2 */
+__attribute__((target("avx512f")))
+static __m512 ExpAVX512(__m512 x)
+{
+   __m512 fx,y;
+   __m512i e;
+
+   x = _mm512_max_ps(x,_mm512_set1_ps(-87.0f));
+   e = _mm512_cvtps_epi32(_mm512_mul_ps(x,_mm512_set1_ps(1.44269504f)));
+   fx = _mm512_cvtepi32_ps(e);
+   x = _mm512_fnmadd_ps(fx,_mm512_set1_ps(0.693359375f),x);
+   x = _mm512_fnmadd_ps(fx,_mm512_set1_ps(-2.12194440e-4f),x);
+   y = _mm512_set1_ps(1.9875691500e-4f);
+   y = _mm512_fmadd_ps(y,x,_mm512_set1_ps(1.3981999507e-3f));
+   y = _mm512_fmadd_ps(y,x,_mm512_set1_ps(8.3334519073e-3f));
+   y = _mm512_fmadd_ps(y,x,_mm512_set1_ps(4.1665795894e-2f));
+   y = _mm512_fmadd_ps(y,x,_mm512_set1_ps(1.6666665459e-1f));
+   y = _mm512_fmadd_ps(y,x,_mm512_set1_ps(5.0000001201e-1f));
+   y = _mm512_fmadd_ps(y,_mm512_mul_ps(x,x),_mm512_add_ps(x,_mm512_set1_ps(1.0f)));
+   e = _mm512_slli_epi32(_mm512_add_epi32(e,_mm512_set1_epi32(127)),23);
+   return _mm512_mul_ps(y,_mm512_castsi512_ps(e));
+}
+
+/* OutPFramesAVX512: as OutPFramesAVX2, 16 frames per vector */
+__attribute__((target("avx512f")))
+static void OutPFramesAVX512(StateInfo_lv *si, int s, const float *xt, int ldx, int n, LogFloat *outP)
+{
+   int t,l,m,c,nc,i,nMix,nDim;
+   float *base,*mix,*mean,*invVar;
+   const float *x;
+   __m512 p[OUTP_MIXCHUNK],a0,a1,d0,d1,mx,bmax,sum;
+   float vmax[16],vsum[16];
+
+   base = HLVMODEL_BLOCK_BASE(si,s);
+   nMix = HLVMODEL_BLOCK_NMIX(si,base);
+   nDim = si->nDim;
+   for (t=0; t<n; t+=16) {
+      x = xt + t;
+      bmax = _mm512_set1_ps(LZERO); sum = _mm512_setzero_ps();
+      mix = base;
+      for (m=0; m<nMix; m+=nc) {
+         nc = (nMix-m < OUTP_MIXCHUNK) ? nMix-m : OUTP_MIXCHUNK;
+         for (c=0; c<nc; c++, mix+=si->floatsPerMix) {
+            mean = mix + HLVMODEL_BLOCK_MEAN_OFFSET(si);
+            invVar = mix + HLVMODEL_BLOCK_INVVAR_OFFSET(si);
+            a0 = _mm512_set1_ps(HLVMODEL_BLOCK_GCONST(si,mix));
+            a1 = _mm512_setzero_ps();
+            for (i=0; i+2<=nDim; i+=2) {
+               d0 = _mm512_sub_ps(_mm512_loadu_ps(x+i*ldx),_mm512_set1_ps(mean[i]));
+               d1 = _mm512_sub_ps(_mm512_loadu_ps(x+(i+1)*ldx),_mm512_set1_ps(mean[i+1]));
+               a0 = _mm512_fmadd_ps(_mm512_mul_ps(d0,d0),_mm512_set1_ps(invVar[i]),a0);
+               a1 = _mm512_fmadd_ps(_mm512_mul_ps(d1,d1),_mm512_set1_ps(invVar[i+1]),a1);
+            }
+            if (i<nDim) {
+               d0 = _mm512_sub_ps(_mm512_loadu_ps(x+i*ldx),_mm512_set1_ps(mean[i]));
+               a0 = _mm512_fmadd_ps(_mm512_mul_ps(d0,d0),_mm512_set1_ps(invVar[i]),a0);
+            }
+            p[c] = _mm512_fmadd_ps(_mm512_add_ps(a0,a1),_mm512_set1_ps(-0.5f),
+                                   _mm512_set1_ps(HLVMODEL_BLOCK_MIXW(si,mix)));
+         }
+         mx = bmax;
+         for (c=0; c<nc; c++) mx = _mm512_max_ps(mx,p[c]);
+         sum = _mm512_mul_ps(sum,ExpAVX512(_mm512_sub_ps(bmax,mx)));
+         for (c=0; c<nc; c++) sum = _mm512_add_ps(sum,ExpAVX512(_mm512_sub_ps(p[c],mx)));
+         bmax = mx;
+      }
+      _mm512_storeu_ps(vmax,bmax); _mm512_storeu_ps(vsum,sum);
+      for (l=0; l<16 && t+l<n; l++)
+         outP[t+l] = vmax[l] + log(vsum[l]);
+   }
+}
+
+#endif  /* OUTP_X86 */
+
+/* SelectOutPKernels: choose the OutPBlock kernels for this CPU and OUTPKERNEL */
+static void SelectOutPKernels(void)
+{
+   framesKernel = NULL; frameKernel = NULL; outPLanes = 1;
+   outPKernelName = "GENERIC";
+#ifdef OUTP_X86
+   if ((strcmp(outPKernel,"AUTO")==0 || strcmp(outPKernel,"AVX512")==0) &&
+       __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+       __builtin_cpu_supports("fma")) {
+      framesKernel = OutPFramesAVX512; frameKernel = OutPFrameAVX2; outPLanes = 16;
+      outPKernelName = "AVX512";
+      return;
+   }
+   if ((strcmp(outPKernel,"AUTO")==0 || strcmp(outPKernel,"AVX2")==0) &&
+       __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      framesKernel = OutPFramesAVX2; frameKernel = OutPFrameAVX2; outPLanes = 8;
+      outPKernelName = "AVX2";
+      return;
+   }
+#endif
+   if (strcmp(outPKernel,"AUTO")!=0 && strcmp(outPKernel,"GENERIC")!=0)
+      HError(-7070,"SelectOutPKernels: OUTPKERNEL %s not available, using GENERIC",outPKernel);
+}
+
+/* ScoreFrames: outP[t] for state s and the 0-based frames x[0..n-1] */
+static void ScoreFrames (StateInfo_lv *si, float **x, int n, int s, LogFloat *outP)
+{
+   float xt[OUTP_MAXPAD*MAXBLOCKOBS];
+   int i, t, ldx, pad;
+
+   pad = si->nVec * HLVMODEL_VEC_PAD;
+   if (frameKernel == NULL || pad > OUTP_MAXPAD || n > MAXBLOCKOBS) {
+      for (t = 0; t < n; ++t)
+         outP[t] = OutP_lv (si, s, x[t]);
+   }
+   else if (n == 1) {
+      for (i = 0; i < si->nDim; ++i) xt[i] = x[0][i];
+      for (; i < pad; ++i) xt[i] = 0.0;
+      outP[0] = frameKernel (si, s, xt);
+   }
+   else {                       /* pad the frames to whole vectors */
+      ldx = RoundAlign (n, outPLanes);
+      for (t = 0; t < ldx; ++t) {
+         float *src = x[(t < n) ? t : 0];
+         for (i = 0; i < si->nDim; ++i)
+            xt[i*ldx + t] = src[i];
+      }
+      framesKernel (si, s, xt, ldx, n, outP);
+   }
+}
+
 void OutPBlock (StateInfo_lv *si, Observation **obsBlock, int n, int sIdx, float acScale, LogFloat *outP, Ptr dec)
 {
    int i;
    DecoderInst *decPtr = (DecoderInst *) dec;
+   float *x[MAXBLOCKOBS];
 
    /* cz277 - ANN */
    switch (decPtr->decodeKind) {
       case NORMALDK:
-         for (i = 0; i < n; ++i) {
-            outP[i] = OutP_lv (si, sIdx, &obsBlock[i]->fv[1][1]);
-         }
+         assert (n <= MAXBLOCKOBS);
+         for (i = 0; i < n; ++i)
+            x[i] = &obsBlock[i]->fv[1][1];
+         if (decPtr->gsel.gs != NULL && 
+             HLVMODEL_BLOCK_NMIX(si, HLVMODEL_BLOCK_BASE(si, sIdx)) > 1)
+            for (i = 0; i < n; ++i)
+               outP[i] = OutPSel_lv (si, &decPtr->gsel, i, sIdx, x[i]);
+         else
+            ScoreFrames (si, x, n, sIdx, outP);
          break;
       case TANDEMDK:
          assert(n === 1);
@@ -293,6 +640,85 @@ void OutPBlock (StateInfo_lv *si, Observation **obsBlock, int n, int sIdx, float
          outP[i] *= acScale;
 }
 
+/* NowNS: monotonic clock in nanoseconds */
+static double NowNS (void)
+{
+   struct timespec ts;
+
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* TimeOutPKernels: report ns/Gaussian of each available kernel on si */
+static void TimeOutPKernels (StateInfo_lv *si)
+{
+   static char *names[] = { "GENERIC", "AVX2", "AVX512" };
+   static int blockN[] = { 1, MAXBLOCKOBS };
+   char saved[MAXSTRLEN];
+   HMMScanState hss;
+   int *sIdx, nState, nGauss, k, b, j, t, i, reps;
+   float *obs, *x[MAXBLOCKOBS], *mean;
+   LogFloat ref[MAXBLOCKOBS], res[MAXBLOCKOBS];
+   double start, elapsed, maxDiff;
+
+   sIdx = (int *) New (&gcheap, si->nBlocks * sizeof (int));
+   nState = nGauss = 0;
+   NewHMMScan (si->hset, &hss);
+   while (GoNextState (&hss, FALSE)) {
+      sIdx[nState++] = hss.si->sIdx;
+      nGauss += hss.si->pdf[1].nMix;
+   }
+   EndHMMScan (&hss);
+
+   /* frames scattered around the first mean of the first state */
+   obs = (float *) New (&gcheap, MAXBLOCKOBS * si->nDim * sizeof (float));
+   mean = HLVMODEL_BLOCK_BASE(si, sIdx[0]) + HLVMODEL_BLOCK_MEAN_OFFSET(si);
+   for (t = 0; t < MAXBLOCKOBS; ++t) {
+      x[t] = obs + t * si->nDim;
+      for (i = 0; i < si->nDim; ++i)
+         x[t][i] = mean[i] + 0.25 * ((t + i) % 5 - 2);
+   }
+
+   strcpy (saved, outPKernel);
+   for (k = 0; k < 3; ++k) {
+      strcpy (outPKernel, names[k]);
+      SelectOutPKernels ();
+      if (strcmp (outPKernelName, names[k]) != 0)
+         continue;
+      maxDiff = 0.0;
+      for (b = 0; b < 2; ++b)
+         for (j = 0; j < nState; ++j) {
+            ScoreFrames (si, x, blockN[b], sIdx[j], res);
+            for (t = 0; t < blockN[b]; ++t) {
+               ref[t] = OutP_lv (si, sIdx[j], x[t]);
+               if (fabs (res[t] - ref[t]) > maxDiff)
+                  maxDiff = fabs (res[t] - ref[t]);
+            }
+         }
+      for (b = 0; b < 2; ++b) {
+         reps = 0;
+         start = NowNS ();
+         do {
+            for (j = 0; j < nState; ++j)
+               ScoreFrames (si, x, blockN[b], sIdx[j], res);
+            ++reps;
+            elapsed = NowNS () - start;
+         } while (elapsed < 2e8);
+         printf ("OutPBlock %-7s %2d frames: %6.2f ns/Gaussian (%d states, %d Gaussians)\n",
+                 names[k], blockN[b], elapsed / ((double) reps * nGauss * blockN[b]),
+                 nState, nGauss);
+      }
+      printf ("OutPBlock %-7s max |diff| from OutP_lv %.2e\n", names[k], maxDiff);
+   }
+   strcpy (outPKernel, saved);
+   SelectOutPKernels ();
+   printf ("OutPBlock kernel %s\n", outPKernelName);
+   fflush (stdout);
+
+   Dispose (&gcheap, obs);
+   Dispose (&gcheap, sIdx);
+}
+
 
 /* ------------------------ End of HLVModel.c ----------------------- */
 
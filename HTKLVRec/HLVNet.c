@@ -693,6 +693,36 @@ void Handle1PhonePron (MemHeap *heap, TLexNet *net, Pron pron)
 
 }
 
+/* SortedWords
+
+     return array of all words in voc sorted by name. The vocab hash is
+     keyed by LabId address, so iterating it directly makes node creation
+     order (and hence the PronId assignment) differ from run to run.
+*/
+static int word_cmp (const void *v1, const void *v2)
+{
+   return strcmp ((*(Word *) v1)->wordName->name, (*(Word *) v2)->wordName->name);
+}
+
+static Word *SortedWords (Vocab *voc, int *nwords)
+{
+   Word *words, word;
+   int i, n;
+
+   n = 0;
+   for (i = 0; i < VHASHSIZE; i++)
+      for (word = voc->wtab[i]; word ; word = word->next)
+         ++n;
+   words = (Word *) New (&gcheap, (n > 0 ? n : 1) * sizeof (Word));
+   n = 0;
+   for (i = 0; i < VHASHSIZE; i++)
+      for (word = voc->wtab[i]; word ; word = word->next)
+         words[n++] = word;
+   qsort (words, n, sizeof (Word), word_cmp);
+   *nwords = n;
+   return words;
+}
+
 /* CreateBYnodes
 
      Create the forward tree from phone B to phone Y, 
@@ -707,74 +737,77 @@ void CreateBYnodes (MemHeap *heap, TLexNet *net)
    Word word;
    Pron pron;
    int nshared = 0;
+   Word *words;
+   int nwords;
 
    /* Create tree B -- Y */
 
-   /* for each pron with 2 or more phones */
-   for (i = 0; i < VHASHSIZE; i++)
-      for (word = net->voc->wtab[i]; word ; word = word->next)
-         if (word->aux == (Ptr) 1 && (word->wordName != net->startId && word->wordName != net->endId))
-            for (pron = word->pron; pron ; pron = pron->next) {
-               if (pron->aux == (Ptr) 1) {
-                  if (pron->nphones >= 2) {
-               
-                     /* find AB node */
-                     prevln = FindAddTLCN (NULL, net, LAYER_AB, &net->nlexAB, net->lexABhash, 
-                                           pron->phones[0], pron->phones[1]);
-               
-                     /* add models for phones B -- Y */
-                     for (p = 1; p < pron->nphones - 1; ++p) {
-                        hmm = FindTriphone (net->hset, pron->phones[p-1], pron->phones[p], pron->phones[p+1]);
-                        /* search in prevln's successors */
+   /* for each pron with 2 or more phones, in word name order */
+   words = SortedWords (net->voc, &nwords);
+   for (i = 0; i < nwords; i++)
+      if ((word = words[i])->aux == (Ptr) 1 && (word->wordName != net->startId && word->wordName != net->endId))
+         for (pron = word->pron; pron ; pron = pron->next) {
+            if (pron->aux == (Ptr) 1) {
+               if (pron->nphones >= 2) {
+            
+                  /* find AB node */
+                  prevln = FindAddTLCN (NULL, net, LAYER_AB, &net->nlexAB, net->lexABhash, 
+                                        pron->phones[0], pron->phones[1]);
+            
+                  /* add models for phones B -- Y */
+                  for (p = 1; p < pron->nphones - 1; ++p) {
+                     hmm = FindTriphone (net->hset, pron->phones[p-1], pron->phones[p], pron->phones[p+1]);
+                     /* search in prevln's successors */
+                     
+                     ll = FindHMMLink (prevln, hmm);
+                     if (ll) {
+                        prevln = ll->end;
+                        ++nshared;
+                     }
+                     else {             /* model not found -> create a new one */
+                        ln = NewTLexNodeMod (heap, net, LAYER_BY, hmm);
+                        /* sxz20 */
+                        if (markLogHmm)
+                            ln->labid=TriphoneLab(pron->phones[p-1], pron->phones[p], pron->phones[p+1]);
+                        
+                        ln->next = net->nodeBY;
+                        net->nodeBY = ln;
+                        ++net->nNodeBY;
+                        
+                        AddLink (heap, prevln, ln);   /* guaranteed to be a new link! */
                         
-                        ll = FindHMMLink (prevln, hmm);
-                        if (ll) {
-                           prevln = ll->end;
-                           ++nshared;
-                        }
-                        else {             /* model not found -> create a new one */
-                           ln = NewTLexNodeMod (heap, net, LAYER_BY, hmm);
-                           /* sxz20 */
-                           if (markLogHmm)
-                               ln->labid=TriphoneLab(pron->phones[p-1], pron->phones[p], pron->phones[p+1]);
-                           
-                           ln->next = net->nodeBY;
-                           net->nodeBY = ln;
-                           ++net->nNodeBY;
-                           
-                           AddLink (heap, prevln, ln);   /* guaranteed to be a new link! */
-                           
 #ifdef DEBUG_LABEL_NET          /*#### expensive name lookup for dot graph! */
-                           ln->lc = FindMacroStruct (net->hset, 'h', hmm)->id;
+                        ln->lc = FindMacroStruct (net->hset, 'h', hmm)->id;
 #else 
-                           ln->lc = NULL;
+                        ln->lc = NULL;
 #endif 
-                           prevln = ln;
-                        }
+                        prevln = ln;
                      }
-                     /* create word end node */
-                     ln = NewTLexNodeWe (heap, net, LAYER_WE, pron);
-                     
-                     ln->lc = pron->word->wordName;
-                     ln->next = net->nodeBY;
-                     net->nodeBY = ln;
-                     ++net->nNodeBY;
-                     
-                     AddLink (heap, prevln, ln);   /* guaranteed to be a NEW link! */
-                     prevln = ln;
-                     
-                     /* find YZ node */
-                     ln = FindAddTLCN (NULL, net, LAYER_YZ, &net->nlexYZ, net->lexYZhash, 
-                                       pron->phones[pron->nphones - 2], pron->phones[pron->nphones - 1]);
-                     /* find LexNode and connect prevln to it */
-                     AddLink (heap, prevln, ln);
-                  }
-                  else {
-                     /*  printf ("one- or two-phone word (%s) ignored\n", word->wordName->name); */
-                  Handle1PhonePron (heap, net, pron);
                   }
+                  /* create word end node */
+                  ln = NewTLexNodeWe (heap, net, LAYER_WE, pron);
+                  
+                  ln->lc = pron->word->wordName;
+                  ln->next = net->nodeBY;
+                  net->nodeBY = ln;
+                  ++net->nNodeBY;
+                  
+                  AddLink (heap, prevln, ln);   /* guaranteed to be a NEW link! */
+                  prevln = ln;
+                  
+                  /* find YZ node */
+                  ln = FindAddTLCN (NULL, net, LAYER_YZ, &net->nlexYZ, net->lexYZhash, 
+                                    pron->phones[pron->nphones - 2], pron->phones[pron->nphones - 1]);
+                  /* find LexNode and connect prevln to it */
+                  AddLink (heap, prevln, ln);
+               }
+               else {
+                  /*  printf ("one- or two-phone word (%s) ignored\n", word->wordName->name); */
+               Handle1PhonePron (heap, net, pron);
                }
             }
+         }
+   Dispose (&gcheap, words);
    if (trace & T_NETCON)
       printf ("nodes shared in prefix tree: %d\n", nshared);
 }
@@ -976,13 +1009,26 @@ int TraverseTree (TLexNode *ln, int start, int *lmlaCount)
    return curHi;
 }
 
+/* lcn_cmp
+
+     compare two context nodes by (lc,rc) names
+*/
+static int lcn_cmp (const void *v1, const void *v2)
+{
+   TLexNode *l1 = *(TLexNode **) v1, *l2 = *(TLexNode **) v2;
+   int c;
+
+   c = strcmp (l1->lc->name, l2->lc->name);
+   return c ? c : strcmp (l1->rc->name, l2->rc->name);
+}
+
 /* AssignWEIds
 
 */
 void AssignWEIds(TLexNet *tnet)
 {
-   int i;
-   TLexNode *ln;
+   int i, nab;
+   TLexNode *ln, **ab;
    int start, highest;
 
    /* assign PronIds to wordend nodes reachable from AB nodes.
@@ -991,21 +1037,32 @@ void AssignWEIds(TLexNet *tnet)
        - start/end words  (cf. CreateStartEnd)
    */
 
-   highest = tnet->nPronIds;
+   /* visit AB nodes in (lc,rc) name order rather than hash order so that
+      the PronIds are reproducible (cf. SortedWords) */
+   nab = 0;
+   ab = (TLexNode **) New (&gcheap, (tnet->nlexAB + 1) * sizeof (TLexNode *));
    for (i = 0; i < LEX_CON_HASH_SIZE; ++i)
-      for (ln = tnet->lexABhash[i]; ln; ln = ln->next) {
-         start = highest + 1;
+      for (ln = tnet->lexABhash[i]; ln; ln = ln->next)
+         ab[nab++] = ln;
+   assert (nab <= tnet->nlexAB);
+   qsort (ab, nab, sizeof (TLexNode *), lcn_cmp);
 
-         /*          ln->loWE = start; */
-         ln->lmlaIdx = ++tnet->lmlaCount;
-         highest = TraverseTree (ln, start, &tnet->lmlaCount);
-         ln->hiWE = highest;
+   highest = tnet->nPronIds;
+   for (i = 0; i < nab; ++i) {
+      ln = ab[i];
+      start = highest + 1;
 
+      /*          ln->loWE = start; */
+      ln->lmlaIdx = ++tnet->lmlaCount;
+      highest = TraverseTree (ln, start, &tnet->lmlaCount);
+      ln->hiWE = highest;
 
-         if (trace & T_NETCON)
-            printf ("AB %s-%s  loWE %d hiWE %d  lmlaIdx %d\n", ln->lc->name, ln->rc->name, 
-                    ln->loWE, ln->hiWE, ln->lmlaIdx);
-      }
+
+      if (trace & T_NETCON)
+         printf ("AB %s-%s  loWE %d hiWE %d  lmlaIdx %d\n", ln->lc->name, ln->rc->name, 
+                 ln->loWE, ln->hiWE, ln->lmlaIdx);
+   }
+   Dispose (&gcheap, ab);
 
    /* one A node can have multiple successors. */
    /* create complex lmla nodes for them in CreateCompLMLA() */
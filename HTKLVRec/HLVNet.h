@@ -74,8 +74,7 @@ typedef enum _LexNodeType {
 } LexNodeType;
 
 
-struct _LexNode {
-   LexNodeInst *inst;		/* model instance or NULL if inactive */
+struct _LexNode {               /* instances are held per decoder, see LN_INST */
    union {
       HLink hmm;                /* #### switch to HMM Ids (2 byte ints) */
       PronId pron;
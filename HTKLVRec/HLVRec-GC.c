@@ -43,6 +43,12 @@ char *hlvrec_gc_vc_id = "$Id: HLVRec-GC.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $"
 #define MARKED_PATH_P(p)        ((p)->user & MARK_PATH_MASK)
 #define UNMARK_PATH(p)          (p->user = p->user & ~MARK_PATH_MASK)
 
+/* during a minor GC the next bit flags paths in the nursery */
+#define YOUNG_PATH_MASK 0x4000
+#define YOUNG_PATH(p)           (p->user = (p)->user | YOUNG_PATH_MASK)
+#define YOUNG_PATH_P(p)         ((p)->user & YOUNG_PATH_MASK)
+#define UNYOUNG_PATH(p)         (p->user = p->user & ~(YOUNG_PATH_MASK | MARK_PATH_MASK))
+
 /* mark AltWordendHyp in least significant bit of a->prev, which is normally 
    always 0, since pointers are aligned */
 #define MARK_ALTPATH_MASK     0x0000000000000001UL
@@ -64,6 +70,12 @@ char *hlvrec_gc_vc_id = "$Id: HLVRec-GC.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $"
 #define MARKED_MODPATH_P(m)     ((long)((m)->ln) & MARK_MODPATH_MASK)
 #define UNMARK_MODPATH(m)       (m->ln = (LexNode *)((long)((m)->ln) & ~MARK_MODPATH_MASK))
 
+#define YOUNG_MODPATH_MASK      0x0000000000000002UL
+#define YOUNG_MODPATH(m)        (m->ln = (LexNode *)((long)((m)->ln) | YOUNG_MODPATH_MASK))
+#define YOUNG_MODPATH_P(m)      ((long)((m)->ln) & YOUNG_MODPATH_MASK)
+#define UNYOUNG_MODPATH(m)      (m->ln = (LexNode *)((long)((m)->ln) & \
+                                                     ~(YOUNG_MODPATH_MASK | MARK_MODPATH_MASK)))
+
 static void MarkModPath (ModendHyp *m)
 {
    if (!m || MARKED_MODPATH_P(m))
@@ -285,11 +297,210 @@ static void SweepModPaths (MemHeap *heap)
 }
 #endif
 
+/* ------------------------ generational collection ----------------------- */
+
+/* Every traceback record points only to records that were allocated
+   before it, so records that survived a collection never refer to
+   younger ones. The minor collection therefore only traces and
+   sweeps the records allocated since the last collection (the
+   nursery): marking stops at the first older record and the sweep
+   walks the nursery instead of the whole heap. Survivors are
+   promoted and only reclaimed by the next full collection.
+
+   AltWordendHyps can be shared between copies of a WordendHyp, so
+   they are traced through but only freed by full collections.
+*/
+
+/* CreateNursery
+
+     create an empty nursery owned by one decoder instance
+*/
+static void CreateNursery (PathNursery *ny, char *name)
+{
+   CreateHeap (&ny->chunkHeap, name, MHEAP, sizeof (NurseryChunk), 1.0, 4, 64);
+   ny->head = ny->tail = (NurseryChunk *) New (&ny->chunkHeap, sizeof (NurseryChunk));
+   ny->head->next = NULL;
+   ny->head->n = 0;
+   ny->n = 0;
+}
+
+/* ResetNursery
+
+     empty the nursery, all its records are considered old from now on
+*/
+static void ResetNursery (PathNursery *ny)
+{
+   NurseryChunk *c;
+
+   for (c = ny->head; c && c->n > 0; c = c->next)
+      c->n = 0;
+   ny->tail = ny->head;
+   ny->n = 0;
+}
+
+/* NurseryAdd
+
+     remember record p as allocated since the last GC
+*/
+static void NurseryAdd (PathNursery *ny, Ptr p)
+{
+   NurseryChunk *c;
+
+   c = ny->tail;
+   if (c->n == NURSERY_CHUNK) {
+      if (!c->next) {
+         c->next = (NurseryChunk *) New (&ny->chunkHeap, sizeof (NurseryChunk));
+         c->next->next = NULL;
+         c->next->n = 0;
+      }
+      c = ny->tail = c->next;
+   }
+   c->item[c->n++] = p;
+   ++ny->n;
+}
+
+/* NewWordendHyp
+
+     allocate WordendHyp and add it to the nursery
+*/
+static WordendHyp *NewWordendHyp (DecoderInst *dec)
+{
+   WordendHyp *path;
+
+   path = (WordendHyp *) New (&dec->weHypHeap, sizeof (WordendHyp));
+   NurseryAdd (&dec->weNursery, path);
+   return path;
+}
+
+#ifdef MODALIGN
+/* NewModendHyp
+
+     allocate ModendHyp and add it to the nursery
+*/
+static ModendHyp *NewModendHyp (DecoderInst *dec)
+{
+   ModendHyp *m;
+
+   m = (ModendHyp *) New (&dec->modendHypHeap, sizeof (ModendHyp));
+   NurseryAdd (&dec->modNursery, m);
+   return m;
+}
+
+static void MarkYoungModPath (ModendHyp *m)
+{
+   for ( ; m && YOUNG_MODPATH_P (m) && !MARKED_MODPATH_P (m); m = m->prev)
+      MARK_MODPATH(m);
+}
+#endif
+
+static void MarkYoungPath (WordendHyp *path)
+{
+   AltWordendHyp *alt;
+
+   for ( ; path && YOUNG_PATH_P (path) && !MARKED_PATH_P (path); path = path->prev) {
+      MARK_PATH (path);
+#ifdef MODALIGN
+      MarkYoungModPath (path->modpath);
+#endif
+      for (alt = path->alt; alt; alt = alt->next) {
+#ifdef MODALIGN
+         MarkYoungModPath (alt->modpath);
+#endif
+         MarkYoungPath (alt->prev);
+      }
+   }
+}
+
+/* MinorCollectPaths
+
+     dispose all WordendHyps (and ModendHyps) from the nursery that are
+     not reachable by active tokens anymore
+*/
+static void MinorCollectPaths (DecoderInst *dec)
+{
+   int i, j, l, N, freed;
+   LexNodeInst *inst;
+   TokenSet *ts;
+   RelToken *tok;
+   PathNursery *ny;
+   NurseryChunk *c;
+   WordendHyp *path;
+
+   /* flag nursery */
+   ny = &dec->weNursery;
+   for (c = ny->head; c; c = c->next)
+      for (i = 0; i < c->n; ++i) {
+         path = (WordendHyp *) c->item[i];
+         YOUNG_PATH (path);
+      }
+#ifdef MODALIGN
+   if (dec->modAlign)
+      for (c = dec->modNursery.head; c; c = c->next)
+         for (i = 0; i < c->n; ++i) {
+            ModendHyp *m = (ModendHyp *) c->item[i];
+            YOUNG_MODPATH (m);
+         }
+#endif
+
+   /* mark phase */
+   for (l = 0; l < dec->nLayers; ++l) {
+      for (inst = dec->instsLayer[l]; inst; inst = inst->next) {
+         N = (inst->node->type == LN_MODEL) ? inst->node->data.hmm->numStates : 1;
+         for (i = 0, ts = inst->ts; i < N; ++i, ++ts) {
+            for (j = 0, tok = ts->relTok; j < ts->n; ++j, ++tok) {
+               MarkYoungPath (tok->path);
+#ifdef MODALIGN
+               if (tok->modpath)
+                  MarkYoungModPath (tok->modpath);
+#endif
+            }
+         }
+      }
+   }
+
+   /* sweep phase: promote survivors, free the rest */
+   freed = 0;
+   for (c = ny->head; c; c = c->next)
+      for (i = 0; i < c->n; ++i) {
+         path = (WordendHyp *) c->item[i];
+         if (MARKED_PATH_P (path))
+            UNYOUNG_PATH (path);
+         else {
+            Dispose (&dec->weHypHeap, path);
+            ++freed;
+         }
+      }
+   if (trace&T_GC)
+      printf ("minor GC: freed %d of %d new Paths\n", freed, ny->n);
+   ResetNursery (ny);
+
+#ifdef MODALIGN
+   if (dec->modAlign) {
+      ny = &dec->modNursery;
+      freed = 0;
+      for (c = ny->head; c; c = c->next)
+         for (i = 0; i < c->n; ++i) {
+            ModendHyp *m = (ModendHyp *) c->item[i];
+            if (MARKED_MODPATH_P (m))
+               UNYOUNG_MODPATH (m);
+            else {
+               Dispose (&dec->modendHypHeap, m);
+               ++freed;
+            }
+         }
+      if (trace&T_GC)
+         printf ("minor GC: freed %d of %d new ModPaths\n", freed, ny->n);
+      ResetNursery (ny);
+   }
+#endif
+}
+
+
 /* GarbageCollectPaths
 
      dispose all WordEndhyps that are not reachable by active tokens
      anymore
-     uses simple mark & sweep GC
+     uses simple mark & sweep GC (full collection)
 */
 static void GarbageCollectPaths (DecoderInst *dec)
 {
@@ -332,9 +543,12 @@ static void GarbageCollectPaths (DecoderInst *dec)
    /* sweep phase */
    SweepPaths (&dec->weHypHeap);
    SweepAltPaths (&dec->altweHypHeap);
+   ResetNursery (&dec->weNursery);
 #ifdef MODALIGN
-   if (dec->modAlign)
+   if (dec->modAlign) {
       SweepModPaths (&dec->modendHypHeap);
+      ResetNursery (&dec->modNursery);
+   }
 #endif
 
    if (trace&T_GC) {
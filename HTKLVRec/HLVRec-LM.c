@@ -55,7 +55,7 @@ static void UpdateLMlookahead(DecoderInst *dec, LexNode *ln)
    assert (lmlaIdx != 0);
    assert (lmlaIdx < dec->net->laTree->nNodes + dec->net->laTree->nCompNodes);
    
-   ts = ln->inst->ts;
+   ts = LN_INST(dec, ln)->ts;
    assert (ts->n > 0);
 
    bestDelta = LZERO;
@@ -237,6 +237,205 @@ static LMTokScore LMCacheTransProb (DecoderInst *dec, FSLM *lm,
 #endif
 }
 
+/******************* shared persistent LM lookahead store */
+
+/* CreateLMLAStore
+
+     allocate an empty store of at most sizeMB MBytes
+*/
+static LMLAStore *CreateLMLAStore (int sizeMB)
+{
+   LMLAStore *st;
+   unsigned long n;
+   int i;
+
+   st = (LMLAStore *) New (&gcheap, sizeof (LMLAStore));
+   for (n = 1; 2 * n * sizeof (LMLASet) <= (unsigned long) sizeMB << 20; n *= 2)
+      ;
+   st->nSet = n;
+   st->set = (LMLASet *) New (&gcheap, n * sizeof (LMLASet));
+   memset (st->set, 0, n * sizeof (LMLASet));
+   for (i = 0; i < LMLA_NLOCK; ++i) {
+      pthread_mutex_init (&st->lock[i].m, NULL);
+      st->lock[i].hit = st->lock[i].miss = 0;
+      st->lock[i].evict = st->lock[i].used = 0;
+   }
+   pthread_mutex_init (&st->bindLock, NULL);
+   st->net = NULL;
+   st->lm = NULL;
+   st->lmScale = 0.0;
+   st->shared = FALSE;
+   st->users = 0;
+   return st;
+}
+
+/* BindLMLAStore
+
+     make dec use its store for the coming utterance, flushing it if the
+     stored scores were computed for a different net, LM or LM scale.
+     The store is only flushed while no other instance is bound to it,
+     otherwise dec decodes this utterance with its private LMCache alone.
+*/
+static void BindLMLAStore (DecoderInst *dec)
+{
+   LMLAStore *st;
+   int i;
+
+   st = dec->lmlaStore;
+   dec->useLMLAStore = FALSE;
+   if (!st || dec->lm->type != fslm_ngram)
+      return;
+
+   pthread_mutex_lock (&st->bindLock);
+   if (st->net != dec->net || st->lm != dec->lm || st->lmScale != dec->lmScale) {
+      if (st->users > 0) {
+         pthread_mutex_unlock (&st->bindLock);
+         return;
+      }
+      if (st->net && (trace & T_TOP))
+         printf ("BindLMLAStore: flushing LM lookahead store\n");
+      for (i = 0; i < LMLA_NLOCK; ++i)
+         pthread_mutex_lock (&st->lock[i].m);
+      memset (st->set, 0, st->nSet * sizeof (LMLASet));
+      for (i = 0; i < LMLA_NLOCK; ++i)
+         st->lock[i].evict = st->lock[i].used = 0;
+      st->net = dec->net;
+      st->lm = dec->lm;
+      st->lmScale = dec->lmScale;
+      for (i = LMLA_NLOCK - 1; i >= 0; --i)
+         pthread_mutex_unlock (&st->lock[i].m);
+   }
+   ++st->users;
+   pthread_mutex_unlock (&st->bindLock);
+   dec->useLMLAStore = TRUE;
+}
+
+/* UnbindLMLAStore
+
+     release the store bound to dec by BindLMLAStore
+*/
+static void UnbindLMLAStore (DecoderInst *dec)
+{
+   LMLAStore *st;
+
+   st = dec->lmlaStore;
+   if (!st || !dec->useLMLAStore)
+      return;
+   pthread_mutex_lock (&st->bindLock);
+   --st->users;
+   pthread_mutex_unlock (&st->bindLock);
+   dec->useLMLAStore = FALSE;
+}
+
+/* LMLAStoreSet
+
+     return set index for (src,idx)
+*/
+static unsigned long LMLAStoreSet (LMLAStore *st, LMState src, int idx)
+{
+   unsigned long h;
+
+   h = ((unsigned long) src >> 3) * 2654435761UL + (unsigned long) idx * 40503UL;
+   h ^= h >> 15;
+   return h & (st->nSet - 1);
+}
+
+/* LMLAStoreFind
+
+     look up score for (src,idx), return FALSE if not in store
+*/
+static Boolean LMLAStoreFind (LMLAStore *st, LMState src, int idx, LMTokScore *prob)
+{
+   LMLASet *set;
+   LMLALock *lk;
+   unsigned long s;
+   int w;
+   Boolean found = FALSE;
+
+   s = LMLAStoreSet (st, src, idx);
+   set = &st->set[s];
+   lk = &st->lock[s % LMLA_NLOCK];
+   if (st->shared) pthread_mutex_lock (&lk->m);
+   for (w = 0; w < LMLA_WAYS; ++w)
+      if (set->e[w].idx == idx + 1 && set->e[w].src == src) {
+         *prob = set->e[w].prob;
+         set->ref[w] = 1;
+         found = TRUE;
+         break;
+      }
+   if (found) ++lk->hit; else ++lk->miss;
+   if (st->shared) pthread_mutex_unlock (&lk->m);
+   return found;
+}
+
+/* LMLAStoreAdd
+
+     enter score for (src,idx), replacing the first entry of its set
+     not referenced since the clock hand last passed it
+*/
+static void LMLAStoreAdd (LMLAStore *st, LMState src, int idx, LMTokScore prob)
+{
+   LMLASet *set;
+   LMLALock *lk;
+   LMLAEntry *e;
+   unsigned long s;
+   int w;
+
+   s = LMLAStoreSet (st, src, idx);
+   set = &st->set[s];
+   lk = &st->lock[s % LMLA_NLOCK];
+   if (st->shared) pthread_mutex_lock (&lk->m);
+   /* another instance may have entered it since our lookup */
+   for (w = 0; w < LMLA_WAYS; ++w)
+      if (set->e[w].idx == idx + 1 && set->e[w].src == src)
+         break;
+   if (w == LMLA_WAYS) {
+      while (set->ref[set->hand]) {
+         set->ref[set->hand] = 0;
+         set->hand = (set->hand + 1) % LMLA_WAYS;
+      }
+      w = set->hand;
+      set->hand = (set->hand + 1) % LMLA_WAYS;
+      if (set->e[w].idx) ++lk->evict; else ++lk->used;
+   }
+   e = &set->e[w];
+   e->src = src;
+   e->idx = idx + 1;
+   e->prob = prob;
+   set->ref[w] = 1;
+   if (st->shared) pthread_mutex_unlock (&lk->m);
+}
+
+/* EXPORT->PrintLMLAStats
+
+     print LM lookahead cache statistics of the last utterance and
+     totals of the shared store
+*/
+void PrintLMLAStats (FILE *f, DecoderInst *dec)
+{
+   LMLAStore *st;
+   unsigned long hit, miss, evict, used;
+   int i;
+
+#ifdef COLLECT_STATS
+   fprintf (f, "Stats: LMlaCacheHits %lu\n", dec->stats.nLMlaCacheHit);
+   fprintf (f, "Stats: LMlaCacheMiss %lu\n", dec->stats.nLMlaCacheMiss);
+#endif
+   st = dec->lmlaStore;
+   if (!st || !dec->useLMLAStore)
+      return;
+   hit = miss = evict = used = 0;
+   for (i = 0; i < LMLA_NLOCK; ++i) {
+      if (st->shared) pthread_mutex_lock (&st->lock[i].m);
+      hit += st->lock[i].hit; miss += st->lock[i].miss;
+      evict += st->lock[i].evict; used += st->lock[i].used;
+      if (st->shared) pthread_mutex_unlock (&st->lock[i].m);
+   }
+   fprintf (f, "Stats: LMlaStore %lu/%lu entries (%.1f MB)  hits %lu  misses %lu (%.1f%%)  evictions %lu\n\n",
+            used, st->nSet * LMLA_WAYS, st->nSet * sizeof (LMLASet) / 1048576.0,
+            hit, miss, (hit + miss) ? 100.0 * hit / (hit + miss) : 0.0, evict);
+}
+
 LMTokScore LMLA_nocache (DecoderInst *dec, LMState lmState, int lmlaIdx)
 {
    LMlaTree *laTree;
@@ -299,6 +498,9 @@ static LMTokScore LMCacheLookaheadProb (DecoderInst *dec, LMState lmState,
       }
       if (i < nodeCache->nEntries) {
          ++cache->laHit;
+#ifdef COLLECT_STATS
+         ++dec->stats.nLMlaCacheHit;
+#endif
 #if 0         /* #### very expensive sanity check */
          assert (entry->prob == LMLA_nocache (dec, lmState, lmlaIdx));
 #endif
@@ -315,8 +517,16 @@ static LMTokScore LMCacheLookaheadProb (DecoderInst *dec, LMState lmState,
 
       entry = &nodeCache->la[0];
    }
-   
+#ifdef COLLECT_STATS
+   ++dec->stats.nLMlaCacheMiss;
+#endif
+
    /* now entry points to the place to store the prob we are about to calulate */
+   if (dec->useLMLAStore && LMLAStoreFind (dec->lmlaStore, lmState, lmlaIdx, &lmscore)) {
+      entry->src = lmState;
+      entry->prob = lmscore;
+      return lmscore;
+   }
    {
       LMlaTree *laTree;
       
@@ -350,6 +560,8 @@ static LMTokScore LMCacheLookaheadProb (DecoderInst *dec, LMState lmState,
    
    entry->src = lmState;
    entry->prob = lmscore;
+   if (dec->useLMLAStore)
+      LMLAStoreAdd (dec->lmlaStore, lmState, lmlaIdx, lmscore);
 
    /*    printf ("lmla %f\n", lmscore); */
    return lmscore;
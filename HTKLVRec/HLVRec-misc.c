@@ -61,8 +61,9 @@ void CheckTokenSetOrder (DecoderInst *dec, TokenSet *ts)
   Debug_DumpNet
 
 */
-void Debug_DumpNet (LexNet *net)
+void Debug_DumpNet (DecoderInst *dec)
 {
+   LexNet *net = dec->net;
    int i, j, k, N;
    LexNode *ln;
    LexNodeInst *inst;
@@ -83,7 +84,7 @@ void Debug_DumpNet (LexNet *net)
 
    for (i = 0; i < net->nNodes; ++i) {
       ln = &net->node[i];
-      inst = ln->inst;
+      inst = LN_INST(dec, ln);
       if (inst) {
          fprintf (debugFile, "node %d  (LexNode *) %p", i, ln);
          fprintf (debugFile, " type %d nfoll %d", ln->type, ln->nfoll);
@@ -272,7 +272,7 @@ x      CACHE_FLAG_SET(dec, sIdx);
 
 /* cz277 - ANN */
 static LogFloat SOutP_HMod (HMMSet *hset, int s, Vector v, StreamElem *se,
-                            int id)
+                            AdaptXForm *inXForm, int id)
 {
    int m;
    LogFloat bx,px,wt,det;
@@ -329,9 +329,9 @@ LogFloat POutP_HModel (HMMSet *hset,Observation *x, StateInfo *si, int id, Decod
    if (S == 1 && si->weights == NULL) {
       switch (dec->decodeKind) {
          case NORMALDK:
-            return SOutP_HMod(hset, 1, x->fv[1], si->pdf + 1, id);
+            return SOutP_HMod(hset, 1, x->fv[1], si->pdf + 1, dec->inXForm, id);
          case TANDEMDK:
-            return SOutP_HMod(hset, 1, dec->cacheVec[frameIdx][1], si->pdf + 1, id);
+            return SOutP_HMod(hset, 1, dec->cacheVec[frameIdx][1], si->pdf + 1, dec->inXForm, id);
          case HYBRIDDK:
          default:
             HError(7890, "POutP_HModel: Unsupported DecodeKind");
@@ -341,12 +341,12 @@ LogFloat POutP_HModel (HMMSet *hset,Observation *x, StateInfo *si, int id, Decod
    switch (dec->decodeKind) {
       case NORMALDK:
          for (s = 1; s <= S; s++, se++) {
-            bx += w[s] * SOutP_HMod(hset, s, x->fv[s], se, id);
+            bx += w[s] * SOutP_HMod(hset, s, x->fv[s], se, dec->inXForm, id);
          }
          break;
       case TANDEMDK:
          for (s = 1; s <= S; s++, se++) {
-            bx += w[s] * SOutP_HMod(hset, s, dec->cacheVec[frameIdx][s], se, id);
+            bx += w[s] * SOutP_HMod(hset, s, dec->cacheVec[frameIdx][s], se, dec->inXForm, id);
          }
          break;
       case HYBRIDDK:
@@ -33,14 +33,6 @@ char *hlvrec_prop_version = "!HVER!HLVRec-propagate:   3.5.0 [CUED 12/10/15]";
 char *hlvrec_prop_vc_id = "$Id: HLVRec-propagate.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $";
 
 
-/* stats for TokenSet Id optimisation */
-static int mts_copy = 0;
-static int mts_fast = 0;
-static int mts_slow = 0;
-static int mts_newid = 0;
-static int mts_newidNTOK = 0;
-
-
 /* MergeTokSet
 
      Merge TokenSet src into dest after adding score to all src scores
@@ -65,7 +57,9 @@ static void MergeTokSet (DecoderInst *dec, TokenSet *src, TokenSet *dest,
       dest->score = src->score + score;
       dest->id = src->id;
 
-      ++mts_copy;
+#ifdef COLLECT_STATS
+      ++dec->stats.mtsCopy;
+#endif
       for (i = 0, srcTok = src->relTok, destTok = dest->relTok; i < src->n; ++i, ++srcTok, ++destTok)
          *destTok = *srcTok;
       /*         dest->relTok[i] = src->relTok[i]; */
@@ -78,7 +72,9 @@ static void MergeTokSet (DecoderInst *dec, TokenSet *src, TokenSet *dest,
    else if (src->id == dest->id) {      /* TokenSet Id optimisation from [Odell:2000] */
       TokScore srcScore;
 
-      ++mts_fast;
+#ifdef COLLECT_STATS
+      ++dec->stats.mtsFast;
+#endif
       /* only compare Tokensets' best scores and pick better */
       srcScore = src->score + score;
       
@@ -100,7 +96,9 @@ static void MergeTokSet (DecoderInst *dec, TokenSet *src, TokenSet *dest,
       TokScore winScore;
       RelTokScore srcCorr, destCorr, deltaLimit;
 
-      ++mts_slow;
+#ifdef COLLECT_STATS
+      ++dec->stats.mtsSlow;
+#endif
 
       winTok = dec->winTok;
       nWinTok = 0;
@@ -220,7 +218,9 @@ static void MergeTokSet (DecoderInst *dec, TokenSet *src, TokenSet *dest,
             dest->id = dest->id;         /* copy dest->id */
          else {
             dest->id = ++dec->tokSetIdCount;    /* new id */
-            ++mts_newid;
+#ifdef COLLECT_STATS
+            ++dec->stats.mtsNewId;
+#endif
          }
       } else {
          /* perform Bucket sort/Histogram pruning to reduce to dec->nTok tokens */
@@ -232,7 +232,9 @@ static void MergeTokSet (DecoderInst *dec, TokenSet *src, TokenSet *dest,
          LogFloat binWidth, limit;
 
          dest->id = ++dec->tokSetIdCount;    /* #### new id always necessary? */
-         ++mts_newidNTOK;
+#ifdef COLLECT_STATS
+         ++dec->stats.mtsNewIdNTok;
+#endif
 
          binWidth = deltaLimit*1.001 / NBINS;   /* handle delta==deltaLimit case */
 
@@ -347,8 +349,6 @@ static void MergeTokSet (DecoderInst *dec, TokenSet *src, TokenSet *dest,
 }
 
 
-static int PI_LR = 0;
-static int PI_GEN = 0;
 /* PropagateInternal
 
      Internal token propagation
@@ -384,7 +384,9 @@ static void PropagateInternal (DecoderInst *dec, LexNodeInst *inst)
    if (hmm->tIdx < 0) {
       /*         PropagateInternal_LR (dec, inst);  */
       
-      PI_LR++;
+#ifdef COLLECT_STATS
+      ++dec->stats.piLR;
+#endif
       bestScore = LZERO;
       
       /* loop transition for state N-1 (which has no forward trans) */
@@ -463,7 +465,9 @@ static void PropagateInternal (DecoderInst *dec, LexNodeInst *inst)
       
       tempTS = dec->tempTS[N];
       
-      PI_GEN++;
+#ifdef COLLECT_STATS
+      ++dec->stats.piGen;
+#endif
 #ifdef DEBUG_TRACE
       if (trace & T_PROP)
          printf ("#########################PropagateInternal hmm %p '%s':\n", inst->node,
@@ -592,7 +596,7 @@ void UpdateModPaths (DecoderInst *dec, TokenSet *ts, LexNode *ln)
       /* #### optimise by sharing ModendHyp's between tokens with
          same tok->modpath */
       for (i = 0, tok = ts->relTok; i < ts->n; ++i, ++tok) {
-         m = New (&dec->modendHypHeap, sizeof (ModendHyp));
+         m = NewModendHyp (dec);
          m->frame = dec->frame;
          m->ln = ln;
          m->prev = tok->modpath;
@@ -613,9 +617,9 @@ static void PropIntoNode (DecoderInst *dec, TokenSet *ts, LexNode *ln, Boolean u
    LexNodeInst *inst;
    TokScore best;
 
-   if (!ln->inst)                /* activate if necessary */
-      ActivateNode (dec, ln);
-   inst = ln->inst;
+   inst = LN_INST(dec, ln);
+   if (!inst)                   /* activate if necessary */
+      inst = ActivateNode (dec, ln);
          
    /* propagate tokens from ln's exit into follLN's entry state */
    MergeTokSet (dec, ts, &inst->ts[0], 0.0, TRUE);
@@ -754,7 +758,7 @@ static void HandleWordend (DecoderInst *dec, LexNode *ln)
 
    assert (ln->type == LN_WORDEND);
 
-   inst = ln->inst;
+   inst = LN_INST(dec, ln);
    assert (inst);
    ts = inst->ts;
    
@@ -906,7 +910,7 @@ static void HandleWordend (DecoderInst *dec, LexNode *ln)
          ++newN;
 
          /* new wordendHyp */
-         weHyp = (WordendHyp *) New (&dec->weHypHeap, sizeof (WordendHyp));
+         weHyp = NewWordendHyp (dec);
       
          weHyp->prev = prev;
          weHyp->pron = ln->data.pron;
@@ -993,7 +997,7 @@ static void UpdateWordEndHyp (DecoderInst *dec, LexNodeInst *inst)
 
       /* don't copy weHyp, if it is up-to-date (i.e. for <s>) */
       if (oldweHyp->frame != dec->frame || oldweHyp->pron != dec->net->startPron) {
-         weHyp = (WordendHyp *) New (&dec->weHypHeap, sizeof (WordendHyp));
+         weHyp = NewWordendHyp (dec);
          *weHyp = *oldweHyp;
          weHyp->score = ts->score + tok->delta;
          weHyp->frame = dec->frame;
@@ -1039,7 +1043,7 @@ static void AddPronProbs (DecoderInst *dec, TokenSet *ts, int var)
       if (path->user != var) {
          WordendHyp *weHyp;
 
-         weHyp = (WordendHyp *) New (&dec->weHypHeap, sizeof (WordendHyp));
+         weHyp = NewWordendHyp (dec);
          *weHyp = *path;
          weHyp->user = var;
          tok->path = weHyp;
@@ -1070,13 +1074,13 @@ void HandleSpSkipLayer (DecoderInst *dec, LexNodeInst *inst)
       lnSA = ln->foll[0]->foll[0];
                   
       /* node should be either inactive or empty */
-      assert (!lnSA->inst || lnSA->inst->ts[0].n == 0);
+      assert (!LN_INST(dec, lnSA) || LN_INST(dec, lnSA)->ts[0].n == 0);
       
       PropIntoNode (dec, &inst->ts[0], ln->foll[0]->foll[0], FALSE);
       
       /* add pronprobs and keep record of variant in path->user */
       /*   user = 0: - variant, 1: sp, 2: sil */
-      AddPronProbs (dec, &lnSA->inst->ts[0], 0);
+      AddPronProbs (dec, &LN_INST(dec, lnSA)->ts[0], 0);
       
       /* now add sp variant pronprob to token set and propagate as normal */
       AddPronProbs (dec, &inst->ts[0], 1);
@@ -1143,12 +1147,14 @@ void ProcessFrame (DecoderInst *dec, Observation **obsBlock, int nObs,
    int nActive, modelActive;
    TokScore beamLimit;
    
-   inXForm = xform; /* sepcifies the transform to use */
+   dec->inXForm = xform; /* sepcifies the transform to use */
 
    dec->obs = obsBlock[0];
    dec->nObs = nObs;
    for (i = 0; i < nObs; ++i)
       dec->obsBlock[i] = obsBlock[i];
+   if (dec->gsel.gs != NULL && dec->decodeKind == NORMALDK)
+      GSelFrames (&dec->gsel, obsBlock, nObs, dec->frame);
    dec->bestScore = LZERO;
    dec->bestInst = NULL;
    ++dec->frame;
@@ -1156,11 +1162,17 @@ void ProcessFrame (DecoderInst *dec, Observation **obsBlock, int nObs,
    /* cz277 - ANN */
    dec->cacheVecIdx = cacheVecIdx;
 
-   if (dec->frame % gcFreq == 0)
-      GarbageCollectPaths (dec);
+   if (dec->frame % gcFreq == 0) {
+      if (gcMajorFreq <= 1 || ++dec->nGC % gcMajorFreq == 0)
+         GarbageCollectPaths (dec);
+      else
+         MinorCollectPaths (dec);
+   }
 
-   mts_copy = mts_fast = mts_slow = 0;
-   mts_newid = mts_newidNTOK = 0;
+#ifdef COLLECT_STATS
+   dec->stats.mtsCopy = dec->stats.mtsFast = dec->stats.mtsSlow = 0;
+   dec->stats.mtsNewId = dec->stats.mtsNewIdNTok = 0;
+#endif
 
    if (trace & T_BEST) {
       printf ("frame: %d beamLimit: %f\n", dec->frame, dec->beamLimit);
@@ -1202,8 +1214,9 @@ void ProcessFrame (DecoderInst *dec, Observation **obsBlock, int nObs,
          /*         printf ("BEST %p %f\n", inst->node, inst->best); */
       }
 #if 0
-   printf ("MTS_copy: %d MTS_fast: %d  MTS slow: %d ", mts_copy, mts_fast, mts_slow);
-   printf ("MTS_newid: %d MTS_newidNTOK: %d\n", mts_newid, mts_newidNTOK);
+   printf ("MTS_copy: %d MTS_fast: %d  MTS slow: %d ", 
+           dec->stats.mtsCopy, dec->stats.mtsFast, dec->stats.mtsSlow);
+   printf ("MTS_newid: %d MTS_newidNTOK: %d\n", dec->stats.mtsNewId, dec->stats.mtsNewIdNTok);
 #endif
       if (trace & T_TOKSTATS)
          printf ("Pass1: %d active nodes in layer %d\n", nActive, l);
@@ -1421,8 +1434,9 @@ void ProcessFrame (DecoderInst *dec, Observation **obsBlock, int nObs,
       } /* for inst */
 
 #if 0
-      printf ("MTS_copy: %d MTS_fast: %d  MTS slow: %d ", mts_copy, mts_fast, mts_slow);
-      printf ("MTS_newid: %d MTS_newidNTOK: %d\n", mts_newid, mts_newidNTOK);
+      printf ("MTS_copy: %d MTS_fast: %d  MTS slow: %d ", 
+              dec->stats.mtsCopy, dec->stats.mtsFast, dec->stats.mtsSlow);
+      printf ("MTS_newid: %d MTS_newidNTOK: %d\n", dec->stats.mtsNewId, dec->stats.mtsNewIdNTok);
       printf ("LMCacheLA:  %d hits  %d misses\n", 
               dec->lmCache->laHit, dec->lmCache->laMiss);
 #endif
@@ -1503,12 +1517,15 @@ void ProcessFrame (DecoderInst *dec, Observation **obsBlock, int nObs,
 #if 0
    printf ("cacheHits: %d  cacheMisses: %d\n", 
            dec->outPCache->cacheHit, dec->outPCache->cacheMiss);
-   printf ("MTS_copy: %d MTS_fast: %d  MTS slow: %d ", mts_copy, mts_fast, mts_slow);
-   printf ("MTS_newid: %d MTS_newidNTOK: %d\n", mts_newid, mts_newidNTOK);
+   printf ("MTS_copy: %d MTS_fast: %d  MTS slow: %d ", 
+           dec->stats.mtsCopy, dec->stats.mtsFast, dec->stats.mtsSlow);
+   printf ("MTS_newid: %d MTS_newidNTOK: %d\n", dec->stats.mtsNewId, dec->stats.mtsNewIdNTok);
    printf ("tokSetIDcount: %d\n", dec->tokSetIdCount);
-   printf ("PI_LR: %d  PI_GEN: %d\n", PI_LR, PI_GEN);
+   printf ("PI_LR: %d  PI_GEN: %d\n", dec->stats.piLR, dec->stats.piGen);
+#endif
+#ifdef COLLECT_STATS
+   dec->stats.piLR = dec->stats.piGen = 0;
 #endif
-   PI_LR = PI_GEN = 0;
    dec->outPCache->cacheHit = dec->outPCache->cacheMiss = 0;
 
 #if 0
@@ -1521,7 +1538,7 @@ void ProcessFrame (DecoderInst *dec, Observation **obsBlock, int nObs,
    dec->lmCache->laHit = dec->lmCache->laMiss = 0;
 
 #if 0
-   Debug_DumpNet (dec->net);
+   Debug_DumpNet (dec);
 #endif
 #if 0
    AccumulateStats (dec);
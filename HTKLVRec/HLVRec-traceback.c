@@ -114,27 +114,77 @@ TokenSet *BestTokSet (DecoderInst *dec)
    return (ts);
 }
 
+/* PathLabels
+
+     label list of the words on path back to (excluding) root, times and
+     scores relative to the end of root
+*/
+static LabList *PathLabels (MemHeap *heap, DecoderInst *dec, 
+                            WordendHyp *path, WordendHyp *root)
+{
+   LabList *ll;
+   LLink lab, nextlab;
+   WordendHyp *weHyp;
+   LogFloat prevScore, score;
+   Pron pron;
+   HTime start;
+
+   ll = CreateLabelList (heap, 0);
+
+   /* going backwards from </s> to <s> */
+   for (weHyp = path; weHyp && weHyp != root; weHyp = weHyp->prev) {
+      lab = CreateLabel (heap, ll->maxAuxLab);
+      pron = dec->net->pronlist[weHyp->pron];
+      if ((weHyp->user & 3) == 1)
+         pron = pron->next;             /* sp */
+      else if ((weHyp->user & 3) == 2)
+         pron = pron->next->next;       /* sil */
+
+      lab->labid = pron->outSym;
+      lab->score = weHyp->score;
+      lab->start = 0.0;
+      lab->end = weHyp->frame * dec->frameDur * 1.0e7;
+      lab->succ = ll->head->succ;
+      lab->pred = ll->head;
+      lab->succ->pred = lab->pred->succ = lab;
+   }
+
+   start = root ? root->frame * dec->frameDur * 1.0e7 : 0.0;
+   prevScore = root ? root->score : 0.0;
+   for (lab = ll->head->succ; lab != ll->tail; lab = lab->succ) {
+      lab->start = start;
+      start = lab->end;
+      score = lab->score - prevScore;
+      prevScore = lab->score;
+      lab->score = score;
+   }
+
+   for (lab = ll->head->succ; lab != ll->tail; lab = nextlab) {
+      nextlab = lab->succ;
+      if (!lab->labid)          /* delete words with [] outSym */
+         DeleteLabel (lab);
+   }
+
+   return ll;
+}
+
 /* TraceBack
 
      Finds best token in end state and returns path.
+     Words already returned by StreamTraceBack are not included.
 
 */
 Transcription *TraceBack(MemHeap *heap, DecoderInst *dec)
 {
    Transcription *trans;
    LabList *ll;
-   LLink lab, nextlab;
-   WordendHyp *weHyp;
    TokenSet *ts;
    RelToken *bestTok=NULL;
-   LogFloat prevScore, score;
    RelTokScore bestDelta;
-   Pron pron;
    int i;
-   HTime start;
 
-   if (dec->net->end->inst && dec->net->end->inst->ts->n > 0)
-      ts = dec->net->end->inst->ts;
+   if (LN_INST(dec, dec->net->end) && LN_INST(dec, dec->net->end)->ts->n > 0)
+      ts = LN_INST(dec, dec->net->end)->ts;
    else {
       HError (-7820, "no token survived to sent end!");
 
@@ -161,51 +211,198 @@ Transcription *TraceBack(MemHeap *heap, DecoderInst *dec)
       PrintTokSet (dec, ts);
 
    if (trace & T_TOP) {
-      printf ("best score %f\n", ts->score);
+      fprintf (MsgOut (), "best score %f\n", ts->score);
       PrintRelTok (dec, bestTok);
    }
 
    trans = CreateTranscription (heap);
-   ll = CreateLabelList (heap, 0);
 
    if(bestTok==NULL)
      HError(7820,"best token not found");
-   /* going backwards from </s> to <s> */
-   for (weHyp = bestTok->path; weHyp; weHyp = weHyp->prev) {
-      lab = CreateLabel (heap, ll->maxAuxLab);
-      pron = dec->net->pronlist[weHyp->pron];
-      if ((weHyp->user & 3) == 1)
-         pron = pron->next;             /* sp */
-      else if ((weHyp->user & 3) == 2)
-         pron = pron->next->next;       /* sil */
+   ll = PathLabels (heap, dec, bestTok->path, dec->streamRoot);
+   AddLabelList (ll, trans);
+   
+   return trans;
+}
 
-      lab->labid = pron->outSym;
-      lab->score = weHyp->score;
-      lab->start = 0.0;
-      lab->end = weHyp->frame * dec->frameDur * 1.0e7;
-      lab->succ = ll->head->succ;
-      lab->pred = ll->head;
-      lab->succ->pred = lab->pred->succ = lab;
+/* ------------------------ streaming traceback ----------------------- */
+
+/* StreamTraceBack lets a caller that feeds frames incrementally to
+   ProcessFrame collect the words of the utterance as soon as they are
+   stable.  A word is stable when it is a common predecessor of the
+   paths of all active tokens: no future frame can change it.  Only
+   predecessors of tok->path are considered since the latest word end
+   of a token may still be copied (sp/sil, UpdateWordEndHyp).
+
+   With maxLatency > 0 a word on the path of the best token that ended
+   more than maxLatency frames ago is output even if it is not stable
+   yet, and all tokens that do not share it are pruned.  This bounds
+   the output delay and, together with the cut below, the length of
+   the paths that have to be kept.
+
+   Words are output once: the last word output becomes dec->streamRoot
+   and later tracebacks stop there.  Unless lattices are generated
+   (alternatives may refer to older paths) the path is cut behind the
+   root so that the GC can free the history, including the model
+   level traceback of the root word itself (MODALIGN).
+*/
+
+/* CommonPath
+
+     latest WordendHyp shared by the (fixed part of the) paths of all
+     active tokens, NULL if none
+*/
+static WordendHyp *CommonPath (DecoderInst *dec)
+{
+   int i, j, l, N;
+   LexNodeInst *inst;
+   TokenSet *ts;
+   RelToken *tok;
+   WordendHyp *common, *a, *b;
+   Boolean first;
+
+   first = TRUE;
+   common = NULL;
+   for (l = 0; l < dec->nLayers; ++l) {
+      for (inst = dec->instsLayer[l]; inst; inst = inst->next) {
+         N = (inst->node->type == LN_MODEL) ? inst->node->data.hmm->numStates : 1;
+         for (i = 0, ts = inst->ts; i < N; ++i, ++ts) {
+            for (j = 0, tok = ts->relTok; j < ts->n; ++j, ++tok) {
+               b = tok->path ? tok->path->prev : NULL;
+               if (first) {
+                  common = b;
+                  first = FALSE;
+                  continue;
+               }
+               /* walk back the later of the two paths until they meet */
+               a = common;
+               while (a != b && a && b) {
+                  if (a->frame >= b->frame)
+                     a = a->prev;
+                  else
+                     b = b->prev;
+               }
+               common = (a == b) ? a : NULL;
+               if (!common || common == dec->streamRoot)
+                  return common;
+            }
+         }
+      }
    }
+   return common;
+}
 
-   start = 0.0;
-   prevScore = 0.0;
-   for (lab = ll->head->succ; lab != ll->tail; lab = lab->succ) {
-      lab->start = start;
-      start = lab->end;
-      score = lab->score - prevScore;
-      prevScore = lab->score;
-      lab->score = score;
+/* OnPath
+
+     does path lead back to we?
+*/
+static Boolean OnPath (WordendHyp *path, WordendHyp *we)
+{
+   for ( ; path && path->frame >= we->frame; path = path->prev)
+      if (path == we)
+         return TRUE;
+   return FALSE;
+}
+
+/* PruneOffPath
+
+     remove all tokens whose path does not lead back to we
+*/
+static void PruneOffPath (DecoderInst *dec, WordendHyp *we)
+{
+   int i, j, k, l, N;
+   LexNodeInst *inst;
+   TokenSet *ts;
+   RelToken *tok;
+   RelTokScore bestDelta;
+
+   for (l = 0; l < dec->nLayers; ++l) {
+      for (inst = dec->instsLayer[l]; inst; inst = inst->next) {
+         N = (inst->node->type == LN_MODEL) ? inst->node->data.hmm->numStates : 1;
+         inst->best = LZERO;
+         for (i = 0, ts = inst->ts; i < N; ++i, ++ts) {
+            if (ts->n == 0)
+               continue;
+            bestDelta = LZERO;
+            for (j = k = 0, tok = ts->relTok; j < ts->n; ++j, ++tok)
+               if (OnPath (tok->path, we)) {
+                  if (tok->delta > bestDelta)
+                     bestDelta = tok->delta;
+                  ts->relTok[k++] = *tok;
+               }
+            if (k == ts->n) {
+               if (ts->score > inst->best)
+                  inst->best = ts->score;
+               continue;
+            }
+            ts->n = k;
+            if (k == 0) {
+               ts->score = LZERO;
+               ts->id = 0;
+               continue;
+            }
+            /* renormalise to new best token */
+            for (j = 0, tok = ts->relTok; j < k; ++j, ++tok)
+               tok->delta -= bestDelta;
+            ts->score += bestDelta;
+            ts->id = ++dec->tokSetIdCount;
+            if (ts->score > inst->best)
+               inst->best = ts->score;
+         }
+      }
    }
+}
 
-   for (lab = ll->head->succ; lab != ll->tail; lab = nextlab) {
-      nextlab = lab->succ;
-      if (!lab->labid)          /* delete words with [] outSym */
-         DeleteLabel (lab);
+/* StreamTraceBack
+
+     return the words that became stable (or older than maxLatency
+     frames) since the last call, see above
+*/
+Transcription *StreamTraceBack (MemHeap *heap, DecoderInst *dec, int maxLatency)
+{
+   Transcription *trans;
+   LabList *ll;
+   TokenSet *ts;
+   RelToken *bestTok;
+   WordendHyp *stable, *we;
+   int i;
+
+   stable = CommonPath (dec);
+   if (stable == dec->streamRoot)
+      stable = NULL;
+
+   if (maxLatency > 0 && (ts = BestTokSet (dec)) != NULL) {
+      bestTok = NULL;
+      for (i = 0; i < ts->n; ++i)
+         if (!bestTok || ts->relTok[i].delta > bestTok->delta)
+            bestTok = &ts->relTok[i];
+      /* latest word on the best path that is older than maxLatency */
+      we = (bestTok && bestTok->path) ? bestTok->path->prev : NULL;
+      while (we && we != dec->streamRoot && we->frame > dec->frame - maxLatency)
+         we = we->prev;
+      if (we && we != dec->streamRoot && (!stable || we->frame > stable->frame)) {
+         if (trace & T_TOP)
+            printf ("StreamTraceBack: forcing word end at frame %d\n", we->frame);
+         PruneOffPath (dec, we);
+         stable = we;
+      }
    }
 
+   trans = CreateTranscription (heap);
+   if (stable) {
+      ll = PathLabels (heap, dec, stable, dec->streamRoot);
+      dec->streamRoot = stable;
+      if (!dec->latgen) {
+         stable->prev = NULL;
+#ifdef MODALIGN
+         stable->modpath = NULL;
+#endif
+      }
+   }
+   else
+      ll = CreateLabelList (heap, 0);
    AddLabelList (ll, trans);
-   
+
    return trans;
 }
 
@@ -390,14 +587,15 @@ Lattice *LatTraceBack (MemHeap *heap, DecoderInst *dec)
    Lattice *lat;
    int i, nnodes = 0, nlinks = 0;
    WordendHyp *sentEndWE;
+   LexNodeInst *endInst = LN_INST(dec, dec->net->end);
 
-   if (!dec->net->end->inst)
+   if (!endInst)
       HError (-7821, "LatTraceBack: end node not active");
    else
-      printf ("found %d tokens in end state\n", dec->net->end->inst->ts->n);
+      fprintf (MsgOut (), "found %d tokens in end state\n", endInst->ts->n);
 
-   if (buildLatSE && dec->net->end->inst && dec->net->end->inst->ts->n == 1)
-      sentEndWE = dec->net->end->inst->ts->relTok[0].path;
+   if (buildLatSE && endInst && endInst->ts->n == 1)
+      sentEndWE = endInst->ts->relTok[0].path;
    else {
       if (buildLatSE)
          HError (-7821, "no tokens in sentend -- falling back to BUILDLATSENTEND = F");
@@ -425,7 +623,7 @@ Lattice *LatTraceBack (MemHeap *heap, DecoderInst *dec)
    LatTraceBackCount (dec, sentEndWE, &nnodes, &nlinks);
 
    ++nnodes;    /* !NULL lattice start node */
-   printf ("nnodes %d nlinks %d\n", nnodes, nlinks);
+   fprintf (MsgOut (), "nnodes %d nlinks %d\n", nnodes, nlinks);
 
    /*# create lattice */
    lat = NewLattice (heap, nnodes, nlinks);
@@ -718,7 +916,7 @@ WordendHyp *AltPathList2Path (DecoderInst *dec, AltWordendHyp *alt, PronId pron)
      HError(7823,"failed to find best alternative word end");
 
    /* create full WordendHyp for best */
-   path = (WordendHyp *) New (&dec->weHypHeap, sizeof (WordendHyp));
+   path = NewWordendHyp (dec);
    path->prev = bestAlt->prev;
    path->pron = pron;
    path->frame = dec->frame;
@@ -738,7 +936,7 @@ WordendHyp *AltPathList2Path (DecoderInst *dec, AltWordendHyp *alt, PronId pron)
    }
    *pAlt = NULL;
 
-   printf ("found %d arcs\n", i);
+   fprintf (MsgOut (), "found %d arcs\n", i);
    return path;
 }
 
@@ -793,7 +991,7 @@ WordendHyp *BuildLattice (DecoderInst *dec)
                tok->path->modpath = tok->modpath;
                
                if (!silModend) {
-                  silModend = New (&dec->modendHypHeap, sizeof (ModendHyp));
+                  silModend = NewModendHyp (dec);
                   silModend->frame = dec->frame;
                   silModend->ln = ln;   /* dodgy, but we just need ln with 'sil' model... */
                   silModend->prev = NULL;
@@ -82,6 +82,7 @@ static Boolean buildLatSE = FALSE;/* build lat from single tok in SENTEND node *
 static Boolean forceLatOut = TRUE;/* always output lattice, even when no token survived */
 
 static int gcFreq = 100;          /* run Garbage Collection every gcFreq frames */
+static int gcMajorFreq = 10;      /* every gcMajorFreq-th GC is a full collection */
 
 static Boolean pde = FALSE;      /* partial distance elimination */
 
@@ -89,8 +90,12 @@ static Boolean useOldPrune = FALSE;     /* backward compatibility for max model
 static Boolean mergeTokOnly = TRUE;     /* if merge token set with pruning */
 static float maxLNBeamFlr = 0.8;        /* maximum percentile of glogal beam for max model pruning */
 static float dynBeamInc = 1.3;          /* dynamic beam increment for max model pruning */
+static int lmlaCacheSize = 64;          /* MBytes of shared LM lookahead cache, 0 = off */
 #define LAYER_SIL_NTOK_SCALE 6          /* SIL layer re-adjust token set size e.g. 6 */
 
+/* heap for instances of N state nodes, in SIL layer or not */
+#define INST_HEAP(dec,N,isSil) (&(dec)->instHeap[2 * ((N) - 1) + ((isSil) ? 1 : 0)])
+
 /* -------------------------- Global Variables --------------------- */
 
 RelToken startTok = {NULL, NULL, 0.0, 0.0, NULL};
@@ -100,7 +105,6 @@ Token debug_nullTok = {(void *) 7, LZERO, LZERO, NULL};
 #endif
 MemHeap recCHeap;                       /* CHEAP for small general allocation */
                                         /* avoid wherever possible! */
-static AdaptXForm *inXForm;
 
 /* --------------------------- Prototypes ---------------------- */
 
@@ -111,6 +115,11 @@ DecoderInst *CreateDecoderInst(HMMSet *hset, FSLM *lm, int nTok, Boolean latgen,
                                Boolean useHModel,
                                int outpBlocksize, Boolean doPhonePost,
                                Boolean modAlign);
+DecoderInst *CreateSharedDecoderInst (DecoderInst *dec0);
+static DecoderInst *NewDecoderInst (HMMSet *hset, FSLM *lm, StateInfo_lv *si,
+                                    GSIndex *gs, int nTok,
+                                    Boolean latgen, Boolean useHModel,
+                                    int outpBlocksize, Boolean modAlign);
 static Boolean CheckLRTransP (SMatrix transP);
 void InitDecoderInst (DecoderInst *dec, LexNet *net, HTime sampRate, LogFloat beamWidth, 
                       LogFloat relBeamWidth, LogFloat weBeamWidth, LogFloat zsBeamWidth,
@@ -118,7 +127,7 @@ void InitDecoderInst (DecoderInst *dec, LexNet *net, HTime sampRate, LogFloat be
                       LogFloat insPen, float acScale, float pronScale, float lmScale,
                       LogFloat fastlmlaBeam);
 void CleanDecoderInst (DecoderInst *dec);
-static TokenSet *NewTokSetArrayVar(DecoderInst *dec, int N, Boolean isSil);
+static TokenSet *InitTokSetArray (TokenSet *ts, RelToken *relTok, int N, int nRelTok);
 static LexNodeInst *ActivateNode (DecoderInst *dec, LexNode *ln);
 static void DeactivateNode (DecoderInst *dec, LexNode *ln);
 static void PruneTokSet (DecoderInst *dec, TokenSet *ts);
@@ -152,6 +161,9 @@ LMNodeCache* AllocLMNodeCache (LMCache *cache, int lmlaIdx);
 static LMTokScore LMCacheTransProb (DecoderInst *dec, FSLM *lm, 
                                     LMState src, PronId pronid, LMState *dest);
 LMTokScore LMLA_nocache (DecoderInst *dec, LMState lmState, int lmlaIdx);
+static LMLAStore *CreateLMLAStore (int sizeMB);
+static void BindLMLAStore (DecoderInst *dec);
+static void UnbindLMLAStore (DecoderInst *dec);
 static LMTokScore LMCacheLookaheadProb (DecoderInst *dec, LMState lmState, 
                                         int lmlaIdx, Boolean fastlmla);
 /* HLVRec-traceback.c */
@@ -191,6 +203,13 @@ static void SweepAltPaths (MemHeap *heap);
 static void SweepModPaths (MemHeap *heap);
 #endif
 static void GarbageCollectPaths (DecoderInst *dec);
+static void MinorCollectPaths (DecoderInst *dec);
+static void CreateNursery (PathNursery *ny, char *name);
+static void ResetNursery (PathNursery *ny);
+static WordendHyp *NewWordendHyp (DecoderInst *dec);
+#ifdef MODALIGN
+static ModendHyp *NewModendHyp (DecoderInst *dec);
+#endif
 
 
 /* HLVRec-outP.c */
@@ -205,7 +224,7 @@ void OutPBlock_Hybrid(StateInfo_lv *si, int n, int sIdx, float acScale, LogFloat
 
 /* HLVRec-misc.c */
 void CheckTokenSetOrder (DecoderInst *dec, TokenSet *ts);
-void Debug_DumpNet (LexNet *net);
+void Debug_DumpNet (DecoderInst *dec);
 void Debug_Check_Score (DecoderInst *dec);
 void InitPhonePost (DecoderInst *dec);
 void CalcPhonePost (DecoderInst *dec);
@@ -239,11 +258,13 @@ void InitLVRec(void)
       if (GetConfBool (cParm, nParm, "BUILDLATSENTEND",&b)) buildLatSE = b;
       if (GetConfBool (cParm, nParm, "FORCELATOUT",&b)) forceLatOut = b;
       if (GetConfInt (cParm, nParm,"GCFREQ", &i)) gcFreq = i;
+      if (GetConfInt (cParm, nParm,"GCMAJORFREQ", &i)) gcMajorFreq = i;
       if (GetConfBool (cParm, nParm, "PDE",&b)) pde = b;
       if (GetConfBool (cParm, nParm, "USEOLDPRUNE",&b)) useOldPrune = b;
       if (GetConfBool (cParm, nParm, "MERGETOKONLY",&b)) mergeTokOnly = b;
       if (GetConfFlt (cParm, nParm, "MAXLNBEAMFLR", &f)) maxLNBeamFlr = f;
       if (GetConfFlt (cParm, nParm, "DYNBEAMINC", &f)) dynBeamInc = f;
+      if (GetConfInt (cParm, nParm, "LMLACACHESIZE", &i)) lmlaCacheSize = i;
 
       if (useOldPrune) {
          mergeTokOnly = FALSE; maxLNBeamFlr = 0.0; dynBeamInc = 1.1;
@@ -267,13 +288,93 @@ void InitLVRec(void)
 
      Create a new instance of the decoding engine. All state information is stored
      here. 
-     #### Ideally instances should share other structures (i.e.
-          LexNets) this is not implemented, yet.
+     Further instances sharing the LexNet, LM and models can be created
+     with CreateSharedDecoderInst.
 */
 DecoderInst *CreateDecoderInst(HMMSet *hset, FSLM *lm, int nTok, Boolean latgen, 
                                Boolean useHModel,
                                int outpBlocksize, Boolean doPhonePost,
                                Boolean modAlign)
+{
+   DecoderInst *dec;
+   StateInfo_lv *si;
+   GSIndex *gs;
+
+   /* create compact State info. This can change number of shared states! */
+   /* #### this is ugly as we end up doing this twice, if we use adaptation! */
+   si = ConvertHSet (&gcheap, hset, useHModel);
+
+   /* Gaussian selection index, keyed on the sIdx assigned by ConvertHSet */
+   gs = useHModel ? NULL : CreateGSIndex (&gcheap, hset);
+
+   dec = NewDecoderInst (hset, lm, si, gs, nTok, latgen, useHModel, outpBlocksize, modAlign);
+
+   /* LM lookahead scores are only kept across utterances for n-gram LMs,
+      lattice LMs change with every utterance */
+   if (lmlaCacheSize > 0 && lm && lm->type == fslm_ngram)
+      dec->lmlaStore = CreateLMLAStore (lmlaCacheSize);
+
+   /* tag left-to-right models */
+   {
+      HMMScanState hss;
+
+      NewHMMScan(dec->hset,&hss);
+      do {
+         /* #### should check each tidX only once! */
+         /*     if (!IsSeenV(hss.hmm->transP)) { */
+         if (CheckLRTransP (hss.hmm->transP))
+            hss.hmm->tIdx *= -1;
+         /*            TouchV(hss.hmm->transP); */
+      }
+      while(GoNextHMM(&hss));
+      EndHMMScan(&hss);
+   
+   }
+
+   if (doPhonePost)
+      InitPhonePost (dec);
+   else
+      dec->nPhone = 0;
+
+   return dec;
+}
+
+/* CreateSharedDecoderInst
+
+     Create a further instance of the decoding engine with the settings
+     of dec0.  The HMMSet, LM, compact state info and Gaussian selection
+     index are shared with dec0 (and the LexNet is passed to
+     InitDecoderInst as usual), as is the LM lookahead store; all
+     search state is private, so the instances can decode different
+     utterances concurrently.  Phone posteriors are not supported.
+*/
+DecoderInst *CreateSharedDecoderInst (DecoderInst *dec0)
+{
+   DecoderInst *dec;
+   Boolean modAlign = FALSE;
+
+   if (dec0->nPhone > 0)
+      HError (7890, "CreateSharedDecoderInst: phone posteriors not supported");
+#ifdef MODALIGN
+   modAlign = dec0->modAlign;
+#endif
+   dec = NewDecoderInst (dec0->hset, dec0->lm, dec0->si, dec0->gsel.gs, dec0->nTok, dec0->latgen, 
+                         dec0->useHModel, dec0->outPCache->block, modAlign);
+   dec->lmlaStore = dec0->lmlaStore;
+   if (dec->lmlaStore)
+      dec->lmlaStore->shared = TRUE;
+   return dec;
+}
+
+/* NewDecoderInst
+
+     allocate an instance with its own heaps and caches for the given
+     (already converted) models
+*/
+static DecoderInst *NewDecoderInst (HMMSet *hset, FSLM *lm, StateInfo_lv *si,
+                                    GSIndex *gs, int nTok,
+                                    Boolean latgen, Boolean useHModel,
+                                    int outpBlocksize, Boolean modAlign)
 {
    DecoderInst *dec;
    int i, N, s;
@@ -284,51 +385,43 @@ DecoderInst *CreateDecoderInst(HMMSet *hset, FSLM *lm, int nTok, Boolean latgen,
    dec->lm = lm;
    dec->hset = hset;
    dec->useHModel = useHModel;
+   dec->inXForm = NULL;
    /*    dec->net = net; */
-
-   /* create compact State info. This can change number of shared states! */
-   /* #### this is ugly as we end up doing this twice, if we use adaptation! */
-   dec->si = ConvertHSet (&gcheap, hset, dec->useHModel);
+   dec->si = si;
+   ResetGSel (&dec->gsel, gs);
+   dec->lmlaStore = NULL;
+   dec->useLMLAStore = FALSE;
 
    CreateHeap (&dec->heap, "Decoder Instance heap", MSTAK, 1, 1.5, 10000, 100000);
 
-   CreateHeap (&dec->nodeInstanceHeap, "Decoder NodeInstance heap", 
-               MHEAP, sizeof (LexNodeInst), 1.5, 1000, 10000);
-
 
    dec->nTok = nTok;
    dec->latgen = latgen;
    dec->nLayers = 0;
    dec->instsLayer = NULL;
 
-   /* alloc & init Heaps for TokenSets */
+   /* alloc & init Heaps for LexNodeInsts; each element holds the
+      instance, its N TokenSets and their RelToken arrays in one block */
    N = MaxStatesInSet (dec->hset);
    dec->maxNStates = N;
 
-   dec->tokSetHeap = (MemHeap *) New (&dec->heap, N * sizeof (MemHeap));
-
-
-   /* #### make initial size of heap blocks smaller,
-      or don't alloc unneeded ones in the first place (scan HMMSet) */
-   for (i = 0; i < N; ++i) {
-   sprintf (buf, "Decoder %d TokenSet heap", i+1);
-      CreateHeap (&dec->tokSetHeap[i], buf, 
-                  MHEAP, (i+1) * sizeof (TokenSet), 9, 10, 5000);
-   }   
+   dec->instHeap = (MemHeap *) New (&dec->heap, 2 * N * sizeof (MemHeap));
+   for (i = 1; i <= N; ++i) {
+      for (s = 0; s < 2; ++s) {
+         sprintf (buf, "Decoder %d state %sNodeInstance heap", i, s ? "SIL " : "");
+         CreateHeap (INST_HEAP(dec, i, s), buf, MHEAP, sizeof (LexNodeInst) + 
+                     i * (sizeof (TokenSet) + (s ? LAYER_SIL_NTOK_SCALE : 1) * 
+                          dec->nTok * sizeof (RelToken)),
+                     1.5, 100, 2000);
+      }
+   }
 
    dec->tempTS = (TokenSet **) New (&dec->heap, (N+1) * sizeof (TokenSet *));
 
-
-   /* alloc Heap for RelToken arrays */
-   CreateHeap (&dec->relTokHeap, "Decoder RelToken array heap",
-               MHEAP, dec->nTok * sizeof (RelToken), 1, 1000, 5000);
-
-   CreateHeap (&dec->lrelTokHeap, "Decoder RelToken array heap",
-               MHEAP, LAYER_SIL_NTOK_SCALE * dec->nTok * sizeof (RelToken), 1, 1000, 5000);   
-   
    /* alloc heap for word end hyps */
    CreateHeap (&dec->weHypHeap, "WordendHyp heap", MHEAP, sizeof (WordendHyp), 
                1.0, 80000, 800000);
+   CreateNursery (&dec->weNursery, "WordendHyp nursery");
    if (dec->latgen) {
       CreateHeap (&dec->altweHypHeap, "AltWordendHyp heap", MHEAP, 
                   sizeof (AltWordendHyp), 1.0, 8000, 80000);
@@ -339,6 +432,7 @@ DecoderInst *CreateDecoderInst(HMMSet *hset, FSLM *lm, int nTok, Boolean latgen,
    if (dec->modAlign) {
       CreateHeap (&dec->modendHypHeap, "ModendHyp heap", MHEAP, 
                   sizeof (ModendHyp), 1.0, 80000, 800000);
+      CreateNursery (&dec->modNursery, "ModendHyp nursery");
    }
 #else
    if (modAlign)
@@ -364,27 +458,7 @@ DecoderInst *CreateDecoderInst(HMMSet *hset, FSLM *lm, int nTok, Boolean latgen,
    /*      printf ("i %d  C_G %lu\n", i, CACHE_FLAG_GET(dec,i)); */
 #endif 
 
-   /* tag left-to-right models */
-   {
-      HMMScanState hss;
-
-      NewHMMScan(dec->hset,&hss);
-      do {
-         /* #### should check each tidX only once! */
-         /*     if (!IsSeenV(hss.hmm->transP)) { */
-         if (CheckLRTransP (hss.hmm->transP))
-            hss.hmm->tIdx *= -1;
-         /*            TouchV(hss.hmm->transP); */
-      }
-      while(GoNextHMM(&hss));
-      EndHMMScan(&hss);
-   
-   }
-
-   if (doPhonePost)
-      InitPhonePost (dec);
-   else
-      dec->nPhone = 0;
+   dec->nPhone = 0;
 
    /* cz277 - ANN */
    /* set decodeKind */
@@ -455,7 +529,9 @@ void InitDecoderInst (DecoderInst *dec, LexNet *net, HTime sampRate, LogFloat be
                       LogFloat insPen, float acScale, float pronScale, float lmScale,
                       LogFloat fastlmlaBeam)
 {       
-   int i;
+   int i, nRelTok;
+   LexNodeInst *inst;
+   TokenSet *ts;
 
    dec->net = net;
 
@@ -466,24 +542,26 @@ void InitDecoderInst (DecoderInst *dec, LexNet *net, HTime sampRate, LogFloat be
    /* alloc InstsLayer start pointers */
    dec->nLayers = net->nLayers;
    dec->instsLayer = (LexNodeInst **) New (&dec->heap, net->nLayers * sizeof (LexNodeInst *));
+   dec->nodeInst = (LexNodeInst **) New (&dec->heap, net->nNodes * sizeof (LexNodeInst *));
 
    /* reset inst (i.e. reset pruning, etc.)
       purge all heaps
    */
 
-   ResetHeap (&dec->nodeInstanceHeap);
    ResetHeap (&dec->weHypHeap);
+   ResetNursery (&dec->weNursery);
    if (dec->latgen)
       ResetHeap (&dec->altweHypHeap);
 #ifdef MODALIGN
-   if (dec->modAlign)
+   if (dec->modAlign) {
       ResetHeap (&dec->modendHypHeap);
+      ResetNursery (&dec->modNursery);
+   }
 #endif
-   ResetHeap (&dec->nodeInstanceHeap);
-   for (i = 0; i < dec->maxNStates; ++i) 
-      ResetHeap (&dec->tokSetHeap[i]);
-   ResetHeap (&dec->relTokHeap);
-   ResetHeap (&dec->lrelTokHeap);
+   for (i = 0; i < 2 * dec->maxNStates; ++i) 
+      ResetHeap (&dec->instHeap[i]);
+   dec->nGC = 0;
+   dec->streamRoot = NULL;
 
    if (trace & T_MEM) {
       printf ("memory stats at start of recognition\n");
@@ -524,8 +602,11 @@ void InitDecoderInst (DecoderInst *dec, LexNet *net, HTime sampRate, LogFloat be
    
 
    /* alloc temp tokenset arrays for use in PropagateInternal */
-   for (i=1; i <= dec->maxNStates; ++i) 
-      dec->tempTS[i] = NewTokSetArrayVar (dec, i, TRUE);
+   for (i=1; i <= dec->maxNStates; ++i) {
+      nRelTok = LAYER_SIL_NTOK_SCALE * dec->nTok;
+      ts = (TokenSet *) New (&dec->heap, i * (sizeof (TokenSet) + nRelTok * sizeof (RelToken)));
+      dec->tempTS[i] = InitTokSetArray (ts, (RelToken *) (ts + i), i, nRelTok);
+   }
 
    /* alloc winTok array for MergeTokSet */
    dec->winTok = (RelToken *) New (&dec->heap, LAYER_SIL_NTOK_SCALE * dec->nTok * sizeof (RelToken));
@@ -537,17 +618,17 @@ void InitDecoderInst (DecoderInst *dec, LexNet *net, HTime sampRate, LogFloat be
 
    /* deactivate all nodes */
    for (i = 0; i < dec->net->nNodes; ++i) {
-      dec->net->node[i].inst = NULL;
+      dec->nodeInst[i] = NULL;
 #ifdef COLLECT_STATS_ACTIVATION
       dec->net->node[i].eventT = -1;
 #endif
    }
 
-   ActivateNode (dec, dec->net->start);
-   dec->net->start->inst->ts[0].n = 1;
-   dec->net->start->inst->ts[0].score = 0.0;
-   dec->net->start->inst->ts[0].relTok[0] = startTok;
-   dec->net->start->inst->ts[0].relTok[0].lmState = LMInitial (dec->lm);
+   inst = ActivateNode (dec, dec->net->start);
+   inst->ts[0].n = 1;
+   inst->ts[0].score = 0.0;
+   inst->ts[0].relTok[0] = startTok;
+   inst->ts[0].relTok[0].lmState = LMInitial (dec->lm);
 
 #ifdef COLLECT_STATS
    dec->stats.nTokSet = 0;
@@ -571,6 +652,7 @@ void InitDecoderInst (DecoderInst *dec, LexNet *net, HTime sampRate, LogFloat be
 
    /* LM lookahead cache */
    dec->lmCache = CreateLMCache (dec, &dec->heap);
+   BindLMLAStore (dec);
 
    /* invalidate OutP cache */
    ResetOutPCache (dec->outPCache);
@@ -578,28 +660,25 @@ void InitDecoderInst (DecoderInst *dec, LexNet *net, HTime sampRate, LogFloat be
 
 void CleanDecoderInst (DecoderInst *dec)
 {
+   UnbindLMLAStore (dec);
    FreeLMCache (dec->lmCache);
 }
 
 
-/* NewTokSetArrayVar:
+/* InitTokSetArray:
 
-   allocating rel token array for lex node, larger array size
-   for silence layer nodes
+   clear N token sets and attach RelToken arrays of nRelTok elements
+   taken from relTok
 */
-static TokenSet *NewTokSetArrayVar(DecoderInst *dec, int N, Boolean isSil)
+static TokenSet *InitTokSetArray (TokenSet *ts, RelToken *relTok, int N, int nRelTok)
 {
-   TokenSet *ts;
    int i;
 
-   ts= (TokenSet *) New (&dec->tokSetHeap[N-1], N * sizeof (TokenSet));
-
-   /* clear token set */
    for (i = 0; i < N; ++i) {
       ts[i].score = 0.0;
       ts[i].n = 0;
       ts[i].id = 0;             /* id=0 means empty TokSet */
-      ts[i].relTok = (isSil) ? (RelToken *) New (&dec->lrelTokHeap, LAYER_SIL_NTOK_SCALE * dec->nTok * sizeof (RelToken)) : (RelToken *) New (&dec->relTokHeap, dec->nTok * sizeof (RelToken));
+      ts[i].relTok = relTok + i * nRelTok;
    }
    return ts;
 }
@@ -614,7 +693,7 @@ static LexNodeInst *ActivateNode (DecoderInst *dec, LexNode *ln)
 {
    LexNodeInst *inst;
    int N;               /* number of states in HMM for this node */
-   int l;
+   int l, nRelTok;
 
 #ifdef COLLECT_STATS
    ++dec->stats.nActivate;
@@ -630,12 +709,7 @@ static LexNodeInst *ActivateNode (DecoderInst *dec, LexNode *ln)
    ln->eventT = dec->frame;
 #endif
 
-   assert (!ln->inst);
-
-   inst = (LexNodeInst *) New (&dec->nodeInstanceHeap, 0);
-
-   inst->node = ln;
-   ln->inst = inst;
+   assert (!LN_INST(dec, ln));
 
    switch (ln->type) {
    case LN_MODEL:
@@ -650,11 +724,6 @@ static LexNodeInst *ActivateNode (DecoderInst *dec, LexNode *ln)
       break;
    }
 
-   /* alloc N tokensets */
-/*    inst->ts = NewTokSetArray (dec, N);          /\*  size is  N * sizeof (TokenSet) *\/ */
-
-   inst->best = LZERO;
-
    /* add new instance to list of active nodes in the right place */
    /* find right layer */
    l = dec->nLayers-1;
@@ -662,7 +731,15 @@ static LexNodeInst *ActivateNode (DecoderInst *dec, LexNode *ln)
       --l;
       assert (l >= 0);
    }
-   inst->ts = NewTokSetArrayVar (dec, N, (l == LAYER_SIL));          /*  size is  N * sizeof (TokenSet) */
+
+   /* instance, N tokensets and their RelTokens come in one block */
+   nRelTok = ((l == LAYER_SIL) ? LAYER_SIL_NTOK_SCALE : 1) * dec->nTok;
+   inst = (LexNodeInst *) New (INST_HEAP(dec, N, l == LAYER_SIL), 0);
+   inst->ts = InitTokSetArray ((TokenSet *) (inst + 1), 
+                               (RelToken *) ((TokenSet *) (inst + 1) + N), N, nRelTok);
+   inst->node = ln;
+   inst->best = LZERO;
+   LN_INST(dec, ln) = inst;
 #ifdef DEBUG_TRACE
    if (trace & T_ACTIV)
       printf ("allocating %d tokens in array for node in layer %d\n", ((l == LAYER_SIL) ? LAYER_SIL_NTOK_SCALE : 1) * dec->nTok, l);
@@ -682,7 +759,8 @@ static LexNodeInst *ActivateNode (DecoderInst *dec, LexNode *ln)
 
 static void DeactivateNode (DecoderInst *dec, LexNode *ln)
 {
-   int N, i, l;
+   int N, l;
+   LexNodeInst *inst = LN_INST(dec, ln);
 
 #ifdef COLLECT_STATS
    ++dec->stats.nDeActivate;
@@ -698,7 +776,7 @@ static void DeactivateNode (DecoderInst *dec, LexNode *ln)
    ln->eventT = dec->frame;
 #endif
 
-   assert (ln->inst);
+   assert (inst);
    
    switch (ln->type) {
    case LN_MODEL:
@@ -720,16 +798,10 @@ static void DeactivateNode (DecoderInst *dec, LexNode *ln)
       --l;
       assert (l >= 0);
    }
-   for (i = 0; i < N; ++i) {
-      if (l == LAYER_SIL) Dispose (&dec->lrelTokHeap, ln->inst->ts[i].relTok);
-      else Dispose (&dec->relTokHeap, ln->inst->ts[i].relTok);
-   }
-
-   Dispose (&dec->tokSetHeap[N-1], ln->inst->ts);
-   Dispose (&dec->nodeInstanceHeap, ln->inst);
+   Dispose (INST_HEAP(dec, N, l == LAYER_SIL), inst);
 #endif
 
-   ln->inst = NULL;
+   LN_INST(dec, ln) = NULL;
 }
 
 
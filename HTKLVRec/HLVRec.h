@@ -50,6 +50,9 @@ extern "C" {
 #include "HLVNet.h"     /* for LexNet */
 #include "HLVLM.h"      /* for LMState */
 #include "HLVModel.h"
+#include "HGSel.h"      /* for GSSel */
+
+#include <pthread.h>
 
 
 typedef struct _Token Token;            /* Info about partial hypothesis */
@@ -135,6 +138,24 @@ struct _AltWordendHyp {         /* stores info about N-best word(end) for lattic
   #define TOK_LMSTATE_GT(t1,t2)   ((t1)->lmState >  (t2)->lmState)
 #endif
 
+#define NURSERY_CHUNK 4096
+
+typedef struct _NurseryChunk NurseryChunk;
+struct _NurseryChunk {
+   NurseryChunk *next;
+   int n;                       /* items used in this chunk */
+   Ptr item[NURSERY_CHUNK];
+};
+
+typedef struct _PathNursery PathNursery;  /* traceback records allocated since the last
+                                             garbage collection (see HLVRec-GC.c) */
+struct _PathNursery {
+   MemHeap chunkHeap;           /* chunks are kept and reused after a GC */
+   NurseryChunk *head;
+   NurseryChunk *tail;          /* chunk receiving new items */
+   int n;                       /* total number of items */
+};
+
 typedef struct _TokenSet TokenSet;      /* contains n tokens with different LM states */
 
 struct _TokenSet {
@@ -146,7 +167,9 @@ struct _TokenSet {
    
 struct _LexNodeInst {           /* attached to active LexNode's, contains info about tokens */
    LexNode *node;
-   TokenSet *ts;                /* array of TokenSets; one per state (incl. entry and exit) */
+   TokenSet *ts;                /* array of TokenSets; one per state (incl. entry and exit),
+                                   stored directly after the LexNodeInst, followed by
+                                   the RelToken arrays */
    TokScore best;               /* score of best token in any HMM state and LM state,
                                    used for pruning */
    LexNodeInst *next;           /* next instance in linked linst for this layer */
@@ -168,6 +191,9 @@ struct _Stats {
    unsigned long nFrames;
    unsigned long nLMlaCacheHit;
    unsigned long nLMlaCacheMiss;
+   int mtsCopy, mtsFast, mtsSlow;    /* MergeTokSet cases in current frame */
+   int mtsNewId, mtsNewIdNTok;       /* new TokenSet ids in current frame */
+   int piLR, piGen;                  /* PropagateInternal cases in current frame */
 #ifdef COLLECT_STATS_ACTIVATION
    unsigned long lnDeadT[STATS_MAXT+1];
    unsigned long lnLiveT[STATS_MAXT+1];
@@ -287,6 +313,44 @@ struct _LMCache {
 
 
 
+/* LMLAStore -- LM lookahead scores shared by all decoder instances that
+   use the same LexNet and n-gram LM, kept across utterances. It backs the
+   per instance LMCache: set associative with LMLA_WAYS entries per set and
+   clock replacement within a set, sets are locked in LMLA_NLOCK stripes. */
+#define LMLA_WAYS 4
+#define LMLA_NLOCK 64
+
+typedef struct _LMLAEntry {
+   LMState src;
+   int idx;                     /* lmlaIdx + 1, 0 for empty entries */
+   LMTokScore prob;             /* scaled lookahead score */
+} LMLAEntry;
+
+typedef struct _LMLASet {
+   LMLAEntry e[LMLA_WAYS];
+   unsigned char ref[LMLA_WAYS];        /* clock reference bits */
+   unsigned char hand;                  /* next victim */
+} LMLASet;
+
+typedef struct _LMLALock {
+   pthread_mutex_t m;
+   unsigned long hit, miss;     /* lookups in the sets of this stripe */
+   unsigned long evict, used;   /* replaced and occupied entries */
+} LMLALock;
+
+typedef struct _LMLAStore {
+   LexNet *net;                 /* scores are valid for this net, */
+   FSLM *lm;                    /* LM */
+   float lmScale;               /* and LM scale only */
+   Boolean shared;              /* used by more than one instance: lock */
+   unsigned long nSet;          /* number of sets (power of 2) */
+   LMLASet *set;
+   LMLALock lock[LMLA_NLOCK];
+   pthread_mutex_t bindLock;    /* serialises BindLMLAStore */
+   int users;                   /* instances bound for the current utt */
+} LMLAStore;
+
+
 /**** decoder instance */
 
 /* cz277 - ANN */
@@ -295,8 +359,9 @@ typedef enum _DecodeKind DecodeKind;
 
 typedef struct _DecoderInst DecoderInst;  /* contains all state information about one instance
                                              of the decoder 
-                                             the aim is to share as much info as possible across
-                                             instances (i.e. the LexNet), but this is tough... */
+                                             the LexNet, LM, HMMSet and StateInfo_lv are only
+                                             read, so several instances can share them (see
+                                             CreateSharedDecoderInst) */
 
 struct _DecoderInst {
    LexNet *net;                 /* network, contains pointers to Vocab and HMMSet */
@@ -308,12 +373,14 @@ struct _DecoderInst {
    FSLM *lm;
 
    MemHeap heap;                /* MSTACK for general allocation */
-   MemHeap nodeInstanceHeap;    /* MHEAP for LexNodeInsts */
+   MemHeap *instHeap;           /* MHEAPs for LexNodeInsts with their TokenSet and
+                                   RelToken arrays, see INST_HEAP */
    MemHeap weHypHeap;           /* MHEAP for word end hyps */
    MemHeap altweHypHeap;        /* MHEAP for alt word end hyps (for latgen) */
-   MemHeap *tokSetHeap;         /* MHEAPs for N TokenSet arrays */
-   MemHeap relTokHeap;          /* MHEAP for RelToken arrays (dec->nTok-1 elements) */
-   MemHeap lrelTokHeap;         /* MHEAP for larger size RelToken arrays (e.g. 6 * dec->nTok-1 elements) */
+   PathNursery weNursery;       /* word end hyps allocated since last GC */
+   int nGC;                     /* number of GCs in this utterance */
+   WordendHyp *streamRoot;      /* last word end output by StreamTraceBack,
+                                   tracebacks stop here; NULL if none */
 
    TokenSet **tempTS;           /* temp tokset arrays for PropagateInternal() */
    RelToken *winTok;            /* RelTok array fro MergeTokSet() */
@@ -322,6 +389,8 @@ struct _DecoderInst {
    int nLayers;                 /* nuber of node layers */
    LexNodeInst **instsLayer;    /* array of pointers to the linked list of 
                                    active LexNodeInsts in each layer */
+   LexNodeInst **nodeInst;      /* [0..net->nNodes-1] instance of each LexNode,
+                                   NULL if inactive (see LN_INST) */
    char *utterFN;               /* name of current utterance */
    Observation *obs;            /* Observation for current frame */
    Observation *obsBlock[MAXBLOCKOBS]; /* block of current and future Observations */
@@ -356,20 +425,25 @@ struct _DecoderInst {
    LogFloat fastlmlaBeam;       /* beam in which to use full lmla */
    
    Boolean useHModel;           /* use normal HModel OutP() functions? */
+   AdaptXForm *inXForm;         /* input transform for HModel OutP() */
    /*    outP cache */
    OutPCache *outPCache;        /* cache of outP values for block of observations */
 
    /* LM lookahead cache */
    LMCache *lmCache;
+   LMLAStore *lmlaStore;        /* shared persistent cache or NULL */
+   Boolean useLMLAStore;        /* lmlaStore valid for this utterance */
 
    /* relToken set identifier */
    unsigned int tokSetIdCount;/* max id used so far for token sets */
 
    StateInfo_lv *si;
+   GSSel gsel;                  /* Gaussian selection for the current block */
 
 #ifdef MODALIGN
    Boolean modAlign;
    MemHeap modendHypHeap;       /* MHEAP for word end hyps */
+   PathNursery modNursery;      /* model end hyps allocated since last GC */
 #endif
 
 #ifdef COLLECT_STATS
@@ -389,6 +463,9 @@ struct _DecoderInst {
 };
 
 
+/* instance of LexNode ln in decoder dec, NULL if ln is inactive */
+#define LN_INST(dec,ln) ((dec)->nodeInst[(ln) - (dec)->net->node])
+
 /*
 #define TOK_TOTSCORE(t) ((t)->score + (t)->lmscore)
 #define TOK_LMSCORE(t) ((t)->lmscore)
@@ -400,6 +477,7 @@ DecoderInst *CreateDecoderInst(HMMSet *hset, FSLM *lm, int nTok, Boolean latgen,
                                Boolean useHModel,
                                int outpBlocksize, Boolean doPhonePost,
                                Boolean modAlign);
+DecoderInst *CreateSharedDecoderInst (DecoderInst *dec0);
 void InitDecoderInst (DecoderInst *dec, LexNet *net, HTime sampRate, LogFloat beamWidth, 
                       LogFloat relBeamWidth, LogFloat weBeamWidth, LogFloat zsBeamWidth,
                       int maxModel,
@@ -407,11 +485,13 @@ void InitDecoderInst (DecoderInst *dec, LexNet *net, HTime sampRate, LogFloat be
                       LogFloat fastlmlaBeam);
 
 void CleanDecoderInst (DecoderInst *dec);
+void PrintLMLAStats (FILE *f, DecoderInst *dec);
 
 /* cz277 - ANN */
 void ProcessFrame (DecoderInst *dec, Observation **obsBlock, int nObs, AdaptXForm *xform, int cacheVecIdx);
 
 Transcription *TraceBack (MemHeap *heap, DecoderInst *dec);
+Transcription *StreamTraceBack (MemHeap *heap, DecoderInst *dec, int maxLatency);
 Lattice *LatTraceBack (MemHeap *heap, DecoderInst *dec);
 
 void ReFormatTranscription(Transcription *trans,HTime frameDur,
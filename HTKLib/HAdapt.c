@@ -104,16 +104,25 @@ typedef struct _ObsCache{
 typedef struct _AccCache{
    int     baseclass;
    DVector bVector;
-   TriMat  *bTriMat;
+   Vector  obsVec;                /* parent xform observation for this frame */
+   Boolean cached;                /* obsVec set for the current frame */
    struct _AccCache *next;
 } AccCache;                       /* acc cache to save accumulators related to parent XForm */  
 
+typedef struct {
+   int nFrame;                    /* number of frames held */
+   IntVec blockSize;              /* xform block sizes */
+   float *obs;                    /* [(k-1)*accFrameBlock+t] observations */
+   double *wt;                    /* [(i-1)*accFrameBlock+t] weights for row i */
+   double *prod;                  /* [t] outer product element for each frame */
+} FrameBlock;                     /* frames buffered for a baseclass G update */
+
 typedef struct {
    float occ;
    Vector spSum;
    Vector spSumSq;
    TriMat *bTriMat;
-   TriMat *bDiagMat;
+   FrameBlock *fBlock;
    DVector bVector;
    Vector  obsVec;
 } RegAcc;
@@ -201,6 +210,7 @@ static double maxXFormIter = 10; /* something big, for CMLLR */
 static ObsCache *headpoc = NULL; 
 static ObsCache *headboc = NULL; 
 static AccCache *headac = NULL;
+static int accFrameBlock = 32;   /* frames buffered per baseclass G update */
 
 /* new variables to support semi-tied transforms */
 static float semiTiedFloorScale = 0.1;
@@ -371,6 +381,7 @@ void InitAdapt()
       if (GetConfInt(cParm,nParm,"MAXXFORMITER",&i)) maxXFormIter = i;
       if (GetConfBool(cParm,nParm,"MLLRDIAGCOV",&b)) mllrDiagCov = b;      
       if (GetConfBool(cParm,nParm,"SWAPXFORMS",&b)) swapXForms = b;      
+      if (GetConfInt(cParm,nParm,"ACCFRAMEBLOCK",&i)) accFrameBlock = i;
       if (GetConfBool(cParm,nParm,"MLLRCOV2CMLLR",&b)) mllrCov2CMLLR = b; 
 
       if (GetConfFlt(cParm,nParm,"SEMITIEDFLOOR",&d)) semiTiedFloorScale = (float) d;
@@ -417,6 +428,8 @@ void InitAdapt()
       if (GetConfStr (cParm,nParm,"CMLLRADAPTKIND",buf))
          cmllrAdaptKind = Str2AdaptKind(buf);
    }
+   if (accFrameBlock<1)
+      HError(999,"InitAdapt: ACCFRAMEBLOCK must be positive");
 
    /* cz277 - xform */
    /* Initialise the XFInfo values */
@@ -976,31 +989,6 @@ static void ResetComp(MixPDF *mp)
    } 
 }
 
-static TriMat *CreateBlockTriMat(MemHeap *x, IntVec blockSize)
-{
-  TriMat *tm;
-  int nblock, bsize, b, *i;
-  
-  nblock = IntVecSize(blockSize);
-  tm = (TriMat *)New(x,sizeof(TriMat)*(nblock+1));  
-  i = (int *)tm; *i = nblock;
-  for (b=1;b<=nblock;b++) {
-    bsize = blockSize[b];
-    tm[b] = CreateTriMat(x, bsize); 
-    ZeroTriMat(tm[b]);
-  }
-  return(tm);
-}
-
-static void ZeroBlockTriMat(TriMat *bTriMat)
-{
-  int *nblock,b;
-
-  nblock = (int *)bTriMat;
-  for (b=1; b<=*nblock; b++)
-      ZeroTriMat(bTriMat[b]);  
-}
-
 static void ZeroBaseTriMat(TriMat *bTriMat)
 {
   int i;
@@ -1014,6 +1002,73 @@ static void ZeroBaseTriMat(TriMat *bTriMat)
   }  
 }
 
+/* CreateFrameBlock: create a buffer of accFrameBlock frames for a 
+   baseclass with given block structure */
+static FrameBlock *CreateFrameBlock(MemHeap *x, IntVec blockSize, int vsize)
+{
+  FrameBlock *fb;
+
+  fb = (FrameBlock *)New(x,sizeof(FrameBlock));
+  fb->nFrame = 0;
+  fb->blockSize = blockSize;
+  fb->obs = (float *)New(x,vsize*accFrameBlock*sizeof(float));
+  fb->wt = (double *)New(x,vsize*accFrameBlock*sizeof(double));
+  fb->prod = (double *)New(x,accFrameBlock*sizeof(double));
+  return(fb);
+}
+
+/* FlushFrameBlock: add the buffered frames into the baseclass 
+   accumulators, bTriMat[i][j][k] += sum_t wt[i][t]*obs[j][t]*obs[k][t].
+   Each outer product element is formed once for all frames and then
+   applied to every row of its block as a dot product over the frames. */
+static void FlushFrameBlock(FrameBlock *fb, TriMat *bTriMat)
+{
+  int i,j,k,t,b,bsize,cnt;
+  int nt = fb->nFrame, stride = accFrameBlock;
+  float *oj,*ok;
+  double *w,*prod = fb->prod;
+  double s0,s1,s2,s3;
+
+  if (nt == 0) return;
+  for (b=1,cnt=0;b<=IntVecSize(fb->blockSize);b++) {
+    bsize = fb->blockSize[b];
+    for (j=1;j<=bsize;j++) {
+      oj = fb->obs+(cnt+j-1)*stride;
+      for (k=1;k<=j;k++) {
+        ok = fb->obs+(cnt+k-1)*stride;
+        for (t=0;t<nt;t++) 
+          prod[t] = (float)(oj[t]*ok[t]);
+        for (i=1;i<=bsize;i++) {
+          w = fb->wt+(cnt+i-1)*stride;
+          s0 = s1 = s2 = s3 = 0.0;
+          for (t=0;t+4<=nt;t+=4) {
+            s0 += w[t]*prod[t];     s1 += w[t+1]*prod[t+1];
+            s2 += w[t+2]*prod[t+2]; s3 += w[t+3]*prod[t+3];
+          }
+          for (;t<nt;t++) s0 += w[t]*prod[t];
+          bTriMat[cnt+i][j][k] += (s0+s1)+(s2+s3);
+        }
+      }
+    }
+    cnt += bsize;
+  }
+  fb->nFrame = 0;
+}
+
+/* PushFrameBlock: buffer observation obs with weights wt, flushing
+   into bTriMat when the buffer is full */
+static void PushFrameBlock(FrameBlock *fb, TriMat *bTriMat, Vector obs, DVector wt)
+{
+  int i, vsize = VectorSize(obs), t = fb->nFrame;
+
+  for (i=1;i<=vsize;i++) {
+    fb->obs[(i-1)*accFrameBlock+t] = obs[i];
+    fb->wt[(i-1)*accFrameBlock+t] = wt[i];
+  }
+  if (++fb->nFrame == accFrameBlock)
+    FlushFrameBlock(fb,bTriMat);
+}
+
 static void CreateBaseTriMat(MemHeap *x, MixPDF *mp, AdaptXForm *xform, int class)
 {
   TriMat *tm;
@@ -1031,7 +1086,7 @@ static void CreateBaseTriMat(MemHeap *x, MixPDF *mp, AdaptXForm *xform, int clas
     ZeroDVector(regAcc->bVector);
     regAcc->obsVec =  CreateVector(x,vsize);
     ZeroVector(regAcc->obsVec);
-    regAcc->bDiagMat = CreateBlockTriMat(x,blockSize); 
+    regAcc->fBlock = CreateFrameBlock(x,blockSize,vsize); 
     tm = (TriMat *)New(x,sizeof(TriMat)*(vsize+1));
     vsp = (int *)tm; *vsp = vsize;
     for (b=1,cntj=1;b<=IntVecSize(blockSize);b++) {
@@ -1051,7 +1106,7 @@ static void CreateBaseTriMat(MemHeap *x, MixPDF *mp, AdaptXForm *xform, int clas
       if( me != mp ) {
         ra = GetRegAcc(me);
         ra->bVector = regAcc->bVector;
-        ra->bDiagMat = regAcc->bDiagMat;
+        ra->fBlock = regAcc->fBlock;
         ra->bTriMat = regAcc->bTriMat;
         ra->obsVec = regAcc->obsVec;
       }
@@ -1068,26 +1123,15 @@ void SetBaseAccsTime(int t)
 void UpdateAccCache(double Lr, Vector svec, MixPDF *mp)
 {
    AccCache *paac;
-   TriMat m;
    int vsize = VectorSize(svec);
    Vector covar;
-   int i, j, bl, bstart, bsize;
-   unsigned long int nblock;
+   int i;
 
    paac = GetPAAccCache(mp);    
    if ( paac != NULL ) {
-      /* This needs to be altered so that it does not rely on a non-zero first element */
-      if ( paac->bTriMat[1][1][1] == 0 ) {
-	nblock = (unsigned long int)(paac->bTriMat[0]);
-	for (bl=1,bstart=0;bl<=nblock;bl++) {
-	  m = paac->bTriMat[bl];
-	  bsize = TriMatSize(m);
-	  for (i=1;i<=bsize;i++) { /* Fill the accumulate stores */
-	    for (j=1; j<=i; j++)
-		m[i][j] = svec[i+bstart] * svec[j+bstart];
-	  }
-	  bstart += bsize;
-	}
+      if ( !paac->cached ) {
+         CopyVector(svec,paac->obsVec);
+         paac->cached = TRUE;
       }
       covar = mp->cov.var;
       for (i=1;i<=vsize;i++) {
@@ -1099,15 +1143,12 @@ void UpdateAccCache(double Lr, Vector svec, MixPDF *mp)
    }
 }
 
+/* UpdateBaseAccs: buffer the weighted observation of the previous 
+   frame for each baseclass, svec is NULL at the end of the data */
 void UpdateBaseAccs(Vector svec)
 {
-   int i,j,b,k, bsize, bl;
-   unsigned long int nblock;
-   int cnt, cnti, cntj;
-   TriMat tm, m;
+   int i,b;
    RegAcc *ra;
-   DVector acc;
-   Vector ovec;
    BaseClass *bclass;
    MixPDF *mp;
    
@@ -1116,32 +1157,7 @@ void UpdateBaseAccs(Vector svec)
       mp = ((MixtureElem *)(bclass->ilist[b])->item)->mpdf;
       ra = GetRegAcc(mp);
       if ((ra->bTriMat != NULL) && (ra->bVector[1]>0)) {    
-         acc = ra->bVector;
-         nblock = (unsigned long int)(ra->bDiagMat[0]);
-
-         /* generate the outer-product */
-         /* moved to here for speed with large numbers of baseclasses */
-         ovec = ra->obsVec;
-         for (bl=1, cnt=1; bl<=nblock;bl++){
-            bsize = TriMatSize(ra->bDiagMat[bl]);
-            m = ra->bDiagMat[bl];
-            for (i=1, cnti=cnt; i<=bsize; i++,cnti++) { /* Fill the outer product */
-               for (j=1,cntj=cnt; j<=i; j++,cntj++)
-                  m[i][j] = ovec[cnti]*ovec[cntj];
-            }
-            cnt +=bsize;
-         }
-
-    for (bl=1,cnti=1;bl<=nblock;bl++) {
-      m = ra->bDiagMat[bl];
-      bsize = TriMatSize(m);
-      for (i=1;i<=bsize;i++,cnti++) { /* Fill the accumulate stores */
-        tm = ra->bTriMat[cnti];
-        for (j=1; j<=bsize; j++)
-          for (k=1; k<=j; k++)
-            tm[j][k] += m[j][k] * acc[cnti];
-      }
-         }
+         PushFrameBlock(ra->fBlock,ra->bTriMat,ra->obsVec,ra->bVector);
          ZeroDVector(ra->bVector);
       }
       /* now update the observation cache */
@@ -1155,12 +1171,8 @@ void UpdateBaseAccs(Vector svec)
 
 void UpdateBaseAccsWithPaac(void)
 {
-   int i,j,k, b, bsize, bl;
-   unsigned long int nblock;
-   int cnti;
-   TriMat tm, m;
+   int b;
    RegAcc *ra;
-   DVector acc;
    BaseClass *bclass;
    MixPDF *mp;
    AccCache *paac;
@@ -1173,20 +1185,8 @@ void UpdateBaseAccsWithPaac(void)
 
       if ( ra->bTriMat != NULL) {
         for (paac = headac; paac!= NULL; paac=paac->next) { 
-          if ( (paac->baseclass == b)&& (paac->bVector[1]>0) ){
-            acc = paac->bVector;
-            nblock = (unsigned long int)(ra->bDiagMat[0]);
-            for (bl=1,cnti=1;bl<=nblock;bl++) {
-              m = paac->bTriMat[bl];
-              bsize = TriMatSize(m);
-              for (i=1;i<=bsize;i++,cnti++) { /* Fill the accumulate stores */
-                tm = ra->bTriMat[cnti];
-                for (j=1; j<=bsize; j++)
-                  for (k=1; k<=j; k++)
-                    tm[j][k] += m[j][k] * acc[cnti];
-              }
-            }
-          }
+          if ( (paac->baseclass == b)&& (paac->bVector[1]>0) )
+            PushFrameBlock(ra->fBlock,ra->bTriMat,paac->obsVec,paac->bVector);
         }
       }
    }  
@@ -1199,11 +1199,28 @@ void ResetAccCache(void)
    if ( headac != NULL) {
       for (ac = headac; ac!= NULL; ac=ac->next) {
         ZeroDVector(ac->bVector);
-        ZeroBlockTriMat(ac->bTriMat);
+        ac->cached = FALSE;
       }
    }
 }
 
+/* FlushBaseAccs: add any buffered frames into the baseclass accumulators */
+static void FlushBaseAccs(void)
+{
+   int b;
+   RegAcc *ra;
+   BaseClass *bclass;
+   MixPDF *mp;
+
+   bclass = outXForm->bclass;
+   for (b=1;b<=bclass->numClasses;b++) {
+      mp = ((MixtureElem *)(bclass->ilist[b])->item)->mpdf;
+      ra = GetRegAcc(mp);
+      if (ra->bTriMat != NULL)
+         FlushFrameBlock(ra->fBlock,ra->bTriMat);
+   }
+}
+
 static Boolean XFormModCovar(AdaptXForm *xform)
 {
   Boolean isModified = FALSE;
@@ -1290,6 +1307,7 @@ static RegAcc *CreateRegAcc(MemHeap *x, MixPDF *mp, AdaptXForm *xform)
     ZeroVector(regAcc->spSumSq);
   } else regAcc->spSumSq = NULL;
   regAcc->bTriMat = NULL;   
+  regAcc->fBlock = NULL;
   return regAcc;
 }
 
@@ -1690,6 +1708,8 @@ static void AccCMLLRBaseStats(MixPDF *mp, AccStruct *accs)
   int i,j,k;
   int cnti,b,bsize;
   TriMat tm;
+  float *trow;
+  double *grow;
  
   ra = GetRegAcc(mp);
   for (b=1,cnti=1;b<=IntVecSize(accs->blockSize);b++) {
@@ -1697,9 +1717,9 @@ static void AccCMLLRBaseStats(MixPDF *mp, AccStruct *accs)
     for (i=1;i<=bsize;i++,cnti++) {
       tm = ra->bTriMat[cnti];
       for (j=1;j<=bsize;j++) {
-         for (k=1;k<=j;k++) {
-            accs->G[cnti][j][k] += tm[j][k];
-         }      
+         trow = tm[j]; grow = accs->G[cnti][j];
+         for (k=1;k<=j;k++)
+            grow[k] += trow[k];
       }
     }
   }
@@ -1948,7 +1968,8 @@ static AccCache  *CreateAccCache(IntVec size,  int b)
    ac->baseclass = b;
    ac->bVector  = CreateDVector(&acccaStack,vsize);
    ZeroDVector(ac->bVector);
-   ac->bTriMat = CreateBlockTriMat(&acccaStack,size);
+   ac->obsVec = CreateVector(&acccaStack,vsize);
+   ac->cached = FALSE;
    ac->next = headac;
    headac = ac;
    return(ac);
@@ -4025,7 +4046,10 @@ void ZeroAdaptAccs(HMMSet *hset, AdaptXForm *xform)
             if (ra->spSumSq != NULL) ZeroVector(ra->spSumSq);
          }
          /* Use last component of the baseclass to access baseclass stats */
-         if (ra->bTriMat != NULL) ZeroBaseTriMat(ra->bTriMat);
+         if (ra->bTriMat != NULL) {
+            ZeroBaseTriMat(ra->bTriMat);
+            ra->fBlock->nFrame = 0;
+         }
       }
    }
 }
@@ -4373,6 +4397,7 @@ void TidyBaseAccs()
       UpdateBaseAccsWithPaac();
       ResetAccCache();
    }
+   FlushBaseAccs();
 }
 
 AdaptXForm *GetMLLRDiagCov(AdaptXForm *xform)
@@ -4423,6 +4448,7 @@ Boolean UpdateSpkrStats(HMMSet *hset, XFInfo *xfinfo, char *datafn)
                UpdateBaseAccsWithPaac();
                ResetAccCache();
             }
+            FlushBaseAccs();
             /* Generate the new transform */
             MakeFN(coutspkr,NULL,xfinfo->outXFormExt,newMn);
             xfinfo->outXForm = CreateAdaptXForm(hset, newMn);
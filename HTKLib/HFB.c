@@ -53,6 +53,7 @@ char *hfb_vc_id = "$Id: HFB.c,v 1.1.1.1 2006/10/11 09:54:57 jal58 Exp $";
 #include "HUtil.h"
 #include "HAdapt.h"
 #include "HFB.h"
+#include <pthread.h>
 
 
 /* ------------------- Trace Information ------------------------------ */
@@ -89,6 +90,10 @@ static struct {
 static Boolean pde = FALSE;  /* partial distance elimination */
 static Boolean sharedMix = FALSE; /* true if shared mixtures */
 
+/* guards the per-HMM numEg counters when several FBInfo instances
+   accumulate concurrently into separate accumulator slots */
+static pthread_mutex_t numEgLock = PTHREAD_MUTEX_INITIALIZER;
+
 /* ------------------------- Min HMM Duration -------------------------- */
 
 /* Recusively calculate topological order for transition matrix */
@@ -160,35 +165,41 @@ void SetMinDurs(HMMSet *hset)
 
 /* ----------------------------------------------------------------------- */
 
-/* CreateTrAcc: create an accumulator for transition counts */
-static TrAcc *CreateTrAcc(MemHeap *x, int numStates)
+/* CreateTrAcc: create nPara accumulators for transition counts */
+static TrAcc *CreateTrAcc(MemHeap *x, int numStates, int nPara)
 {
    TrAcc *ta;
+   int i;
   
-   ta = (TrAcc *) New(x,sizeof(TrAcc));
-   ta->tran = CreateMatrix(x,numStates,numStates);
-   ZeroMatrix(ta->tran);
-   ta->occ = CreateVector(x,numStates);
-   ZeroVector(ta->occ);
-  
+   ta = (TrAcc *) New(x,sizeof(TrAcc)*nPara);
+   for (i=0;i<nPara;i++) {
+      ta[i].tran = CreateMatrix(x,numStates,numStates);
+      ZeroMatrix(ta[i].tran);
+      ta[i].occ = CreateVector(x,numStates);
+      ZeroVector(ta[i].occ);
+      ta[i].minDur = 0;
+   }
    return ta;
 }
 
-/* CreateWtAcc: create an accumulator for mixture weights */
-static WtAcc *CreateWtAcc(MemHeap *x, int nMix)
+/* CreateWtAcc: create nPara accumulators for mixture weights */
+static WtAcc *CreateWtAcc(MemHeap *x, int nMix, int nPara)
 {
    WtAcc *wa;
+   int i;
    
-   wa = (WtAcc *) New(x,sizeof(WtAcc));
-   wa->c = CreateVector(x,nMix);
-   ZeroVector(wa->c);
-   wa->occ = 0.0;
-   wa->time = -1; wa->prob = NULL;
+   wa = (WtAcc *) New(x,sizeof(WtAcc)*nPara);
+   for (i=0;i<nPara;i++) {
+      wa[i].c = CreateVector(x,nMix);
+      ZeroVector(wa[i].c);
+      wa[i].occ = 0.0;
+      wa[i].time = -1; wa[i].prob = NULL;
+   }
    return wa;
 }
 
 /* AttachTrAccs: attach transition accumulators to hset */
-static void AttachWtTrAccs(HMMSet *hset, MemHeap *x)
+static void AttachWtTrAccs(HMMSet *hset, MemHeap *x, int nPara)
 {
    HMMScanState hss;
    StreamElem *ste;
@@ -199,13 +210,13 @@ static void AttachWtTrAccs(HMMSet *hset, MemHeap *x)
       hmm = hss.hmm;
       hmm->hook = (void *)0;  /* used as numEg counter */
       if (!IsSeenV(hmm->transP)) {
-         SetHook(hmm->transP, CreateTrAcc(x,hmm->numStates));
+         SetHook(hmm->transP, CreateTrAcc(x,hmm->numStates,nPara));
          TouchV(hmm->transP);       
       }
       while (GoNextState(&hss,TRUE)) {
          while (GoNextStream(&hss,TRUE)) {
             ste = hss.ste;
-            ste->hook = CreateWtAcc(x,hss.M);
+            ste->hook = CreateWtAcc(x,hss.M,nPara);
          }
       }
    } while (GoNextHMM(&hss));
@@ -249,18 +260,29 @@ void SetTraceFB(void)
 void InitialiseForBack(FBInfo *fbInfo, MemHeap *x, HMMSet *hset, UPDSet uset, 
                        LogDouble pruneInit, LogDouble pruneInc, 
                        LogDouble pruneLim, float minFrwdP)
+{
+   InitialiseForBackParallel(fbInfo, x, hset, uset, pruneInit, pruneInc,
+                             pruneLim, minFrwdP, 1);
+}
+
+void InitialiseForBackParallel(FBInfo *fbInfo, MemHeap *x, HMMSet *hset, 
+                               UPDSet uset, LogDouble pruneInit, 
+                               LogDouble pruneInc, LogDouble pruneLim, 
+                               float minFrwdP, int nPara)
 {
    int s;
    AlphaBeta *ab;
   
    fbInfo->uFlags = uset;
+   fbInfo->nPara = nPara;
+   fbInfo->accIdx = 0;
    fbInfo->up_hset = fbInfo->al_hset = hset;
    fbInfo->twoModels = FALSE;
    fbInfo->hsKind = hset->hsKind;
    /* Accumulators attached using AttachAccs() in HERest are overwritten
       by the following line. This is ugly and needs to be sorted out. Note:
       this function is called by HERest and HVite */
-   AttachWtTrAccs(hset, x);
+   AttachWtTrAccs(hset, x, nPara);
    SetMinDurs(hset);
    fbInfo->maxM = MaxMixInSet(hset);
    fbInfo->skipstart = skipstartInit;
@@ -325,8 +347,10 @@ void UseAlignHMMSet(FBInfo* fbInfo, MemHeap* x, HMMSet *al_hset)
    /* update the global alignment set features */
    fbInfo->hsKind = al_hset->hsKind;      
    fbInfo->maxM = MaxMixInSet(al_hset);
+   if (fbInfo->nPara>1)
+      HError(7392,"UseAlignHMMSet: 2-model re-estimation needs a single accumulator set");
    /* dummy accs to accomodate minDir */
-   AttachWtTrAccs(al_hset, x);
+   AttachWtTrAccs(al_hset, x, 1);
    SetMinDurs(al_hset);
    /* precomps */
    if ( al_hset->hsKind == SHAREDHS)
@@ -336,6 +360,18 @@ void UseAlignHMMSet(FBInfo* fbInfo, MemHeap* x, HMMSet *al_hset)
    fbInfo->twoModels = TRUE;
 }
 
+/* Initialise a worker copy of src which accumulates into slot index */
+void CloneForBack(FBInfo *fbInfo, FBInfo *src, MemHeap *x, int index)
+{
+   if (index<0 || index>=src->nPara)
+      HError(7392,"CloneForBack: accumulator slot %d out of range [0,%d]",
+             index,src->nPara-1);
+   *fbInfo = *src;
+   fbInfo->accIdx = index;
+   fbInfo->ab = (AlphaBeta *) New(x, sizeof(AlphaBeta));
+   CreateHeap(&fbInfo->ab->abMem,  "AlphaBetaFB",  MSTAK, 1, 1.0, 100000, 5000000);
+}
+
 /* Initialise the utterance memory requirements */
 void InitUttInfo( UttInfo *utt, Boolean twoFiles )
 {
@@ -560,10 +596,11 @@ static int CreateInsts(FBInfo *fbInfo, AlphaBeta *ab, int Q, Transcription *tr)
 
       if (q>1 && qDms[q]==0 && qDms[q-1]==0)
          HError(7332,"CreateInsts: Cannot have successive Tee models");
-      if (al_hset->hsKind==SHAREDHS)
+      if (al_hset->hsKind==SHAREDHS && fbInfo->nPara==1)
          ResetHMMPreComps(al_qList[q],al_hset->swidth[0]);
-      else if (al_hset->hsKind==PLAINHS)
-         ResetHMMWtAccs(al_qList[q],al_hset->swidth[0]);         
+      else if (al_hset->hsKind==PLAINHS || al_hset->hsKind==SHAREDHS)
+         ResetHMMWtAccsParallel(al_qList[q],al_hset->swidth[0],
+                                fbInfo->accIdx);
    }
    if ((qDms[1]==0)||(qDms[Q]==0))
       HError(7332,"CreateInsts: Cannot have Tee models at start or end of transcription");
@@ -898,9 +935,11 @@ static float * NewOtprobVec(MemHeap *x, int M)
    return v;
 }
 
-/* ShStrP: Stream Outp calculation exploiting sharing */
+/* ShStrP: Stream Outp calculation exploiting sharing.  The PreComp
+   cache attached to each MixPDF is global so it is only used when 
+   a single accumulator set (ie a single FBInfo) is active */
 static float * ShStrP(HMMSet *hset, StreamElem *ste, Vector v, int t,
-		       AdaptXForm *xform, MemHeap *abmem)
+		       AdaptXForm *xform, MemHeap *abmem, int idx, int nPara)
 {
    WtAcc *wa;
    MixtureElem *me;
@@ -911,7 +950,7 @@ static float * ShStrP(HMMSet *hset, StreamElem *ste, Vector v, int t,
    LogFloat det,x,mixp,wt;
    Vector otvs;
    
-   wa = (WtAcc *)ste->hook;
+   wa = (WtAcc *)ste->hook + idx;
    if (wa->time==t)           /* seen this state before */
       outprobjs = wa->prob;
    else {
@@ -920,7 +959,7 @@ static float * ShStrP(HMMSet *hset, StreamElem *ste, Vector v, int t,
       me = ste->spdf.cpdf+1;
       if (M==1){                 /* Single Mix Case */
          mp = me->mpdf;
-         pMix = (PreComp *)mp->hook;
+         pMix = (nPara==1) ? (PreComp *)mp->hook : NULL;
          if ((pMix != NULL) && (pMix->time == t))
             x = pMix->prob;
          else {
@@ -936,7 +975,7 @@ static float * ShStrP(HMMSet *hset, StreamElem *ste, Vector v, int t,
             wt = MixLogWeight(hset,me->weight);
             if (wt>LMINMIX){
                mp = me->mpdf;
-               pMix = (PreComp *)mp->hook;
+               pMix = (nPara==1) ? (PreComp *)mp->hook : NULL;
                if ((pMix != NULL) && (pMix->time == t))
                   mixp = pMix->prob;
                else {
@@ -1041,11 +1080,13 @@ static void Setotprob(AlphaBeta *ab, FBInfo *fbInfo, ParmBuf pbuf,
                   case PLAINHS:  
                   case SHAREDHS: 
 		     if (S==1)
-		        outprobj[0] = ShStrP(hset,ste,ot.fv[s],t,fbInfo->al_inXForm,&ab->abMem);
+		        outprobj[0] = ShStrP(hset,ste,ot.fv[s],t,fbInfo->al_inXForm,&ab->abMem,
+                                             fbInfo->accIdx,fbInfo->nPara);
 		     else {
-                        if (((WtAcc *)ste->hook)->time==t) seenState=TRUE;
+                        if (((WtAcc *)ste->hook+fbInfo->accIdx)->time==t) seenState=TRUE;
                         else seenState=FALSE;
-		        outprobj[s] = ShStrP(hset,ste,ot.fv[s],t,fbInfo->al_inXForm,&ab->abMem);
+		        outprobj[s] = ShStrP(hset,ste,ot.fv[s],t,fbInfo->al_inXForm,&ab->abMem,
+                                             fbInfo->accIdx,fbInfo->nPara);
                      }
 		    break;
                   default:
@@ -1170,7 +1211,7 @@ static LogDouble SetBeta(AlphaBeta *ab, FBInfo *fbInfo, UttInfo *utt)
    p=ab->pInfo;
    beta=ab->beta;
 
-   maxP = CreateDVector(&gstack, Q);   /* for calculating beam width */
+   maxP = CreateDVector(&ab->abMem, Q);   /* for calculating beam width */
   
    /* Last Column t = T */
    p->qHi[T] = Q; endq = p->qLo[T];
@@ -1381,7 +1422,7 @@ static void UpTranParms(FBInfo *fbInfo, HLink hmm, int t, int q,
 
    N = hmm->numStates;
    ab = fbInfo->ab;
-   ta = (TrAcc *) GetHook(hmm->transP);
+   ta = (TrAcc *) GetHook(hmm->transP) + fbInfo->accIdx;
    outprob = ab->otprob[t][q]; 
    if (bqt1!=NULL) outprob1 = ab->otprob[t+1][q];  /* Bug fix */
    else outprob1 = NULL;
@@ -1466,10 +1507,10 @@ static void UpMixParms(FBInfo *fbInfo, int q, HLink hmm, HLink al_hmm,
    }
    
    /* allows a clean tidy of the space */
-   comp_prob = CreateVector(&gstack,fbInfo->maxM);
+   comp_prob = CreateVector(&ab->abMem,fbInfo->maxM);
 
    if (strmProj) { /* recreate full vector */
-      ovec = CreateVector(&gstack,hset->vecSize);
+      ovec = CreateVector(&ab->abMem,hset->vecSize);
       for (i=1,s=1;s<=S;s++)
          for (k=1;k<=hset->swidth[s];k++,i++)
             ovec[i] = ot.fv[s][k];
@@ -1513,7 +1554,7 @@ static void UpMixParms(FBInfo *fbInfo, int q, HLink hmm, HLink al_hmm,
             break;
          }
          /* update weight occupation count */
-         wa = (WtAcc *) ste->hook; steSumLr = 0.0;
+         wa = (WtAcc *) ste->hook + fbInfo->accIdx; steSumLr = 0.0;
 
          if (fbInfo->twoModels) { /* component probs of update hmm */
             norm = LZERO;
@@ -1626,8 +1667,8 @@ static void UpMixParms(FBInfo *fbInfo, int q, HLink hmm, HLink al_hmm,
                      this accumulates "true" outer products to allow multiple streams
                   */ 
                   if (fbInfo->uFlags&UPSEMIT) {
-                     ma = (MuAcc *) GetHook(mp->mean);
-                     va = (VaAcc *) GetHook(mp->cov.var);
+                     ma = (MuAcc *) GetHook(mp->mean) + fbInfo->accIdx;
+                     va = (VaAcc *) GetHook(mp->cov.var) + fbInfo->accIdx;
                      ma->occ += Lr;
                      va->occ += Lr;
                      mu_jm = ma->mu;
@@ -1663,8 +1704,8 @@ static void UpMixParms(FBInfo *fbInfo, int q, HLink hmm, HLink al_hmm,
                      if ((fbInfo->uFlags&UPMEANS) || (fbInfo->uFlags&UPVARS))
                         mean = mp->mean; 
                      if ((fbInfo->uFlags&UPMEANS) && (fbInfo->uFlags&UPVARS)) {
-                        ma = (MuAcc *) GetHook(mean);
-                        va = (VaAcc *) GetHook(mp->cov.var);
+                        ma = (MuAcc *) GetHook(mean) + fbInfo->accIdx;
+                        va = (VaAcc *) GetHook(mp->cov.var) + fbInfo->accIdx;
                         ma->occ += Lr;
                         va->occ += Lr;
                         mu_jm = ma->mu;
@@ -1691,7 +1732,7 @@ static void UpMixParms(FBInfo *fbInfo, int q, HLink hmm, HLink al_hmm,
                         }
                      }
                      else if (fbInfo->uFlags&UPMEANS){
-                        ma = (MuAcc *) GetHook(mean);
+                        ma = (MuAcc *) GetHook(mean) + fbInfo->accIdx;
                         mu_jm = ma->mu;
                         ma->occ += Lr;
                         for (k=1;k<=vSize;k++)     /* sum zero mean */
@@ -1699,7 +1740,7 @@ static void UpMixParms(FBInfo *fbInfo, int q, HLink hmm, HLink al_hmm,
                      }
                      else if (fbInfo->uFlags&UPVARS){
                         /* update covariance counts */
-                        va = (VaAcc *) GetHook(mp->cov.var);
+                        va = (VaAcc *) GetHook(mp->cov.var) + fbInfo->accIdx;
                         va->occ += Lr;
                         if ((mp->ckind==DIAGC)||(mp->ckind==INVDIAGC)){
                            var = va->cov.var;
@@ -1740,7 +1781,7 @@ static void UpMixParms(FBInfo *fbInfo, int q, HLink hmm, HLink al_hmm,
       }
    }
 
-   FreeVector(&gstack,comp_prob);
+   FreeVector(&ab->abMem,comp_prob);
 }
 
 /* -------------------- Top Level of F-B Updating ---------------- */
@@ -1766,11 +1807,13 @@ static void StepForward(FBInfo *fbInfo, UttInfo *utt)
     if (trace & T_OCC) {
         CreateTraceOcc(ab, utt);
     }
+    if (fbInfo->nPara>1) pthread_mutex_lock(&numEgLock);
     for (q = 1; q <= utt->Q; q++) {	/* inc access counters */
         up_hmm = ab->up_qList[q];
         negs = (unsigned long int)up_hmm->hook + 1;
         up_hmm->hook = (void *)negs;
     }
+    if (fbInfo->nPara>1) pthread_mutex_unlock(&numEgLock);
     ResetObsCache();
 
     for (t = 1; t <= utt->T; t++) {
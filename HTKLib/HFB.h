@@ -118,6 +118,8 @@ typedef struct {
   AdaptXForm *inXForm;/* current input transform (if any) */
   AdaptXForm *al_inXForm;/* current input transform for al_hset (if any) */
   AdaptXForm *paXForm;/* current parent transform (if any) */
+  int nPara;          /* number of accumulator slots attached */
+  int accIdx;         /* accumulator slot updated by this instance */
 } FBInfo;
 
 
@@ -134,6 +136,17 @@ void InitialiseForBack(FBInfo *fbInfo, MemHeap *x, HMMSet *set, UPDSet uset,
                        LogDouble pruneInit, LogDouble pruneInc, 
                        LogDouble pruneLim, float minFrwdP);
 
+/* As above but attach nPara accumulator slots so that nPara FBInfo 
+   instances (see CloneForBack) may accumulate concurrently */
+void InitialiseForBackParallel(FBInfo *fbInfo, MemHeap *x, HMMSet *set, 
+                               UPDSet uset, LogDouble pruneInit, 
+                               LogDouble pruneInc, LogDouble pruneLim, 
+                               float minFrwdP, int nPara);
+
+/* Initialise fbInfo as a copy of src with its own alpha-beta heap
+   which updates accumulator slot index */
+void CloneForBack(FBInfo *fbInfo, FBInfo *src, MemHeap *x, int index);
+
 /* Use a different model set for alignment */
 void UseAlignHMMSet(FBInfo* fbInfo, MemHeap* x, HMMSet *al_hset);
 
@@ -0,0 +1,533 @@
+/* ----------------------------------------------------------- */
+/*                                                             */
+/*                          ___                                */
+/*                       |_| | |_/   SPEECH                    */
+/*                       | | | | \   RECOGNITION               */
+/*                       =========   SOFTWARE                  */
+/*                                                             */
+/*                                                             */
+/* ----------------------------------------------------------- */
+/* developed at:                                               */
+/*                                                             */
+/*           Speech Vision and Robotics group                  */
+/*           (now Machine Intelligence Laboratory)             */
+/*           Cambridge University Engineering Department       */
+/*           http://mi.eng.cam.ac.uk/                          */
+/*                                                             */
+/*           Entropic Cambridge Research Laboratory            */
+/*           (now part of Microsoft)                           */
+/*                                                             */
+/* ----------------------------------------------------------- */
+/*           Copyright: Microsoft Corporation                  */
+/*            1995-2000 Redmond, Washington USA                */
+/*                      http://www.microsoft.com               */
+/*                                                             */
+/*           Copyright: Cambridge University                   */
+/*                      Engineering Department                 */
+/*            2001-2015 Cambridge, Cambridgeshire UK           */
+/*                      http://www.eng.cam.ac.uk               */
+/*                                                             */
+/*   Use of this software is governed by a License Agreement   */
+/*    ** See the file License for the Conditions of Use  **    */
+/*    **     This banner notice must not be removed      **    */
+/*                                                             */
+/* ----------------------------------------------------------- */
+/*          File: HGSel.c  Gaussian selection shortlists       */
+/* ----------------------------------------------------------- */
+
+char *hgsel_version = "!HVER!HGSel:   3.5.0 [CUED 12/10/15]";
+char *hgsel_vc_id = "$Id: HGSel.c,v 1.0 2015/12/10 10:00:00 $";
+
+#include "HShell.h"
+#include "HMem.h"
+#include "HMath.h"
+#include "HWave.h"
+#include "HAudio.h"
+#include "HParm.h"
+#include "HLabel.h"
+#include "HANNet.h"
+#include "HModel.h"
+#include "HUtil.h"
+#include "HVQ.h"
+#include "HGSel.h"
+
+/* ------------------------ Trace Flags ------------------------- */
+
+#define T_BUILD  0001      /* report index construction */
+#define T_STATS  0002      /* per utterance selection statistics */
+
+static int trace = 0;
+
+/* ----------------------- Configuration ------------------------ */
+
+#define GSMAXCODE 4096     /* max codewords per stream */
+#define GSITER    4        /* k-means iterations per tree level */
+#define GSPERTURB 0.2      /* split perturbation in std devs */
+
+static ConfParam *cParm[MAXGLOBS];       /* config parameters */
+static int numParm = 0;
+static Boolean initDone = FALSE;
+
+static Boolean gsSelect = FALSE;   /* enable Gaussian selection */
+static char gsCodebook[MAXSTRLEN]; /* HVQ codebook, "" = build from model */
+static int gsCodewords = 256;      /* leaves of the built codebook */
+static float gsThresh = 1.5;       /* normalised distance threshold */
+static int gsMinMix = 1;           /* components always kept per state */
+static LogFloat gsFloor = -1000.0; /* outp of a state with no components */
+static int gsCheck = 0;            /* full check every gsCheck states */
+
+/* ------------------------ Index Layout ------------------------ */
+
+typedef struct {                /* shortlists of one stream */
+   int nCode;                   /* number of codewords */
+   Vector *cent;                /* [0..nCode-1] codeword centroids */
+   short *nMix;                 /* [0..nIdx-1] mixtures in each state */
+   int *off;                    /* [c*(nIdx+1)+sIdx] offset into list[c] */
+   short **list;                /* [0..nCode-1] 1-based mixture indices */
+} GSStream;
+
+struct _GSIndex {
+   HMMSet *hset;                /* set the index was built for */
+   VQTable vq;                  /* codebook used to quantise frames */
+   int nStream;                 /* number of streams */
+   int nIdx;                    /* states are indexed by sIdx 0..nIdx-1 */
+   GSStream st[SMAX];           /* [1..nStream] shortlists */
+};
+
+static int gsNum = 0;           /* number of indexes built (for naming) */
+
+/* EXPORT->InitGSel: initialise the Gaussian selection module */
+void InitGSel(void)
+{
+   int i;
+   double d;
+   Boolean b;
+   
+   Register(hgsel_version,hgsel_vc_id);
+   gsCodebook[0] = '\0';
+   numParm = GetConfig("HGSEL", TRUE, cParm, MAXGLOBS);
+   if (numParm>0){
+      if (GetConfInt(cParm,numParm,"TRACE",&i)) trace = i;
+      if (GetConfBool(cParm,numParm,"GSELECT",&b)) gsSelect = b;
+      GetConfStr(cParm,numParm,"GSCODEBOOK",gsCodebook);
+      if (GetConfInt(cParm,numParm,"GSCODEWORDS",&i)) gsCodewords = i;
+      if (GetConfFlt(cParm,numParm,"GSTHRESH",&d)) gsThresh = d;
+      if (GetConfInt(cParm,numParm,"GSMINMIX",&i)) gsMinMix = i;
+      if (GetConfFlt(cParm,numParm,"GSFLOOR",&d)) gsFloor = d;
+      if (GetConfInt(cParm,numParm,"GSCHECK",&i)) gsCheck = i;
+   }
+   if (gsCodewords<2 || gsCodewords>GSMAXCODE)
+      HError(6190,"InitGSel: GSCODEWORDS %d must be in 2..%d",
+             gsCodewords,GSMAXCODE);
+   if (gsMinMix<0)
+      HError(6190,"InitGSel: GSMINMIX %d must be >= 0",gsMinMix);
+   initDone = TRUE;
+}
+
+/* ---------------------- Index Construction -------------------- */
+
+/* IVar: inverse variance of element i of diagonal mixture mp */
+static float IVar(MixPDF *mp, int i)
+{
+   return (mp->ckind==INVDIAGC) ? mp->cov.var[i] : 1.0/mp->cov.var[i];
+}
+
+/* WDist: weighted squared distance between x and y */
+static float WDist(Vector x, Vector y, Vector w, int D)
+{
+   float d,sum = 0.0;
+   int i;
+
+   for (i=1; i<=D; i++) {
+      d = x[i]-y[i]; sum += d*d*w[i];
+   }
+   return sum;
+}
+
+/* CheckGSelSet: return TRUE if all used components in hset are diagonal */
+static Boolean CheckGSelSet(HMMSet *hset)
+{
+   HMMScanState hss;
+   Boolean ok = TRUE;
+
+   if (hset->hsKind!=PLAINHS && hset->hsKind!=SHAREDHS) {
+      HError(-6190,"CheckGSelSet: Gaussian selection needs a continuous HMM set");
+      return FALSE;
+   }
+   NewHMMScan(hset,&hss);
+   while (ok && GoNextMix(&hss,FALSE))
+      if (hss.mp->ckind!=DIAGC && hss.mp->ckind!=INVDIAGC) {
+         HError(-6190,"CheckGSelSet: Gaussian selection needs diagonal covariances");
+         ok = FALSE;
+      }
+   EndHMMScan(&hss);
+   return ok;
+}
+
+/* CollectMix: return the used components of stream s in mix[0..*n-1] */
+static MixPDF **CollectMix(MemHeap *tmp, HMMSet *hset, int s, int *n)
+{
+   HMMScanState hss;
+   MixPDF **mix = NULL;
+   int num = 0, pass;
+
+   for (pass=0; pass<2; pass++) {
+      NewHMMScan(hset,&hss);
+      while (GoNextMix(&hss,FALSE))
+         if (hss.s==s && MixLogWeight(hset,hss.me->weight)>LMINMIX) {
+            if (pass==1) mix[num] = hss.mp;
+            num++;
+         }
+      EndHMMScan(&hss);
+      if (pass==0) {
+         mix = (MixPDF **) New(tmp,(num>0?num:1)*sizeof(MixPDF *));
+         *n = num; num = 0;
+      }
+   }
+   return mix;
+}
+
+/* 
+   BuildTree: build a binary tree codebook with K leaves for stream s
+   from the means of mix[0..G-1].  Nodes are numbered 1..2K-1 with the
+   children of k at 2k and 2k+1; each level is made by splitting every
+   node of the level above and refining the split with GSITER k-means
+   passes over the members of the parent.  The metric is the inverse
+   of the average component variance, so that GetVQ descends the tree
+   as it was built.
+*/
+static void BuildTree(MemHeap *x, MemHeap *tmp, VQTable vq, int s, int D,
+                      MixPDF **mix, int G, int K, GSStream *st)
+{
+   Vector *mean,w;
+   DVector *acc;
+   VQNode *node;
+   Covariance cov;
+   int *cls,*cnt,nNode,first,it,g,k,c,i;
+   double sum,d;
+
+   nNode = 2*K;
+   mean = (Vector *) New(x,nNode*sizeof(Vector));
+   acc = (DVector *) New(tmp,nNode*sizeof(DVector));
+   for (k=1; k<nNode; k++) {
+      mean[k] = CreateVector(x,D);
+      acc[k] = CreateDVector(tmp,D);
+   }
+   cnt = (int *) New(tmp,nNode*sizeof(int));
+   cls = (int *) New(tmp,G*sizeof(int));
+   w = CreateVector(x,D);
+
+   /* metric and root node */
+   ZeroVector(mean[1]);
+   for (i=1; i<=D; i++) {
+      sum = 0.0;
+      for (g=0; g<G; g++) {
+         sum += 1.0/IVar(mix[g],i);
+         mean[1][i] += mix[g]->mean[i];
+      }
+      w[i] = (sum>0.0) ? G/sum : 1.0;
+      mean[1][i] /= G;
+   }
+   for (g=0; g<G; g++) cls[g] = 1;
+
+   /* split the nodes first..2*first-1 into 2*first..4*first-1 */
+   for (first=1; first<K; first*=2) {
+      for (k=first; k<2*first; k++)
+         for (i=1; i<=D; i++) {
+            d = GSPERTURB/sqrt(w[i]);
+            mean[2*k][i] = mean[k][i]-d;
+            mean[2*k+1][i] = mean[k][i]+d;
+         }
+      for (it=0; it<GSITER; it++) {
+         for (k=2*first; k<4*first; k++) {
+            ZeroDVector(acc[k]); cnt[k] = 0;
+         }
+         for (g=0; g<G; g++) {
+            k = (it==0) ? cls[g] : cls[g]/2;
+            c = (WDist(mix[g]->mean,mean[2*k+1],w,D) <
+                 WDist(mix[g]->mean,mean[2*k],w,D)) ? 2*k+1 : 2*k;
+            cls[g] = c; cnt[c]++;
+            for (i=1; i<=D; i++) acc[c][i] += mix[g]->mean[i];
+         }
+         for (k=2*first; k<4*first; k++)
+            if (cnt[k]>0)
+               for (i=1; i<=D; i++) mean[k][i] = acc[k][i]/cnt[k];
+      }
+   }
+
+   /* convert to VQ nodes, leaves K..2K-1 are codewords 0..K-1 */
+   cov.var = w;
+   node = (VQNode *) New(tmp,nNode*sizeof(VQNode));
+   for (k=nNode-1; k>=1; k--)
+      if (k>=K)
+         node[k] = CreateVQNode(k-K,k,0,0,mean[k],INVDIAGC,cov);
+      else {
+         node[k] = CreateVQNode(0,k,2*k,2*k+1,mean[k],INVDIAGC,cov);
+         node[k]->left = node[2*k]; node[k]->right = node[2*k+1];
+      }
+   vq->tree[s] = node[1];
+   vq->numNodes += nNode-1;
+
+   st->nCode = K;
+   st->cent = (Vector *) New(x,K*sizeof(Vector));
+   for (c=0; c<K; c++) st->cent[c] = mean[K+c];
+}
+
+/* FindCent: record the centroid of each codeword in the tree below n */
+static void FindCent(VQNode n, TreeType type, Vector *cent, int *nCode)
+{
+   for (; n!=NULL; n=n->right)
+      if (type==binTree && n->right!=NULL)
+         FindCent(n->left,type,cent,nCode);
+      else {
+         if (n->vqidx<0 || n->vqidx>=GSMAXCODE)
+            HError(6192,"FindCent: codeword %d out of range 0..%d",
+                   n->vqidx,GSMAXCODE-1);
+         cent[n->vqidx] = n->mean;
+         if (n->vqidx>=*nCode) *nCode = n->vqidx+1;
+      }
+}
+
+/* LoadCodebook: load the GSCODEBOOK table and find its codewords */
+static void LoadCodebook(MemHeap *x, MemHeap *tmp, GSIndex *gs)
+{
+   Vector *cent;
+   GSStream *st;
+   int s,c;
+
+   gs->vq = LoadVQTab(gsCodebook,0);
+   if (gs->vq->ckind==FULLC)
+      HError(6192,"LoadCodebook: full covariance codebook %s not supported",
+             gsCodebook);
+   if (gs->vq->swidth[0]!=gs->nStream)
+      HError(6192,"LoadCodebook: codebook %s has %d streams, models have %d",
+             gsCodebook,gs->vq->swidth[0],gs->nStream);
+   cent = (Vector *) New(tmp,GSMAXCODE*sizeof(Vector));
+   for (s=1; s<=gs->nStream; s++) {
+      if (gs->vq->swidth[s]!=gs->hset->swidth[s])
+         HError(6192,"LoadCodebook: stream %d width %d in %s, %d in models",
+                s,gs->vq->swidth[s],gsCodebook,gs->hset->swidth[s]);
+      st = gs->st+s; st->nCode = 0;
+      for (c=0; c<GSMAXCODE; c++) cent[c] = NULL;
+      FindCent(gs->vq->tree[s],gs->vq->type,cent,&st->nCode);
+      st->cent = (Vector *) New(x,st->nCode*sizeof(Vector));
+      for (c=0; c<st->nCode; c++) st->cent[c] = cent[c];
+   }
+}
+
+/*
+   BuildLists: build the shortlist of every state for every codeword of
+   stream s.  state[0..nIdx-1] maps sIdx to the state, NULL for gaps.
+*/
+static void BuildLists(MemHeap *x, MemHeap *tmp, GSIndex *gs, int s,
+                       StateInfo **state, int maxMix)
+{
+   GSStream *st = gs->st+s;
+   HMMSet *hset = gs->hset;
+   StreamElem *se;
+   MixtureElem *me;
+   MixPDF *mp;
+   Vector cent;
+   float *dist,t,d;
+   Boolean *sel;
+   short *buf;
+   int *off,D,c,k,m,i,n,nSel,best,nState = 0;
+   double nSum = 0.0, nTotal = 0.0;
+
+   D = hset->swidth[s];
+   st->nMix = (short *) New(x,gs->nIdx*sizeof(short));
+   for (k=0,n=0; k<gs->nIdx; k++) {
+      st->nMix[k] = (state[k]!=NULL) ? state[k]->pdf[s].nMix : 0;
+      if (state[k]!=NULL) nState++;
+      n += st->nMix[k];
+   }
+   buf = (short *) New(tmp,(n>0?n:1)*sizeof(short));
+   dist = (float *) New(tmp,(maxMix+1)*sizeof(float));
+   sel = (Boolean *) New(tmp,(maxMix+1)*sizeof(Boolean));
+   st->off = (int *) New(x,(size_t)st->nCode*(gs->nIdx+1)*sizeof(int));
+   st->list = (short **) New(x,st->nCode*sizeof(short *));
+
+   for (c=0; c<st->nCode; c++) {
+      cent = st->cent[c];
+      off = st->off+c*(gs->nIdx+1);
+      for (k=0,n=0; k<gs->nIdx; k++) {
+         off[k] = n;
+         if (state[k]==NULL || cent==NULL) continue;
+         se = state[k]->pdf+s;
+         nSel = 0;
+         for (m=1,me=se->spdf.cpdf+1; m<=se->nMix; m++,me++) {
+            sel[m] = FALSE; dist[m] = -1.0;
+            if (MixLogWeight(hset,me->weight)<=LMINMIX) continue;
+            mp = me->mpdf; d = 0.0;
+            for (i=1; i<=D; i++) {
+               t = cent[i]-mp->mean[i]; d += t*t*IVar(mp,i);
+            }
+            dist[m] = d/D;
+            if (dist[m]<=gsThresh) sel[m] = TRUE, nSel++;
+         }
+         for (; nSel<gsMinMix; nSel++) {   /* keep the nearest */
+            for (m=1,best=0; m<=se->nMix; m++)
+               if (!sel[m] && dist[m]>=0.0 && (best==0 || dist[m]<dist[best]))
+                  best = m;
+            if (best==0) break;
+            sel[best] = TRUE;
+         }
+         for (m=1; m<=se->nMix; m++)
+            if (sel[m]) buf[n++] = m;
+      }
+      off[gs->nIdx] = n;
+      st->list[c] = (short *) New(x,(n>0?n:1)*sizeof(short));
+      for (k=0; k<n; k++) st->list[c][k] = buf[k];
+      nSum += n;
+   }
+   if (trace&T_BUILD) {
+      for (k=0; k<gs->nIdx; k++) nTotal += st->nMix[k];
+      printf("HGSel: stream %d, %d codewords, %.2f of %.2f comps per state\n",
+             s,st->nCode,nSum/((double)st->nCode*nState),nTotal/nState);
+      fflush(stdout);
+   }
+}
+
+/* EXPORT->CreateGSIndex: build the selection index for hset */
+GSIndex *CreateGSIndex(MemHeap *x, HMMSet *hset)
+{
+   GSIndex *gs;
+   MemHeap tmp;
+   HMMScanState hss;
+   StateInfo **state;
+   MixPDF **mix;
+   char name[MAXSTRLEN];
+   int s,k,K,G = 0,maxMix = 1;
+
+   if (!initDone || !gsSelect || !CheckGSelSet(hset))
+      return NULL;
+   gs = (GSIndex *) New(x,sizeof(GSIndex));
+   gs->hset = hset;
+   gs->nStream = hset->swidth[0];
+   CreateHeap(&tmp,"GSel build heap",MSTAK,1,1.0,100000,1000000);
+
+   /* map each sIdx to its state */
+   gs->nIdx = 0;
+   NewHMMScan(hset,&hss);
+   while (GoNextState(&hss,FALSE)) {
+      if (hss.si->sIdx<0)
+         HError(6191,"CreateGSIndex: state has no index");
+      if (hss.si->sIdx>=gs->nIdx) gs->nIdx = hss.si->sIdx+1;
+      for (s=1; s<=gs->nStream; s++)
+         if (hss.si->pdf[s].nMix>maxMix) maxMix = hss.si->pdf[s].nMix;
+   }
+   EndHMMScan(&hss);
+   state = (StateInfo **) New(&tmp,gs->nIdx*sizeof(StateInfo *));
+   for (k=0; k<gs->nIdx; k++) state[k] = NULL;
+   NewHMMScan(hset,&hss);
+   while (GoNextState(&hss,FALSE))
+      state[hss.si->sIdx] = hss.si;
+   EndHMMScan(&hss);
+
+   /* codebook */
+   if (gsCodebook[0]!='\0')
+      LoadCodebook(x,&tmp,gs);
+   else {
+      K = 2;
+      while (K<gsCodewords) K *= 2;
+      sprintf(name,"<gsel-%d>",++gsNum);
+      gs->vq = CreateVQTab(name,0,binTree,INVDIAGC,hset->swidth);
+      for (s=1; s<=gs->nStream; s++) {
+         mix = CollectMix(&tmp,hset,s,&G);
+         if (G==0)
+            HError(6191,"CreateGSIndex: no components in stream %d",s);
+         BuildTree(x,&tmp,gs->vq,s,hset->swidth[s],mix,G,K,gs->st+s);
+      }
+   }
+
+   for (s=1; s<=gs->nStream; s++)
+      BuildLists(x,&tmp,gs,s,state,maxMix);
+   DeleteHeap(&tmp);
+   return gs;
+}
+
+/* ------------------------- Selection -------------------------- */
+
+/* EXPORT->ResetGSel: attach g to gs and clear its counters */
+void ResetGSel(GSSel *g, GSIndex *gs)
+{
+   g->gs = gs;
+   g->checkCount = gsCheck;
+   g->nFrames = g->nState = g->nFloor = g->nCheck = 0;
+   g->nFull = g->nEval = g->sumErr = g->maxErr = 0.0;
+   g->frame = g->last = -1;
+}
+
+/* EXPORT->GSelFrames: quantise the frames of x[0..n-1] not yet seen */
+void GSelFrames(GSSel *g, Observation **x, int n, long frame)
+{
+   long f;
+
+   if (g->gs==NULL) return;
+   if (n>GSMAXBLOCK)
+      HError(6191,"GSelFrames: block of %d frames, max %d",n,GSMAXBLOCK);
+   if (frame <= g->frame || frame > g->last+1)   /* not a continuation */
+      g->last = frame-1;
+   g->frame = frame;
+   for (f=g->last+1; f<frame+n; f++)
+      GetVQ(g->gs->vq,g->gs->nStream,x[f-frame]->fv,g->code[f%GSMAXBLOCK]);
+   if (frame+n-1 > g->last) g->last = frame+n-1;
+   g->nFrames++;
+}
+
+/* EXPORT->GSelList: return shortlist for stream s of state sIdx in frame t */
+short *GSelList(GSSel *g, int t, int s, int sIdx, int *n)
+{
+   GSStream *st = g->gs->st+s;
+   int c, *off;
+
+   if (sIdx<0 || sIdx>=g->gs->nIdx)
+      HError(6191,"GSelList: state index %d out of range",sIdx);
+   c = g->code[(g->frame+t)%GSMAXBLOCK][s];
+   off = st->off+c*(g->gs->nIdx+1)+sIdx;
+   *n = off[1]-off[0];
+   g->nState++;
+   g->nEval += *n; g->nFull += st->nMix[sIdx];
+   if (*n==0) g->nFloor++;
+   return st->list[c]+off[0];
+}
+
+/* EXPORT->GSelFloor: outp of a state with an empty shortlist */
+LogFloat GSelFloor(GSSel *g)
+{
+   return gsFloor;
+}
+
+/* EXPORT->GSelCheckDue: TRUE if the state just selected should be checked */
+Boolean GSelCheckDue(GSSel *g)
+{
+   if (gsCheck<=0 || --g->checkCount>0)
+      return FALSE;
+   g->checkCount = gsCheck;
+   return TRUE;
+}
+
+/* EXPORT->GSelAccError: accumulate error of selected outp sel */
+void GSelAccError(GSSel *g, LogFloat full, LogFloat sel)
+{
+   double e = fabs(full-sel);
+
+   g->nCheck++; g->sumErr += e;
+   if (e>g->maxErr) g->maxErr = e;
+}
+
+/* EXPORT->ReportGSel: print and clear the counters of g */
+void ReportGSel(FILE *f, GSSel *g)
+{
+   if ((trace&T_STATS) && g->gs!=NULL && g->nState>0 && g->nFull>0) {
+      fprintf(f," GSel: %ld frames, %.2f of %.2f comps per state (%.1f%%), %ld/%ld floored\n",
+              g->nFrames,g->nEval/g->nState,g->nFull/g->nState,
+              100.0*g->nEval/g->nFull,g->nFloor,g->nState);
+      if (g->nCheck>0)
+         fprintf(f," GSel: %ld checks, |full-sel| mean %.4f max %.4f\n",
+                 g->nCheck,g->sumErr/g->nCheck,g->maxErr);
+   }
+   ResetGSel(g,g->gs);
+}
+
+/* ------------------------ End of HGSel.c ------------------------ */
@@ -0,0 +1,152 @@
+/* ----------------------------------------------------------- */
+/*                                                             */
+/*                          ___                                */
+/*                       |_| | |_/   SPEECH                    */
+/*                       | | | | \   RECOGNITION               */
+/*                       =========   SOFTWARE                  */
+/*                                                             */
+/*                                                             */
+/* ----------------------------------------------------------- */
+/* developed at:                                               */
+/*                                                             */
+/*           Speech Vision and Robotics group                  */
+/*           (now Machine Intelligence Laboratory)             */
+/*           Cambridge University Engineering Department       */
+/*           http://mi.eng.cam.ac.uk/                          */
+/*                                                             */
+/*           Entropic Cambridge Research Laboratory            */
+/*           (now part of Microsoft)                           */
+/*                                                             */
+/* ----------------------------------------------------------- */
+/*           Copyright: Microsoft Corporation                  */
+/*            1995-2000 Redmond, Washington USA                */
+/*                      http://www.microsoft.com               */
+/*                                                             */
+/*           Copyright: Cambridge University                   */
+/*                      Engineering Department                 */
+/*            2001-2015 Cambridge, Cambridgeshire UK           */
+/*                      http://www.eng.cam.ac.uk               */
+/*                                                             */
+/*   Use of this software is governed by a License Agreement   */
+/*    ** See the file License for the Conditions of Use  **    */
+/*    **     This banner notice must not be removed      **    */
+/*                                                             */
+/* ----------------------------------------------------------- */
+/*          File: HGSel.h  Gaussian selection shortlists       */
+/* ----------------------------------------------------------- */
+
+/* !HVER!HGSel:   3.5.0 [CUED 12/10/15] */
+
+/*
+   This module provides Gaussian selection for large multiple mixture
+   systems.  The feature space of each stream is partitioned by a VQ
+   codebook and for every codeword and every state a shortlist of the
+   mixture components that lie near the codeword centroid is stored.
+   At run time each frame is quantised once and the output probability
+   of a state is computed from the components in its shortlist only.
+
+   The codebook is either loaded from an HVQ table (GSCODEBOOK) or,
+   by default, built from the model means as a binary tree of
+   GSCODEWORDS leaves.  A component m is placed in the shortlist of
+   codeword c if
+
+        1/D sum_i (c_i - mu_mi)^2 / var_mi  <=  GSTHRESH
+
+   and at least the GSMINMIX nearest components are always kept.  A
+   state whose shortlist is empty scores GSFLOOR.  Every GSCHECK'th
+   selected state is also scored in full and the difference is
+   reported with the Gaussian counts when TRACE is set.
+
+   Only PLAINHS/SHAREDHS sets with diagonal covariances are supported;
+   the index is keyed on StateInfo.sIdx so it must be created after any
+   renumbering of the states.
+*/
+
+#ifndef _HGSEL_H_
+#define _HGSEL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GSMAXBLOCK 16           /* max frames quantised in one call */
+
+typedef struct _GSIndex GSIndex;   /* codebook + shortlists (HGSel.c) */
+
+typedef struct {                /* per recogniser selection state */
+   GSIndex *gs;                 /* index in use, NULL if disabled */
+   short code[GSMAXBLOCK][SMAX];/* codewords, ring indexed by frame % GSMAXBLOCK */
+   long frame;                  /* first frame of the current block */
+   long last;                   /* last frame quantised */
+   int checkCount;              /* states until next full check */
+   long nFrames;                /* frames quantised */
+   long nState;                 /* states scored from shortlists */
+   long nFloor;                 /* states with an empty shortlist */
+   double nFull;                /* components a full evaluation needs */
+   double nEval;                /* components actually evaluated */
+   long nCheck;                 /* number of full checks */
+   double sumErr;               /* sum of |full - selected| */
+   double maxErr;               /* max of |full - selected| */
+} GSSel;
+
+void InitGSel(void);
+/*
+   Initialise module, requires HVQ to be initialised
+*/
+
+GSIndex *CreateGSIndex(MemHeap *x, HMMSet *hset);
+/*
+   Create the Gaussian selection index for hset in x.  Returns NULL
+   if Gaussian selection is not enabled (GSELECT) or the set is not
+   supported.
+*/
+
+void ResetGSel(GSSel *g, GSIndex *gs);
+/*
+   Attach g to index gs (may be NULL) and clear its counters
+*/
+
+void GSelFrames(GSSel *g, Observation **x, int n, long frame);
+/*
+   Make x[0..n-1], frames frame..frame+n-1, the current block for
+   GSelList.  When the block overlaps the previous one (a sliding
+   window advanced by one or more frames) only the new frames are
+   quantised.
+*/
+
+short *GSelList(GSSel *g, int t, int s, int sIdx, int *n);
+/*
+   Return the shortlist of 1-based mixture indices for stream s of
+   state sIdx in frame t of the last GSelFrames block.  Its length
+   is returned in n; if it is zero GSelFloor should be used.
+*/
+
+LogFloat GSelFloor(GSSel *g);
+/*
+   Return the log likelihood used for a state with an empty shortlist
+*/
+
+Boolean GSelCheckDue(GSSel *g);
+/*
+   Return TRUE if the state just selected should also be scored in
+   full and passed to GSelAccError
+*/
+
+void GSelAccError(GSSel *g, LogFloat full, LogFloat sel);
+/*
+   Accumulate the error of a selected output probability
+*/
+
+void ReportGSel(FILE *f, GSSel *g);
+/*
+   Print the speed/accuracy counters of g to f (if tracing) and
+   clear them
+*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* _HGSEL_H_ */
+
+/* ------------------------ End of HGSel.h ----------------------- */
@@ -97,6 +97,8 @@ static void ReadRNLM(LModel* lm, char* fn, Boolean usefrnnlm)
    rnlm->lmstate = NULL;
    rnlm->curlmste = NULL;
    rnlm->heap = lm->heap;
+   rnlm->nHit = rnlm->nMiss = 0;
+   rnlm->nBatch = rnlm->nBatchFwd = 0;
 
    if (!ReadString(&src, buf)) {
       HError(8110, "ReadRNLM: Can't read header from RNNLM file %s", fn);
@@ -357,6 +359,7 @@ float UpdateRNNLMCache(LModel *lm, char **hist, RNNLM *rnnlm, int wdID, char *wo
 #endif
    /* if ngrams of matching history found */
    if (ne && ne->nse == rnnlm->out_num_word) {
+      lm->data.rnlm->nHit++;
 #if 0
       fprintf(stdout, "Found ngrams in cache : P(");
       for (j=1; j<hSize2; j++) {
@@ -397,6 +400,7 @@ float UpdateRNNLMCache(LModel *lm, char **hist, RNNLM *rnnlm, int wdID, char *wo
    }
    /* otherwise cache ngrams */
    else {      
+      lm->data.rnlm->nMiss++;
       /* if not at the start/initial node of the lattice */
       if ((LModel *)lm->data.rnlm->curlmste != NULL) { 
 #if 0
@@ -558,6 +562,20 @@ float UpdateRNNLMCache(LModel *lm, char **hist, RNNLM *rnnlm, int wdID, char *wo
 }
 
 
+/* PrintRNLMCacheStats: report and clear the history cache counts */
+static void PrintRNLMCacheStats(RNLM *rnlm)
+{
+   long n = rnlm->nHit + rnlm->nMiss;
+
+   printf("RNNLM history cache: %ld lookups, %ld hits (%.1f%%), %ld single misses, "
+          "%ld histories in %ld batches\n", n, rnlm->nHit,
+          (n > 0) ? 100.0*rnlm->nHit/n : 0.0, rnlm->nMiss,
+          rnlm->nBatchFwd, rnlm->nBatch);
+   fflush(stdout);
+   rnlm->nHit = rnlm->nMiss = 0;
+   rnlm->nBatch = rnlm->nBatchFwd = 0;
+}
+
 /* GetRNNLMProb: computing RNN LM prob */
 float GetRNNLMProb(LModel* lm , LabId prid[NSIZE], LabId wdid)
 /* Given   word prid, return prob p(wdid | prid ... <s> )
@@ -699,5 +717,97 @@ LogFloat LMTrans_RNNLM (LModel *lm, LMState src, LabId wdid, LMState *dest)
    return prob;
 }
 
+/* LMPrefetch_RNNLM
+
+     fill the history cache for the n states src in batches.  As in
+     UpdateRNNLMCache a history is computed from the future hidden
+     vector cached for the history one word shorter; states without
+     that, or already cached, are left to LMTrans_RNNLM.
+*/
+static void LMPrefetch_RNNLM (LModel *lm, int n, LMState *src)
+{
+   int i, j, k, nb, l1, nout;
+   RNLM *rnlm = lm->data.rnlm;
+   RNNLM *rnnlm = (RNNLM *) rnlm->rnnlm;
+   NGramLM *nglm = ((LModel *) rnlm->cache)->data.ngram;
+   lmId (*ndx)[MLP_NSIZE+1];
+   NEntry *ste, *ne, *ne_prev;
+   LabId wdid, startid;
+   SEntry *cse;
+   int *prID;
+   float **hin, **hout, **outP, *buf;
+
+#ifdef MLPLMPROBNORM
+   return;
 #endif
+   if (rnnlmUseHVDist || rnlm->curlmste == NULL || !isProbTableCached())
+      return;
+   /* leave resetting a full cache to UpdateRNNLMCache */
+   if (nglm->heap->totAlloc > 1073741824)
+      return;
+   startid = GetLabId("<s>", FALSE);
+
+   ndx = New(&gstack, n * sizeof(*ndx));
+   prID = (int *) New(&gstack, n * sizeof(int));
+   hin = (float **) New(&gstack, 3 * n * sizeof(float *));
+   hout = hin + n; outP = hout + n;
+   for (k = nb = 0; k < n; k++) {
+      if ((ste = (NEntry *) src[k]) == NULL)
+         continue;
+      /* RNN LM history context, as built by GetRNNLMProb */
+      memset(ndx[nb], 0, sizeof(ndx[nb]));
+      for (i=0; i<MLP_NSIZE; i++) {
+         wdid = (i < MLP_NSIZE-1 && ste->word[i] != 0) ? rnlm->wdlist[ste->word[i]] : NULL;
+         if (!wdid && padStartWord)
+            wdid = startid;
+         if (!wdid)
+            break;
+         ndx[nb][i+1] = RNNLMInVocabMap(rnnlm, wdid->name);
+      }
+      if (i < MLP_NSIZE)
+         continue;
+      ne = GetNEntry2_RNNLM(nglm, ndx[nb]+1, FALSE, ACTUAL_MLP_NSIZE, NULL, NULL);
+      if (ne && ne->nse == rnnlm->out_num_word)
+         continue;
+      ne_prev = GetNEntry2_RNNLM(nglm, ndx[nb]+2, FALSE, ACTUAL_MLP_NSIZE, NULL, NULL);
+      if (!ne_prev || ne_prev->nse != rnnlm->out_num_word)
+         continue;
+      prID[nb] = ndx[nb][1];
+      hin[nb] = ne_prev->rnnlm_fhist + 1;
+      ++nb;
+   }
+
+   if (nb > 0) {
+      l1 = GetRNNLMHiddenVectorSize(rnnlm);
+      nout = (rnnlm->out_num_word > rnnlm->layer2_size) ? rnnlm->out_num_word : rnnlm->layer2_size;
+      buf = (float *) New(&gstack, (size_t) nb * (l1 + nout) * sizeof(float));
+      for (k=0; k<nb; k++) {
+         hout[k] = buf; buf += l1;
+         outP[k] = buf; buf += nout;
+      }
+      RNNLMAcceptWordBatch(rnnlm, nb, hin, prID, hout, outP);
+
+      for (k=0; k<nb; k++) {
+         ne = GetNEntry2_RNNLM(nglm, ndx[k]+1, TRUE, ACTUAL_MLP_NSIZE, NULL, NULL);
+         if (ne->nse == rnnlm->out_num_word)     /* repeated in this batch */
+            continue;
+         ne->se = (SEntry *) New(nglm->heap, rnnlm->out_num_word * sizeof(SEntry));
+         ne->nse = rnnlm->out_num_word;
+         for (i=0, cse=ne->se; i<rnnlm->out_num_word; i++, cse++) {
+            cse->prob = outP[k][i];
+            cse->word = (lmId) i;
+         }
+         ne->rnnlm_hist = CreateVector(nglm->heap, l1);
+         ne->rnnlm_fhist = CreateVector(nglm->heap, l1);
+         for (j=1; j<=l1; j++) {
+            ne->rnnlm_hist[j] = hin[k][j-1];
+            ne->rnnlm_fhist[j] = hout[k][j-1];
+         }
+      }
+      ++rnlm->nBatch;
+      rnlm->nBatchFwd += nb;
+   }
+   Dispose(&gstack, ndx);
+}
 
+#endif
@@ -50,6 +50,7 @@ char *hlm_vc_id = "$Id: HLM.c,v 1.1.1.1 2015/12/18 18:18:18 xl207 Exp $";
 /* --------------------------- Trace Flags ------------------------- */
 
 #define T_TIO 1  /* Progress tracing whilst performing IO */
+#define T_RNC 2  /* RNN LM history cache statistics */
 
 static int trace=0;
 
@@ -1482,6 +1483,8 @@ void ResetMLPLMCache(LModel *lm)
       }
       if (((LModel *)ilang->lms[i])->type == rnnLM) {
          rnlm = ((LModel *)ilang->lms[i])->data.rnlm;
+         if (trace&T_RNC)
+            PrintRNLMCacheStats(rnlm);
          /* ngram cache */
          ResetHeap( ((LModel *) rnlm->cache)->heap );
          ((LModel *) rnlm->cache)->data.ngram =
@@ -1510,6 +1513,8 @@ void ResetMLPLMCache(LModel *lm)
     
    if(lm->type == rnnLM) {
       rnlm = ((LModel *) lm)->data.rnlm;
+      if (trace&T_RNC)
+         PrintRNLMCacheStats(rnlm);
       /* ngram cache */
       ResetHeap( ((LModel *) rnlm->cache)->heap );
       ((LModel *) rnlm->cache)->data.ngram =
@@ -2105,6 +2110,17 @@ LogFloat LMTrans (LModel *lm, LMState src, LabId wdid, LMState *dest, LMState *s
    }
 }
 
+/* LMPrefetch
+
+     prepare transitions out of the n states src; only RNN LMs do
+     anything, filling their history cache in one batch
+*/
+void LMPrefetch (LModel *lm, int n, LMState *src)
+{
+   if (lm->type == rnnLM)
+      LMPrefetch_RNNLM (lm, n, src);
+}
+
 #endif
 
 
@@ -165,6 +165,8 @@ typedef struct {
                                    history in RNNLM to compute P(w_i+1 | w_i, v_{i-1, ..., 1})
                                    generated AFTER computing P(w_i | w_i-1, v_{i-2, ..., 1})
                                  */
+   long nHit, nMiss;            /* history cache lookups found / computed singly */
+   long nBatch, nBatchFwd;      /* batched cache fills and histories they computed */
    MemHeap *heap ;  
 } RNLM;
 
@@ -249,6 +251,12 @@ void ResetMLPLMCache(LModel *lm);
 typedef Ptr LMState;
 
 LogFloat LMTrans (LModel *lm, LMState src, LabId wdid, LMState *dest, LMState *src_mix, LMState *dest_mix);
+
+void LMPrefetch (LModel *lm, int n, LMState *src);
+/*
+   Prepare the transitions out of the n states src ahead of LMTrans();
+   RNN LMs evaluate all the missing histories as one batch.
+*/
 #endif
 
 #ifdef __cplusplus
@@ -1095,6 +1095,27 @@ static SubLNode *FindAddSubLNode (MemHeap *heap, LNode *ln, LMState lmstate, LMS
 }
 
 
+/* PrefetchSubLNodes
+
+     let the LM prepare the transitions out of all sub-nodes of ln at once
+*/
+static void PrefetchSubLNodes (LModel *lm, LNode *ln)
+{
+   int n;
+   SubLNode *sln;
+   LMState *src;
+
+   for (n = 0, sln = (SubLNode *) ln->hook; sln; sln = sln->next)
+      ++n;
+   if (n == 0)
+      return;
+   src = (LMState *) New (&gcheap, n * sizeof(LMState));
+   for (n = 0, sln = (SubLNode *) ln->hook; sln; sln = sln->next)
+      src[n++] = sln->data.lmstate;
+   LMPrefetch (lm, n, src);
+   Dispose (&gcheap, src);
+}
+
 /* EXPORT->LatExpand
 
      expand lattice using new (typically higher-order) language Model
@@ -1141,6 +1162,8 @@ Lattice *LatExpand (MemHeap *heap, Lattice *lat, LModel *lm)
    /* create lists of sub-nodes and sub-arcs and count them as we go along */
    for (i = 0; i < lat->nn; ++i) {
       ln = topOrder[i];
+      if (ln->foll)
+         PrefetchSubLNodes (lm, ln);
       for (startSLN = (SubLNode *) ln->hook; startSLN; startSLN = startSLN->next) {
          /* for each outgoing arc from current subLNode */
          for (la = ln->foll; la; la = la->farc) {
@@ -65,11 +65,14 @@ char *hmath_vc_id = "$Id: HMath.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $";
 #include "mkl_lapacke.h"
 #endif
 
+#include <pthread.h>
+
 /* ----------------------------- Trace Flags ------------------------- */
 
 static int trace = 0;
 
 #define T_DIM   0002        /* Matrix/Vector dimension checking */
+#define T_GEMM  0004        /* Report the selected CPU GEMM kernel */
 /* cz277 - 1004 */
 #define MAXSVDITER 30
 #define SIGN(a, b) (b > 0.0 ? fabs(a): -fabs(a))
@@ -88,6 +91,9 @@ static int numParm = 0;
 static int nMKLThreads = 1;             /* the number of threads used by CPU LAPACK/BLAS kernels (MKL) */
 static char *nMKLThreadEnvVar = "";
 #endif
+#define MAXGEMMTHREADS 64
+static int nGemmThreads = 1;            /* the number of threads used by the CPU GEMM engine */
+static char *gemmKernelName = "AUTO";   /* CPU GEMM micro-kernel: AUTO, AVX512, AVX2 or GENERIC */
 static NMatrix *tmpNMat = NULL;         /* the pointer to the temp matrix */
 static NVector *tmpNVec = NULL;
 static int tmpRowNum = 1;               /* the row number of the temp matrix*/
@@ -1749,6 +1755,7 @@ float CumGauss(float x, float mean, float var)
 void InitMath(void)
 {
    int i;
+   char buf[MAXSTRLEN];
 #ifdef MKL
    ConfParam *cpVal;
 #endif
@@ -1770,6 +1777,13 @@ void InitMath(void)
               HError(5222, "InitMath: Unknown NMKLTHREADS value kind");
       }
 #endif
+      if (GetConfInt(cParm, numParm, "NGEMMTHREADS", &i)) {
+         if (i < 1 || i > MAXGEMMTHREADS)
+            HError(5222, "InitMath: NGEMMTHREADS should be in [1, %d]", MAXGEMMTHREADS);
+         nGemmThreads = i;
+      }
+      if (GetConfStr(cParm, numParm, "GEMMKERNEL", buf))
+         gemmKernelName = CopyString(&gcheap, buf);
    }
 }
 
@@ -3933,16 +3947,377 @@ void FindMaxElement(NMatrix *srcMat, int row, int col, IntVec resVec) {
     
 }
 
-static void HNBlasNNgemmCPU(int m, int n, int k, NFloat alpha, NFloat *A, NFloat *B, NFloat beta, NFloat *C) {
-    int i, j, l;
+/* ---------------------- Blocked CPU GEMM engine --------------------- */
 
-    for (i = 0; i < n; ++i) {
-        for (j = 0; j < m; ++j) {
-            C[i * m + j] *= beta;
-            for (l = 0; l < k; ++l) 
-                C[i * m + j] += alpha * A[l * m + j] * B[i * k + l];
-        }
-    }
+/*
+   Used by the HNBlas??gemm routines when neither CUDA nor MKL is
+   available.  All matrices are column major and the engine computes
+   C = alpha * op(A) * op(B) + beta * C with the usual three levels of
+   blocking: a KC x NC block of op(B) is packed into panels of NR
+   columns, an MC x KC block of op(A) into panels of MR rows, and a
+   register blocked micro-kernel then updates one MR x NR tile of C
+   from a pair of panels.  The micro-kernel (AVX-512, AVX2+FMA or
+   portable C) is selected at run time from the CPU features, or
+   forced by GEMMKERNEL.  When NGEMMTHREADS > 1, C is split into
+   column (or, for tall thin products, row) strips which are
+   computed concurrently, each thread with its own packing buffers.
+   The engine is selected once (pthread_once) on first use; callers
+   on different threads share the packing buffers, so gemmLock lets
+   one product run at a time.
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMM_X86
+#include <immintrin.h>
+#endif
+
+#define GEMMTHREADFLOPS 1.0e6        /* smallest m*n*k worth splitting */
+#define GEN_MR 8                     /* portable micro-kernel tile */
+#define GEN_NR 4
+
+typedef void (*GemmKernel)(int kc, const NFloat *Ap, const NFloat *Bp, NFloat alpha, NFloat *C, int ldc);
+
+typedef struct {
+   char *name;                /* reported by trace and GEMMKERNEL */
+   int mr, nr;                /* register tile of the micro-kernel */
+   int mc, kc, nc;            /* cache blocking of op(A) and op(B) */
+   GemmKernel kernel;
+} GemmEngine;
+
+typedef struct {
+   int m, n, k;               /* C is m x n, inner dimension k */
+   NFloat alpha, beta;
+   const NFloat *A;           /* op(A)[i,l] = A[i*rsA + l*csA] */
+   int rsA, csA;
+   const NFloat *B;           /* op(B)[l,j] = B[l*rsB + j*csB] */
+   int rsB, csB;
+   NFloat *C;
+   int ldc;
+   int slot;                  /* index of the packing buffers used */
+} GemmTask;
+
+static GemmEngine *gemmEngine = NULL;
+static NFloat *gemmPackA[MAXGEMMTHREADS];
+static NFloat *gemmPackB[MAXGEMMTHREADS];
+static pthread_once_t gemmOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t gemmLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* GemmKernelGeneric: portable GEN_MR x GEN_NR micro-kernel, C += alpha*Ap*Bp */
+static void GemmKernelGeneric(int kc, const NFloat *Ap, const NFloat *Bp, NFloat alpha, NFloat *C, int ldc)
+{
+   NFloat ab[GEN_MR * GEN_NR];
+   int i, j, l;
+
+   memset(ab, 0, sizeof(ab));
+   for (l = 0; l < kc; ++l, Ap += GEN_MR, Bp += GEN_NR)
+      for (j = 0; j < GEN_NR; ++j)
+         for (i = 0; i < GEN_MR; ++i)
+            ab[j * GEN_MR + i] += Ap[i] * Bp[j];
+   for (j = 0; j < GEN_NR; ++j)
+      for (i = 0; i < GEN_MR; ++i)
+         C[j * ldc + i] += alpha * ab[j * GEN_MR + i];
+}
+
+#ifdef GEMM_X86
+
+#ifdef DOUBLEANN
+#define V2_T __m256d
+#define V2_LOAD _mm256_loadu_pd
+#define V2_STORE _mm256_storeu_pd
+#define V2_SET1 _mm256_set1_pd
+#define V2_ZERO _mm256_setzero_pd
+#define V2_FMA _mm256_fmadd_pd
+#define V2_LANES 4
+#define V5_T __m512d
+#define V5_LOAD _mm512_loadu_pd
+#define V5_STORE _mm512_storeu_pd
+#define V5_SET1 _mm512_set1_pd
+#define V5_ZERO _mm512_setzero_pd
+#define V5_FMA _mm512_fmadd_pd
+#define V5_LANES 8
+#else
+#define V2_T __m256
+#define V2_LOAD _mm256_loadu_ps
+#define V2_STORE _mm256_storeu_ps
+#define V2_SET1 _mm256_set1_ps
+#define V2_ZERO _mm256_setzero_ps
+#define V2_FMA _mm256_fmadd_ps
+#define V2_LANES 8
+#define V5_T __m512
+#define V5_LOAD _mm512_loadu_ps
+#define V5_STORE _mm512_storeu_ps
+#define V5_SET1 _mm512_set1_ps
+#define V5_ZERO _mm512_setzero_ps
+#define V5_FMA _mm512_fmadd_ps
+#define V5_LANES 16
+#endif
+
+/* one column of the tile: two vectors of A times a broadcast of B */
+#define GEMM_COL(V, j) b = V##_SET1(Bp[j]); \
+   c0_##j = V##_FMA(a0, b, c0_##j); c1_##j = V##_FMA(a1, b, c1_##j)
+#define GEMM_OUT(V, j) \
+   V##_STORE(C + j * ldc, V##_FMA(c0_##j, va, V##_LOAD(C + j * ldc))); \
+   V##_STORE(C + j * ldc + V##_LANES, V##_FMA(c1_##j, va, V##_LOAD(C + j * ldc + V##_LANES)))
+
+/* GemmKernelAVX2: (2*V2_LANES) x 6 micro-kernel using 12 accumulators */
+__attribute__((target("avx2,fma")))
+static void GemmKernelAVX2(int kc, const NFloat *Ap, const NFloat *Bp, NFloat alpha, NFloat *C, int ldc)
+{
+   V2_T c0_0 = V2_ZERO(), c0_1 = V2_ZERO(), c0_2 = V2_ZERO(), c0_3 = V2_ZERO(), c0_4 = V2_ZERO(), c0_5 = V2_ZERO();
+   V2_T c1_0 = V2_ZERO(), c1_1 = V2_ZERO(), c1_2 = V2_ZERO(), c1_3 = V2_ZERO(), c1_4 = V2_ZERO(), c1_5 = V2_ZERO();
+   V2_T a0, a1, b, va;
+   int l;
+
+   for (l = 0; l < kc; ++l, Ap += 2 * V2_LANES, Bp += 6) {
+      a0 = V2_LOAD(Ap);
+      a1 = V2_LOAD(Ap + V2_LANES);
+      GEMM_COL(V2, 0); GEMM_COL(V2, 1); GEMM_COL(V2, 2);
+      GEMM_COL(V2, 3); GEMM_COL(V2, 4); GEMM_COL(V2, 5);
+   }
+   va = V2_SET1(alpha);
+   GEMM_OUT(V2, 0); GEMM_OUT(V2, 1); GEMM_OUT(V2, 2);
+   GEMM_OUT(V2, 3); GEMM_OUT(V2, 4); GEMM_OUT(V2, 5);
+}
+
+/* GemmKernelAVX512: (2*V5_LANES) x 12 micro-kernel using 24 accumulators */
+__attribute__((target("avx512f")))
+static void GemmKernelAVX512(int kc, const NFloat *Ap, const NFloat *Bp, NFloat alpha, NFloat *C, int ldc)
+{
+   V5_T c0_0 = V5_ZERO(), c0_1 = V5_ZERO(), c0_2 = V5_ZERO(), c0_3 = V5_ZERO(), c0_4 = V5_ZERO(), c0_5 = V5_ZERO();
+   V5_T c0_6 = V5_ZERO(), c0_7 = V5_ZERO(), c0_8 = V5_ZERO(), c0_9 = V5_ZERO(), c0_10 = V5_ZERO(), c0_11 = V5_ZERO();
+   V5_T c1_0 = V5_ZERO(), c1_1 = V5_ZERO(), c1_2 = V5_ZERO(), c1_3 = V5_ZERO(), c1_4 = V5_ZERO(), c1_5 = V5_ZERO();
+   V5_T c1_6 = V5_ZERO(), c1_7 = V5_ZERO(), c1_8 = V5_ZERO(), c1_9 = V5_ZERO(), c1_10 = V5_ZERO(), c1_11 = V5_ZERO();
+   V5_T a0, a1, b, va;
+   int l;
+
+   for (l = 0; l < kc; ++l, Ap += 2 * V5_LANES, Bp += 12) {
+      a0 = V5_LOAD(Ap);
+      a1 = V5_LOAD(Ap + V5_LANES);
+      GEMM_COL(V5, 0); GEMM_COL(V5, 1); GEMM_COL(V5, 2); GEMM_COL(V5, 3);
+      GEMM_COL(V5, 4); GEMM_COL(V5, 5); GEMM_COL(V5, 6); GEMM_COL(V5, 7);
+      GEMM_COL(V5, 8); GEMM_COL(V5, 9); GEMM_COL(V5, 10); GEMM_COL(V5, 11);
+   }
+   va = V5_SET1(alpha);
+   GEMM_OUT(V5, 0); GEMM_OUT(V5, 1); GEMM_OUT(V5, 2); GEMM_OUT(V5, 3);
+   GEMM_OUT(V5, 4); GEMM_OUT(V5, 5); GEMM_OUT(V5, 6); GEMM_OUT(V5, 7);
+   GEMM_OUT(V5, 8); GEMM_OUT(V5, 9); GEMM_OUT(V5, 10); GEMM_OUT(V5, 11);
+}
+
+#endif  /* GEMM_X86 */
+
+static GemmEngine gemmEngines[] = {
+#ifdef GEMM_X86
+   {"AVX512", 2 * V5_LANES, 12, 16 * V5_LANES, 256, 4032, GemmKernelAVX512},
+   {"AVX2", 2 * V2_LANES, 6, 16 * V2_LANES, 256, 4032, GemmKernelAVX2},
+#endif
+   {"GENERIC", GEN_MR, GEN_NR, 16 * GEN_MR, 256, 4032, GemmKernelGeneric}
+};
+
+/* GemmEngineUsable: can the current CPU run the given engine */
+static Boolean GemmEngineUsable(GemmEngine *eng)
+{
+#ifdef GEMM_X86
+   if (strcmp(eng->name, "AVX512") == 0)
+      return __builtin_cpu_supports("avx512f") ? TRUE : FALSE;
+   if (strcmp(eng->name, "AVX2") == 0)
+      return (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ? TRUE : FALSE;
+#endif
+   return TRUE;
+}
+
+/* SelectGemmEngine: select the micro-kernel and allocate the packing buffers, run once */
+static void SelectGemmEngine(void)
+{
+   int i, numEng = sizeof(gemmEngines) / sizeof(GemmEngine);
+   size_t sizeA, sizeB;
+
+   for (i = 0; i < numEng; ++i) {
+      if (strcmp(gemmKernelName, "AUTO") != 0 && strcmp(gemmKernelName, gemmEngines[i].name) != 0)
+         continue;
+      if (GemmEngineUsable(&gemmEngines[i])) {
+         gemmEngine = &gemmEngines[i];
+         break;
+      }
+   }
+   if (gemmEngine == NULL) {
+      HError(-5222, "SelectGemmEngine: GEMMKERNEL %s not available, using GENERIC", gemmKernelName);
+      gemmEngine = &gemmEngines[numEng - 1];
+   }
+   sizeA = (size_t) gemmEngine->mc * gemmEngine->kc * sizeof(NFloat);
+   sizeB = (size_t) gemmEngine->nc * gemmEngine->kc * sizeof(NFloat);
+   /* malloc rather than gcheap, which may be in use on another thread */
+   for (i = 0; i < nGemmThreads; ++i) {
+      gemmPackA[i] = (NFloat *) malloc(sizeA);
+      gemmPackB[i] = (NFloat *) malloc(sizeB);
+      if (gemmPackA[i] == NULL || gemmPackB[i] == NULL)
+         HError(5205, "SelectGemmEngine: Cannot allocate GEMM packing buffers");
+   }
+   if (trace & T_GEMM)
+      printf("SelectGemmEngine: %s micro-kernel %dx%d, %d thread(s)\n", gemmEngine->name, gemmEngine->mr, gemmEngine->nr, nGemmThreads);
+}
+
+/* GetGemmEngine: the engine selected on first use */
+static GemmEngine *GetGemmEngine(void)
+{
+   pthread_once(&gemmOnce, SelectGemmEngine);
+   return gemmEngine;
+}
+
+/* PackGemmA: copy an mb x kb block of op(A) into zero padded panels of mr rows */
+static void PackGemmA(int mr, int mb, int kb, const NFloat *A, int rsA, int csA, NFloat *dst)
+{
+   int i, l, ir, mrr;
+   const NFloat *src;
+
+   for (ir = 0; ir < mb; ir += mr) {
+      mrr = MIN(mr, mb - ir);
+      for (l = 0; l < kb; ++l, dst += mr) {
+         src = A + ir * rsA + l * csA;
+         if (rsA == 1)
+            memcpy(dst, src, mrr * sizeof(NFloat));
+         else
+            for (i = 0; i < mrr; ++i)
+               dst[i] = src[i * rsA];
+         for (i = mrr; i < mr; ++i)
+            dst[i] = 0.0;
+      }
+   }
+}
+
+/* PackGemmB: copy a kb x nb block of op(B) into zero padded panels of nr columns */
+static void PackGemmB(int nr, int kb, int nb, const NFloat *B, int rsB, int csB, NFloat *dst)
+{
+   int j, l, jr, nrr;
+   const NFloat *src;
+
+   for (jr = 0; jr < nb; jr += nr) {
+      nrr = MIN(nr, nb - jr);
+      for (l = 0; l < kb; ++l, dst += nr) {
+         src = B + l * rsB + jr * csB;
+         if (csB == 1)
+            memcpy(dst, src, nrr * sizeof(NFloat));
+         else
+            for (j = 0; j < nrr; ++j)
+               dst[j] = src[j * csB];
+         for (j = nrr; j < nr; ++j)
+            dst[j] = 0.0;
+      }
+   }
+}
+
+/* GemmSerial: compute one task on the calling thread */
+static void GemmSerial(GemmEngine *eng, GemmTask *t)
+{
+   int i, j, ic, jc, pc, ir, jr, mb, nb, kb, mrr, nrr;
+   NFloat *packA = gemmPackA[t->slot], *packB = gemmPackB[t->slot], *Cp;
+   NFloat tile[32 * 12];      /* largest mr x nr of any engine */
+
+   if (t->beta != 1.0)
+      for (j = 0; j < t->n; ++j)
+         for (i = 0; i < t->m; ++i)
+            t->C[j * t->ldc + i] = (t->beta == 0.0) ? 0.0 : t->beta * t->C[j * t->ldc + i];
+   if (t->alpha == 0.0)
+      return;
+
+   for (jc = 0; jc < t->n; jc += eng->nc) {
+      nb = MIN(eng->nc, t->n - jc);
+      for (pc = 0; pc < t->k; pc += eng->kc) {
+         kb = MIN(eng->kc, t->k - pc);
+         PackGemmB(eng->nr, kb, nb, t->B + pc * t->rsB + jc * t->csB, t->rsB, t->csB, packB);
+         for (ic = 0; ic < t->m; ic += eng->mc) {
+            mb = MIN(eng->mc, t->m - ic);
+            PackGemmA(eng->mr, mb, kb, t->A + ic * t->rsA + pc * t->csA, t->rsA, t->csA, packA);
+            for (jr = 0; jr < nb; jr += eng->nr) {
+               nrr = MIN(eng->nr, nb - jr);
+               for (ir = 0; ir < mb; ir += eng->mr) {
+                  mrr = MIN(eng->mr, mb - ir);
+                  Cp = t->C + (size_t) (jc + jr) * t->ldc + ic + ir;
+                  if (mrr == eng->mr && nrr == eng->nr) 
+                     eng->kernel(kb, packA + ir * kb, packB + jr * kb, t->alpha, Cp, t->ldc);
+                  else {
+                     /* edge tile: compute into a scratch tile and add the valid part */
+                     memset(tile, 0, eng->mr * eng->nr * sizeof(NFloat));
+                     eng->kernel(kb, packA + ir * kb, packB + jr * kb, t->alpha, tile, eng->mr);
+                     for (j = 0; j < nrr; ++j)
+                        for (i = 0; i < mrr; ++i)
+                           Cp[(size_t) j * t->ldc + i] += tile[j * eng->mr + i];
+                  }
+               }
+            }
+         }
+      }
+   }
+}
+
+/* GemmThread: pthread entry point for one strip of C */
+static void *GemmThread(void *arg)
+{
+   GemmSerial(gemmEngine, (GemmTask *) arg);
+   return NULL;
+}
+
+/* GemmCPU: C = alpha * op(A) * op(B) + beta * C, column major, C is m x n */
+static void GemmCPU(Boolean transA, Boolean transB, int m, int n, int k, NFloat alpha, const NFloat *A, int lda, const NFloat *B, int ldb, NFloat beta, NFloat *C, int ldc)
+{
+   GemmEngine *eng = GetGemmEngine();
+   GemmTask task[MAXGEMMTHREADS];
+   pthread_t tid[MAXGEMMTHREADS];
+   int i, nThreads, tiles, step, start, len;
+   Boolean splitCols;
+
+   task[0].m = m; task[0].n = n; task[0].k = k;
+   task[0].alpha = alpha; task[0].beta = beta;
+   task[0].A = A; task[0].rsA = transA ? lda : 1; task[0].csA = transA ? 1 : lda;
+   task[0].B = B; task[0].rsB = transB ? ldb : 1; task[0].csB = transB ? 1 : ldb;
+   task[0].C = C; task[0].ldc = ldc; task[0].slot = 0;
+
+   nThreads = nGemmThreads;
+   if ((double) m * n * k < GEMMTHREADFLOPS * nThreads)
+      nThreads = 1;
+   pthread_mutex_lock(&gemmLock);
+   if (nThreads <= 1) {
+      GemmSerial(eng, &task[0]);
+      pthread_mutex_unlock(&gemmLock);
+      return;
+   }
+
+   /* split whichever dimension of C gives more micro-tiles */
+   splitCols = ((n + eng->nr - 1) / eng->nr >= (m + eng->mr - 1) / eng->mr) ? TRUE : FALSE;
+   tiles = splitCols ? (n + eng->nr - 1) / eng->nr : (m + eng->mr - 1) / eng->mr;
+   if (nThreads > tiles)
+      nThreads = tiles;
+   step = (tiles + nThreads - 1) / nThreads * (splitCols ? eng->nr : eng->mr);
+   for (i = 0, start = 0; i < nThreads; ++i, start += step) {
+      task[i] = task[0];
+      task[i].slot = i;
+      len = MIN(step, (splitCols ? n : m) - start);
+      if (len <= 0) {
+         nThreads = i;
+         break;
+      }
+      if (splitCols) {
+         task[i].n = len;
+         task[i].B = B + (size_t) start * task[0].csB;
+         task[i].C = C + (size_t) start * ldc;
+      }
+      else {
+         task[i].m = len;
+         task[i].A = A + (size_t) start * task[0].rsA;
+         task[i].C = C + start;
+      }
+   }
+   for (i = 1; i < nThreads; ++i)
+      if (pthread_create(&tid[i], NULL, GemmThread, &task[i]) != 0)
+         HError(5226, "GemmCPU: Failed to create GEMM thread %d", i);
+   GemmSerial(eng, &task[0]);
+   for (i = 1; i < nThreads; ++i)
+      if (pthread_join(tid[i], NULL) != 0)
+         HError(5226, "GemmCPU: Failed to join GEMM thread %d", i);
+   pthread_mutex_unlock(&gemmLock);
+}
+
+static void HNBlasNNgemmCPU(int m, int n, int k, NFloat alpha, NFloat *A, NFloat *B, NFloat beta, NFloat *C) {
+    GemmCPU(FALSE, FALSE, m, n, k, alpha, A, m, B, k, beta, C, m);
 }
 
 #ifdef MKL
@@ -3978,15 +4353,7 @@ void HNBlasNNgemm(int m, int n, int k, NFloat alpha, NMatrix *A, NMatrix *B, NFl
 }
 
 static void HNBlasNTgemmCPU(int m, int n, int k, NFloat alpha, NFloat *A, NFloat *B, NFloat beta, NFloat *C) {
-    int i, j, l;
-
-    for (i = 0; i < n; ++i) {
-        for (j = 0; j < m; ++j) {
-            C[i * m + j] *= beta;
-            for (l = 0; l < k; ++l) 
-                C[i * m + j] += alpha * A[l * m + j] * B[l * n + i];
-        }
-    }
+    GemmCPU(FALSE, TRUE, m, n, k, alpha, A, m, B, n, beta, C, m);
 }
 
 #ifdef MKL
@@ -4023,15 +4390,7 @@ void HNBlasNTgemm(int m, int n, int k, NFloat alpha, NMatrix *A, NMatrix *B, NFl
 }
 
 static void HNBlasTNgemmCPU(int m, int n, int k, NFloat alpha, NFloat *A, NFloat *B, NFloat beta, NFloat *C) {
-    int i, j, l;
-
-    for (i = 0; i < n; ++i) {
-        for (j = 0; j < m; ++j) {
-            C[i * m + j] *= beta;
-            for (l = 0; l < k; ++l) 
-                C[i * m + j] += alpha * A[j * k + l] * B[i * k + l];
-        }
-    }
+    GemmCPU(TRUE, FALSE, m, n, k, alpha, A, k, B, k, beta, C, m);
 }
 
 #ifdef MKL
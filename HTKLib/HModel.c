@@ -110,6 +110,7 @@ static int pde1BlockEnd = 13;          /* size of PDE blocks */
 static int pde2BlockEnd = 26;          /* size of PDE blocks */
 static LogFloat pdeTh1 = -5.0;         /* threshold for 1/3 PDE */
 static LogFloat pdeTh2 = 0.0;          /* threshold for 2/3 PDE */
+static char gaussKernel[MAXSTRLEN] = "AUTO"; /* scoring kernels: AUTO, AVX512, AVX2, GENERIC */
 
 #ifdef PDE_STATS
 static int nGaussTot = 0;
@@ -118,6 +119,7 @@ static int nGaussPDE2 = 0;
 #endif
 
 void InitSymNames(void);
+static void SelectGaussKernels(void);
 char *ActFunKind2Str(ActFunKind afkind, char *buf);
 char *LayerKind2Str(LayerKind layerKind, char *buf);
 
@@ -160,11 +162,13 @@ void InitModel(void)
          forceHSKind = TRUE;
       }
       if (GetConfBool(cParm,nParm,"REORDERCOMPS",&b)) reorderComps = b;
+      if (GetConfStr (cParm,nParm,"GAUSSKERNEL",buf)) strcpy(gaussKernel,buf);
       if (GetConfInt(cParm,nParm,"PDE1BLOCKEND",&i)) pde1BlockEnd = i;
       if (GetConfInt(cParm,nParm,"PDE2BLOCKEND",&i)) pde2BlockEnd = i;
       if (GetConfFlt(cParm,nParm,"PDETHRESHOLD1",&d)) pdeTh1 = d;
       if (GetConfFlt(cParm,nParm,"PDETHRESHOLD2",&d)) pdeTh2 = d;
    }
+   SelectGaussKernels();
 }
 
 /* cz277 - ANN */
@@ -9409,6 +9413,135 @@ void PrecomputeTMix(HMMSet *hset, Observation *x, float tmThresh, int topM)
    }
 }
 
+/* --------------- Quadratic Form Kernels (FULLC/LLTC/XFORMC) --------------- */
+
+/*
+   The full covariance, Choleski and transform cases reduce to dot
+   products and axpys over contiguous rows of a TriMat or Matrix.
+   The work vectors live on the stack (C99 arrays sized by the stream
+   width) so that no heap, and in particular no gstack, is touched
+   while scoring; this keeps the output probability functions safe to
+   call from several threads at once.  Kernels are selected once by
+   SelectGaussKernels in InitModel.
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GAUSS_X86
+#include <immintrin.h>
+#endif
+
+#define QUAD_FBLOCK 4           /* frames sharing each row load in MBlockOutP */
+
+typedef float (*DotKernel)(const float *a, const float *b, int n);
+typedef void (*Dot4Kernel)(const float *a, float **b, int n, float *res);
+typedef void (*AxpyKernel)(float s, const float *x, float *y, int n);
+
+/* DotGeneric: return a[0..n-1].b[0..n-1] */
+static float DotGeneric(const float *a, const float *b, int n)
+{
+   int i;
+   float s0=0.0,s1=0.0;
+
+   for (i=0; i+2<=n; i+=2) {
+      s0 += a[i]*b[i]; s1 += a[i+1]*b[i+1];
+   }
+   if (i<n) s0 += a[i]*b[i];
+   return s0+s1;
+}
+
+/* Dot4Generic: res[k] = a[0..n-1].b[k][0..n-1], k=0..3 */
+static void Dot4Generic(const float *a, float **b, int n, float *res)
+{
+   int i;
+   float s0=0.0,s1=0.0,s2=0.0,s3=0.0;
+
+   for (i=0; i<n; i++) {
+      s0 += a[i]*b[0][i]; s1 += a[i]*b[1][i];
+      s2 += a[i]*b[2][i]; s3 += a[i]*b[3][i];
+   }
+   res[0] = s0; res[1] = s1; res[2] = s2; res[3] = s3;
+}
+
+/* AxpyGeneric: y[0..n-1] += s*x[0..n-1] */
+static void AxpyGeneric(float s, const float *x, float *y, int n)
+{
+   int i;
+
+   for (i=0; i<n; i++) y[i] += s*x[i];
+}
+
+#ifdef GAUSS_X86
+
+/* HSum256: horizontal sum of the 8 lanes of v */
+__attribute__((target("avx2,fma")))
+static float HSum256(__m256 v)
+{
+   __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v,1));
+   s = _mm_add_ps(s, _mm_movehl_ps(s,s));
+   s = _mm_add_ss(s, _mm_shuffle_ps(s,s,1));
+   return _mm_cvtss_f32(s);
+}
+
+/* DotAVX2: as DotGeneric */
+__attribute__((target("avx2,fma")))
+static float DotAVX2(const float *a, const float *b, int n)
+{
+   int i;
+   float s;
+   __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+
+   for (i=0; i+16<=n; i+=16) {
+      a0 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i),_mm256_loadu_ps(b+i),a0);
+      a1 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i+8),_mm256_loadu_ps(b+i+8),a1);
+   }
+   if (i+8<=n) {
+      a0 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i),_mm256_loadu_ps(b+i),a0);
+      i += 8;
+   }
+   s = HSum256(_mm256_add_ps(a0,a1));
+   for (; i<n; i++) s += a[i]*b[i];
+   return s;
+}
+
+/* Dot4AVX2: as Dot4Generic, each load of a is shared by four frames */
+__attribute__((target("avx2,fma")))
+static void Dot4AVX2(const float *a, float **b, int n, float *res)
+{
+   int i,k;
+   __m256 va, s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+   __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+
+   for (i=0; i+8<=n; i+=8) {
+      va = _mm256_loadu_ps(a+i);
+      s0 = _mm256_fmadd_ps(va,_mm256_loadu_ps(b[0]+i),s0);
+      s1 = _mm256_fmadd_ps(va,_mm256_loadu_ps(b[1]+i),s1);
+      s2 = _mm256_fmadd_ps(va,_mm256_loadu_ps(b[2]+i),s2);
+      s3 = _mm256_fmadd_ps(va,_mm256_loadu_ps(b[3]+i),s3);
+   }
+   res[0] = HSum256(s0); res[1] = HSum256(s1);
+   res[2] = HSum256(s2); res[3] = HSum256(s3);
+   for (; i<n; i++)
+      for (k=0; k<4; k++) res[k] += a[i]*b[k][i];
+}
+
+/* AxpyAVX2: as AxpyGeneric */
+__attribute__((target("avx2,fma")))
+static void AxpyAVX2(float s, const float *x, float *y, int n)
+{
+   int i;
+   __m256 vs = _mm256_set1_ps(s);
+
+   for (i=0; i+8<=n; i+=8)
+      _mm256_storeu_ps(y+i,_mm256_fmadd_ps(vs,_mm256_loadu_ps(x+i),_mm256_loadu_ps(y+i)));
+   for (; i<n; i++) y[i] += s*x[i];
+}
+
+#endif  /* GAUSS_X86 */
+
+static DotKernel dotKernel = DotGeneric;
+static Dot4Kernel dot4Kernel = Dot4Generic;
+static AxpyKernel axpyKernel = AxpyGeneric;
+
 /* DOutP: Log prob of x in given mixture - Diagonal Case */
 static LogFloat DOutP(Vector x, int vecSize, MixPDF *mp)
 {
@@ -9424,61 +9557,58 @@ static LogFloat DOutP(Vector x, int vecSize, MixPDF *mp)
 }
 
 /* FOutP: Log prob of x in given mixture - Full Covariance Case */
+/*        d'Ad is accumulated a row of the lower triangle at a time: */
+/*        sum_i d_i (2 A[i][1..i-1].d[1..i-1] + A[i][i] d_i)         */
 static LogFloat FOutP(Vector x, int vecSize, MixPDF *mp)
 {
+   float xmm[vecSize];
    float sum;
-   int i,j;
-   Vector xmm;
+   int i;
    TriMat m = mp->cov.inv;
    
-   xmm = CreateVector(&gstack,vecSize);
-   for (i=1;i<=vecSize;i++)
-      xmm[i] = x[i] - mp->mean[i];
-   sum = 0.0;
-   for (j=1;j<vecSize;j++)
-      for (i=j+1;i<=vecSize;i++)
-         sum += xmm[i]*xmm[j]*m[i][j];
-   sum *= 2;
-   sum += mp->gConst;
+   for (i=0;i<vecSize;i++)
+      xmm[i] = x[i+1] - mp->mean[i+1];
+   sum = mp->gConst;
    for (i=1;i<=vecSize;i++)
-      sum += xmm[i] * xmm[i] * m[i][i];
-   FreeVector(&gstack,xmm);
+      sum += xmm[i-1] * (2.0*dotKernel(m[i]+1,xmm,i-1) + m[i][i]*xmm[i-1]);
    return -0.5*sum;
 }
 
 
 /* COutP: Log prob of x in given mixture - LLT (Choleski) Cov Case */
+/*        cov.inv holds the lower triangular L with inverse covariance */
+/*        LL', so the quadratic term is |L'd|^2.  L'd is built by rows */
+/*        of L as axpys, avoiding strided column access               */
 static LogFloat COutP(Vector x, int vecSize, MixPDF *mp)
 {
-   HError(7001,"COutP: Choleski storage not yet implemented");
-   return 0.0;
+   float xmm[vecSize],y[vecSize];
+   int i;
+   TriMat l = mp->cov.inv;
+
+   for (i=0;i<vecSize;i++) {
+      xmm[i] = x[i+1] - mp->mean[i+1];
+      y[i] = 0.0;
+   }
+   for (i=1;i<=vecSize;i++)
+      axpyKernel(xmm[i-1],l[i]+1,y,i);
+   return -0.5*(mp->gConst + dotKernel(y,y,vecSize));
 }
 
 /* XOutP: Log prob of x in given mixture - XForm Case */
 static LogFloat XOutP(Vector x, int vecSize, MixPDF *mp)
 {
-   Vector xmm,trans_xmm;
-   int i,j;
-   int numrows;
-   Vector xrow;
-   LogFloat sum;
-
-   xmm = CreateVector(&gstack,vecSize);
-   trans_xmm = CreateVector(&gstack,vecSize);
-   for (j=1;j<=vecSize;j++)
-      xmm[j] = x[j] - mp->mean[j];
+   float xmm[vecSize];
+   int i,numrows;
+   LogFloat sum,t;
+
+   for (i=0;i<vecSize;i++)
+      xmm[i] = x[i+1] - mp->mean[i+1];
    numrows=NumRows(mp->cov.xform);
+   sum = mp->gConst;
    for (i=1;i<=numrows;i++) {
-      trans_xmm[i] = 0.0;
-      xrow = mp->cov.xform[i];
-      for (j=1;j<=vecSize;j++)
-         trans_xmm[i] += xrow[j]*xmm[j];
-   }        
-   sum = 0.0;
-   for (i=1;i<=numrows;i++)
-      sum += trans_xmm[i]*trans_xmm[i];
-   sum += mp->gConst;
-   FreeVector(&gstack,xmm);
+      t = dotKernel(mp->cov.xform[i]+1,xmm,vecSize);
+      sum += t*t;
+   }
    return -0.5*sum;
 }
 
@@ -9564,6 +9694,57 @@ LogFloat MOutP(Vector x, MixPDF *mp)
    return px;
 }
 
+/* QuadBlock: px[k] = d_k'Md_k for QUAD_FBLOCK frames, M held as TriMat */
+/*            (ckind FULLC) or as the Choleski factor L (ckind LLTC)    */
+static void QuadBlock(CovKind ckind, TriMat m, float **d, int vecSize, float *px)
+{
+   float y[QUAD_FBLOCK][vecSize], r[QUAD_FBLOCK];
+   float *yp[QUAD_FBLOCK];
+   int i,k;
+
+   for (k=0; k<QUAD_FBLOCK; k++) px[k] = 0.0;
+   if (ckind == FULLC) {
+      for (i=1; i<=vecSize; i++) {
+         dot4Kernel(m[i]+1,d,i-1,r);
+         for (k=0; k<QUAD_FBLOCK; k++)
+            px[k] += d[k][i-1] * (2.0*r[k] + m[i][i]*d[k][i-1]);
+      }
+   } else {
+      for (k=0; k<QUAD_FBLOCK; k++) {
+         yp[k] = y[k];
+         for (i=0; i<vecSize; i++) y[k][i] = 0.0;
+      }
+      for (i=1; i<=vecSize; i++)
+         for (k=0; k<QUAD_FBLOCK; k++)
+            axpyKernel(d[k][i-1],m[i]+1,y[k],i);
+      for (k=0; k<QUAD_FBLOCK; k++)
+         px[k] = dotKernel(yp[k],yp[k],vecSize);
+   }
+}
+
+/* EXPORT-> MBlockOutP: log probs of x[0..nFrames-1] for one mixture */
+void MBlockOutP(Vector *x, int nFrames, MixPDF *mp, LogFloat *px)
+{
+   int t,k,i,vSize = VectorSize(x[0]);
+   float xmm[QUAD_FBLOCK][vSize], q[QUAD_FBLOCK];
+   float *d[QUAD_FBLOCK];
+
+   if (mp->ckind != FULLC && mp->ckind != LLTC) {
+      for (t=0; t<nFrames; t++) px[t] = MOutP(x[t],mp);
+      return;
+   }
+   for (k=0; k<QUAD_FBLOCK; k++) d[k] = xmm[k];
+   for (t=0; t+QUAD_FBLOCK<=nFrames; t+=QUAD_FBLOCK) {
+      for (k=0; k<QUAD_FBLOCK; k++)
+         for (i=0; i<vSize; i++)
+            xmm[k][i] = x[t+k][i+1] - mp->mean[i+1];
+      QuadBlock(mp->ckind,mp->cov.inv,d,vSize,q);
+      for (k=0; k<QUAD_FBLOCK; k++)
+         px[t+k] = -0.5*(mp->gConst + q[k]);
+   }
+   for (; t<nFrames; t++) px[t] = MOutP(x[t],mp);
+}
+
 /* cz277 - ANN: TODO: GMMAK, ANNAK */
 /* EXPORT-> SOutP: returns log prob of stream s of observation x */
 LogFloat SOutP(HMMSet *hset, int s, Observation *x, StreamElem *se)
@@ -9677,6 +9858,388 @@ LogFloat OutP(Observation *x, HLink hmm, int state)
    return bx;
 }
 
+
+/* ------------------- Batched Diagonal Gaussian Scoring ------------------ */
+
+/*
+   A GaussScorer holds a copy of every DIAGC/INVDIAGC component of an
+   HMMSet, packed per stream into contiguous zero padded rows of means
+   and of -0.5*inverse variances, ordered by state index so that the
+   components of one state occupy a single range.  Each component also
+   carries log(weight)-0.5*gConst.  A block of frames is copied into
+   a padded buffer once, after which each state is scored against all
+   frames of the block with one kernel call followed by a log-sum-exp
+   over its mixture components.  Mixture streams that cannot be
+   packed (full covariance, XFORMC) are scored one component at a
+   time over the block by MBlockOutP; discrete streams and ANN targets
+   go through SOutP, so results are always complete.
+*/
+
+#define GAUSS_FBLOCK 4          /* frames scored together per component */
+
+typedef void (*GaussKernel)(int nG, int pad, const float *mean, const float *hivar, const float *lwgc, int nT, const float *obs, float *out);
+
+/* GaussKernelGeneric: out[t*nG+g] = lwgc[g] + sum_i (obs[t][i]-mean[g][i])^2 * hivar[g][i] */
+static void GaussKernelGeneric(int nG, int pad, const float *mean, const float *hivar, const float *lwgc, int nT, const float *obs, float *out)
+{
+   int g,t,i;
+   const float *mu,*hv,*x;
+   float sum,d;
+
+   for (g=0; g<nG; g++) {
+      mu = mean + g*pad; hv = hivar + g*pad;
+      for (t=0; t<nT; t++) {
+         x = obs + t*pad; sum = 0.0;
+         for (i=0; i<pad; i++) {
+            d = x[i] - mu[i];
+            sum += d*d*hv[i];
+         }
+         out[t*nG+g] = lwgc[g] + sum;
+      }
+   }
+}
+
+#ifdef GAUSS_X86
+
+/* GaussKernelAVX2: as GaussKernelGeneric, pad a multiple of 8 */
+__attribute__((target("avx2,fma")))
+static void GaussKernelAVX2(int nG, int pad, const float *mean, const float *hivar, const float *lwgc, int nT, const float *obs, float *out)
+{
+   int g,t,i;
+   const float *mu,*hv,*x;
+   __m256 m,h,d0,d1,d2,d3,a0,a1,a2,a3;
+
+   for (g=0; g<nG; g++) {
+      mu = mean + g*pad; hv = hivar + g*pad;
+      for (t=0; t+GAUSS_FBLOCK<=nT; t+=GAUSS_FBLOCK) {
+         x = obs + t*pad;
+         a0 = a1 = a2 = a3 = _mm256_setzero_ps();
+         for (i=0; i<pad; i+=8) {
+            m = _mm256_loadu_ps(mu+i); h = _mm256_loadu_ps(hv+i);
+            d0 = _mm256_sub_ps(_mm256_loadu_ps(x+i),m);
+            d1 = _mm256_sub_ps(_mm256_loadu_ps(x+pad+i),m);
+            d2 = _mm256_sub_ps(_mm256_loadu_ps(x+2*pad+i),m);
+            d3 = _mm256_sub_ps(_mm256_loadu_ps(x+3*pad+i),m);
+            a0 = _mm256_fmadd_ps(_mm256_mul_ps(d0,d0),h,a0);
+            a1 = _mm256_fmadd_ps(_mm256_mul_ps(d1,d1),h,a1);
+            a2 = _mm256_fmadd_ps(_mm256_mul_ps(d2,d2),h,a2);
+            a3 = _mm256_fmadd_ps(_mm256_mul_ps(d3,d3),h,a3);
+         }
+         out[t*nG+g] = lwgc[g] + HSum256(a0);
+         out[(t+1)*nG+g] = lwgc[g] + HSum256(a1);
+         out[(t+2)*nG+g] = lwgc[g] + HSum256(a2);
+         out[(t+3)*nG+g] = lwgc[g] + HSum256(a3);
+      }
+      for (; t<nT; t++) {
+         x = obs + t*pad;
+         a0 = _mm256_setzero_ps();
+         for (i=0; i<pad; i+=8) {
+            d0 = _mm256_sub_ps(_mm256_loadu_ps(x+i),_mm256_loadu_ps(mu+i));
+            a0 = _mm256_fmadd_ps(_mm256_mul_ps(d0,d0),_mm256_loadu_ps(hv+i),a0);
+         }
+         out[t*nG+g] = lwgc[g] + HSum256(a0);
+      }
+   }
+}
+
+/* GaussKernelAVX512: as GaussKernelGeneric, pad a multiple of 16 */
+__attribute__((target("avx512f")))
+static void GaussKernelAVX512(int nG, int pad, const float *mean, const float *hivar, const float *lwgc, int nT, const float *obs, float *out)
+{
+   int g,t,i;
+   const float *mu,*hv,*x;
+   __m512 m,h,d0,d1,d2,d3,a0,a1,a2,a3;
+
+   for (g=0; g<nG; g++) {
+      mu = mean + g*pad; hv = hivar + g*pad;
+      for (t=0; t+GAUSS_FBLOCK<=nT; t+=GAUSS_FBLOCK) {
+         x = obs + t*pad;
+         a0 = a1 = a2 = a3 = _mm512_setzero_ps();
+         for (i=0; i<pad; i+=16) {
+            m = _mm512_loadu_ps(mu+i); h = _mm512_loadu_ps(hv+i);
+            d0 = _mm512_sub_ps(_mm512_loadu_ps(x+i),m);
+            d1 = _mm512_sub_ps(_mm512_loadu_ps(x+pad+i),m);
+            d2 = _mm512_sub_ps(_mm512_loadu_ps(x+2*pad+i),m);
+            d3 = _mm512_sub_ps(_mm512_loadu_ps(x+3*pad+i),m);
+            a0 = _mm512_fmadd_ps(_mm512_mul_ps(d0,d0),h,a0);
+            a1 = _mm512_fmadd_ps(_mm512_mul_ps(d1,d1),h,a1);
+            a2 = _mm512_fmadd_ps(_mm512_mul_ps(d2,d2),h,a2);
+            a3 = _mm512_fmadd_ps(_mm512_mul_ps(d3,d3),h,a3);
+         }
+         out[t*nG+g] = lwgc[g] + _mm512_reduce_add_ps(a0);
+         out[(t+1)*nG+g] = lwgc[g] + _mm512_reduce_add_ps(a1);
+         out[(t+2)*nG+g] = lwgc[g] + _mm512_reduce_add_ps(a2);
+         out[(t+3)*nG+g] = lwgc[g] + _mm512_reduce_add_ps(a3);
+      }
+      for (; t<nT; t++) {
+         x = obs + t*pad;
+         a0 = _mm512_setzero_ps();
+         for (i=0; i<pad; i+=16) {
+            d0 = _mm512_sub_ps(_mm512_loadu_ps(x+i),_mm512_loadu_ps(mu+i));
+            a0 = _mm512_fmadd_ps(_mm512_mul_ps(d0,d0),_mm512_loadu_ps(hv+i),a0);
+         }
+         out[t*nG+g] = lwgc[g] + _mm512_reduce_add_ps(a0);
+      }
+   }
+}
+
+#endif  /* GAUSS_X86 */
+
+static GaussKernel gaussKernelFn = GaussKernelGeneric;
+static int gaussLanes = 1;      /* padding needed by gaussKernelFn */
+
+/* SelectGaussKernels: choose the scoring kernels for this CPU and GAUSSKERNEL */
+static void SelectGaussKernels(void)
+{
+   gaussKernelFn = GaussKernelGeneric; gaussLanes = 1;
+   dotKernel = DotGeneric; dot4Kernel = Dot4Generic; axpyKernel = AxpyGeneric;
+#ifdef GAUSS_X86
+   if ((strcmp(gaussKernel,"AUTO")==0 || strcmp(gaussKernel,"AVX512")==0 ||
+        strcmp(gaussKernel,"AVX2")==0) &&
+       __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      dotKernel = DotAVX2; dot4Kernel = Dot4AVX2; axpyKernel = AxpyAVX2;
+   }
+   if ((strcmp(gaussKernel,"AUTO")==0 || strcmp(gaussKernel,"AVX512")==0) &&
+       __builtin_cpu_supports("avx512f")) {
+      gaussKernelFn = GaussKernelAVX512; gaussLanes = 16;
+      return;
+   }
+   if (dotKernel == DotAVX2 && strcmp(gaussKernel,"AVX512")!=0) {
+      gaussKernelFn = GaussKernelAVX2; gaussLanes = 8;
+      return;
+   }
+#endif
+   if (strcmp(gaussKernel,"AUTO")!=0 && strcmp(gaussKernel,"GENERIC")!=0)
+      HError(-7070,"SelectGaussKernels: GAUSSKERNEL %s not available, using GENERIC",gaussKernel);
+}
+
+/* PackableStream: true if all live components of se are diagonal */
+static Boolean PackableStream(HMMSet *hset, StreamElem *se)
+{
+   int m;
+   MixtureElem *me;
+
+   if (se->densKind != GMMDK || se->spdf.cpdf == NULL || se->nMix < 1)
+      return FALSE;
+   for (m=1,me=se->spdf.cpdf+1; m<=se->nMix; m++,me++) {
+      if (se->nMix > 1 && MixLogWeight(hset,me->weight) <= LMINMIX) continue;
+      if (me->mpdf->ckind != DIAGC && me->mpdf->ckind != INVDIAGC)
+         return FALSE;
+   }
+   return TRUE;
+}
+
+/* EXPORT->CreateGaussScorer: pack the diagonal Gaussians of hset */
+GaussScorer *CreateGaussScorer(MemHeap *x, HMMSet *hset, int maxFrames)
+{
+   GaussScorer *gs;
+   GaussStream *gstr;
+   StateInfo *si;
+   StreamElem *se;
+   MixtureElem *me;
+   MixPDF *mp;
+   HLink hmm;
+   MLink q;
+   LogFloat wt;
+   int h,i,j,m,s,S,n,g,lanes,maxMix;
+
+   if (hset->hsKind != PLAINHS && hset->hsKind != SHAREDHS && hset->hsKind != DISCRETEHS)
+      HError(7071,"CreateGaussScorer: HMM set kind %d not supported",hset->hsKind);
+   if (maxFrames < 1)
+      HError(7071,"CreateGaussScorer: block size %d must be positive",maxFrames);
+   gs = (GaussScorer *) New(x,sizeof(GaussScorer));
+   gs->hset = hset; gs->mem = x;
+   gs->numStates = hset->numStates;
+   gs->maxFrames = maxFrames; gs->nFrames = 0;
+   lanes = gaussLanes;
+   S = hset->swidth[0];
+
+   /* map state indexes to their StateInfo */
+   gs->sinfo = (StateInfo **) New(x,(gs->numStates+1)*sizeof(StateInfo *));
+   for (i=0; i<=gs->numStates; i++) gs->sinfo[i] = NULL;
+   for (h=0; h<MACHASHSIZE; h++)
+      for (q=hset->mtab[h]; q!=NULL; q=q->next)
+         if (q->type == 'h') {
+            hmm = (HLink) q->structure;
+            for (j=2; j<hmm->numStates; j++) {
+               si = hmm->svec[j].info;
+               if (si->sIdx < 1 || si->sIdx > gs->numStates)
+                  HError(7071,"CreateGaussScorer: state index %d out of range",si->sIdx);
+               gs->sinfo[si->sIdx] = si;
+            }
+         }
+
+   maxMix = 1;
+   for (s=1; s<=S; s++) {
+      gstr = gs->gstr+s;
+      gstr->vecSize = hset->swidth[s];
+      gstr->padSize = (gstr->vecSize + lanes - 1) / lanes * lanes;
+      gstr->packed = (Boolean *) New(x,(gs->numStates+1)*sizeof(Boolean));
+      gstr->first = (int *) New(x,(gs->numStates+2)*sizeof(int));
+      /* count components */
+      n = 0;
+      for (i=1; i<=gs->numStates; i++) {
+         gstr->first[i] = n;
+         si = gs->sinfo[i];
+         gstr->packed[i] = (si != NULL && hset->hsKind != DISCRETEHS &&
+                            PackableStream(hset,si->pdf+s));
+         if (!gstr->packed[i]) continue;
+         se = si->pdf+s;
+         for (m=1,me=se->spdf.cpdf+1,j=0; m<=se->nMix; m++,me++)
+            if (se->nMix == 1 || MixLogWeight(hset,me->weight) > LMINMIX) j++;
+         n += j;
+         if (j > maxMix) maxMix = j;
+      }
+      gstr->first[gs->numStates+1] = n;
+      gstr->nGauss = n;
+      gstr->mean = (float *) New(x,(size_t)(n>0?n:1)*gstr->padSize*sizeof(float));
+      gstr->hivar = (float *) New(x,(size_t)(n>0?n:1)*gstr->padSize*sizeof(float));
+      gstr->lwgc = (float *) New(x,(n>0?n:1)*sizeof(float));
+      gstr->obs = (float *) New(x,(size_t)maxFrames*gstr->padSize*sizeof(float));
+      memset(gstr->mean,0,(size_t)(n>0?n:1)*gstr->padSize*sizeof(float));
+      memset(gstr->hivar,0,(size_t)(n>0?n:1)*gstr->padSize*sizeof(float));
+      memset(gstr->obs,0,(size_t)maxFrames*gstr->padSize*sizeof(float));
+      /* copy parameters */
+      for (i=1; i<=gs->numStates; i++) {
+         if (!gstr->packed[i]) continue;
+         se = gs->sinfo[i]->pdf+s;
+         g = gstr->first[i];
+         for (m=1,me=se->spdf.cpdf+1; m<=se->nMix; m++,me++) {
+            wt = (se->nMix == 1) ? 0.0 : MixLogWeight(hset,me->weight);
+            if (se->nMix > 1 && wt <= LMINMIX) continue;
+            mp = me->mpdf;
+            for (j=1; j<=gstr->vecSize; j++) {
+               gstr->mean[g*gstr->padSize+j-1] = mp->mean[j];
+               gstr->hivar[g*gstr->padSize+j-1] = -0.5 *
+                  ((mp->ckind == INVDIAGC) ? mp->cov.var[j] : 1.0/mp->cov.var[j]);
+            }
+            gstr->lwgc[g] = wt - 0.5*mp->gConst;
+            g++;
+         }
+      }
+   }
+   if (maxMix < 2) maxMix = 2;  /* MixBlockOutP needs two rows */
+   gs->scratch = (float *) New(x,(size_t)maxFrames*maxMix*sizeof(float));
+   gs->obsPtr = (Observation **) New(x,maxFrames*sizeof(Observation *));
+   gs->xvec = (Vector *) New(x,maxFrames*sizeof(Vector));
+   return gs;
+}
+
+/* EXPORT->LoadGaussBlock: copy a block of frames into the scorer */
+void LoadGaussBlock(GaussScorer *gs, Observation **x, int nFrames)
+{
+   GaussStream *gstr;
+   int s,t,i,S;
+   float *dst;
+
+   if (nFrames < 1 || nFrames > gs->maxFrames)
+      HError(7071,"LoadGaussBlock: %d frames outside block size %d",nFrames,gs->maxFrames);
+   S = gs->hset->swidth[0];
+   for (s=1; s<=S; s++) {
+      gstr = gs->gstr+s;
+      for (t=0; t<nFrames; t++) {
+         if (VectorSize(x[t]->fv[s]) != gstr->vecSize)
+            HError(7071,"LoadGaussBlock: incompatible stream widths %d vs %d",
+                   VectorSize(x[t]->fv[s]),gstr->vecSize);
+         dst = gstr->obs + t*gstr->padSize;
+         for (i=1; i<=gstr->vecSize; i++)
+            dst[i-1] = x[t]->fv[s][i];
+      }
+   }
+   for (t=0; t<nFrames; t++) gs->obsPtr[t] = x[t];
+   gs->nFrames = nFrames;
+}
+
+/* MixBlockOutP: add w * log b_s(x_t) to outp[1..nFrames] for an unpacked
+   mixture stream, scoring each component against the whole block */
+static void MixBlockOutP(GaussScorer *gs, int s, StreamElem *se, float w, Vector outp)
+{
+   int t,m,n = gs->nFrames;
+   LogFloat wt,*px,*bx;
+   MixtureElem *me;
+
+   px = gs->scratch; bx = gs->scratch + gs->maxFrames;
+   for (t=0; t<n; t++) gs->xvec[t] = gs->obsPtr[t]->fv[s];
+   if (se->nMix == 1) {
+      MBlockOutP(gs->xvec,n,se->spdf.cpdf[1].mpdf,px);
+      for (t=0; t<n; t++) outp[t+1] += w * px[t];
+      return;
+   }
+   for (t=0; t<n; t++) bx[t] = LZERO;
+   for (m=1,me=se->spdf.cpdf+1; m<=se->nMix; m++,me++) {
+      wt = MixLogWeight(gs->hset,me->weight);
+      if (wt <= LMINMIX) continue;
+      MBlockOutP(gs->xvec,n,me->mpdf,px);
+      for (t=0; t<n; t++) bx[t] = LAdd(bx[t],wt+px[t]);
+   }
+   for (t=0; t<n; t++) outp[t+1] += w * bx[t];
+}
+
+/* GaussStreamOutP: add w * log b_s(x_t) to outp[1..nFrames] for stream s */
+static void GaussStreamOutP(GaussScorer *gs, int s, StateInfo *si, float w, Vector outp)
+{
+   GaussStream *gstr = gs->gstr+s;
+   StreamElem *se = si->pdf+s;
+   int t,m,nG,first,pad;
+   float *sc,maxP,sum;
+   LogFloat px;
+
+   if (!gstr->packed[si->sIdx]) {
+      if (gs->hset->hsKind != DISCRETEHS && se->densKind == GMMDK &&
+          se->spdf.cpdf != NULL && se->nMix > 0)
+         MixBlockOutP(gs,s,se,w,outp);
+      else
+         for (t=0; t<gs->nFrames; t++)
+            outp[t+1] += w * SOutP(gs->hset,s,gs->obsPtr[t],se);
+      return;
+   }
+   first = gstr->first[si->sIdx];
+   nG = gstr->first[si->sIdx+1] - first;
+   if (nG == 0) {
+      for (t=1; t<=gs->nFrames; t++) outp[t] += w * LZERO;
+      return;
+   }
+   pad = gstr->padSize;
+   gaussKernelFn(nG,pad,gstr->mean+(size_t)first*pad,gstr->hivar+(size_t)first*pad,
+                 gstr->lwgc+first,gs->nFrames,gstr->obs,gs->scratch);
+   for (t=0,sc=gs->scratch; t<gs->nFrames; t++,sc+=nG) {
+      if (nG == 1) {
+         px = sc[0];
+      } else {
+         for (m=1,maxP=sc[0]; m<nG; m++)
+            if (sc[m] > maxP) maxP = sc[m];
+         for (m=0,sum=0.0; m<nG; m++)
+            sum += exp(sc[m]-maxP);
+         px = maxP + log(sum);
+      }
+      outp[t+1] += w * px;
+   }
+}
+
+/* EXPORT->GaussBlockOutP: log output probs of state si for each frame of the block */
+void GaussBlockOutP(GaussScorer *gs, StateInfo *si, Vector outp)
+{
+   int s,t,S = gs->hset->swidth[0];
+
+   if (si->sIdx < 1 || si->sIdx > gs->numStates || gs->sinfo[si->sIdx] != si)
+      HError(7071,"GaussBlockOutP: state %d not in scorer",si->sIdx);
+   for (t=1; t<=gs->nFrames; t++) outp[t] = 0.0;
+   if (S == 1 && si->weights == NULL)
+      GaussStreamOutP(gs,1,si,1.0,outp);
+   else
+      for (s=1; s<=S; s++)
+         GaussStreamOutP(gs,s,si,si->weights[s],outp);
+}
+
+/* EXPORT->GaussBlockAllOutP: log output probs of every state for each frame of the block */
+void GaussBlockAllOutP(GaussScorer *gs, Matrix outp)
+{
+   int i;
+
+   for (i=1; i<=gs->numStates; i++)
+      if (gs->sinfo[i] != NULL)
+         GaussBlockOutP(gs,gs->sinfo[i],outp[i]);
+}
          
 /* EXPORT->DProb2Short: convert prob to scaled log form */
 short DProb2Short(float p)
@@ -9735,10 +10298,18 @@ void FixInvDiagGConst(MixPDF *mp)
    mp->gConst = sum;
 }
 
-/* EXPORT->FixLLTGConst: Sets gConst for given MixPDF in INVDIAGC case */
+/* EXPORT->FixLLTGConst: Sets gConst for given MixPDF in LLTC case */
+/*    the inverse covariance is LL' so log|Cov| = -2 sum log L[i][i] */
 void FixLLTGConst(MixPDF *mp)
 {
-   mp->gConst = 0.0;
+   TriMat l = mp->cov.inv;
+   int i,n;
+   float sum;
+
+   n = TriMatSize(l); sum = n*log(TPI);
+   for (i=1; i<=n; i++)
+      sum -= 2.0*((l[i][i]<=MINLARG)?LZERO:log(l[i][i]));
+   mp->gConst = sum;
 }
 
 /* EXPORT->FixFullGConst: Sets gConst for given MixPDF in FULLC case */
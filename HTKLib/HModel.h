@@ -613,6 +613,11 @@ LogFloat SOutP(HMMSet *hset, int s, Observation *x, StreamElem *se);
 Boolean PDEMOutP(Vector otvs, MixPDF *mp, LogFloat *mixp, LogFloat xwtdet);
 LogFloat MOutP(Vector x, MixPDF *mp);
 LogFloat IDOutP(Vector x, int vecSize, MixPDF *mp);
+void MBlockOutP(Vector *x, int nFrames, MixPDF *mp, LogFloat *px);
+/*
+   Set px[0..nFrames-1] to MOutP(x[t],mp).  FULLC and LLTC components
+   share each row of the covariance between several frames.
+*/
 short DProb2Short(float p);
 
 #ifdef PDE_STATS
@@ -657,6 +662,56 @@ float MixWeight(HMMSet *hset, float weight);
   Get the log-weight
 */
 
+/* ---------------- Batched Diagonal Gaussian Scoring -------------- */
+
+typedef struct {
+   int vecSize;         /* stream width */
+   int padSize;         /* row length of the packed arrays */
+   int nGauss;          /* number of packed components */
+   Boolean *packed;     /* [1..numStates] state scored from packed arrays */
+   int *first;          /* [1..numStates+1] first component of each state */
+   float *mean;         /* nGauss x padSize means */
+   float *hivar;        /* nGauss x padSize -0.5 * inverse variances */
+   float *lwgc;         /* [nGauss] log weight - 0.5 * gConst */
+   float *obs;          /* maxFrames x padSize current frame block */
+} GaussStream;
+
+typedef struct {
+   HMMSet *hset;        /* packed model set */
+   MemHeap *mem;        /* heap holding the scorer */
+   int numStates;       /* number of distinct states (hset->numStates) */
+   StateInfo **sinfo;   /* [1..numStates] state of each index */
+   GaussStream gstr[SMAX]; /* [1..S] packed streams */
+   int maxFrames;       /* largest block size */
+   int nFrames;         /* frames in the current block */
+   Observation **obsPtr;   /* [0..nFrames-1] observations of the block */
+   float *scratch;      /* maxFrames x max components work space */
+   Vector *xvec;        /* [0..nFrames-1] stream vectors of the block */
+} GaussScorer;
+
+GaussScorer *CreateGaussScorer(MemHeap *x, HMMSet *hset, int maxFrames);
+/*
+   Pack every DIAGC/INVDIAGC mixture component of hset into per-stream
+   padded arrays ordered by state index, for scoring blocks of up to
+   maxFrames frames.  Other mixture streams are scored one component
+   at a time over the block with MBlockOutP, the rest with SOutP.
+   Must be rebuilt if the model parameters or state indexes change,
+   eg after adaptation.  Tied mixture sets are not supported.
+*/
+
+void LoadGaussBlock(GaussScorer *gs, Observation **x, int nFrames);
+/*
+   Make x[0..nFrames-1] the current block of frames of gs
+*/
+
+void GaussBlockOutP(GaussScorer *gs, StateInfo *si, Vector outp);
+void GaussBlockAllOutP(GaussScorer *gs, Matrix outp);
+/*
+   Set outp[t] to the log output probability of state si for frame t
+   (1..nFrames) of the current block, as POutP would, or outp[i][t]
+   for every state index i.
+*/
+
 /* ---------------------- XForm support code ---------------------- */
 
 /* EXPORT->LoadInputXForm: loads, or returns, the specified transform */
@@ -57,6 +57,10 @@ char *hncache_vc_id = "$Id: HNCache.c,v 1.0 2015/10/12 12:07:24 cz277 Exp $";
 #include "HLat.h"
 #include "HNCache.h"
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 /* ------------------------------ Trace Flags ------------------------------ */
 
@@ -65,6 +69,7 @@ static int trace = 0;
 #define T_TOP 0001
 #define T_CCH 0002
 #define T_RPL 0004
+#define T_PIP 0010       /* batch pipeline counters */
 #define MAX(a,b) ((a)>(b) ? (a):(b))
 
 
@@ -97,7 +102,18 @@ static const size_t QN_XORTable[32] = {0x1, 0x1, 0x3, 0x6, 0xc, 0x14, 0x30, 0x60
 /* cz277 - mtload */
 static Boolean extThreadLoad = FALSE;
 
+static int corpusPrefetch = 2;                  /* batches of a packed corpus to request ahead */
+static int pipeThreads = 0;                     /* worker threads assembling FRMVK batches, 0 to fill in line */
+static int pipeDepth = 2;                       /* the number of batches the pipeline holds */
+static HTime loadSampRate = 0.0;                /* the label frame rate of the last utterance loaded */
+
 static void UnloadOneUtt(DataCache *cache, int dstPos);
+static void DetachCacheCorpus(DataCache *cache);
+static void CreatePipe(DataCache *cache);
+static void DrainPipe(DataCache *cache);
+static void FreePipe(DataCache *cache);
+static void SchedulePipe(DataCache *cache);
+static void PrintPipeStats(DataCache *cache);
 
 
 /* get the batch size */
@@ -302,6 +318,21 @@ void InitNCache(void)
             extThreadLoad = boolVal;
             HError(-8921, "InitNCache: EXTRATHREADLOADING is disabled");
         }
+        if (GetConfInt(cParm, nParm, "CORPUSPREFETCH", &intVal)) {
+            if (intVal < 0) 
+                HError(8921, "InitNCache: CORPUSPREFETCH should not be negative");
+            corpusPrefetch = intVal;
+        }
+        if (GetConfInt(cParm, nParm, "PIPELINETHREADS", &intVal)) {
+            if (intVal < 0) 
+                HError(8921, "InitNCache: PIPELINETHREADS should not be negative");
+            pipeThreads = intVal;
+        }
+        if (GetConfInt(cParm, nParm, "PIPELINEDEPTH", &intVal)) {
+            if (intVal < 2) 
+                HError(8921, "InitNCache: PIPELINEDEPTH should be at least 2");
+            pipeDepth = intVal;
+        }
     }
 
     /* initialise the stacks */
@@ -445,6 +476,10 @@ DataCache *CreateCache(MemHeap *heap, FILE *scpFile, int scpCnt, HMMSet *hset, O
     cache->saveUttName = saveUttName;
     /* 7. set xfInfo */
     cache->xfInfo = xfInfo;
+    /* 8. no packed corpus until one is attached */
+    cache->corpus = NULL;
+    /* 9. the batch pipeline is started by InitCache */
+    cache->pipe = NULL;
 
     return cache;
 }
@@ -471,10 +506,21 @@ static void CleanCache(DataCache *cache) {
 
 /* reset to reuse the cache */
 void ResetCache(DataCache *cache) {
+    int i;
+    Boolean reload;
+
     /* set revisit */
     cache->revisit = TRUE;
+    /* wait for the batches being assembled */
+    if (cache->pipe != NULL) {
+        if (trace & T_PIP) 
+            PrintPipeStats(cache);
+        DrainPipe(cache);
+    }
+    /* a packed corpus stays mapped and is never reloaded */
+    reload = need2Unload && cache->corpus == NULL;
     /* release the rest loaded utterances */
-    if (need2Unload) {
+    if (reload) {
         CleanCache(cache);
     }
     /* reset frame items */
@@ -483,20 +529,28 @@ void ResetCache(DataCache *cache) {
         cache->frmOrder = NULL;
         cache->fvLen = 0;
     }
-    if (need2Unload) {
+    if (reload) {
         cache->frmNum = 0;
         cache->tFrmNum = 0;
     }
     cache->batLen = 0;
     /* reset utterance items */
-    if (need2Unload) {
+    if (reload) {
         cache->nxtUttPos = 0;
     }
+    /* reshuffle the frames within the mapped utterances */
+    if (cache->corpus != NULL) {
+        for (i = 0; i < cache->tUttNum; ++i) {
+            cache->uttElems[i].frmUsed = 0;
+            if (cache->uttElems[i].frmOrder != NULL) 
+                ShuffleSegment(cache->uttElems[i].frmOrder, 0, cache->uttElems[i].uttLen, sizeof(int));
+        }
+    }
     /*memset(cache->uttElems, 0, cache->tUttNum * sizeof(UttElem));*/
     cache->stUttPos = 0;
     cache->edUttPos = 0;
     /* reset file handler */
-    if (need2Unload) {
+    if (reload) {
         rewind(cache->scpFile);
     }
     /* initialise the cache */
@@ -505,8 +559,14 @@ void ResetCache(DataCache *cache) {
 
 /* A function to release the whole cache */
 void FreeCache(DataCache *cache) {
+    /* stop the batch pipeline */
+    if (cache->pipe != NULL) 
+        FreePipe(cache);
     /* release the rest loaded utterances */
-    CleanCache(cache);
+    if (cache->corpus != NULL) 
+        DetachCacheCorpus(cache);
+    else 
+        CleanCache(cache);
     /* release uttElems */
     Dispose(cache->cmem, cache->uttElems);
     /* release uttOrder */
@@ -737,28 +797,142 @@ void ResetNVecRPL() {
 }
 
 /* load one utterance into cache, at dstPos (usually nxtUttPos) */
-static ReturnStatus LoadOneUtt(DataCache *cache, int dstPos) {
-    int i, j, len, dim, sIdx, lsIdx = 0, transcnt;	/* cz277 - trans */
+/* convert the label file of utterance feaBuf (len frames at sampRate)
+   into target indexes, accumulating the target occupancies and the
+   transition counts if they are to be updated */
+static void LoadLabIdxes(DataCache *cache, char *feaBuf, HTime sampRate, int len, int *labIdxes) {
+    int i, j, sIdx = 0, lsIdx = 0, transcnt;	/* cz277 - trans */
     long stIdx, edIdx, curIdx;
-    char feaBuf[MAXSTRLEN], spkBuf[MAXSTRLEN], labBuf[MAXSTRLEN], hmmBuf[MAXSTRLEN];
+    char spkBuf[MAXSTRLEN], labBuf[MAXSTRLEN], hmmBuf[MAXSTRLEN];
+    Boolean isPhoneLab;	/* cz277 - trans */
+    Transcription *trans;
+    LLink llink;
+    MLink macDef;
+    StreamElem *streamElem;
+    HLink hlink;
+    LabId hmmId = NULL, lhmmId;	/* cz277 - trans */
+    TrAcc *ta;
+
+    if (cache->labelInfo->labFileMask != NULL) {
+        if (!MaskMatch(cache->labelInfo->labFileMask, spkBuf, feaBuf)) {
+            HError(8919, "LoadLabIdxes: Mask %s has no match with segment %s", cache->labelInfo->labFileMask, feaBuf);
+        }
+        MakeFN(spkBuf, cache->labelInfo->labDir, cache->labelInfo->labExt, labBuf);
+    }
+    else {
+        MakeFN(feaBuf, cache->labelInfo->labDir, cache->labelInfo->labExt, labBuf);
+    }
+    ResetHeap(&transStack);
+    trans = LOpen(&transStack, labBuf, UNDEFF);
+    /* convert trans to labIdxes */
+    i = 0;
+    for (llink = trans->head->head->succ; llink->succ != NULL; llink = llink->succ) {
+        /* cz277 - trans */
+        lhmmId = hmmId;
+        lsIdx = sIdx;
+        
+        ExtractState(llink->labid->name, hmmBuf, &sIdx);    /* support hmm state by hacking labid */
+        if (sIdx == 0) {
+            hmmId = llink->labid;
+            /* cz277 - trans */
+            isPhoneLab = TRUE;
+        }
+        else {
+            hmmId = GetLabId(hmmBuf, FALSE);
+            /* cz277 - trans */
+            isPhoneLab = FALSE;
+        }
+        if (hmmId == NULL) {
+            HError(8925, "LoadLabIdxes: Failed to find model for label \"%s\" given in the input MLF file", hmmBuf);
+        }
+        if ((macDef = FindMacroName(cache->hmmSet, 'l', hmmId)) == NULL) {
+            HError(8925, "LoadLabIdxes: Unknown label %s", hmmId->name);
+        }
+        hlink = (HLink) macDef->structure;
+        if (sIdx == 0) {    /* if it is a phone label */
+            /* check whether all states of that hmm share the same ANN target */
+            for (j = 3; j < hlink->numStates; ++j) {
+                if ((hlink->svec[2].info->pdf[cache->streamIdx].targetSrc != hlink->svec[j].info->pdf[cache->streamIdx].targetSrc) ||
+                    (hlink->svec[2].info->pdf[cache->streamIdx].targetIdx != hlink->svec[j].info->pdf[cache->streamIdx].targetIdx)) {
+                    HError(8925, "LoadLabIdxes: Phone label in the label file does not match the state level definition");
+                }
+            }
+            sIdx = 2;
+        }
+        else if (sIdx <= 1 || sIdx >= hlink->numStates) {
+            HError(8925, "LoadLabIdxes: Illegal state index in the label file");
+        }
+        /* get the stream element pointer */
+        streamElem = &hlink->svec[sIdx].info->pdf[cache->streamIdx]; 
+        /* check the output layer source */
+        if (streamElem->targetSrc != cache->hmmSet->annSet->outLayers[cache->streamIdx]) {
+            HError(8926, "LoadLabIdxes: Only one output layer is allowed in one stream");
+        }
+        /* get the frame indexes */
+        stIdx = (long) (llink->start / sampRate + 0.5);
+        edIdx = (long) (llink->end / sampRate + 0.5);
+        if (stIdx > edIdx) {
+            HError(8927, "LoadLabIdxes: Empty segment");
+        }
+        /* cz277 - trans */
+        if ((cache->labelInfo->uFlags & UPTRANS) != 0) {
+            ta = (TrAcc *) GetHook(hlink->transP);
+            if (isPhoneLab) {
+                transcnt = (int) ((edIdx - stIdx) / (hlink->numStates - 2.0) + 0.5);
+                transcnt -= 1;
+                lsIdx = 1;
+                for (j = 2; j <= hlink->numStates; ++j) {
+                    ta->occ[lsIdx] += 1;
+                    ta->tran[lsIdx][j] += 1;
+                    if (transcnt > 0) {
+                        ta->occ[j] += transcnt;
+                        ta->tran[j][j] += transcnt;
+                    }
+                    lsIdx = j;
+                }
+            }
+            else {
+                if (lhmmId != hmmId) {
+                    lsIdx = 1;
+                }
+                ta->occ[lsIdx] += 1;
+                ta->tran[lsIdx][sIdx] += 1;
+			transcnt = edIdx - stIdx - 1;
+                ta->occ[sIdx] += transcnt;
+                if (transcnt > 0) {
+                    ta->tran[sIdx][sIdx] += transcnt;
+                }
+            }
+        }
+
+        if ((cache->labelInfo->uFlags & UPTARGETPEN) != 0) {
+            streamElem->occAcc += edIdx - stIdx;
+        }
+        for (curIdx = stIdx; curIdx < edIdx; ++curIdx, ++i) {
+            if (curIdx != i) {
+                HError(8927, "LoadLabIdxes: Discontinuous Utterance");
+            }
+            labIdxes[i] = streamElem->targetIdx - 1;   /* targetIdx >= 1, labIdxes >= 0 */
+        }
+    }
+    if (i != len) {
+        HError(8924, "LoadLabIdxes: %s Feature and Utterance lengths (%i, %i) do not match", feaBuf, i, len);
+    }
+}
+
+static ReturnStatus LoadOneUtt(DataCache *cache, int dstPos) {
+    int i, j, len, dim;
+    char feaBuf[MAXSTRLEN], spkBuf[MAXSTRLEN], labBuf[MAXSTRLEN];
     char fnBuf[MAXSTRLEN], pathBuf[MAXSTRLEN], latBuf[MAXSTRLEN];
     FILE *filePtr;
-    Boolean isPipe, isPhoneLab;	/* cz277 - trans */
+    Boolean isPipe;
     Observation *obs;
     UttElem *uttElem;
     float *dstPtr;
     Vector x;
-    Transcription *trans;
-    LLink llink;
-    MLink macDef;
-    StreamElem *streamElem;
-    HLink hlink;
     ParmBuf parmBuf;
     BufferInfo pbInfo;
-    LabId hmmId = NULL, lhmmId;	/* cz277 - trans */
     Vector tmpVec;
-    /* cz277 - trans */
-    TrAcc *ta;
 
     /* check the destinate position */
     if (dstPos >= cache->tUttNum) 
@@ -895,113 +1069,10 @@ static ReturnStatus LoadOneUtt(DataCache *cache, int dstPos) {
         /* process lab files */
         uttElem->labIdxes = NULL;
         if ((cache->labelInfo->labelKind & LABLK) != 0) { /* load lab files */
-            if (cache->labelInfo->labFileMask != NULL) {
-                if (!MaskMatch(cache->labelInfo->labFileMask, spkBuf, feaBuf)) {
-                    HError(8919, "LoadOneUtt: Mask %s has no match with segment %s", cache->labelInfo->labFileMask, feaBuf);
-                }
-                MakeFN(spkBuf, cache->labelInfo->labDir, cache->labelInfo->labExt, labBuf);
-            }
-            else {
-                MakeFN(feaBuf, cache->labelInfo->labDir, cache->labelInfo->labExt, labBuf);
-            }
-            ResetHeap(&transStack);
-            trans = LOpen(&transStack, labBuf, UNDEFF);
-            /* convert trans to labIdxes */
+            GetBufferInfo(parmBuf, &pbInfo);
+            loadSampRate = pbInfo.tgtSampRate;
             uttElem->labIdxes = (int *) New(cache->cmem, len * sizeof(int));
-            i = 0;
-            for (llink = trans->head->head->succ; llink->succ != NULL; llink = llink->succ) {
-                /* cz277 - trans */
-		lhmmId = hmmId;
-                lsIdx = sIdx;
-                
-                ExtractState(llink->labid->name, hmmBuf, &sIdx);    /* support hmm state by hacking labid */
-                if (sIdx == 0) {
-                    hmmId = llink->labid;
-                    /* cz277 - trans */
-                    isPhoneLab = TRUE;
-                }
-                else {
-                    hmmId = GetLabId(hmmBuf, FALSE);
-                    /* cz277 - trans */
-                    isPhoneLab = FALSE;
-                }
-                if (hmmId == NULL) {
-                    HError(8925, "LoadOneUtt: Failed to find model for label \"%s\" given in the input MLF file", hmmBuf);
-                }
-                if ((macDef = FindMacroName(cache->hmmSet, 'l', hmmId)) == NULL) {
-                    HError(8925, "LoadOneUtt: Unknown label %s", hmmId->name);
-                }
-                hlink = (HLink) macDef->structure;
-                if (sIdx == 0) {    /* if it is a phone label */
-                    /* check whether all states of that hmm share the same ANN target */
-                    for (j = 3; j < hlink->numStates; ++j) {
-                        if ((hlink->svec[2].info->pdf[cache->streamIdx].targetSrc != hlink->svec[j].info->pdf[cache->streamIdx].targetSrc) ||
-                            (hlink->svec[2].info->pdf[cache->streamIdx].targetIdx != hlink->svec[j].info->pdf[cache->streamIdx].targetIdx)) {
-                            HError(8925, "LoadOneUtt: Phone label in the label file does not match the state level definition");
-                        }
-                    }
-                    sIdx = 2;
-                }
-                else if (sIdx <= 1 || sIdx >= hlink->numStates) {
-                    HError(8925, "LoadOneUtt: Illegal state index in the label file");
-                }
-                /* get the stream element pointer */
-                streamElem = &hlink->svec[sIdx].info->pdf[cache->streamIdx]; 
-                /* check the output layer source */
-                if (streamElem->targetSrc != cache->hmmSet->annSet->outLayers[cache->streamIdx]) {
-                    HError(8926, "LoadOneUtt: Only one output layer is allowed in one stream");
-                }
-                /* get the frame indexes */
-                GetBufferInfo(parmBuf, &pbInfo);
-                stIdx = (long) (llink->start / pbInfo.tgtSampRate + 0.5);
-                edIdx = (long) (llink->end / pbInfo.tgtSampRate + 0.5);
-                if (stIdx > edIdx) {
-                    HError(8927, "LoadOneUtt: Empty segment");
-                }
-                /* cz277 - trans */
-                if ((cache->labelInfo->uFlags & UPTRANS) != 0) {
-                    ta = (TrAcc *) GetHook(hlink->transP);
-                    if (isPhoneLab) {
-                        transcnt = (int) ((edIdx - stIdx) / (hlink->numStates - 2.0) + 0.5);
-                        transcnt -= 1;
-                        lsIdx = 1;
-                        for (j = 2; j <= hlink->numStates; ++j) {
-                            ta->occ[lsIdx] += 1;
-                            ta->tran[lsIdx][j] += 1;
-                            if (transcnt > 0) {
-                                ta->occ[j] += transcnt;
-                                ta->tran[j][j] += transcnt;
-                            }
-                            lsIdx = j;
-                        }
-                    }
-                    else {
-                        if (lhmmId != hmmId) {
-                            lsIdx = 1;
-                        }
-                        ta->occ[lsIdx] += 1;
-                        ta->tran[lsIdx][sIdx] += 1;
-			transcnt = edIdx - stIdx - 1;
-                        ta->occ[sIdx] += transcnt;
-                        if (transcnt > 0) {
-                            ta->tran[sIdx][sIdx] += transcnt;
-                        }
-                    }
-                }
-
-                if ((cache->labelInfo->uFlags & UPTARGETPEN) != 0) {
-                    streamElem->occAcc += edIdx - stIdx;
-                }
-                for (curIdx = stIdx; curIdx < edIdx; ++curIdx, ++i) {
-                    if (curIdx != i) {
-                        HError(8927, "LoadOneUtt: Discontinuous Utterance");
-                    }
-                    uttElem->labIdxes[i] = streamElem->targetIdx - 1;   /* targetIdx >= 1, labIdxes >= 0 */
-                }
-            }
-            if (i != uttElem->uttLen) {
-                HError(8924, "LoadOneUtt: %s Feature and Utterance lengths (%i, %i) do not match", uttElem->uttName, i, uttElem->uttLen);
-            }
+            LoadLabIdxes(cache, feaBuf, pbInfo.tgtSampRate, len, uttElem->labIdxes);
         }
         /* process lattice files */
         if (((cache->labelInfo->labelKind & LATLK) != 0) && (cache->streamIdx == 1)) { /* load lattice files */
@@ -1117,7 +1188,8 @@ static ReturnStatus LoadOneUtt(DataCache *cache, int dstPos) {
 static int FillCacheSGT(DataCache *cache) {
     int newUttCnt = 0;
 
-    if (cache->revisit == TRUE && need2Unload == FALSE) {
+    /* a packed corpus is loaded as a whole when attached */
+    if (cache->corpus != NULL || (cache->revisit == TRUE && need2Unload == FALSE)) {
         return newUttCnt;
     }
 
@@ -1169,7 +1241,9 @@ void LoadCacheData(DataCache *cache) {
         ret = FillCacheSGT(cache);
     }*/
     FillCacheSGT(cache);
-
+    /* queue the next batches while the current one is used */
+    if (cache->pipe != NULL) 
+        SchedulePipe(cache);
 }
 
 /* need to make ensure that all frames have been used */
@@ -1177,6 +1251,9 @@ static void UnloadOneUtt(DataCache *cache, int dstPos) {
     UttElem *uttElem;
     int i;
 
+    /* utterances of a packed corpus stay mapped */
+    if (cache->corpus != NULL) 
+        return;
     uttElem = &cache->uttElems[dstPos];
     /* check if all frames have been used */
     if (uttElem->frmUsed != uttElem->uttLen) 
@@ -1288,6 +1365,308 @@ static ReturnStatus UpdateFrmOrder(DataCache *cache) {
     return SUCCESS;
 }
 
+/* ---------------------------- Packed Corpus ---------------------------- */
+
+/* A packed corpus holds the cache contents of every utterance of a
+   script in a single file, which is mmap()ed read-only instead of
+   opening and converting the data files utterance by utterance:
+
+       CorpusHeader
+       for each utterance, in script order
+           float fea[uttLen][frmDim]
+           int   lab[uttLen]                  (LABLK only)
+           float flab[uttLen][dimFLab]        (FEALK only)
+           char  name[]                       (if the names are saved)
+       CorpusUtt index[nUtt]
+
+   every section starts on a CORPUSALIGN boundary.  Once attached, all
+   the utterances are in the cache, so FRMVK shuffles the frames of the
+   whole corpus and the page cache does the loading.
+*/
+
+#define CORPUSMAGIC "HNCORP1"
+#define CORPUSALIGN 8
+
+typedef struct _CorpusHeader {
+    char magic[8];              /* CORPUSMAGIC */
+    int nUtt;                   /* the number of utterances */
+    int frmDim;                 /* the frame dimension */
+    int labelKind;              /* the FEALK and LABLK bits of the packed labels */
+    int dimFLab;                /* the dimension of the feature type labels */
+    HTime sampRate;             /* the frame rate of the label files */
+    size_t tFrmNum;             /* the total number of frames */
+    size_t idxOff;              /* the offset of the utterance index */
+    size_t size;                /* the size of the file */
+} CorpusHeader;
+
+typedef struct _CorpusUtt {
+    size_t feaOff;              /* the offset of the frame matrix */
+    size_t labOff;              /* the offset of the target indexes, 0 if none */
+    size_t flabOff;             /* the offset of the feature type labels, 0 if none */
+    size_t nameOff;             /* the offset of the utterance name, 0 if none */
+    int uttLen;                 /* the number of frames */
+    int pad;
+} CorpusUtt;
+
+struct _CacheCorpus {
+    char *base;                 /* the mapped file */
+    size_t size;                /* the size of the mapping */
+    size_t pageSize;            /* the system page size */
+    size_t pfPtr;               /* the frmOrder or uttOrder position requested up to */
+};
+
+/* write a section of len bytes at offset off, return the next section offset */
+static size_t WriteCorpusSect(FILE *f, char *fn, size_t off, void *data, size_t len) {
+    static char zeros[CORPUSALIGN];
+    size_t pad;
+
+    pad = (CORPUSALIGN - (off + len) % CORPUSALIGN) % CORPUSALIGN;
+    if ((len > 0 && fwrite(data, 1, len, f) != len) || (pad > 0 && fwrite(zeros, 1, pad, f) != pad)) 
+        HError(8932, "WriteCorpusSect: Failed to write corpus file %s", fn);
+    return off + len + pad;
+}
+
+/* load every utterance of the script once and pack it into fn */
+static void PackCorpus(DataCache *cache, char *fn) {
+    int i, k;
+    size_t off;
+    FILE *f;
+    CorpusHeader hdr;
+    CorpusUtt *idx;
+    UttElem *uttElem;
+
+    if ((f = fopen(fn, "wb")) == NULL) 
+        HError(8932, "PackCorpus: Cannot create corpus file %s", fn);
+    memset(&hdr, 0, sizeof(CorpusHeader));
+    strcpy(hdr.magic, CORPUSMAGIC);
+    hdr.nUtt = cache->tUttNum;
+    hdr.frmDim = cache->frmDim;
+    if (cache->labelInfo != NULL) {
+        hdr.labelKind = cache->labelInfo->labelKind & (FEALK | LABLK);
+        if ((hdr.labelKind & FEALK) != 0) 
+            hdr.dimFLab = cache->labelInfo->dimFLab;
+    }
+    idx = (CorpusUtt *) New(&gstack, hdr.nUtt * sizeof(CorpusUtt));
+    memset(idx, 0, hdr.nUtt * sizeof(CorpusUtt));
+    /* the header is written again once the offsets are known */
+    off = WriteCorpusSect(f, fn, 0, &hdr, sizeof(CorpusHeader));
+    for (i = 0; i < cache->tUttNum; ++i) {
+        if (LoadOneUtt(cache, i) < SUCCESS) 
+            HError(8913, "PackCorpus: Load utterance %d failed", i);
+        uttElem = &cache->uttElems[i];
+        for (k = 1; k <= MAXAUGFEAS; ++k) 
+            if (uttElem->augFeaVec[k] != NULL) 
+                HError(8933, "PackCorpus: Augmented features can not be packed");
+        idx[i].uttLen = uttElem->uttLen;
+        idx[i].feaOff = off;
+        off = WriteCorpusSect(f, fn, off, uttElem->frmMat, (size_t) uttElem->uttLen * hdr.frmDim * sizeof(float));
+        if ((hdr.labelKind & LABLK) != 0) {
+            idx[i].labOff = off;
+            off = WriteCorpusSect(f, fn, off, uttElem->labIdxes, (size_t) uttElem->uttLen * sizeof(int));
+        }
+        if ((hdr.labelKind & FEALK) != 0) {
+            idx[i].flabOff = off;
+            off = WriteCorpusSect(f, fn, off, uttElem->flabMat, (size_t) uttElem->uttLen * hdr.dimFLab * sizeof(float));
+        }
+        if (uttElem->uttName != NULL) {
+            idx[i].nameOff = off;
+            off = WriteCorpusSect(f, fn, off, uttElem->uttName, strlen(uttElem->uttName) + 1);
+        }
+        hdr.tFrmNum += uttElem->uttLen;
+        /* release the utterance again */
+        uttElem->frmUsed = uttElem->uttLen;
+        UnloadOneUtt(cache, i);
+    }
+    hdr.sampRate = loadSampRate;
+    hdr.idxOff = off;
+    hdr.size = WriteCorpusSect(f, fn, off, idx, hdr.nUtt * sizeof(CorpusUtt));
+    if (fseek(f, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(CorpusHeader), 1, f) != 1 || fclose(f) != 0) 
+        HError(8932, "PackCorpus: Failed to write corpus file %s", fn);
+    Dispose(&gstack, idx);
+    /* back to an empty cache */
+    cache->nxtUttPos = 0;
+    cache->frmNum = 0;
+    cache->tFrmNum = 0;
+    rewind(cache->scpFile);
+    if (cache->labelInfo != NULL && (cache->labelInfo->labelKind & FEALK) != 0) 
+        rewind(cache->labelInfo->scpFLab);
+    if (trace & T_TOP) 
+        printf("PackCorpus: %d utterances (%lu frames) packed into %s\n", hdr.nUtt, (unsigned long) hdr.tFrmNum, fn);
+}
+
+/* map the packed corpus fn into cache, packing it first if fn does not exist;
+   must be called before the cache is initialised */
+void AttachCacheCorpus(DataCache *cache, char *fn) {
+    int i, j, fd, maxLen, labelKind = 0, *labIdxes;
+    char *base, buf[MAXSTRLEN];
+    Boolean packed = FALSE;
+    struct stat st;
+    CorpusHeader *hdr;
+    CorpusUtt *idx;
+    UttElem *uttElem;
+    CacheCorpus *corpus;
+
+    if (cache->corpus != NULL || cache->nxtUttPos > 0) 
+        HError(8932, "AttachCacheCorpus: Cache already holds utterances");
+    if (cache->labelInfo != NULL) {
+        if ((cache->labelInfo->labelKind & LATLK) != 0) 
+            HError(8933, "AttachCacheCorpus: Lattices can not be packed");
+        labelKind = cache->labelInfo->labelKind & (FEALK | LABLK);
+    }
+    if (GetNumNMatRPLInfo() > 0 || GetNumNVecRPLInfo() > 0) 
+        HError(8933, "AttachCacheCorpus: Replaceable parts can not be packed");
+    if (stat(fn, &st) != 0) {
+        PackCorpus(cache, fn);
+        packed = TRUE;
+    }
+    /* map the file */
+    if ((fd = open(fn, O_RDONLY)) < 0 || fstat(fd, &st) != 0) 
+        HError(8932, "AttachCacheCorpus: Cannot open corpus file %s", fn);
+    if (st.st_size < sizeof(CorpusHeader)) 
+        HError(8932, "AttachCacheCorpus: %s is not a corpus file", fn);
+    base = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) 
+        HError(8932, "AttachCacheCorpus: Failed to map corpus file %s", fn);
+    hdr = (CorpusHeader *) base;
+    if (strcmp(hdr->magic, CORPUSMAGIC) != 0 || hdr->size != st.st_size) 
+        HError(8932, "AttachCacheCorpus: %s is not a corpus file", fn);
+    if (hdr->nUtt != cache->tUttNum || hdr->frmDim != cache->frmDim) 
+        HError(8932, "AttachCacheCorpus: %s holds %d utterances of dimension %d, not %d of %d", fn, hdr->nUtt, hdr->frmDim, cache->tUttNum, cache->frmDim);
+    if ((hdr->labelKind & labelKind) != labelKind || ((labelKind & FEALK) != 0 && hdr->dimFLab != cache->labelInfo->dimFLab)) 
+        HError(8932, "AttachCacheCorpus: %s does not hold the required labels", fn);
+    /* frames are visited at random, utterances from start to end */
+    if (cache->visitKind == FRMVK) 
+        madvise(base, st.st_size, MADV_RANDOM);
+    else if (cache->visitKind == NONEVK || cache->visitKind == PLNONEVK) 
+        madvise(base, st.st_size, MADV_SEQUENTIAL);
+    corpus = (CacheCorpus *) New(cache->cmem, sizeof(CacheCorpus));
+    corpus->base = base;
+    corpus->size = st.st_size;
+    corpus->pageSize = sysconf(_SC_PAGESIZE);
+    corpus->pfPtr = 0;
+    /* point the utterances into the mapping */
+    idx = (CorpusUtt *) (base + hdr->idxOff);
+    cache->tFrmNum = 0;
+    maxLen = 0;
+    for (i = 0; i < cache->tUttNum; ++i) {
+        uttElem = &cache->uttElems[i];
+        uttElem->uttLen = idx[i].uttLen;
+        uttElem->frmUsed = 0;
+        uttElem->frmMat = (float *) (base + idx[i].feaOff);
+        uttElem->labIdxes = ((labelKind & LABLK) != 0) ? (int *) (base + idx[i].labOff) : NULL;
+        uttElem->flabMat = ((labelKind & FEALK) != 0) ? (float *) (base + idx[i].flabOff) : NULL;
+        uttElem->uttName = (cache->saveUttName && idx[i].nameOff > 0) ? base + idx[i].nameOff : NULL;
+        uttElem->frmOrder = NULL;
+        if (cache->visitKind == PLUTTFRMVK || cache->visitKind == UTTFRMVK) {
+            uttElem->frmOrder = (int *) New(cache->cmem, uttElem->uttLen * sizeof(int));
+            for (j = 0; j < uttElem->uttLen; ++j) 
+                uttElem->frmOrder[j] = j;
+            ShuffleSegment(uttElem->frmOrder, 0, uttElem->uttLen, sizeof(int));
+        }
+        if (cache->xfInfo != NULL) {
+            uttElem->inXForm = cache->xfInfo->inXForm;
+            uttElem->paXForm = cache->xfInfo->paXForm;
+        }
+        cache->tFrmNum += uttElem->uttLen;
+        if (uttElem->uttLen > maxLen) 
+            maxLen = uttElem->uttLen;
+    }
+    if (cache->tFrmNum != hdr->tFrmNum) 
+        HError(8932, "AttachCacheCorpus: Corrupted corpus file %s", fn);
+    /* the target and transition counts come from the label files, unless
+       they were collected while packing */
+    if (!packed && (labelKind & LABLK) != 0 && (cache->labelInfo->uFlags & (UPTARGETPEN | UPTRANS)) != 0) {
+        labIdxes = (int *) New(&gstack, maxLen * sizeof(int));
+        for (i = 0; i < cache->tUttNum; ++i) {
+            if (GetNextScpWord(cache->scpFile, buf) == NULL) 
+                HError(8913, "AttachCacheCorpus: Fail to read the next word in the script");
+            uttElem = &cache->uttElems[i];
+            LoadLabIdxes(cache, buf, hdr->sampRate, uttElem->uttLen, labIdxes);
+            if (memcmp(labIdxes, uttElem->labIdxes, uttElem->uttLen * sizeof(int)) != 0) 
+                HError(8932, "AttachCacheCorpus: Labels of %s differ from corpus %s", buf, fn);
+        }
+        Dispose(&gstack, labIdxes);
+        rewind(cache->scpFile);
+    }
+    /* all utterances are loaded */
+    cache->nxtUttPos = cache->tUttNum;
+    cache->frmNum = cache->tFrmNum;
+    cache->corpus = corpus;
+    if (trace & T_TOP) 
+        printf("AttachCacheCorpus: %d utterances (%lu frames) mapped from %s\n", cache->tUttNum, (unsigned long) cache->tFrmNum, fn);
+}
+
+/* unmap the packed corpus of cache */
+static void DetachCacheCorpus(DataCache *cache) {
+    int i;
+
+    for (i = 0; i < cache->tUttNum; ++i) {
+        if (cache->uttElems[i].frmOrder != NULL) {
+            Dispose(cache->cmem, cache->uttElems[i].frmOrder);
+            cache->uttElems[i].frmOrder = NULL;
+        }
+    }
+    munmap(cache->corpus->base, cache->corpus->size);
+    Dispose(cache->cmem, cache->corpus);
+    cache->corpus = NULL;
+}
+
+/* ask for the pages of len bytes at addr to be read in */
+static void AdviseCorpus(CacheCorpus *corpus, void *addr, size_t len) {
+    size_t st, ed;
+
+    ed = (char *) addr - corpus->base + len;
+    st = ((char *) addr - corpus->base) / corpus->pageSize * corpus->pageSize;
+    madvise(corpus->base + st, ed - st, MADV_WILLNEED);
+}
+
+/* request the frames (FRMVK) or utterances of the next corpusPrefetch
+   batches, so that they are read in while the current batch is used */
+static void PrefetchCorpus(DataCache *cache) {
+    size_t i, ed;
+    int dimFLab;
+    FrmIndex *frmIdx;
+    UttElem *uttElem;
+    CacheCorpus *corpus;
+
+    corpus = cache->corpus;
+    if (corpusPrefetch == 0) 
+        return;
+    dimFLab = (cache->labelInfo != NULL) ? cache->labelInfo->dimFLab : 0;
+    if (corpus->pfPtr < cache->orderPtr) 
+        corpus->pfPtr = cache->orderPtr;
+    if (cache->visitKind == FRMVK) {
+        ed = cache->orderPtr + (size_t) corpusPrefetch * cache->batchSamples;
+        if (ed > cache->fvLen) 
+            ed = cache->fvLen;
+        for (i = corpus->pfPtr; i < ed; ++i) {
+            frmIdx = &cache->frmOrder[i];
+            uttElem = &cache->uttElems[frmIdx->uttIdx];
+            AdviseCorpus(corpus, uttElem->frmMat + (size_t) frmIdx->frmIdx * cache->frmDim, cache->frmDim * sizeof(float));
+            if (uttElem->labIdxes != NULL) 
+                AdviseCorpus(corpus, &uttElem->labIdxes[frmIdx->frmIdx], sizeof(int));
+            if (uttElem->flabMat != NULL) 
+                AdviseCorpus(corpus, uttElem->flabMat + (size_t) frmIdx->frmIdx * dimFLab, dimFLab * sizeof(float));
+        }
+    }
+    else {
+        ed = cache->orderPtr + (size_t) corpusPrefetch * cache->ptrNum;
+        if (ed > cache->edUttPos) 
+            ed = cache->edUttPos;
+        for (i = corpus->pfPtr; i < ed; ++i) {
+            uttElem = &cache->uttElems[cache->uttOrder[i]];
+            AdviseCorpus(corpus, uttElem->frmMat, (size_t) uttElem->uttLen * cache->frmDim * sizeof(float));
+            if (uttElem->labIdxes != NULL) 
+                AdviseCorpus(corpus, uttElem->labIdxes, uttElem->uttLen * sizeof(int));
+            if (uttElem->flabMat != NULL) 
+                AdviseCorpus(corpus, uttElem->flabMat, (size_t) uttElem->uttLen * dimFLab * sizeof(float));
+        }
+    }
+    if (ed > corpus->pfPtr) 
+        corpus->pfPtr = ed;
+}
+
 /* initialise the cache, is used only once */
 void InitCache(DataCache *cache) {
     int i;
@@ -1333,6 +1712,14 @@ void InitCache(DataCache *cache) {
             HError(8991, "InitCache: Unknown visiting order");
             break;
     }
+    /* start the batch pipeline */
+    if (cache->pipe == NULL && pipeThreads > 0 && cache->visitKind == FRMVK) 
+        CreatePipe(cache);
+    /* start reading the first batches of a packed corpus */
+    if (cache->corpus != NULL) {
+        cache->corpus->pfPtr = 0;
+        PrefetchCorpus(cache);
+    }
     /* cz277 - mtload */
     /*if (extThreadLoad == TRUE) {
         memset(&cache->extThread, 0, sizeof(pthread_t));
@@ -1416,7 +1803,8 @@ static void CopyExtFrame2Batch(UttElem *uttElem, int curIdx, FELink feaElem, NFl
 
 
 /* fill the batch in the FRM series way */
-static Boolean FillBatchFRM(DataCache *cache, int nSamples) {
+/* the frame indexes are appended to frmBatch, *batLen counts them */
+static Boolean FillBatchFRM(DataCache *cache, FrmIndex *frmBatch, int *batLen, int nSamples) {
     int i;
     Boolean finish = FALSE;
 
@@ -1433,7 +1821,7 @@ static Boolean FillBatchFRM(DataCache *cache, int nSamples) {
             }
         }
         /* copy the frame */
-        memcpy(&cache->frmBatch[cache->batLen++], &cache->frmOrder[cache->orderPtr++], sizeof(FrmIndex));
+        memcpy(&frmBatch[(*batLen)++], &cache->frmOrder[cache->orderPtr++], sizeof(FrmIndex));
         /* update the pointers */
     }
     /* if all data are finished */
@@ -1597,40 +1985,32 @@ int UnloadCacheData(DataCache *cache) {
 }
 
 /* cz277 - many */
-static int GetDataFromCache(DataCache *cache, FELink feaElem, int offset) {
-    int i, j, n, uttIdx, frmIdx, extDim;
-    NFloat *feaPtr;
+/* splice the frames of frmBatch at context shift ctxPool[k] of feaElem into feaPtr */
+static void GetDataFromCache(DataCache *cache, FrmIndex *frmBatch, int batLen, FELink feaElem, int k, NFloat *feaPtr) {
+    int j, uttIdx, frmIdx, extDim;
     UttElem *uttElem;
 
-    n = IntVecSize(feaElem->ctxPool);
     /* set the pointers */
     extDim = feaElem->extDim;
     /* fetch each extended frame */
-    for (i = 1; i <= n; ++i) {
-        feaPtr = feaElem->feaMats[i]->matElems + offset;
-        for (j = offset; j < cache->batLen; ++j, feaPtr += extDim) {
-            uttIdx = cache->frmBatch[j].uttIdx;
-            frmIdx = cache->frmBatch[j].frmIdx + feaElem->ctxPool[i];	/* cz277 - many */
-            /* get the right UttElem */
-            uttElem = &cache->uttElems[uttIdx];
-            /* make and copy the extended frame */
-            CopyExtFrame2Batch(uttElem, frmIdx, feaElem, feaPtr);
-        }
+    for (j = 0; j < batLen; ++j, feaPtr += extDim) {
+        uttIdx = frmBatch[j].uttIdx;
+        frmIdx = frmBatch[j].frmIdx + feaElem->ctxPool[k];	/* cz277 - many */
+        /* get the right UttElem */
+        uttElem = &cache->uttElems[uttIdx];
+        /* make and copy the extended frame */
+        CopyExtFrame2Batch(uttElem, frmIdx, feaElem, feaPtr);
     }
-
-    return cache->batLen;
 }
 
 /* cz277 - many */
 /* fill the feature batch according to frmBatch */
-static int GetAugFeaFromCache(DataCache *cache, FELink feaElem, int offset) {
+static void GetAugFeaFromCache(DataCache *cache, FrmIndex *frmBatch, int batLen, FELink feaElem, NFloat *feaPtr) {
     int i, j, uttIdx;
-    NFloat *feaPtr;
     UttElem *uttElem;
 
-    feaPtr = feaElem->feaMats[1]->matElems + offset;
-    for (i = 0; i < cache->batLen; ++i) {
-        uttIdx = cache->frmBatch[i].uttIdx;
+    for (i = 0; i < batLen; ++i) {
+        uttIdx = frmBatch[i].uttIdx;
         /* get the right UttElem */
         uttElem = &cache->uttElems[uttIdx];
         if (VectorSize(uttElem->augFeaVec[feaElem->augFeaIdx]) != feaElem->feaDim) {
@@ -1640,28 +2020,25 @@ static int GetAugFeaFromCache(DataCache *cache, FELink feaElem, int offset) {
             memcpy(feaPtr, &uttElem->augFeaVec[feaElem->augFeaIdx][1], feaElem->feaDim * sizeof(float));
         }
     }
-
-    return cache->batLen;
 }
 
 /* fill the label batch according to frmBatch and labelKind */
-static void GetHardLabelFromCache(DataCache *cache, int tgtDim, NFloat *labBat, int offset) {
+/* the target indexes also go to labIdx[0 .. batLen-1] */
+static void GetHardLabelFromCache(DataCache *cache, FrmIndex *frmBatch, int batLen, int tgtDim, NFloat *labPtr, int *labIdx) {
     int i, uttIdx, frmIdx, tgtIdx;
-    NFloat *labPtr;
     UttElem *uttElem;
 
     if ((cache->labelInfo->labelKind & LABLK) == 0) {
         HError(8901, "GetHardLabelFromCache: Function does not support current label kind");
     }
 
-    labPtr = labBat + offset;
-    for (i = offset; i < cache->batLen; ++i, labPtr += tgtDim) {
-        uttIdx = cache->frmBatch[i].uttIdx;
-        frmIdx = cache->frmBatch[i].frmIdx;
+    for (i = 0; i < batLen; ++i, labPtr += tgtDim) {
+        uttIdx = frmBatch[i].uttIdx;
+        frmIdx = frmBatch[i].frmIdx;
         /* get the right UttElem */
         uttElem = &cache->uttElems[uttIdx];
         tgtIdx = uttElem->labIdxes[frmIdx];
-        cache->labVec[i + 1] = tgtIdx;   /* fill labVec */
+        labIdx[i] = tgtIdx;   /* fill labVec */
         if (tgtIdx < 0 || tgtIdx >= tgtDim)
             HError(8993, "GetHardLabelFromCache: Label index out of range");
         memset(labPtr, 0.0, tgtDim * sizeof(NFloat));
@@ -1670,10 +2047,8 @@ static void GetHardLabelFromCache(DataCache *cache, int tgtDim, NFloat *labBat,
 }
 
 /* fill the label batch according to frmBatch and labelKind */
-/* return the number of frame in the batch */
-static int GetFeatureLabelFromCache(DataCache *cache, int tgtDim, NFloat *labBat, int offset) {
+static void GetFeatureLabelFromCache(DataCache *cache, FrmIndex *frmBatch, int batLen, int tgtDim, NFloat *labPtr) {
     int i, uttIdx, frmIdx;
-    NFloat *labPtr;
     UttElem *uttElem;
     float *flabPtr;
 #ifdef DOUBLEANN
@@ -1682,17 +2057,14 @@ static int GetFeatureLabelFromCache(DataCache *cache, int tgtDim, NFloat *labBat
 
     if ((cache->labelInfo->labelKind & FEALK) == 0) {
         HError(8901, "GetFeatureLabelFromCache: Function does not support current label kind");
-        return -1;
     }
     if (cache->labelInfo->dimFLab != tgtDim) {
         HError(8930, "GetFeatureLabelFromCache: Inconsistent dimensions between feature type label and output layer");
-        return -1;
     }
 
-    labPtr = labBat + offset;
-    for (i = offset; i < cache->batLen; ++i, labPtr += tgtDim) {
-        uttIdx = cache->frmBatch[i].uttIdx;
-        frmIdx = cache->frmBatch[i].frmIdx;
+    for (i = 0; i < batLen; ++i, labPtr += tgtDim) {
+        uttIdx = frmBatch[i].uttIdx;
+        frmIdx = frmBatch[i].frmIdx;
         /* get the right UttElem */
         uttElem = &cache->uttElems[uttIdx];
         flabPtr = &uttElem->flabMat[frmIdx * tgtDim];
@@ -1703,10 +2075,49 @@ static int GetFeatureLabelFromCache(DataCache *cache, int tgtDim, NFloat *labBat
         memcpy(labPtr, flabPtr, tgtDim * sizeof(float));
 #endif
     }
-
-    return cache->batLen;
 }
 
+/* fill the input and label batches of the frames in frmBatch; with
+   feaDst == NULL the NMatrix batches are filled directly, otherwise
+   feaDst holds a buffer for each input matrix in turn, and labDst and
+   labIdx the buffers for the targets */
+static void FillBatchData(DataCache *cache, FrmIndex *frmBatch, int batLen, NFloat **feaDst, NFloat *labDst, int *labIdx) {
+    int i, k, n, b, nInp, tgtDim;
+    FELink *inpElem;
+    LabelKind labelKind;
+
+    nInp = cache->hmmSet->nInp[cache->streamIdx];
+    inpElem = cache->hmmSet->inpElem[cache->streamIdx];
+    /* fill each input batches */
+    for (i = 0, b = 0; i < nInp; ++i) {
+        if (inpElem[i]->inputKind == INPFEAIK) {
+            n = IntVecSize(inpElem[i]->ctxPool);
+            for (k = 1; k <= n; ++k, ++b) 
+                GetDataFromCache(cache, frmBatch, batLen, inpElem[i], k, (feaDst != NULL) ? feaDst[b] : inpElem[i]->feaMats[k]->matElems);
+        }
+        else if (inpElem[i]->inputKind == AUGFEAIK) {	/* cz277 - aug */
+            GetAugFeaFromCache(cache, frmBatch, batLen, inpElem[i], (feaDst != NULL) ? feaDst[b] : inpElem[i]->feaMats[1]->matElems);
+            ++b;
+        }
+        else 
+            HError(8992, "FillAllInpBatch: Can only have INPFEAIK and AUGFEAIK from host memory");
+    }
+    /* fill the label batch if needed */
+    if (cache->labMat != NULL) {
+        tgtDim = cache->outLayer->nodeNum;
+        labelKind = cache->labelInfo->labelKind;
+        if (labDst == NULL) {
+            labDst = cache->labMat->matElems;
+            labIdx = (cache->labVec != NULL) ? &cache->labVec[1] : NULL;
+        }
+        if (labelKind & FEALK)
+            GetFeatureLabelFromCache(cache, frmBatch, batLen, tgtDim, labDst);
+        else if (labelKind & LABLK)
+            GetHardLabelFromCache(cache, frmBatch, batLen, tgtDim, labDst, labIdx);
+        else
+            HError(8992, "FillAllInpBatch: Label kind does not support cache label matrix");
+    }
+}
 
 /* return the name of the utterance that the frame in frmPtrs[0] is associated with */
 char *GetCurUttName(DataCache *cache) {
@@ -1768,25 +2179,350 @@ FBLatInfo *LoadDenLatsFromUttElem(UttElem *uttElem, FBLatInfo *fbInfo) {
     return fbInfo;
 }
 
+/* ---------------------------- Batch Pipeline ---------------------------- */
+
+/* With PIPELINETHREADS > 0 the batches of a FRMVK cache are assembled
+   ahead of use.  The caller's thread picks the frames of the next
+   batches, which is the only step that touches the visiting order and
+   the loading state, and queues them in one of PIPELINEDEPTH slots.
+   The worker threads splice the context windows and look up the
+   targets into the slot's own buffers, and FillAllInpBatch only waits
+   for the oldest slot and copies it into the NMatrix batches.  The
+   utterances of queued frames stay loaded, as UnloadCacheData only
+   counts the frames of batches already delivered.
+*/
+
+enum { SLOTFREE, SLOTQUEUED, SLOTBUSY, SLOTREADY };
+
+typedef struct _BatchSlot {
+    int state;                  /* SLOTFREE .. SLOTREADY */
+    int batLen;                 /* the number of frames in the batch */
+    Boolean finish;             /* whether this is the last batch */
+    FrmIndex *frmBatch;         /* the frames of the batch */
+    NFloat **feaBuf;            /* a buffer for each input matrix */
+    NFloat *labBuf;             /* the buffer for the label matrix */
+    int *labIdx;                /* the buffer for the target indexes */
+} BatchSlot;
+
+struct _CachePipe {
+    DataCache *cache;           /* the cache the batches come from */
+    int nSlot;                  /* the number of batch slots */
+    int nThread;                /* the number of worker threads */
+    int nBuf;                   /* the number of input matrices */
+    int *bufDim;                /* the row size of each input matrix */
+    BatchSlot *slots;           /* the ring of batch slots */
+    int head;                   /* the oldest slot in use */
+    int nUsed;                  /* the number of slots in use */
+    Boolean ended;              /* the last batch has been queued */
+    Boolean held;               /* a short batch is queued, wait for the cache to refill */
+    Boolean quit;               /* the workers should exit */
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* signalled when a slot is queued */
+    pthread_cond_t done;        /* signalled when a slot is ready */
+    PipeStats stats;
+};
+
+/* wall clock in seconds */
+static double PipeClock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+/* worker thread: splice the oldest queued slot until told to quit */
+static void *PipeWorker(void *arg) {
+    int i;
+    double t;
+    CachePipe *pipe;
+    BatchSlot *slot;
+
+    pipe = (CachePipe *) arg;
+    pthread_mutex_lock(&pipe->lock);
+    while (TRUE) {
+        slot = NULL;
+        t = PipeClock();
+        while (!pipe->quit) {
+            for (i = 0; i < pipe->nUsed; ++i) {
+                slot = &pipe->slots[(pipe->head + i) % pipe->nSlot];
+                if (slot->state == SLOTQUEUED) 
+                    break;
+            }
+            if (i < pipe->nUsed) 
+                break;
+            slot = NULL;
+            pthread_cond_wait(&pipe->work, &pipe->lock);
+        }
+        pipe->stats.idleTime += PipeClock() - t;
+        if (slot == NULL) 
+            break;
+        slot->state = SLOTBUSY;
+        pthread_mutex_unlock(&pipe->lock);
+        t = PipeClock();
+        FillBatchData(pipe->cache, slot->frmBatch, slot->batLen, slot->feaBuf, slot->labBuf, slot->labIdx);
+        t = PipeClock() - t;
+        pthread_mutex_lock(&pipe->lock);
+        pipe->stats.spliceTime += t;
+        slot->state = SLOTREADY;
+        pthread_cond_broadcast(&pipe->done);
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+/* create the pipeline of cache and start its workers */
+static void CreatePipe(DataCache *cache) {
+    int i, j, k, n, nInp, tgtDim;
+    FELink *inpElem;
+    CachePipe *pipe;
+    BatchSlot *slot;
+
+    pipe = (CachePipe *) New(cache->cmem, sizeof(CachePipe));
+    memset(pipe, 0, sizeof(CachePipe));
+    pipe->cache = cache;
+    pipe->nSlot = pipeDepth;
+    pipe->nThread = pipeThreads;
+    /* the input matrices, in the order FillBatchData fills them */
+    nInp = cache->hmmSet->nInp[cache->streamIdx];
+    inpElem = cache->hmmSet->inpElem[cache->streamIdx];
+    for (i = 0; i < nInp; ++i) 
+        pipe->nBuf += (inpElem[i]->inputKind == INPFEAIK) ? IntVecSize(inpElem[i]->ctxPool) : 1;
+    pipe->bufDim = (int *) New(cache->cmem, pipe->nBuf * sizeof(int));
+    for (i = 0, k = 0; i < nInp; ++i) {
+        if (inpElem[i]->inputKind == INPFEAIK) {
+            n = IntVecSize(inpElem[i]->ctxPool);
+            for (j = 1; j <= n; ++j) 
+                pipe->bufDim[k++] = inpElem[i]->extDim;
+        }
+        else 
+            pipe->bufDim[k++] = inpElem[i]->ctxMap[0] * inpElem[i]->feaDim;
+    }
+    tgtDim = cache->outLayer->nodeNum;
+    /* the slots */
+    pipe->slots = (BatchSlot *) New(cache->cmem, pipe->nSlot * sizeof(BatchSlot));
+    for (i = 0; i < pipe->nSlot; ++i) {
+        slot = &pipe->slots[i];
+        slot->state = SLOTFREE;
+        slot->frmBatch = (FrmIndex *) New(cache->cmem, cache->batchSamples * sizeof(FrmIndex));
+        slot->feaBuf = (NFloat **) New(cache->cmem, pipe->nBuf * sizeof(NFloat *));
+        for (k = 0; k < pipe->nBuf; ++k) 
+            slot->feaBuf[k] = (NFloat *) New(cache->cmem, cache->batchSamples * pipe->bufDim[k] * sizeof(NFloat));
+        slot->labBuf = (NFloat *) New(cache->cmem, cache->batchSamples * tgtDim * sizeof(NFloat));
+        slot->labIdx = (int *) New(cache->cmem, cache->batchSamples * sizeof(int));
+    }
+    /* the workers */
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->work, NULL);
+    pthread_cond_init(&pipe->done, NULL);
+    pipe->threads = (pthread_t *) New(cache->cmem, pipe->nThread * sizeof(pthread_t));
+    for (i = 0; i < pipe->nThread; ++i) 
+        if (pthread_create(&pipe->threads[i], NULL, PipeWorker, pipe) != 0) 
+            HError(8929, "CreatePipe: Fail to create batch pipeline thread %d", i);
+    cache->pipe = pipe;
+}
+
+/* drop the queued batches once the workers are done with them */
+static void DrainPipe(DataCache *cache) {
+    int i;
+    Boolean busy;
+    CachePipe *pipe;
+
+    pipe = cache->pipe;
+    pthread_mutex_lock(&pipe->lock);
+    for (i = 0; i < pipe->nSlot; ++i) 
+        if (pipe->slots[i].state == SLOTQUEUED) 
+            pipe->slots[i].state = SLOTFREE;
+    do {
+        for (i = 0, busy = FALSE; i < pipe->nSlot; ++i) 
+            if (pipe->slots[i].state == SLOTBUSY) 
+                busy = TRUE;
+        if (busy) 
+            pthread_cond_wait(&pipe->done, &pipe->lock);
+    } while (busy);
+    for (i = 0; i < pipe->nSlot; ++i) 
+        pipe->slots[i].state = SLOTFREE;
+    pipe->head = 0;
+    pipe->nUsed = 0;
+    pipe->ended = FALSE;
+    pipe->held = FALSE;
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+/* stop the workers and release the pipeline */
+static void FreePipe(DataCache *cache) {
+    int i, k;
+    CachePipe *pipe;
+
+    DrainPipe(cache);
+    pipe = cache->pipe;
+    pthread_mutex_lock(&pipe->lock);
+    pipe->quit = TRUE;
+    pthread_cond_broadcast(&pipe->work);
+    pthread_mutex_unlock(&pipe->lock);
+    for (i = 0; i < pipe->nThread; ++i) 
+        pthread_join(pipe->threads[i], NULL);
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->work);
+    pthread_cond_destroy(&pipe->done);
+    for (i = 0; i < pipe->nSlot; ++i) {
+        for (k = 0; k < pipe->nBuf; ++k) 
+            Dispose(cache->cmem, pipe->slots[i].feaBuf[k]);
+        Dispose(cache->cmem, pipe->slots[i].feaBuf);
+        Dispose(cache->cmem, pipe->slots[i].frmBatch);
+        Dispose(cache->cmem, pipe->slots[i].labBuf);
+        Dispose(cache->cmem, pipe->slots[i].labIdx);
+    }
+    Dispose(cache->cmem, pipe->threads);
+    Dispose(cache->cmem, pipe->slots);
+    Dispose(cache->cmem, pipe->bufDim);
+    Dispose(cache->cmem, pipe);
+    cache->pipe = NULL;
+}
+
+/* pick the frames of the next batches and queue them for the workers;
+   stops after a short batch, as the cache has to be refilled first */
+static void SchedulePipe(DataCache *cache) {
+    double t;
+    CachePipe *pipe;
+    BatchSlot *slot;
+
+    pipe = cache->pipe;
+    t = PipeClock();
+    while (pipe->nUsed < pipe->nSlot && !pipe->ended && !pipe->held) {
+        slot = &pipe->slots[(pipe->head + pipe->nUsed) % pipe->nSlot];
+        slot->batLen = 0;
+        slot->finish = FillBatchFRM(cache, slot->frmBatch, &slot->batLen, cache->batchSamples);
+        if (slot->batLen == 0) 
+            break;
+        if (slot->finish) 
+            pipe->ended = TRUE;
+        else if (slot->batLen < cache->batchSamples) 
+            pipe->held = TRUE;
+        pthread_mutex_lock(&pipe->lock);
+        slot->state = SLOTQUEUED;
+        ++pipe->nUsed;
+        pthread_cond_signal(&pipe->work);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+    pipe->stats.selectTime += PipeClock() - t;
+}
+
+/* copy a spliced slot into the batches of cache */
+static void InstallSlot(DataCache *cache, BatchSlot *slot) {
+    int i, j, k, n, nInp, tgtDim;
+    FELink *inpElem;
+    CachePipe *pipe;
+
+    pipe = cache->pipe;
+    nInp = cache->hmmSet->nInp[cache->streamIdx];
+    inpElem = cache->hmmSet->inpElem[cache->streamIdx];
+    for (i = 0, k = 0; i < nInp; ++i) {
+        n = (inpElem[i]->inputKind == INPFEAIK) ? IntVecSize(inpElem[i]->ctxPool) : 1;
+        for (j = 1; j <= n; ++j, ++k) 
+            memcpy(inpElem[i]->feaMats[j]->matElems, slot->feaBuf[k], slot->batLen * pipe->bufDim[k] * sizeof(NFloat));
+    }
+    if (cache->labMat != NULL) {
+        tgtDim = cache->outLayer->nodeNum;
+        memcpy(cache->labMat->matElems, slot->labBuf, slot->batLen * tgtDim * sizeof(NFloat));
+        if (cache->labVec != NULL && (cache->labelInfo->labelKind & LABLK) != 0) 
+            memcpy(&cache->labVec[1], slot->labIdx, slot->batLen * sizeof(int));
+    }
+    memcpy(cache->frmBatch, slot->frmBatch, slot->batLen * sizeof(FrmIndex));
+    cache->batLen = slot->batLen;
+}
+
+/* deliver the oldest batch of the pipeline, FALSE if none could be queued */
+static Boolean TakePipeBatch(DataCache *cache, Boolean *finish) {
+    int i, nQueued = 0, nReady = 0;
+    double t;
+    CachePipe *pipe;
+    BatchSlot *slot;
+
+    pipe = cache->pipe;
+    SchedulePipe(cache);
+    if (pipe->nUsed == 0) 
+        return FALSE;
+    slot = &pipe->slots[pipe->head];
+    pthread_mutex_lock(&pipe->lock);
+    for (i = 0; i < pipe->nUsed; ++i) {
+        switch (pipe->slots[(pipe->head + i) % pipe->nSlot].state) {
+            case SLOTQUEUED: 
+                ++nQueued; 
+                break;
+            case SLOTREADY: 
+                ++nReady; 
+                break;
+        }
+    }
+    if (slot->state != SLOTREADY) {
+        ++pipe->stats.nStall;
+        t = PipeClock();
+        while (slot->state != SLOTREADY) 
+            pthread_cond_wait(&pipe->done, &pipe->lock);
+        pipe->stats.stallTime += PipeClock() - t;
+    }
+    pthread_mutex_unlock(&pipe->lock);
+    t = PipeClock();
+    InstallSlot(cache, slot);
+    pipe->stats.installTime += PipeClock() - t;
+    *finish = slot->finish;
+    if (!slot->finish && slot->batLen < cache->batchSamples) 
+        pipe->held = FALSE;
+    pthread_mutex_lock(&pipe->lock);
+    slot->state = SLOTFREE;
+    pipe->head = (pipe->head + 1) % pipe->nSlot;
+    --pipe->nUsed;
+    pthread_mutex_unlock(&pipe->lock);
+    /* the counters */
+    ++pipe->stats.nBatch;
+    pipe->stats.sumQueued += nQueued;
+    pipe->stats.sumReady += nReady;
+    if (nQueued > pipe->stats.maxQueued) 
+        pipe->stats.maxQueued = nQueued;
+    if (nReady > pipe->stats.maxReady) 
+        pipe->stats.maxReady = nReady;
+
+    return TRUE;
+}
+
+/* copy the pipeline counters of cache, FALSE if it has no pipeline */
+Boolean GetCachePipeStats(DataCache *cache, PipeStats *stats) {
+    if (cache->pipe == NULL) 
+        return FALSE;
+    pthread_mutex_lock(&cache->pipe->lock);
+    *stats = cache->pipe->stats;
+    pthread_mutex_unlock(&cache->pipe->lock);
+    return TRUE;
+}
+
+/* print the pipeline counters of cache */
+static void PrintPipeStats(DataCache *cache) {
+    PipeStats stats;
+
+    if (!GetCachePipeStats(cache, &stats) || stats.nBatch == 0) 
+        return;
+    printf("Batch pipeline (stream %d): %ld batches, %d threads, %d slots\n", cache->streamIdx, stats.nBatch, cache->pipe->nThread, cache->pipe->nSlot);
+    printf("  select: %.3fs\n", stats.selectTime);
+    printf("  splice: %.3fs busy, %.3fs idle, queue depth %.2f avg %d max\n", stats.spliceTime, stats.idleTime, (double) stats.sumQueued / stats.nBatch, stats.maxQueued);
+    printf("  deliver: %.3fs copying, %ld stalls for %.3fs, ready depth %.2f avg %d max\n", stats.installTime, stats.nStall, stats.stallTime, (double) stats.sumReady / stats.nBatch, stats.maxReady);
+    fflush(stdout);
+}
+
 /* fill all cache related batches as well as the label batch (if needed) */
 /* underfill is only useful for UTT series and PLUTT series VisitKind */
 /*     for UTT, unfilled batch happens at the end of a utterance */
 /*     for PLUTT, unfilled batch happens at the end of all data (insufficient utts for the frmPtrs) */
 /* return TRUE if no more data available; nSamples returns the number of samples loaded */
 Boolean FillAllInpBatch(DataCache *cache, int *nSamples, int *uttCnt) {
-    int i, nInp, tgtDim;
     Boolean finish = FALSE;
-    FELink *inpElem;
-    NFloat *batPtr;
 #ifdef CUDA
-    int j,n;
+    int i, j, n, nInp;
+    FELink *inpElem;
 #endif
 
     /* init nSamples */
     *nSamples = 0;
-    nInp = cache->hmmSet->nInp[cache->streamIdx];
-    inpElem = cache->hmmSet->inpElem[cache->streamIdx];
-    tgtDim = cache->outLayer->nodeNum;
 
     /* cz277 - mtload */
     /*if (extThreadLoad == TRUE && cache->firstLoad == TRUE) 
@@ -1800,55 +2536,51 @@ Boolean FillAllInpBatch(DataCache *cache, int *nSamples, int *uttCnt) {
         UnloadCacheData(cache);
         FillCacheSGT(cache); 
 
-        UpdateUttOrder(cache);
-        if (cache->visitKind == FRMVK) 
-            UpdateFrmOrder(cache);
+        /* the order over a packed corpus covers every utterance already, 
+           and the pipeline has picked frames from the current order */
+        if (cache->corpus == NULL && cache->pipe == NULL) {
+            UpdateUttOrder(cache);
+            if (cache->visitKind == FRMVK) 
+                UpdateFrmOrder(cache);
+        }
     }
-    /* fill the internal batch */
-    switch (cache->visitKind) {
-        case FRMVK:
-            finish = FillBatchFRM(cache, cache->batchSamples - (*nSamples));
-            break;
-        case NONEVK:
-        case UTTFRMVK:
-        case UTTVK:
-            finish = FillBatchUTT(cache, cache->batchSamples - (*nSamples), uttCnt);
-            break;
-        case PLNONEVK:
-        case PLUTTFRMVK:
-        case PLUTTVK:
-            finish = FillBatchPLUTT(cache, cache->batchSamples - (*nSamples));
-            break;
-        default:
-            HError(8991, "FillAllInpBatch: Unknown visiting order");
+    /* take the batch from the pipeline, or fill it here */
+    if (cache->pipe == NULL || !TakePipeBatch(cache, &finish)) {
+        /* fill the internal batch */
+        switch (cache->visitKind) {
+            case FRMVK:
+                finish = FillBatchFRM(cache, cache->frmBatch, &cache->batLen, cache->batchSamples - (*nSamples));
+                break;
+            case NONEVK:
+            case UTTFRMVK:
+            case UTTVK:
+                finish = FillBatchUTT(cache, cache->batchSamples - (*nSamples), uttCnt);
+                break;
+            case PLNONEVK:
+            case PLUTTFRMVK:
+            case PLUTTVK:
+                finish = FillBatchPLUTT(cache, cache->batchSamples - (*nSamples));
+                break;
+            default:
+                HError(8991, "FillAllInpBatch: Unknown visiting order");
+        }
+        /* fill the input and label batches */
+        FillBatchData(cache, cache->frmBatch, cache->batLen, NULL, NULL, NULL);
     }
-    /* fill each input batches */
-    for (i = 0; i < nInp; ++i) {
-        if (inpElem[i]->inputKind == INPFEAIK) 
-            GetDataFromCache(cache, inpElem[i], (*nSamples) * inpElem[i]->extDim);
-        else if (inpElem[i]->inputKind == AUGFEAIK) 	/* cz277 - aug */
-            GetAugFeaFromCache(cache, inpElem[i], (*nSamples) * inpElem[i]->extDim);
-        else 
-            HError(8992, "FillAllInpBatch: Can only have INPFEAIK and AUGFEAIK from host memory");
 #ifdef CUDA
+    nInp = cache->hmmSet->nInp[cache->streamIdx];
+    inpElem = cache->hmmSet->inpElem[cache->streamIdx];
+    for (i = 0; i < nInp; ++i) {
         n = IntVecSize(inpElem[i]->ctxPool);
         for (j = 1; j <= n; ++j) 	/* cz277 - many */
             SyncNMatrixHost2Dev(inpElem[i]->feaMats[j]);
-#endif
     }
-    /* fill the label batch if needed */
-    if (cache->labMat != NULL) {
-        batPtr = cache->labMat->matElems + (*nSamples) * tgtDim;
-        if (cache->labelInfo->labelKind & FEALK)
-            GetFeatureLabelFromCache(cache, tgtDim, batPtr, 0);
-        else if (cache->labelInfo->labelKind & LABLK)
-            GetHardLabelFromCache(cache, tgtDim, batPtr, 0);
-        else
-            HError(8992, "FillAllInpBatch: Label kind does not support cache label matrix");
-#ifdef CUDA
+    if (cache->labMat != NULL) 
         SyncNMatrixHost2Dev(cache->labMat);
 #endif
-    }
+    /* request the next batches of a packed corpus */
+    if (cache->corpus != NULL) 
+        PrefetchCorpus(cache);
     /* update nSamples */
     *nSamples += cache->batLen;
     /* only applicable to UTT and PLUTT series */
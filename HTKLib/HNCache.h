@@ -125,6 +125,23 @@ typedef struct _LabelInfo {
     UPDSet uFlags;
 } LabelInfo;
 
+typedef struct _CacheCorpus CacheCorpus;     /* mmap()ed packed corpus, private to HNCache */
+typedef struct _CachePipe CachePipe;         /* batch assembly pipeline, private to HNCache */
+
+typedef struct _PipeStats {
+    long nBatch;                /* the number of batches delivered by the pipeline */
+    long nStall;                /* the number of deliveries that waited for the workers */
+    long sumQueued;             /* batches waiting to be spliced, summed over the deliveries */
+    long sumReady;              /* batches spliced and waiting, summed over the deliveries */
+    int maxQueued;              /* the maximum of the above */
+    int maxReady;
+    double selectTime;          /* seconds spent picking the frames of the batches */
+    double spliceTime;          /* seconds the workers spent splicing and labelling */
+    double idleTime;            /* seconds the workers waited for batches to splice */
+    double stallTime;           /* seconds the caller waited for a spliced batch */
+    double installTime;         /* seconds spent copying batches into the NMatrix batches */
+} PipeStats;
+
 typedef struct _DataCache {
     /* basic elements */
     MemHeap *cmem;              /* the memory heap for this data cache */
@@ -170,6 +187,8 @@ typedef struct _DataCache {
     XFInfo *xfInfo;
     pthread_t extThread;	/* cz277 - mtload */
     Boolean firstLoad;		/* cz277 - mtload */
+    CacheCorpus *corpus;        /* the packed corpus the utterances are mapped from, NULL if none */
+    CachePipe *pipe;            /* the batch assembly pipeline, NULL if batches are filled in line */
 } DataCache;
 
 /* ------------------------ Global Settings ------------------------- */
@@ -183,12 +202,14 @@ void SetNeed2UnloadFlag(void);
 
 void InitNCache(void);
 DataCache *CreateCache(MemHeap *heap, FILE *scpFile, int scpCnt, HMMSet *hset, Observation *obs, int streamIdx, size_t cacheSamples, VisitKind visitKind, XFInfo *xfInfo, LabelInfo *labelInfo, Boolean saveUttName);
+void AttachCacheCorpus(DataCache *cache, char *fn);
 void InitCache(DataCache *cache);
 Boolean FillAllInpBatch(DataCache *cache, int *nSamples, int *uttCnt);
 /* cz277 - mtload */
 void UpdateCacheStatus(DataCache *cache);
 void LoadCacheData(DataCache *cache);
 int UnloadCacheData(DataCache *cache);
+Boolean GetCachePipeStats(DataCache *cache, PipeStats *stats);
 
 char *GetCurUttName(DataCache *cache);
 int GetCurUttLen(DataCache *cache);
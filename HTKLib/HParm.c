@@ -54,6 +54,7 @@ char *hparm_vc_id = "$Id: HParm.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $";
 #ifdef UNIX
 #include <sys/ioctl.h>
 #endif
+#include <pthread.h>
 
 /* ----------------------------- Trace Flags ------------------------- */
 
@@ -209,6 +210,7 @@ typedef struct {
    char *MatTranFN;           /* points to the file name string */
    int thirdWin;              /* Accel window halfsize */
    int fourthWin;             /* Fourth order differential halfsize */
+   int frameBlock;            /* Frames per block for block coding (0=off) */
 
    /* ------- Internally derived parameters ------- */
    /*  These values are allocated in the IOConfigRec but are really */
@@ -235,6 +237,13 @@ typedef struct {
    float curVol;      /* current volume dB (0.0-100.0) */
    Vector a,k;        /* lpc and refc vectors */
    Vector fbank;      /* filterbank vector */
+   Matrix blkS;       /* block of windowed speech frames */
+   Matrix blkFB;      /* block of filterbank vectors */
+   Matrix blkC;       /* block of cepstral vectors */
+   Matrix blkCM;      /* weighted DCT matrix for block MFCC coding */
+   Vector blkTE;      /* frame energies of block */
+   Vector blkRawTE;   /* raw frame energies of block */
+   FBankBlock fbBlk;  /* workspace for block filterbank analysis */
    Vector c;          /* cepstral vector */
    Vector as, ac, lp; /* Auditory, autocorrelation an lp vectors for PLP */ 
    Vector eql;        /* Equal loundness curve */
@@ -269,6 +278,12 @@ typedef struct {
    char *sideGMMFn;
    /* mjfg, cz277 - 141022 */
    AdaptXForm *appendXForm;
+   /* per buffer scratch, allocated on the first frame read */
+   Vector rdVec;      /* frame as read by GetParm */
+   ShortVec rdShort;  /* compressed frame as read by GetParm */
+   Vector xfA;        /* statics of size d for XformBase */
+   Vector xfB;        /* second vector of size d */
+   Vector xfC;        /* cepstra of size numCepCoef */
 }IOConfigRec;
 
 typedef IOConfigRec *IOConfig;
@@ -382,6 +397,9 @@ typedef enum {
    /* Extended Deltas */
    THIRDWINDOW,
    FOURTHWINDOW,
+
+   /* Block coding */
+   FRAMEBLOCK,    /* Frames per block for FFT based coding */
    CFGSIZE
 }IOConfParm;
 
@@ -414,7 +432,8 @@ static char * ioConfName[CFGSIZE] = {
    /* from mjfg, cz277 - 141022 */
    "APPENDXFORMMASK", "APPENDXFORMEXT", "APPENDXFORMSIZE",
 
-   "MATTRANFN", "MATTRAN", "THIRDWINDOW", "FOURTHWINDOW"
+   "MATTRANFN", "MATTRAN", "THIRDWINDOW", "FOURTHWINDOW",
+   "FRAMEBLOCK"
 };
 
 /* -------------------  Default Configuration Values ---------------------- */
@@ -459,7 +478,8 @@ static const IOConfigRec defConf = {
    NULL,NULL,0,             /* APPENDXFORMMASK APPENDXFORMEXT APPENDXFORMSIZE */
 
    NULL,                  /* vqTab */
-   NULL, NULL, 2, 2      /* MATTRANFN, MATTRAN THIRDWIN FOURTHWIN */
+   NULL, NULL, 2, 2,     /* MATTRANFN, MATTRAN THIRDWIN FOURTHWIN */
+   0                      /* FRAMEBLOCK */
 };
 
 /* ------------------------- Buffer Definition  ------------------------*/
@@ -646,6 +666,7 @@ static Boolean hparmBin=TRUE; /* HTK format files are binary */
 
 static ChannelInfo *defChan=NULL;
 static ChannelInfo *curChan=NULL;
+static pthread_mutex_t chanLock = PTHREAD_MUTEX_INITIALIZER; /* channel counts */
 
 /* ----------------------- IO Configuration Handling ------------------ */
 
@@ -1070,6 +1091,7 @@ static IOConfig ReadIOConfig(IOConfig p)
 
          case THIRDWINDOW:    p->thirdWin = GI(s); break;
          case FOURTHWINDOW:   p->fourthWin = GI(s); break;
+         case FRAMEBLOCK:     p->frameBlock = GI(s); break;
          }
    }
    
@@ -1226,6 +1248,36 @@ void ResetChannelSession(char *confName)
    if (chan->cf.selfCalSilDet!=0) chan->spDetParmsSet=FALSE;
 }
 
+/* EXPORT->ReentrantChannel: check if current channel can be used by threads */
+Boolean ReentrantChannel(char **why)
+{
+   IOConfig cf = &(curChan->cf);
+
+   if (cf->useSilDet)
+      *why = "silence detection";
+   else if (cf->addDither!=0.0)
+      *why = "ADDDITHER";
+   else if (cf->cMeanDN!=NULL || cf->cMeanMask!=NULL ||
+            cf->varScaleDN!=NULL || cf->varScaleMask!=NULL)
+      *why = "side based normalisation";
+   else if (cf->sideXFormMask!=NULL || cf->sideGMMMask!=NULL ||
+            cf->appendXFormMask!=NULL || cf->MatTranFN!=NULL)
+      *why = "feature transforms";
+   else if (cf->augFea1DN!=NULL || cf->augFea1Mask!=NULL ||
+            cf->augFea2DN!=NULL || cf->augFea2Mask!=NULL ||
+            cf->augFea3DN!=NULL || cf->augFea3Mask!=NULL ||
+            cf->augFea4DN!=NULL || cf->augFea4Mask!=NULL ||
+            cf->augFea5DN!=NULL || cf->augFea5Mask!=NULL)
+      *why = "augmented features";
+   else if (cf->vqTab!=NULL || (cf->tgtPK&HASVQ))
+      *why = "VQ coding";
+   else if (cf->srcFF==ESIG || cf->tgtFF==ESIG)
+      *why = "ESIG files";
+   else
+      return TRUE;
+   return FALSE;
+}
+
 /* Keep the next two functions solely for compatibility */
 void SetNewConfig(char *confName)
 {
@@ -2234,124 +2286,112 @@ static void DelQualifiers(float *data, IOConfig cf)
       printf("HParm:  quals deleted to give %s\n",ParmKind2Str(cf->curPK,buf));
 }
 
-/* XformLPC2LPREFC: Convert Static Coefficients LPC -> LPREFC */
-static void XformLPC2LPREFC(float *data,int d)
+/* XformLPC2LPREFC: Convert Static Coefficients LPC -> LPREFC,
+   a and k are scratch vectors of the static size */
+static void XformLPC2LPREFC(float *data,Vector a,Vector k)
 {
-   Vector a,k;
-   int j;
+   int j,d;
    float *p;
    
-   a = CreateVector(&gstack,d);  k = CreateVector(&gstack,d);
+   d = VectorSize(a);
    p = data-1;
    for (j=1; j<=d; j++) a[j] = p[j];
    LPC2RefC(a,k);
    for (j=1; j<=d; j++) p[j] = k[j];
-   FreeVector(&gstack,k); FreeVector(&gstack,a); 
 }
 
 /* XformLPREFC2LPC: Convert Static Coefficients LPREFC -> LPC */
-static void XformLPREFC2LPC(float *data,int d)
+static void XformLPREFC2LPC(float *data,Vector k,Vector a)
 {
-   Vector a,k;
-   int j;
+   int j,d;
    float *p;
    
-   a = CreateVector(&gstack,d);  k = CreateVector(&gstack,d);
+   d = VectorSize(k);
    p = data-1;
    for (j=1; j<=d; j++) k[j] = p[j];
    RefC2LPC(k,a);
    for (j=1; j<=d; j++) p[j] = a[j];
-   FreeVector(&gstack,k); FreeVector(&gstack,a); 
 }
 
 /* XformLPC2LPCEPSTRA: Convert Static Coefficients LPC -> LPCEPSTRA */
-static void XformLPC2LPCEPSTRA(float *data,int d,int dnew,int lifter)
+static void XformLPC2LPCEPSTRA(float *data,Vector a,Vector c,int lifter)
 {
-   Vector a,c;
-   int j;
+   int j,d,dnew;
    float *p;
    
+   d = VectorSize(a); dnew = VectorSize(c);
    if (dnew>d)
       HError(6322,"XformLPC2LPCEPSTRA: lp cep size cannot exceed lpc vec");
-   a = CreateVector(&gstack,d);  c = CreateVector(&gstack,dnew);
    p = data-1;
    for (j=1; j<=d; j++) a[j] = p[j];
    LPC2Cepstrum(a,c);
    if (lifter>0)
       WeightCepstrum(c,1,dnew,lifter);
-   for (j=1; j<=d; j++) p[j] = c[j];
-   FreeVector(&gstack,c); FreeVector(&gstack,a); 
+   for (j=1; j<=dnew; j++) p[j] = c[j];
 }
 
 /* XformLPCEPSTRA2LPC: Convert Static Coefficients LPCEPSTRA -> LPC */
-static void XformLPCEPSTRA2LPC(float *data,int d,int lifter)
+static void XformLPCEPSTRA2LPC(float *data,Vector c,Vector a,int lifter)
 {
-   Vector a,c;
-   int j;
+   int j,d;
    float *p;
    
-   a = CreateVector(&gstack,d);  c = CreateVector(&gstack,d);
+   d = VectorSize(c);
    p = data-1;
    for (j=1; j<=d; j++) c[j] = p[j];   
    if (lifter>0)
       UnWeightCepstrum(c,1,d,lifter);
    Cepstrum2LPC(c,a);
    for (j=1; j<=d; j++) p[j] = a[j];
-   FreeVector(&gstack,c); FreeVector(&gstack,a); 
 }
 
 /* XformMELSPEC2FBANK: Convert Static Coefficients MELSPEC -> FBANK */
-static void XformMELSPEC2FBANK(float *data,int d)
+static void XformMELSPEC2FBANK(float *data,Vector v)
 {
-   Vector v;
-   int j;
+   int j,d;
    float *p;
    
-   v = CreateVector(&gstack,d);
+   d = VectorSize(v);
    p = data-1;
    for (j=1; j<=d; j++) v[j] = p[j];
    MelSpec2FBank(v);
    for (j=1; j<=d; j++) p[j] = v[j];
-   FreeVector(&gstack,v); 
 }
 
 /* XformFBANK2MELSPEC: Convert Static Coefficients FBANK -> MELSPEC */
-static void XformFBANK2MELSPEC(float *data,int d)
+static void XformFBANK2MELSPEC(float *data,Vector v)
 {
-   Vector v;
-   int j;
+   int j,d;
    float *p;
    
-   v = CreateVector(&gstack,d);
+   d = VectorSize(v);
    p = data-1;
    for (j=1; j<=d; j++) v[j] = p[j];   
    FBank2MelSpec(v);
    for (j=1; j<=d; j++) p[j] = v[j];
-   FreeVector(&gstack,v); 
 }
 
 /* XformFBANK2MFCC: Convert Static Coefficients FBANK -> MFCC */
-static void XformFBANK2MFCC(float *data,int d,int dnew,int lifter)
+static void XformFBANK2MFCC(float *data,Vector fbank,Vector c,int lifter)
 {
-   Vector fbank,c;
-   int j;
+   int j,d,dnew;
    float *p;
    
+   d = VectorSize(fbank); dnew = VectorSize(c);
    if (dnew>d)
       HError(6322,"XformFBANK2MFCC: mfcc size cannot exceed fbank size");
-   fbank = CreateVector(&gstack,d);  c = CreateVector(&gstack,dnew);
    p = data-1;
    for (j=1; j<=d; j++) fbank[j] = p[j];
    FBank2MFCC(fbank,c,dnew);
    if (lifter>0)
       WeightCepstrum(c,1,dnew,lifter);
-   for (j=1; j<=d; j++) p[j] = c[j];
-   FreeVector(&gstack,c); FreeVector(&gstack,fbank); 
+   for (j=1; j<=dnew; j++) p[j] = c[j];
 }
 
 /* XformBase: convert statics to change basekind of cf->curPK to cf->tgtPK.
-      Conversion is applied to a single row pointed to by data.  */ 
-static void XformBase(float *data, IOConfig cf)
+      Conversion is applied to a single row pointed to by data, the
+      scratch vectors in cf are allocated from x on the first call.  */ 
+static void XformBase(MemHeap *x, float *data, IOConfig cf)
 {
    char b1[50],b2[50];
    ParmKind curBase,tgtBase,quals;
@@ -2367,14 +2407,19 @@ static void XformBase(float *data, IOConfig cf)
              ParmKind2Str(curBase,b1),ParmKind2Str(tgtBase,b2));
    FindSpans(span, cf->curPK, cf->nUsed);
    d = span[1]-span[0]+1; dnew = cf->numCepCoef; lifter = cf->cepLifter;
+   if (cf->xfA==NULL) {
+      cf->xfA = CreateVector(x,d); cf->xfB = CreateVector(x,d);
+      if (tgtBase==LPCEPSTRA || tgtBase==MFCC)
+         cf->xfC = CreateVector(x,dnew);
+   }
    switch (curBase) {
    case LPC:
       switch(tgtBase){
       case LPREFC:    
-         XformLPC2LPREFC(data,d); 
+         XformLPC2LPREFC(data,cf->xfA,cf->xfB); 
          break;
       case LPCEPSTRA: 
-         XformLPC2LPCEPSTRA(data,d,dnew,lifter);
+         XformLPC2LPCEPSTRA(data,cf->xfA,cf->xfC,lifter);
          if (dnew<d) {
             DeleteColumn(data,cf->nUsed,dnew,d-dnew);
             cf->nUsed -= d-dnew;
@@ -2387,11 +2432,11 @@ static void XformBase(float *data, IOConfig cf)
    case LPREFC:
       switch(tgtBase){
       case LPC:       
-         XformLPREFC2LPC(data,d);       
+         XformLPREFC2LPC(data,cf->xfA,cf->xfB);       
          break;
       case LPCEPSTRA: 
-         XformLPREFC2LPC(data,d);       
-         XformLPC2LPCEPSTRA(data,d,dnew,lifter);
+         XformLPREFC2LPC(data,cf->xfA,cf->xfB);       
+         XformLPC2LPCEPSTRA(data,cf->xfA,cf->xfC,lifter);
          if (dnew<d) {
             DeleteColumn(data,cf->nUsed,dnew,d-dnew);
             cf->nUsed -= d-dnew;
@@ -2404,11 +2449,11 @@ static void XformBase(float *data, IOConfig cf)
    case LPCEPSTRA:
       switch(tgtBase){
       case LPREFC:    
-         XformLPCEPSTRA2LPC(data,d,lifter);
-         XformLPC2LPREFC(data,d); 
+         XformLPCEPSTRA2LPC(data,cf->xfA,cf->xfB,lifter);
+         XformLPC2LPREFC(data,cf->xfA,cf->xfB); 
          break;
       case LPC:
-         XformLPCEPSTRA2LPC(data,d,lifter);
+         XformLPCEPSTRA2LPC(data,cf->xfA,cf->xfB,lifter);
          break;
       default:
          HError(6322,"XformBase: Bad target %s",ParmKind2Str(tgtBase,b1));
@@ -2417,11 +2462,11 @@ static void XformBase(float *data, IOConfig cf)
    case MELSPEC:
       switch(tgtBase){
       case FBANK:    
-         XformMELSPEC2FBANK(data,d); 
+         XformMELSPEC2FBANK(data,cf->xfA); 
          break;
       case MFCC:     
-         XformMELSPEC2FBANK(data,d); 
-         XformFBANK2MFCC(data,d,dnew,lifter);
+         XformMELSPEC2FBANK(data,cf->xfA); 
+         XformFBANK2MFCC(data,cf->xfA,cf->xfC,lifter);
          if (dnew<d) {
             DeleteColumn(data,cf->nUsed,dnew,d-dnew);
             cf->nUsed -= d-dnew;
@@ -2434,10 +2479,10 @@ static void XformBase(float *data, IOConfig cf)
    case FBANK:    
       switch(tgtBase){
       case MELSPEC:    
-         XformFBANK2MELSPEC(data,d); 
+         XformFBANK2MELSPEC(data,cf->xfA); 
          break;
       case MFCC:     
-         XformFBANK2MFCC(data,d,dnew,lifter);
+         XformFBANK2MFCC(data,cf->xfA,cf->xfC,lifter);
          if (dnew<d) {
             DeleteColumn(data,cf->nUsed,dnew,d-dnew);
             cf->nUsed -= d-dnew;
@@ -2479,6 +2524,7 @@ static void SetUpForCoding(MemHeap *x, IOConfig cf, int frSize)
    cf->r = CreateShortVec(x,frSize);
    cf->curPK = btgt = cf->tgtPK&BASEMASK;
    cf->a = cf->k = cf->c = cf->fbank = NULL;
+   cf->blkS = cf->blkFB = cf->blkC = cf->blkCM = NULL;
    SetCodeStyle(cf);
    switch(cf->style){
    case LPCbased:
@@ -2512,6 +2558,19 @@ static void SetUpForCoding(MemHeap *x, IOConfig cf, int frSize)
          cf->cm = CreateDMatrix (x, cf->lpcOrder+1, cf->numChans+2);
          InitPLP (cf->fbInfo, cf->lpcOrder, cf->eql, cf->cm);
       }
+      if (cf->frameBlock > 0) {   /* storage for block coding */
+         cf->blkS = CreateMatrix(x,cf->frameBlock,frSize);
+         cf->blkFB = CreateMatrix(x,cf->frameBlock,cf->numChans);
+         cf->blkTE = CreateVector(x,cf->frameBlock);
+         cf->blkRawTE = CreateVector(x,cf->frameBlock);
+         cf->fbBlk = InitFBankBlock(x,cf->fbInfo,cf->frameBlock);
+         if (btgt == MFCC) {
+            cf->blkC = CreateMatrix(x,cf->frameBlock,cf->numCepCoef);
+            cf->blkCM = CreateMatrix(x,cf->numCepCoef,cf->numChans);
+            InitDCTMatrix(cf->blkCM, cf->cepLifter, 
+                          (cf->v1Compat) ? 1.0 : cf->cepScale);
+         }
+      }
       break;
    default:
       HError(6321,"SetUpForCoding: target %s is not a parameterised form",
@@ -2545,6 +2604,37 @@ static void SetUpForCoding(MemHeap *x, IOConfig cf, int frSize)
    cf->nCvrt = cf->nUsed;
 }
 
+/* UseRawEnergy: true if energy is computed before preEmph and ham */
+static Boolean UseRawEnergy(IOConfig cf)
+{
+   if ((cf->tgtPK&BASEMASK)<MFCC && cf->v1Compat)
+      return FALSE;
+   return cf->rawEnergy;
+}
+
+/* PrepareFrame: dither, zero mean, preemphasise and window speech
+   frame s, return raw energy if needed */
+static float PrepareFrame(IOConfig cf, Vector s)
+{
+   float rawte=0.0;
+   int i,n=VectorSize(s);
+
+   if (cf->addDither!=0.0)
+      for (i=1; i<=n; i++)
+         s[i] += (RandomValue()*2.0 - 1.0)*cf->addDither;
+
+   if (cf->zMeanSrc && !cf->v1Compat)
+      ZeroMeanFrame(s);
+   if ((cf->tgtPK&HASENERGY) && UseRawEnergy(cf)){
+      for (i=1; i<=n; i++)
+         rawte += s[i] * s[i];
+   }
+   if (cf->preEmph>0.0) 
+      PreEmphasise(s,cf->preEmph);
+   if (cf->useHam) Ham(s);
+   return rawte;
+}
+
 /* ConvertFrame: convert frame in cf->s and store in pbuf, return total
    parameters stored in pbuf */
 static int ConvertFrame(IOConfig cf, float *pbuf)
@@ -2557,24 +2647,8 @@ static int ConvertFrame(IOConfig cf, float *pbuf)
    Boolean rawE;
    
    p = pbuf;
-   rawE = cf->rawEnergy;
-   if (btgt<MFCC && cf->v1Compat)
-      rawE = FALSE;
-
-   if (cf->addDither!=0.0)
-      for (i=1; i<=VectorSize(cf->s); i++)
-         cf->s[i] += (RandomValue()*2.0 - 1.0)*cf->addDither;
-
-   if (cf->zMeanSrc && !cf->v1Compat)
-      ZeroMeanFrame(cf->s);
-   if ((cf->tgtPK&HASENERGY) && rawE){
-      rawte = 0.0;
-      for (i=1; i<=VectorSize(cf->s); i++)
-         rawte += cf->s[i] * cf->s[i];
-   }
-   if (cf->preEmph>0.0) 
-      PreEmphasise(cf->s,cf->preEmph);
-   if (cf->useHam) Ham(cf->s);
+   rawE = UseRawEnergy(cf);
+   rawte = PrepareFrame(cf, cf->s);
    switch(btgt){
    case LPC: 
       Wave2LPC(cf->s,cf->a,cf->k,&re,&te);
@@ -2640,6 +2714,60 @@ static int ConvertFrame(IOConfig cf, float *pbuf)
    return p - pbuf;
 }
 
+/* ConvertBlock: convert the nFrames prepared frames in cf->blkS and
+   store them in successive rows of pbuf, nCols apart */
+static void ConvertBlock(IOConfig cf, int nFrames, float *pbuf)
+{
+   ParmKind btgt = cf->tgtPK&BASEMASK;
+   float te,*p,cepScale = 1.0;
+   int i,t,bsize;
+   Vector v;
+   Boolean rawE;
+
+   rawE = UseRawEnergy(cf);
+   Wave2FBankBlock(cf->blkS, cf->blkFB, rawE ? NULL : cf->blkTE, nFrames,
+                   cf->fbInfo, cf->fbBlk);
+   if (btgt == MFCC)      /* lifter and cepScale are in blkCM */
+      FBank2MFCCBlock(cf->blkFB, cf->blkC, nFrames, cf->blkCM);
+   if (btgt == PLP || btgt == MFCC)
+      cepScale = (cf->v1Compat) ? 1.0 : cf->cepScale;
+   for (t=1; t<=nFrames; t++, pbuf += cf->nCols) {
+      p = pbuf;
+      switch(btgt){
+      case MFCC:
+         v = cf->blkC[t]; bsize = cf->numCepCoef;
+         for (i=1; i<=bsize; i++) *p++ = v[i];
+         if (cf->tgtPK&HASZEROC) {
+            *p = FBank2C0(cf->blkFB[t]) * cepScale;
+            if (cf->v1Compat) *p *= cf->eScale;
+            ++p;
+         }
+         break;
+      case PLP:
+         FBank2ASpec(cf->blkFB[t], cf->as, cf->eql, cf->compressFact, 
+                     cf->fbInfo);
+         ASpec2LPCep(cf->as, cf->ac, cf->lp, cf->c, cf->cm);
+         if (cf->cepLifter > 0)
+            WeightCepstrum(cf->c, 1, cf->numCepCoef, cf->cepLifter);
+         v = cf->c; bsize = cf->numCepCoef;
+         for (i=1; i<=bsize; i++) *p++ = v[i] * cepScale;
+         if (cf->tgtPK&HASZEROC)
+            *p++ = v[bsize+1] * cepScale;
+         break;
+      default:          /* FBANK and MELSPEC */
+         v = cf->blkFB[t]; bsize = cf->numChans;
+         for (i=1; i<=bsize; i++) *p++ = v[i];
+         break;
+      }
+      if (cf->tgtPK&HASENERGY) {
+         te = rawE ? cf->blkRawTE[t] : cf->blkTE[t];
+         *p++ = (te<MINLARG) ? LZERO : log(te);  
+      }
+   }
+   if (cf->tgtPK&HASZEROC) cf->curPK|=HASZEROC;
+   if (cf->tgtPK&HASENERGY) cf->curPK|=HASENERGY;
+}
+
 /* Get data from external source and convert to 16 bit linear */
 static int fGetWaveData(int n,void *data,short *res,
                         HParmSrcDef ext,void *bInfo)
@@ -3883,8 +4011,11 @@ static int GetParm(ParmBuf pbuf,int nFrame,void *data)
    /* cz277 - mtload */
    /*v=CreateVector(&gstack,size);
    s=CreateShortVec(&gstack,size);*/
-   v = CreateVector(&gcheap, size);
-   s = CreateShortVec(&gcheap, size);
+   if (cf->rdVec==NULL) {
+      cf->rdVec = CreateVector(pbuf->mem, size);
+      cf->rdShort = CreateShortVec(pbuf->mem, size);
+   }
+   v = cf->rdVec; s = cf->rdShort;
 
    while (r<nFrame && r==n) {
       n++;
@@ -3919,7 +4050,7 @@ static int GetParm(ParmBuf pbuf,int nFrame,void *data)
             /* Delete any qualifiers which are not required by target */
             DelQualifiers(v+1, cf);
             /* Transform static parms if necessary */
-            XformBase(v+1, cf);
+            XformBase(pbuf->mem, v+1, cf);
          }
          /* Now copy transformed vector */
          for (j=1;j<=cf->nUsed;j++)
@@ -3936,11 +4067,6 @@ static int GetParm(ParmBuf pbuf,int nFrame,void *data)
    else {
       if (pbuf->inRow+r>=pbuf->lastRow) pbuf->chClear=TRUE;
    }
-   /* cz277 - mtload */
-   /*FreeShortVec(&gstack,s);
-   FreeVector(&gstack,v);*/
-   FreeShortVec(&gcheap, s);
-   FreeVector(&gcheap, v);
 
    return(r);
 }
@@ -4241,15 +4367,64 @@ static int FramesInChannel(ParmBuf pbuf,int chType)
    return(r);
 }
 
-/* Get a single frame from particular channel */
-/*  Return value indicates number of frames read okay */
-static int GetFrameFromChannel(ParmBuf pbuf,int chType,void *vp)
+/* Get a single waveform frame from particular channel into cf->s */
+/*  and measure its volume.  Return value is 1 if frame read okay */
+static int GetWaveFromChannel(ParmBuf pbuf,int chType)
 {
    IOConfig cf = pbuf->cf;
    AudioInStatus as;
    int r=0,i,j,x,n;
    double m,e;
 
+   switch(chType) {
+      /* First get the waveform */
+   case ch_haudio:
+      GetAudio(pbuf->in.a,1,cf->s+1); r=1;
+      as = GetAIStatus(pbuf->in.a);
+      if (as==AI_CLEARED && pbuf->status>PB_INIT)
+         pbuf->chClear=TRUE;
+      break;
+   case ch_hwave:
+      GetWave(pbuf->in.w,1,cf->s+1); r=1;
+      if (FramesInWave(pbuf->in.w)==0) pbuf->chClear=TRUE;
+      break;
+   case ch_ext_wave:
+      /* Copy overlap */
+      if (pbuf->inRow>0) {
+         n=cf->frRate,x=cf->frSize-cf->frRate;
+         for (i=1;i<=x;i++) 
+            cf->r[i]=cf->r[i+cf->frRate];
+      }
+      else n=cf->frSize,x=0;
+      /* Get new data */
+      if (fGetWaveData(n,cf->rawBuffer,cf->r+x+1,
+                       pbuf->ext,pbuf->in.i)==n) r=1;
+      else r=0;
+      /* Copy to float buffer */
+      for (j=1;j<=cf->frSize;j++) cf->s[j]=cf->r[j];
+      break;
+   }
+   if (r==0) return(0);
+   /* Calc frame energy 0.0-100dB */
+   for (j=1,m=e=0.0;j<=cf->frSize;j++) {
+      x=(int) cf->s[j];
+      m+=x;e+=x*x;
+   }
+   m=m/cf->frSize;e=e/cf->frSize-m*m;
+   if (e>0.0) e=10.0*log10(e/0.32768);
+   else e=0.0;
+   cf->curVol = e;
+
+   if (pbuf->spVal!=NULL)
+      pbuf->spVal[pbuf->main.nRows] = e;
+   return(1);
+}
+
+/* Check whether channel has run out of data */
+static Boolean ChannelCleared(ParmBuf pbuf,int chType)
+{
+   AudioInStatus as;
+
    /* Legacy checks for out of data */
    switch(chType) {
    case ch_haudio:
@@ -4264,54 +4439,25 @@ static int GetFrameFromChannel(ParmBuf pbuf,int chType,void *vp)
       /* Checked in GetParm */
       break;
    }
-   if (pbuf->chClear) return(0);
+   return(pbuf->chClear);
+}
+
+/* Get a single frame from particular channel */
+/*  Return value indicates number of frames read okay */
+static int GetFrameFromChannel(ParmBuf pbuf,int chType,void *vp)
+{
+   IOConfig cf = pbuf->cf;
+   int r=0;
+
+   if (ChannelCleared(pbuf,chType)) return(0);
 
    switch(chType) {
    case ch_haudio:
    case ch_hwave:
    case ch_ext_wave:
       /* Waveform types first */
-      switch(chType) {
-         /* First get the waveform */
-      case ch_haudio:
-         GetAudio(pbuf->in.a,1,cf->s+1); r=1;
-         as = GetAIStatus(pbuf->in.a);
-         if (as==AI_CLEARED && pbuf->status>PB_INIT)
-            pbuf->chClear=TRUE;
-         break;
-      case ch_hwave:
-         GetWave(pbuf->in.w,1,cf->s+1); r=1;
-         if (FramesInWave(pbuf->in.w)==0) pbuf->chClear=TRUE;
-         break;
-      case ch_ext_wave:
-         /* Copy overlap */
-         if (pbuf->inRow>0) {
-            n=cf->frRate,x=cf->frSize-cf->frRate;
-            for (i=1;i<=x;i++) 
-               cf->r[i]=cf->r[i+cf->frRate];
-         }
-         else n=cf->frSize,x=0;
-         /* Get new data */
-         if (fGetWaveData(n,cf->rawBuffer,cf->r+x+1,
-                          pbuf->ext,pbuf->in.i)==n) r=1;
-         else r=0;
-         /* Copy to float buffer */
-         for (j=1;j<=cf->frSize;j++) cf->s[j]=cf->r[j];
-         break;
-      }
+      r=GetWaveFromChannel(pbuf,chType);
       if (r==0) break;
-      /* Calc frame energy 0.0-100dB */
-      for (j=1,m=e=0.0;j<=cf->frSize;j++) {
-         x=(int) cf->s[j];
-         m+=x;e+=x*x;
-      }
-      m=m/cf->frSize;e=e/cf->frSize-m*m;
-      if (e>0.0) e=10.0*log10(e/0.32768);
-      else e=0.0;
-      cf->curVol = e;
-
-      if (pbuf->spVal!=NULL)
-         pbuf->spVal[pbuf->main.nRows] = e;
 
       /* Reset current nUsed/PK to indicate results of conversion */
       cf->nUsed = cf->nCvrt; cf->curPK = cf->tgtPK&BASEMASK;
@@ -4334,6 +4480,31 @@ static int GetFrameFromChannel(ParmBuf pbuf,int chType,void *vp)
    return(r);
 }
 
+/* Get up to nFrames waveform frames from the channel, prepare them */
+/*  in cf->blkS and convert them as a block into successive rows of */
+/*  fp.  Each frame read is added to the buffer so the caller must */
+/*  not update inRow/main.nRows.  Returns number of frames read */
+static int GetBlockFromChannel(ParmBuf pbuf,int chType,float *fp,int nFrames)
+{
+   IOConfig cf = pbuf->cf;
+   int t,i;
+
+   for (t=1; t<=nFrames; t++) {
+      if (ChannelCleared(pbuf,chType) || 
+          GetWaveFromChannel(pbuf,chType)!=1) break;
+      for (i=1; i<=cf->frSize; i++)
+         cf->blkS[t][i] = cf->s[i];
+      cf->blkRawTE[t] = PrepareFrame(cf, cf->blkS[t]);
+      pbuf->inRow++; pbuf->main.nRows++;
+   }
+   if (--t > 0) {
+      cf->nUsed = cf->nCvrt; cf->curPK = cf->tgtPK&BASEMASK;
+      ConvertBlock(cf, t, fp);
+      cf->nCvrt = cf->nUsed; cf->unqPK = cf->curPK;
+   }
+   return(t);
+}
+
 /* ------------ Read and Convert Data from Channel Input ------------ */
 
 /* FillBufFromChannel: fill buffer from channel input  */
@@ -4346,7 +4517,7 @@ static void FillBufFromChannel(ParmBuf pbuf,int minRows)
    PBlock *pb,*lb;
    Boolean dis,cleared;
    char b1[100];
-   int availRows,newRows,space,i,head,tail,nShift;
+   int availRows,newRows,space,i,n,head,tail,nShift;
    short *sp1=NULL, *sp2;
    float *fp1=NULL, *fp2;
    
@@ -4477,24 +4648,38 @@ static void FillBufFromChannel(ParmBuf pbuf,int minRows)
       fp1 = (float*) pbuf->main.data + pbuf->main.nRows*cf->nCols;
 
    /* Read the necessary frames */
-   for (i=0; i<newRows; i++) {
-      /* But have final check on read just in case */
-      if (pbuf->dShort) {
-         if (GetFrameFromChannel(pbuf,pbuf->chType,sp1)!=1) {
+   if (!pbuf->dShort && cf->blkS!=NULL && (pbuf->chType==ch_haudio || 
+       pbuf->chType==ch_hwave || pbuf->chType==ch_ext_wave)) {
+      /* Code block of frames at a time */
+      for (i=0; i<newRows; i+=n) {
+         n = newRows-i; 
+         if (n>cf->frameBlock) n = cf->frameBlock;
+         if (GetBlockFromChannel(pbuf,pbuf->chType,fp1,n)!=n) {
             pbuf->chClear=TRUE;
             break;
          }
-         sp1 += cf->nCols; 
+         fp1 += n*cf->nCols;
       }
-      else {
-         if (GetFrameFromChannel(pbuf,pbuf->chType,fp1)!=1) {
-            pbuf->chClear=TRUE;
-            break;
+   }
+   else
+      for (i=0; i<newRows; i++) {
+         /* But have final check on read just in case */
+         if (pbuf->dShort) {
+            if (GetFrameFromChannel(pbuf,pbuf->chType,sp1)!=1) {
+               pbuf->chClear=TRUE;
+               break;
+            }
+            sp1 += cf->nCols; 
          }
-         fp1 += cf->nCols; 
+         else {
+            if (GetFrameFromChannel(pbuf,pbuf->chType,fp1)!=1) {
+               pbuf->chClear=TRUE;
+               break;
+            }
+            fp1 += cf->nCols; 
+         }
+         pbuf->inRow++;pbuf->main.nRows++;
       }
-      pbuf->inRow++;pbuf->main.nRows++;
-   }
 
    /* Make sure we mark the buffer if we have consumed all input */
    CheckBuffer(pbuf);
@@ -4526,7 +4711,9 @@ static void FillBufFromChannel(ParmBuf pbuf,int minRows)
 
       AddQualifiers(pbuf,fp1,pbuf->qen-pbuf->qst+1,cf,head,tail);
       /* Assume session adaptation now done */
+      pthread_mutex_lock(&chanLock);
       pbuf->chan->oCnt+=pbuf->qen-pbuf->qst+1;
+      pthread_mutex_unlock(&chanLock);
       /* Set qst for the next time */
       pbuf->qst=pbuf->qen+1;
    }
@@ -4956,8 +5143,10 @@ void StartBuffer(ParmBuf pbuf)
       if (pbuf->cf->useSilDet) ChangeState(pbuf,PB_WAITING); 
       else ChangeState(pbuf,PB_FILLING); 
    }
+   pthread_mutex_lock(&chanLock);
    pbuf->chan->fCnt++;
    pbuf->chan->sCnt++;
+   pthread_mutex_unlock(&chanLock);
 }
 
 /* EXPORT->StopBuffer: stop audio and let the buffer empty */
@@ -5403,8 +5592,8 @@ static void CalcCompress(ParmBuf pbuf, PBlock *pbInit,int nCols, Boolean irefc)
    if (irefc)
       for(i=1;i<=cf->srcUsed;i++) cf->A[i]=32767.0,cf->B[i]=0.0;
    else {
-      min = CreateVector(&gstack,nCols); ZeroVector(min); 
-      max = CreateVector(&gstack,nCols); ZeroVector(max); 
+      min = CreateVector(pbuf->mem,nCols); ZeroVector(min); 
+      max = CreateVector(pbuf->mem,nCols); ZeroVector(max); 
       /* Find max and min of each vector component */
       /* Initial value from first block */
       if (pbInit->nRows>0) {
@@ -5429,7 +5618,7 @@ static void CalcCompress(ParmBuf pbuf, PBlock *pbInit,int nCols, Boolean irefc)
             cf->B[nx] = (max[nx]+min[nx]) * 32767.0 / (max[nx]-min[nx]);
          }
       }
-      FreeVector(&gstack,max); FreeVector(&gstack,min);
+      FreeVector(pbuf->mem,max); FreeVector(pbuf->mem,min);
    }
 }
 
@@ -5556,12 +5745,12 @@ ReturnStatus SaveBuffer(ParmBuf pbuf, char *fname, FileFormat ff)
                              sizeof(short),bSwap,cf->crcc);
       }
       else if (cf->saveCompressed) {
-         sp=(short *) New(&gstack,sizeof(short)*pb->nRows*cf->nCols);
+         sp=(short *) New(pbuf->mem,sizeof(short)*pb->nRows*cf->nCols);
          CompressPBlock(pbuf,pb,sp,cf->nCols);
          WriteShort(f,sp,pb->nRows*cf->nCols,hparmBin);
          cf->crcc=UpdateCRCC(sp,pb->nRows*cf->nCols,
                              sizeof(short),bSwap,cf->crcc);
-         Dispose(&gstack,sp);
+         Dispose(pbuf->mem,sp);
       }
       else {
          WriteFloat(f, (float *) pb->data, pb->nRows*cf->nCols, hparmBin);
@@ -186,6 +186,15 @@ void ResetChannelSession(char *chanName);
    Reset the session for the specified channel (NULL indicates default)
 */
 
+Boolean ReentrantChannel(char **why);
+/*
+   Return TRUE if buffers on the current channel may be opened, filled,
+   saved and closed by several threads at once (each with its own heap).
+   Otherwise *why is set to the first configured feature which keeps
+   state across files, eg silence detection, dither or side based
+   normalisation, and buffers must be processed one at a time.
+*/
+
 /* 
    The next two functions have been kept to allow for backwards 
    compatibility.
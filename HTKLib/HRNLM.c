@@ -48,21 +48,13 @@ char *hrnlm_vc_id = "$Id: HRNLM.c,v 1.1.1.1 2015/12/18 18:18:18 xl207 Exp $";
 
 #define HASHTABLESIZE 10000
 #define MAXLINELEN      4096
-#define FASTEXP
 
 static int trace=128;
 
-static union{
-    double d;
-    struct{
-        int j,i;
-        } n;
-} d2i;
 #define M_LN2		0.69314718055994530942	/* log_e 2 */
 #define M_LN10		2.30258509299404568402	/* log_e 10 */
 #define EXP_A (1048576/M_LN2)
-#define EXP_C 60801
-#define FAST_EXP(y) (d2i.n.i = EXP_A*(y)+(1072693248-EXP_C),d2i.d)
+#define EXP_C 60801     /* FastExp: e^y from the exponent bits of a double */
 
 
 
@@ -77,6 +69,8 @@ static Boolean outputContainOOS= TRUE;
 static int oosNodeClass=-1;         /*  default : derived implicitly from output list */
 static Boolean calcProbCache = TRUE;
 static LogFloat outLayerLogNorm = -1;
+static char rnnKernel[MAXSTRLEN] = "AUTO";   /* inference kernel requested */
+static int rnnBatch = 32;           /* inputs per batch in RNNLMAcceptWordBatch */
 
 /* ---------------------- Global Variables ----------------------- */
 
@@ -573,11 +567,7 @@ static void initNet(RNNLM* rnnlm)
 /* static void copyHiddenLayerToInput(RNNLM* rnnlm) */
 void copyHiddenLayerToInput(RNNLM* rnnlm)
 {
-    int a;
-
-    for (a=0; a<rnnlm->layer1_size; a++) {
-        rnnlm->neu0[a+rnnlm->layer0_size-rnnlm->layer1_size].ac=rnnlm->neu1[a].ac;
-    }
+    memcpy(rnnlm->ac0, rnnlm->ac1, rnnlm->layer1_size*sizeof(float));
 }
 
 static void netReset(RNNLM* rnnlm)   /* cleans hidden layer activation + bptt history */
@@ -586,9 +576,9 @@ static void netReset(RNNLM* rnnlm)   /* cleans hidden layer activation + bptt hi
 
     for (a=0; a<rnnlm->layer1_size; a++) {
         if (rnnlm->usefrnnlm)
-            rnnlm->neu1[a].ac=0.1;
+            rnnlm->ac1[a]=0.1;
         else
-            rnnlm->neu1[a].ac=1.0;
+            rnnlm->ac1[a]=1.0;
     }
 
     copyHiddenLayerToInput(rnnlm);
@@ -638,68 +628,441 @@ int searchRNNVocab(RNNLM* rnnlm, char *word)
 
 
 
+/* ----------------------- Packed inference kernels ---------------- */
 /*
-    neuron *dest, neuron *srcvec, synapse *srcmatrix, int matrix_width, int from, int to, int from2, int to2, int type
-    compute matrix vector product:
-    matrix: srcmatrix[from ... to ][ from2 ... to2 ] * srcvec[from2 ... to2]    type = 0
-    */
-static void matrixXvector(struct neuron *dest, struct neuron *srcvec, struct synapse *srcmatrix, int matrix_width, int from, int to, int from2, int to2, int type)
+   LoadRNNLM fills the neuron/synapse arrays above, which are kept as
+   read.  PackRNNLM then copies the weights into contiguous float
+   matrices with one row per destination neuron, each row padded with
+   zeros to a multiple of RNN_VEC floats (w0h, w0x, w1, wc), and holds
+   the activations in float vectors padded the same way (ac0, ac1,
+   acc, ac2).  The input word is then a row added to the hidden layer
+   and every layer a GEMV over unit stride data.  The GEMV and the
+   sigmoid/softmax kernels are chosen in InitRNLM from the CPU and
+   HRNLM: RNNKERNEL (AUTO, AVX2 or GENERIC); both use the FastExp
+   approximation in double precision so they give the same values.
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RNN_X86
+#include <immintrin.h>
+#endif
+
+#define RNN_VEC 8               /* row padding, floats */
+#define RNN_CLAMP 50.0f         /* activation clamp before exp */
+#define RNN_ROWBLK 64           /* output rows per block in batched GEMV */
+
+typedef void (*GemvKernel)(float *y, const float *w, int ld, const float *x, int r0, int r1);
+typedef void (*SigmoidKernel)(float *v, int n);
+typedef double (*ExpSumKernel)(float *v, int n);
+typedef void (*ExpShiftKernel)(float *v, int n, float shift);
+
+static GemvKernel gemvKernel;
+static SigmoidKernel sigmoidKernel;
+static ExpSumKernel expSumKernel;
+static ExpShiftKernel expShiftKernel;
+static char *rnnKernelName = "GENERIC";
+
+/* FastExp: e^y to a few percent by writing EXP_A*y into the exponent
+   and high mantissa bits of a double */
+static double FastExp(double y)
 {
-    int a, b;
-    real val1, val2, val3, val4;
-    real val5, val6, val7, val8;
-
-
-    if (type==0) {		/* forward mode */
-        for (b=0; b<(to-from)/8; b++) {
-            val1=0;
-            val2=0;
-            val3=0;
-            val4=0;
-
-            val5=0;
-            val6=0;
-            val7=0;
-            val8=0;
-
-            for (a=from2; a<to2; a++) {
-                val1 += srcvec[a].ac * srcmatrix[a+(b*8+from+0)*matrix_width].weight;
-                val2 += srcvec[a].ac * srcmatrix[a+(b*8+from+1)*matrix_width].weight;
-                val3 += srcvec[a].ac * srcmatrix[a+(b*8+from+2)*matrix_width].weight;
-                val4 += srcvec[a].ac * srcmatrix[a+(b*8+from+3)*matrix_width].weight;
-
-                val5 += srcvec[a].ac * srcmatrix[a+(b*8+from+4)*matrix_width].weight;
-                val6 += srcvec[a].ac * srcmatrix[a+(b*8+from+5)*matrix_width].weight;
-                val7 += srcvec[a].ac * srcmatrix[a+(b*8+from+6)*matrix_width].weight;
-                val8 += srcvec[a].ac * srcmatrix[a+(b*8+from+7)*matrix_width].weight;
-            }
-            dest[b*8+from+0].ac += val1;
-            dest[b*8+from+1].ac += val2;
-            dest[b*8+from+2].ac += val3;
-            dest[b*8+from+3].ac += val4;
-
-            dest[b*8+from+4].ac += val5;
-            dest[b*8+from+5].ac += val6;
-            dest[b*8+from+6].ac += val7;
-            dest[b*8+from+7].ac += val8;
-        }
-        for (b=b*8; b<to-from; b++) {
-            for (a=from2; a<to2; a++) {
-                dest[b+from].ac += srcvec[a].ac * srcmatrix[a+(b+from)*matrix_width].weight;
-            }
-        }
+    union { double d; struct { int j,i; } n; } u;
+
+    u.n.j = 0;
+    u.n.i = EXP_A*y+(1072693248-EXP_C);
+    return u.d;
+}
+
+static float Clamp(float x)
+{
+    if (x>RNN_CLAMP) return RNN_CLAMP;
+    if (x<-RNN_CLAMP) return -RNN_CLAMP;
+    return x;
+}
+
+/* GemvGeneric: y[r] = sum_a w[r*ld+a]*x[a] for r0<=r<r1 */
+static void GemvGeneric(float *y, const float *w, int ld, const float *x, int r0, int r1)
+{
+    int r, a;
+    const float *row;
+    double s;
+
+    for (r=r0; r<r1; r++) {
+        row = w + (size_t)r*ld;
+        s = 0;
+        for (a=0; a<ld; a++) s += row[a]*x[a];
+        y[r] = s;
+    }
+}
+
+/* SigmoidGeneric: v[a] = 1/(1+e^-v[a]) */
+static void SigmoidGeneric(float *v, int n)
+{
+    int a;
+
+    for (a=0; a<n; a++)
+        v[a] = 1/(1+FastExp(-Clamp(v[a])));
+}
+
+/* ExpSumGeneric: v[a] = e^v[a], returns the sum */
+static double ExpSumGeneric(float *v, int n)
+{
+    int a;
+    double e, sum = 0;
+
+    for (a=0; a<n; a++) {
+        e = FastExp(Clamp(v[a]));
+        sum += e; v[a] = e;
+    }
+    return sum;
+}
+
+/* ExpShiftGeneric: v[a] = e^(v[a]-shift) */
+static void ExpShiftGeneric(float *v, int n, float shift)
+{
+    int a;
+
+    for (a=0; a<n; a++) v[a] = expf(v[a]-shift);
+}
+
+#ifdef RNN_X86
+
+/* FastExpAVX2: FastExp of 4 clamped floats as doubles */
+__attribute__((target("avx2,fma")))
+static __m256d FastExpAVX2(__m128 x)
+{
+    __m256d y;
+    __m128 c;
+    __m128i i;
+
+    c = _mm_min_ps(_mm_max_ps(x,_mm_set1_ps(-RNN_CLAMP)),_mm_set1_ps(RNN_CLAMP));
+    y = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtps_pd(c),_mm256_set1_pd(EXP_A)),
+                      _mm256_set1_pd(1072693248-EXP_C));
+    i = _mm256_cvttpd_epi32(y);
+    return _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_cvtepi32_epi64(i),32));
+}
+
+/* HSumAVX2: horizontal sum of the 8 lanes of v */
+__attribute__((target("avx2,fma")))
+static float HSumAVX2(__m256 v)
+{
+    __m128 s;
+
+    s = _mm_add_ps(_mm256_castps256_ps128(v),_mm256_extractf128_ps(v,1));
+    s = _mm_add_ps(s,_mm_movehl_ps(s,s));
+    s = _mm_add_ss(s,_mm_shuffle_ps(s,s,1));
+    return _mm_cvtss_f32(s);
+}
+
+/* GemvAVX2: as GemvGeneric, four rows at a time; ld % RNN_VEC == 0 */
+__attribute__((target("avx2,fma")))
+static void GemvAVX2(float *y, const float *w, int ld, const float *x, int r0, int r1)
+{
+    int r, a;
+    const float *w0, *w1, *w2, *w3;
+    __m256 s0, s1, s2, s3, xv;
+
+    for (r=r0; r+4<=r1; r+=4) {
+        w0 = w + (size_t)r*ld; w1 = w0+ld; w2 = w1+ld; w3 = w2+ld;
+        s0 = s1 = s2 = s3 = _mm256_setzero_ps();
+        for (a=0; a<ld; a+=RNN_VEC) {
+            xv = _mm256_loadu_ps(x+a);
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0+a),xv,s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(w1+a),xv,s1);
+            s2 = _mm256_fmadd_ps(_mm256_loadu_ps(w2+a),xv,s2);
+            s3 = _mm256_fmadd_ps(_mm256_loadu_ps(w3+a),xv,s3);
+        }
+        y[r] = HSumAVX2(s0); y[r+1] = HSumAVX2(s1);
+        y[r+2] = HSumAVX2(s2); y[r+3] = HSumAVX2(s3);
+    }
+    for (; r<r1; r++) {
+        w0 = w + (size_t)r*ld;
+        s0 = _mm256_setzero_ps();
+        for (a=0; a<ld; a+=RNN_VEC)
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(w0+a),_mm256_loadu_ps(x+a),s0);
+        y[r] = HSumAVX2(s0);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void SigmoidAVX2(float *v, int n)
+{
+    int a;
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m128 x;
+
+    for (a=0; a+4<=n; a+=4) {
+        x = _mm_sub_ps(_mm_setzero_ps(),_mm_loadu_ps(v+a));
+        _mm_storeu_ps(v+a,_mm256_cvtpd_ps(_mm256_div_pd(one,_mm256_add_pd(one,FastExpAVX2(x)))));
+    }
+    SigmoidGeneric(v+a,n-a);
+}
+
+__attribute__((target("avx2,fma")))
+static double ExpSumAVX2(float *v, int n)
+{
+    int a;
+    __m256d e, s = _mm256_setzero_pd();
+    __m128d h;
+
+    for (a=0; a+4<=n; a+=4) {
+        e = FastExpAVX2(_mm_loadu_ps(v+a));
+        s = _mm256_add_pd(s,e);
+        _mm_storeu_ps(v+a,_mm256_cvtpd_ps(e));
+    }
+    h = _mm_add_pd(_mm256_castpd256_pd128(s),_mm256_extractf128_pd(s,1));
+    h = _mm_add_sd(h,_mm_unpackhi_pd(h,h));
+    return _mm_cvtsd_f64(h) + ExpSumGeneric(v+a,n-a);
+}
+
+/* ExpShiftAVX2: as ExpShiftGeneric using the Cephes expf polynomial */
+__attribute__((target("avx2,fma")))
+static void ExpShiftAVX2(float *v, int n, float shift)
+{
+    int a;
+    __m256 x, fx, y;
+    __m256i e;
+
+    for (a=0; a+RNN_VEC<=n; a+=RNN_VEC) {
+        x = _mm256_sub_ps(_mm256_loadu_ps(v+a),_mm256_set1_ps(shift));
+        x = _mm256_min_ps(_mm256_max_ps(x,_mm256_set1_ps(-87.0f)),_mm256_set1_ps(88.0f));
+        e = _mm256_cvtps_epi32(_mm256_mul_ps(x,_mm256_set1_ps(1.44269504f)));
+        fx = _mm256_cvtepi32_ps(e);
+        x = _mm256_fnmadd_ps(fx,_mm256_set1_ps(0.693359375f),x);
+        x = _mm256_fnmadd_ps(fx,_mm256_set1_ps(-2.12194440e-4f),x);
+        y = _mm256_set1_ps(1.9875691500e-4f);
+        y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(1.3981999507e-3f));
+        y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(8.3334519073e-3f));
+        y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(4.1665795894e-2f));
+        y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(1.6666665459e-1f));
+        y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(5.0000001201e-1f));
+        y = _mm256_fmadd_ps(y,_mm256_mul_ps(x,x),_mm256_add_ps(x,_mm256_set1_ps(1.0f)));
+        e = _mm256_slli_epi32(_mm256_add_epi32(e,_mm256_set1_epi32(127)),23);
+        _mm256_storeu_ps(v+a,_mm256_mul_ps(y,_mm256_castsi256_ps(e)));
+    }
+    ExpShiftGeneric(v+a,n-a,shift);
+}
+
+#endif  /* RNN_X86 */
+
+/* SelectRNNKernels: choose the inference kernels for this CPU and RNNKERNEL */
+static void SelectRNNKernels(void)
+{
+    gemvKernel = GemvGeneric; sigmoidKernel = SigmoidGeneric;
+    expSumKernel = ExpSumGeneric; expShiftKernel = ExpShiftGeneric;
+    rnnKernelName = "GENERIC";
+#ifdef RNN_X86
+    if ((strcmp(rnnKernel,"AUTO")==0 || strcmp(rnnKernel,"AVX2")==0) &&
+        __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        gemvKernel = GemvAVX2; sigmoidKernel = SigmoidAVX2;
+        expSumKernel = ExpSumAVX2; expShiftKernel = ExpShiftAVX2;
+        rnnKernelName = "AVX2";
+        return;
+    }
+#endif
+    if (strcmp(rnnKernel,"AUTO")!=0 && strcmp(rnnKernel,"GENERIC")!=0)
+        HError(-999,"SelectRNNKernels: RNNKERNEL %s not available, using GENERIC",rnnKernel);
+}
+
+/* Scale: v[a] /= sum */
+static void Scale(float *v, int n, double sum)
+{
+    int a;
+
+    for (a=0; a<n; a++) v[a] /= sum;
+}
+
+static int PadRow(int n)
+{
+    return (n+RNN_VEC-1)/RNN_VEC*RNN_VEC;
+}
+
+static float *NewPacked(RNNLM* rnnlm, size_t n)
+{
+    float *v;
+
+    v = (float *)New(rnnlm->x, (n>0 ? n : 1)*sizeof(float));
+    memset(v, 0, (n>0 ? n : 1)*sizeof(float));
+    return v;
+}
+
+/* PackRNNLM: build the packed layout of a loaded rnnlm; the weights
+   are shared with src when given, else copied from the synapses */
+static void PackRNNLM(RNNLM* rnnlm, RNNLM* src)
+{
+    int a, b, nw, n1, nr;
+    int l0 = rnnlm->layer0_size, l1 = rnnlm->layer1_size, lc = rnnlm->layerc_size;
+
+    nw = l0 - l1;
+    n1 = (lc>0) ? lc : rnnlm->layer2_size;   /* rows fed by the hidden layer */
+    rnnlm->ld1 = PadRow(l1);
+    rnnlm->ldc = PadRow(lc);
+    rnnlm->ac0 = NewPacked(rnnlm, rnnlm->ld1);
+    rnnlm->ac1 = NewPacked(rnnlm, rnnlm->ld1);
+    rnnlm->acc = NewPacked(rnnlm, rnnlm->ldc);
+    rnnlm->ac2 = NewPacked(rnnlm, PadRow(rnnlm->layer2_size));
+    for (a=0; a<l1; a++) {
+        rnnlm->ac0[a] = rnnlm->neu0[nw+a].ac;
+        rnnlm->ac1[a] = rnnlm->neu1[a].ac;
+    }
+
+    if (src != NULL) {
+        rnnlm->w0h = src->w0h; rnnlm->w0x = src->w0x;
+        rnnlm->w1 = src->w1; rnnlm->wc = src->wc;
+        return;
+    }
+    rnnlm->w0h = NewPacked(rnnlm, (size_t)l1*rnnlm->ld1);
+    rnnlm->w0x = NewPacked(rnnlm, (size_t)nw*rnnlm->ld1);
+    rnnlm->w1 = NewPacked(rnnlm, (size_t)n1*rnnlm->ld1);
+    for (b=0; b<l1; b++) {
+        for (a=0; a<l1; a++)
+            rnnlm->w0h[(size_t)b*rnnlm->ld1+a] = rnnlm->syn0[nw+a+(size_t)b*l0].weight;
+        for (a=0; a<nw; a++)
+            rnnlm->w0x[(size_t)a*rnnlm->ld1+b] = rnnlm->syn0[a+(size_t)b*l0].weight;
+    }
+    for (b=0; b<n1; b++)
+        for (a=0; a<l1; a++)
+            rnnlm->w1[(size_t)b*rnnlm->ld1+a] = rnnlm->syn1[a+(size_t)b*l1].weight;
+    if (lc>0) {
+        nr = rnnlm->layer2_size;
+        rnnlm->wc = NewPacked(rnnlm, (size_t)nr*rnnlm->ldc);
+        for (b=0; b<nr; b++)
+            for (a=0; a<lc; a++)
+                rnnlm->wc[(size_t)b*rnnlm->ldc+a] = rnnlm->sync[a+(size_t)b*lc].weight;
+    }
+    if (trace & T_TIO)
+        printf("RNNLM packed for %s inference kernels\n", rnnKernelName);
+}
+
+/* PropagateHidden: hidden activation h1 (and compression hc) after
+   accepting lastword from the delayed hidden activation h0; keep
+   receives the activation to restore once it has been copied to the
+   input layer when built with SAVEACT* */
+static void PropagateHidden(RNNLM* rnnlm, const float *h0, int lastword, float *h1, float *hc, float *keep)
+{
+    int a, l1 = rnnlm->layer1_size;
+    const float *wx;
+
+    /*  propagate delayed hidden vector to current hidden vector */
+    gemvKernel(h1, rnnlm->w0h, rnnlm->ld1, h0, 0, l1);
+#ifdef SAVEACTWITHINPUTWEIGHTMATRIX
+    if (keep != NULL) {
+        for (a=0; a<l1; a++) keep[a] = h1[a];
+        sigmoidKernel(keep, l1);
+    }
+#endif
+    /*  propagate last word's weight to current hidden vector */
+    if (lastword!=-1) {
+        wx = rnnlm->w0x + (size_t)lastword*rnnlm->ld1;
+        for (a=0; a<l1; a++) h1[a] += wx[a];
     }
+#if defined(SAVEACTNOSIGMOID) && !defined(SAVEACTWITHINPUTWEIGHTMATRIX)
+    if (keep != NULL)
+        for (a=0; a<l1; a++) keep[a] = h1[a];
+#endif
+    sigmoidKernel(h1, l1);
+    if (rnnlm->layerc_size>0) {
+        gemvKernel(hc, rnnlm->w1, rnnlm->ld1, h1, 0, rnnlm->layerc_size);
+        sigmoidKernel(hc, rnnlm->layerc_size);
+    }
+}
+
+/* ClassWords: output rows of all words in class cl */
+static void ClassWords(RNNLM* rnnlm, int cl, int *from, int *to)
+{
+    *from = rnnlm->class_words[cl][0];
+    *to = *from + rnnlm->class_cn[cl];
+}
+
+/* ClassSoftmax: normalise the class outputs o[vocab_size..layer2_size-1] */
+static void ClassSoftmax(RNNLM* rnnlm, float *o)
+{
+    double sum;
+
+    sum = expSumKernel(o+rnnlm->vocab_size, rnnlm->class_size);
+    Scale(o+rnnlm->vocab_size, rnnlm->class_size, sum);
+}
+
+/* WordSoftmax: normalise the word outputs of class cl */
+static void WordSoftmax(RNNLM* rnnlm, float *o, int cl)
+{
+    int from, to;
+    double sum;
+
+    ClassWords(rnnlm, cl, &from, &to);
+    if (to-from == 1)
+        o[from] = 1.0f;
+    else {
+        sum = expSumKernel(o+from, to-from);
+        Scale(o+from, to-from, sum);
+    }
+}
+
+/* ClassProbTable: word probabilities outP from normalised class and
+   word outputs o */
+static void ClassProbTable(RNNLM* rnnlm, const float *o, float *outP)
+{
+    int a, cl, from, to, nvoc = rnnlm->vocab_size;
+    float classprob;
+
+    /* outP_arr stores the real probability value */
+    for (cl = 0 ; cl < rnnlm->class_size; cl ++)
+    {
+        classprob = o[cl+nvoc];
+        ClassWords(rnnlm, cl, &from, &to);
+        for ( a=from; a<to ; a++)
+            outP[a]=classprob * o[a];
+    }
+    /*  special case : oos */
+    if ( oosNodeClass < 0 )
+        outP[nvoc-1] = o[rnnlm->layer2_size -1 ];
     else
+        outP[nvoc-1] = o[nvoc + oosNodeClass ];
+
+    if (rnnlm->fulldict_size == 0)
+    {
+        HError(999,"In RNNLM: fulldict_size is not specified.");
+    }
+    if (rnnlm->fulldict_size < nvoc)
     {
-        printf("ERROR: in matrixXvector, only forward mode is support");
-        exit(1);
+        HError(999, "In RNNLM, fulldict_size should not be less than vocab_size.");
     }
+    outP[nvoc-1] = outP[nvoc-1] / (rnnlm->fulldict_size - nvoc + 1);
+}
+
+/* FullSoftmax: normalise the outputs o of a full output layer */
+static void FullSoftmax(RNNLM* rnnlm, float *o)
+{
+    int nout = rnnlm->layer2_size;
+    double sum;
 
+    if (rnnlm->lognorm >= 0)
+        expShiftKernel(o, nout, rnnlm->lognorm);
+    else {
+        sum = expSumKernel(o, nout);
+        Scale(o, nout, sum);
+    }
+    o[nout-1] /= (rnnlm->fulldict_size - nout + 1);
 }
 
+/* EndAcceptWord: shift the word history and feed the hidden layer back */
+static void EndAcceptWord(RNNLM* rnnlm, float *keep)
+{
+    int a;
 
+    for (a=MAX_NGRAM_ORDER-1; a>0; a--)
+       rnnlm->history[a]=rnnlm->history[a-1];
 
+    /*  curword is the id maps by out_vocab
+     *  need to convert to id in in_vocab,
+     *  update rnnlm->histroy[0] is moved to where this function is called */
 
+    copyHiddenLayerToInput(rnnlm);
+    if (keep != NULL) {
+        for (a=0; a<rnnlm->layer1_size; a++) rnnlm->ac1[a] = keep[a];
+        free(keep);
+    }
+}
 
 
 
@@ -716,7 +1079,7 @@ void InitRNLM(void)
 {
    int i;
    Boolean b;
-/*    char buf[MAXSTRLEN]; */
+   char buf[MAXSTRLEN];
    double f = 0.0;
 
    Register(hrnlm_version,hrnlm_vc_id);
@@ -730,7 +1093,10 @@ void InitRNLM(void)
       if (GetConfInt(cParm,nParm,"OOSCLASS", &i)) oosNodeClass = i;
       if (GetConfBool(cParm, nParm, "RNNPROBCACHE", &b)) calcProbCache  = b;
       if (GetConfFlt(cParm,nParm,"OUTLAYERLOGNORM",&f)) outLayerLogNorm = f;
+      if (GetConfStr(cParm,nParm,"RNNKERNEL",buf)) strcpy(rnnKernel,buf);
+      if (GetConfInt(cParm,nParm,"RNNBATCH",&i) && i>0) rnnBatch = i;
    }
+   SelectRNNKernels();
 }
 
 
@@ -814,6 +1180,10 @@ RNNLM* CreateRNNLM(MemHeap* x)
 	model->sync=NULL;
 	model->syn_d=NULL;
 	model->syn_db=NULL;
+
+	model->ld1=model->ldc=0;
+	model->ac0=model->ac1=model->acc=model->ac2=NULL;
+	model->w0h=model->w0x=model->w1=model->wc=NULL;
 	/*backup */
 	model->neu0b=NULL;
 	model->neu1b=NULL;
@@ -1700,6 +2070,7 @@ void LoadFRNLMwgt (char *orgmodelfn, char *inmap_file, char *outmap_file,
      *-----------------------------------------------------------------------------*/
      LoadFRNNLM(orgmodelfn, rnnlm);
      rnnlm->usefrnnlm = TRUE ;
+     PackRNNLM(rnnlm, NULL);
 
     if ( !rnnlm->setvocab ) {
         /*-----------------------------------------------------------------------------
@@ -1746,6 +2117,7 @@ void LoadRNLMwgt(char* orgmodelfn, char* inmap_file, char* outmap_file,
      *  1. load in original formatted RNN model
      *-----------------------------------------------------------------------------*/
     LoadRNNLM(orgmodelfn, rnnlm );
+    PackRNNLM(rnnlm, NULL);
 
     if ( !rnnlm->setvocab ) {
         /*-----------------------------------------------------------------------------
@@ -1822,219 +2194,65 @@ float FRNNLMAcceptWord(RNNLM* rnnlm, int lastword, int curword)
      *
      */
 {
-#ifdef SAVEACTNOSIGMOID   /*save the active without sigmoid function in the hidden layer.*/
-    double *acwithnosigmoid =  (double *)malloc(rnnlm->layer1_size * sizeof(double));
-#endif
-#ifdef SAVEACTWITHINPUTWEIGHTMATRIX   /*save the active after it pass the first layer, before adding with the word.*/
-    double *actforhist =  (double *)malloc(rnnlm->layer1_size * sizeof(double));
+#if defined(SAVEACTNOSIGMOID) || defined(SAVEACTWITHINPUTWEIGHTMATRIX)
+    float *keep = (float *)malloc(rnnlm->layer1_size * sizeof(float));
+#else
+    float *keep = NULL;
 #endif
-    int a, b;
-    real val;
-    double sum;
+    int nout = rnnlm->layer2_size;
     float log10p;
-    /*   sum is used for normalization: it's better to have larger precision as many numbers are summed together here */
-
-#if 0
-    unsigned long long hash[MAX_NGRAM_ORDER];
-    /* this will hold pointers to syn_d that contains hash parameters */
-
-    int classid=0;
-#endif
-
-    /*-----------------------------------------------------------------------------
-     *  set input neuron value
-     *-----------------------------------------------------------------------------*/
-    if (lastword!=-1) rnnlm->neu0[lastword].ac=1;
 
     /*-----------------------------------------------------------------------------
      *  propagate 0->1
      *-----------------------------------------------------------------------------*/
-    for (a=0; a<rnnlm->layer1_size; a++) rnnlm->neu1[a].ac=0;
-    for (a=0; a<rnnlm->layerc_size; a++) rnnlm->neuc[a].ac=0;
-    /*  propagate delayed hidden vector to current hidden vector */
-    matrixXvector(  rnnlm->neu1, rnnlm->neu0,               /*  destvec, srcvec */
-                    rnnlm->syn0, rnnlm->layer0_size,        /*  matrix,  matrix_width */
-                    0, rnnlm->layer1_size,                  /*  dest start id, dest end id */
-rnnlm->layer0_size-rnnlm->layer1_size, rnnlm->layer0_size,  /*  src  statt id, src  end id */
-                    0                                       /*  type */                );
-
-#ifdef SAVEACTWITHINPUTWEIGHTMATRIX
-    for (b =0; b<rnnlm->layer1_size; b++)
-    {
-        actforhist[b] = rnnlm->neu1[b].ac;
-    }
-    for (a=0; a<rnnlm->layer1_size; a++) {
-        if (actforhist[a]>50) actforhist[a]=50;  /* for numerical stability */
-        if (actforhist[a]<-50) actforhist[a]=-50;  /* for numerical stability */
-        val=-actforhist[a];
-#ifdef FASTEXP
-        actforhist[a]=1/(1+FAST_EXP(val));
-#else
-        actforhist[a]=1/(1+expf(val));
-#endif
-    }
-#endif
-    /*  propagate last word's weight to current hidden vector */
-    for (b=0; b<rnnlm->layer1_size; b++) {
-        a=lastword;
-        if (a!=-1) rnnlm->neu1[b].ac +=  rnnlm->syn0[a+b*rnnlm->layer0_size].weight;
-    }
-
-
-#ifdef SAVEACTNOSIGMOID   /*temp code */
-    for (b =0; b<rnnlm->layer1_size; b++)
-    {
-        acwithnosigmoid[b] = rnnlm->neu1[b].ac;
-    }
-#endif
-    /*-----------------------------------------------------------------------------
-     *  sigmoid of neuron 1
-     *-----------------------------------------------------------------------------*/
-    for (a=0; a<rnnlm->layer1_size; a++) {
-        if (rnnlm->neu1[a].ac>50) rnnlm->neu1[a].ac=50;  /* for numerical stability */
-        if (rnnlm->neu1[a].ac<-50) rnnlm->neu1[a].ac=-50;  /* for numerical stability */
-        val=-rnnlm->neu1[a].ac;
-#ifdef FASTEXP
-        rnnlm->neu1[a].ac=1/(1+FAST_EXP(val));
-#else
-        rnnlm->neu1[a].ac=1/(1+expf(val));
-#endif
-
-    }
-    if (rnnlm->layerc_size>0) {
-        matrixXvector(rnnlm->neuc, rnnlm->neu1,
-                        rnnlm->syn1, rnnlm->layer1_size,
-                        0, rnnlm->layerc_size,
-                        0, rnnlm->layer1_size,
-                    0);
-        /* activate compression      --sigmoid */
-        for (a=0; a<rnnlm->layerc_size; a++) {
-            if (rnnlm->neuc[a].ac>50) rnnlm->neuc[a].ac=50;  /* for numerical stability */
-            if (rnnlm->neuc[a].ac<-50) rnnlm->neuc[a].ac=-50;  /* for numerical stability */
-            val=-rnnlm->neuc[a].ac;
-#ifdef FASTEXP
-            rnnlm->neuc[a].ac=1/(1+FAST_EXP(val));
-#else
-            rnnlm->neuc[a].ac=1/(1+expf(val));
-#endif
-        }
-    }
+    PropagateHidden(rnnlm, rnnlm->ac0, lastword, rnnlm->ac1, rnnlm->acc, keep);
 
     /*-----------------------------------------------------------------------------
      *  propagate 1-> 2.words
      *-----------------------------------------------------------------------------*/
-    if (curword != -1)
-    {
-        for (b=0; b<rnnlm->layer2_size; b++)  rnnlm->neu2[b].ac = 0;
-        if (rnnlm->layerc_size > 0)
-        {
-            HError(999,"In RNNLM: for the F-RNNLM, layerc_size is not implemented yet.");
-        }
-        else
-        {
-            matrixXvector (rnnlm->neu2, rnnlm->neu1, rnnlm->syn1,
-                           rnnlm->layer1_size, 0,
-                           rnnlm->layer2_size, 0,
-                           rnnlm->layer1_size, 0);
-        }
-    }
-
-    /*-----------------------------------------------------------------------------
-     *  softmax function on words
-     *-----------------------------------------------------------------------------*/
     if (rnnlm->direct_size > 0)
     {
         HError(999,"In RNNLM: for the F-RNNLM, direct_size is not implemented yet.");
     }
-    sum = 0;
-    if (curword != -1)
-    {
-        if (rnnlm->lognorm >= 0)
-        {
-            for (a=0; a<rnnlm->layer2_size; a++)
-            {
-                val = rnnlm->neu2[a].ac - rnnlm->lognorm;
-                val = expf(val);
-                rnnlm->neu2[a].ac = val;
-                rnnlm->outP_arr[a]=rnnlm->neu2[a].ac;
-            }
-        }
-        else
-        {
-            for (a=0; a<rnnlm->layer2_size; a++)
-            {
-                if (rnnlm->neu2[a].ac > 50) rnnlm->neu2[a].ac = 50;  /* for numerical stability */
-                if (rnnlm->neu2[a].ac < -50) rnnlm->neu2[a].ac = -50;  /* for numerical stability */
-#ifdef FASTEXP
-                val = FAST_EXP(rnnlm->neu2[a].ac);
-#else
-                val = expf(rnnlm->neu2[a].ac);
-#endif
-                sum += val;
-                rnnlm->neu2[a].ac = val;
-            }
-            for (a=0; a<rnnlm->layer2_size; a++)
-            {
-                rnnlm->neu2[a].ac /= sum;
-                rnnlm->outP_arr[a]=rnnlm->neu2[a].ac;
-            }
-        }
-    }
     /* special case: oos */
-    if (rnnlm->out_oos_nodeid != rnnlm->layer2_size-1)
+    if (rnnlm->out_oos_nodeid != nout-1)
     {
-        HError(999,"In RNNLM: oosNodeWord(%d) should be last words in layer2 (size: %d).", oosNodeWord, rnnlm->layer2_size);
+        HError(999,"In RNNLM: oosNodeWord(%s) should be last words in layer2 (size: %d).", oosNodeWord, nout);
     }
-    /* rnnlm->fulldict_size = 28876; */
     if (rnnlm->fulldict_size == 0)
     {
         HError(999,"In RNNLM: fulldict_size is not specified.");
     }
-    if (rnnlm->fulldict_size < rnnlm->layer2_size)
+    if (rnnlm->fulldict_size < nout)
     {
         HError(999, "In RNNLM, fulldict_size should not be less than layer2_size.");
     }
-    rnnlm->neu2[rnnlm->layer2_size-1].ac = rnnlm->neu2[rnnlm->layer2_size-1].ac / (rnnlm->fulldict_size - rnnlm->layer2_size + 1);
-    rnnlm->outP_arr[rnnlm->layer2_size-1] = rnnlm->outP_arr[rnnlm->layer2_size-1] / (rnnlm->fulldict_size - rnnlm->layer2_size + 1);
 
-    /*-----------------------------------------------------------------------------
-     *  final, compute log10 probability
-     *-----------------------------------------------------------------------------*/
     if (curword != -1)
     {
-        log10p = log10(rnnlm->neu2[curword].ac);
+        if (rnnlm->layerc_size > 0)
+        {
+            HError(999,"In RNNLM: for the F-RNNLM, layerc_size is not implemented yet.");
+        }
+        gemvKernel(rnnlm->ac2, rnnlm->w1, rnnlm->ld1, rnnlm->ac1, 0, nout);
+
+        /*-----------------------------------------------------------------------------
+         *  softmax function on words
+         *-----------------------------------------------------------------------------*/
+        FullSoftmax(rnnlm, rnnlm->ac2);
+        memcpy(rnnlm->outP_arr, rnnlm->ac2, nout*sizeof(float));
+
+        /*-----------------------------------------------------------------------------
+         *  final, compute log10 probability
+         *-----------------------------------------------------------------------------*/
+        log10p = log10(rnnlm->ac2[curword]);
     }
     else
     {
         log10p = 0;
     }
 
-    /* cancel activation caused by lastword */
-    if ( lastword != -1 )
-        rnnlm->neu0[lastword].ac= 0.0 ;
-    for (a=MAX_NGRAM_ORDER-1; a>0; a--)
-       rnnlm->history[a]=rnnlm->history[a-1];
-
-    /*  curword is the id maps by out_vocab
-     *  need to convert to id in in_vocab,
-     *  update rnnlm->histroy[0] is moved to where this function is called */
-
-    copyHiddenLayerToInput(rnnlm);
-
-#ifdef SAVEACTNOSIGMOID
-    for (b =0; b<rnnlm->layer1_size; b++)
-    {
-        rnnlm->neu1[b].ac =  acwithnosigmoid[b];
-    }
-    free (acwithnosigmoid);
-#endif
-#ifdef SAVEACTWITHINPUTWEIGHTMATRIX
-    for (b =0; b<rnnlm->layer1_size; b++)
-    {
-        rnnlm->neu1[b].ac =  actforhist[b];
-    }
-    free (actforhist);
-#endif
+    EndAcceptWord(rnnlm, keep);
     return log10p;
 }
 
@@ -2049,183 +2267,37 @@ float RNNLMAcceptWord(RNNLM* rnnlm, int lastword, int curword)
      *
      */
 {
-#ifdef SAVEACTNOSIGMOID   /*save the active without sigmoid function in the hidden layer.*/
-    double *acwithnosigmoid =  (double *)malloc(rnnlm->layer1_size * sizeof(double));
-#endif
-#ifdef SAVEACTWITHINPUTWEIGHTMATRIX   /*save the active after it pass the first layer, before adding with the word.*/
-    double *actforhist =  (double *)malloc(rnnlm->layer1_size * sizeof(double));
+#if defined(SAVEACTNOSIGMOID) || defined(SAVEACTWITHINPUTWEIGHTMATRIX)
+    float *keep = (float *)malloc(rnnlm->layer1_size * sizeof(float));
+#else
+    float *keep = NULL;
 #endif
-    int a, b, c;
-    real val;
-    double sum;
+    int a, b, c, from, to, ld;
+    const float *w, *src;
+    float *ac2 = rnnlm->ac2;
+    int nvoc = rnnlm->vocab_size;
     float log10p;
-    /*   sum is used for normalization: it's better to have larger precision as many numbers are summed together here */
 
     unsigned long long hash[MAX_NGRAM_ORDER];
     /* this will hold pointers to syn_d that contains hash parameters */
 
     int classid=0;
 
-    /*-----------------------------------------------------------------------------
-     *  set input neuron value
-     *-----------------------------------------------------------------------------*/
-    if (lastword!=-1) rnnlm->neu0[lastword].ac=1;
-
     /*-----------------------------------------------------------------------------
      *  propagate 0->1
      *-----------------------------------------------------------------------------*/
-    for (a=0; a<rnnlm->layer1_size; a++) rnnlm->neu1[a].ac=0;
-    for (a=0; a<rnnlm->layerc_size; a++) rnnlm->neuc[a].ac=0;
-    /*  propagate delayed hidden vector to current hidden vector */
-    matrixXvector(  rnnlm->neu1, rnnlm->neu0,               /*  destvec, srcvec */
-                    rnnlm->syn0, rnnlm->layer0_size,        /*  matrix,  matrix_width */
-                    0, rnnlm->layer1_size,                  /*  dest start id, dest end id */
-rnnlm->layer0_size-rnnlm->layer1_size, rnnlm->layer0_size,  /*  src  statt id, src  end id */
-                    0                                       /*  type */                );
-
-#ifdef SAVEACTWITHINPUTWEIGHTMATRIX
-    for (b =0; b<rnnlm->layer1_size; b++)
-    {
-        actforhist[b] = rnnlm->neu1[b].ac;
-    }
-    for (a=0; a<rnnlm->layer1_size; a++) {
-        if (actforhist[a]>50) actforhist[a]=50;  /* for numerical stability */
-        if (actforhist[a]<-50) actforhist[a]=-50;  /* for numerical stability */
-        val=-actforhist[a];
-        actforhist[a]=1/(1+FAST_EXP(val));
-    }
-#endif
-    /*  propagate last word's weight to current hidden vector */
-    for (b=0; b<rnnlm->layer1_size; b++) {
-        a=lastword;
-        if (a!=-1) rnnlm->neu1[b].ac +=  rnnlm->syn0[a+b*rnnlm->layer0_size].weight;
-    }
-
-
-#ifdef SAVEACTNOSIGMOID   /*temp code */
-    for (b =0; b<rnnlm->layer1_size; b++)
-    {
-        acwithnosigmoid[b] = rnnlm->neu1[b].ac;
-    }
-#endif
-    /*-----------------------------------------------------------------------------
-     *  sigmoid of neuron 1
-     *-----------------------------------------------------------------------------*/
-    for (a=0; a<rnnlm->layer1_size; a++) {
-        if (rnnlm->neu1[a].ac>50) rnnlm->neu1[a].ac=50;  /* for numerical stability */
-        if (rnnlm->neu1[a].ac<-50) rnnlm->neu1[a].ac=-50;  /* for numerical stability */
-        val=-rnnlm->neu1[a].ac;
-        rnnlm->neu1[a].ac=1/(1+FAST_EXP(val));
-    }
+    PropagateHidden(rnnlm, rnnlm->ac0, lastword, rnnlm->ac1, rnnlm->acc, keep);
     if (rnnlm->layerc_size>0) {
-        matrixXvector(rnnlm->neuc, rnnlm->neu1,
-                        rnnlm->syn1, rnnlm->layer1_size,
-                        0, rnnlm->layerc_size,
-                        0, rnnlm->layer1_size,
-                    0);
-        /* activate compression      --sigmoid */
-        for (a=0; a<rnnlm->layerc_size; a++) {
-            if (rnnlm->neuc[a].ac>50) rnnlm->neuc[a].ac=50;  /* for numerical stability */
-            if (rnnlm->neuc[a].ac<-50) rnnlm->neuc[a].ac=-50;  /* for numerical stability */
-            val=-rnnlm->neuc[a].ac;
-            rnnlm->neuc[a].ac=1/(1+FAST_EXP(val));
-        }
-    }
-
-#if 0    /* temp code */
-    for (b=0; b<rnnlm->layer2_size; b++) rnnlm->neu2[b].ac=0;
-        /*  calculate the output cluster node's activation  */
-	    matrixXvector(rnnlm->neu2, rnnlm->neu1,
-                        rnnlm->syn1, rnnlm->layer1_size,
-                        0, rnnlm->vocab_size,
-                        0, rnnlm->layer1_size,
-                        0);
-
-    /*-----------------------------------------------------------------------------
-     *  layer 2 -- softmax
-     *-----------------------------------------------------------------------------*/
-    sum=0;
-    for (a=0; a<rnnlm->vocab_size; a++) {
-        if (rnnlm->neu2[a].ac>50) rnnlm->neu2[a].ac=50;  /* for numerical stability */
-        if (rnnlm->neu2[a].ac<-50) rnnlm->neu2[a].ac=-50;  /* for numerical stability */
-        val=FAST_EXP(rnnlm->neu2[a].ac);
-        sum+=val;
-        rnnlm->neu2[a].ac=val;
-    }
-    for (a=0; a<rnnlm->vocab_size; a++) rnnlm->neu2[a].ac/=sum;
-    /*-----------------------------------------------------------------------------
-     *  prob table caching
-     *-----------------------------------------------------------------------------*/
-    if ( calcProbCache )
-    {
-        for (a=0; a<rnnlm->vocab_size; a++) rnnlm->outP_arr[a] = rnnlm->neu2[a].ac;
-    }
-
-    /*-----------------------------------------------------------------------------
-     *  final, compute log10 probability
-     *-----------------------------------------------------------------------------*/
-    if ( curword!=-1)
-    {
-        log10p = log10(rnnlm->neu2[curword].ac);
-    }
-    else
-    {
-        /*  do not handle oov on rnn its own !!! */
-        log10p = 0;
+        w = rnnlm->wc; ld = rnnlm->ldc; src = rnnlm->acc;
     }
-
-    /* cancel activation caused by lastword */
-    if ( lastword != -1 )
-        rnnlm->neu0[lastword].ac= 0.0 ;
-    for (a=MAX_NGRAM_ORDER-1; a>0; a--)
-       rnnlm->history[a]=rnnlm->history[a-1];
-
-    /*  curword is the id maps by out_vocab
-     *  need to convert to id in in_vocab,
-     *  update rnnlm->histroy[0] is moved to where this function is called */
-
-    copyHiddenLayerToInput(rnnlm);
-
-#ifdef SAVEACTNOSIGMOID
-    for (b =0; b<rnnlm->layer1_size; b++)
-    {
-        rnnlm->neu1[b].ac =  acwithnosigmoid[b];
-    }
-    free (acwithnosigmoid);
-#endif
-#ifdef SAVEACTWITHINPUTWEIGHTMATRIX
-    for (b =0; b<rnnlm->layer1_size; b++)
-    {
-        rnnlm->neu1[b].ac =  actforhist[b];
+    else {
+        w = rnnlm->w1; ld = rnnlm->ld1; src = rnnlm->ac1;
     }
-    free (actforhist);
-#endif
-
-    return log10p;
-#endif
 
     /*-----------------------------------------------------------------------------
      *  propagate 1-> 2.classes
      *-----------------------------------------------------------------------------*/
-    for (b=rnnlm->vocab_size; b<rnnlm->layer2_size; b++) rnnlm->neu2[b].ac=0;
-    if (rnnlm->layerc_size>0) {
-	    matrixXvector(rnnlm->neu2, rnnlm->neuc,
-                        rnnlm->sync, rnnlm->layerc_size,
-                        rnnlm->vocab_size, rnnlm->layer2_size,
-                        0, rnnlm->layerc_size,
-                        0);
-    }
-    else
-    {
-        /*  calculate the output cluster node's activation  */
-	    matrixXvector(rnnlm->neu2, rnnlm->neu1,
-                        rnnlm->syn1, rnnlm->layer1_size,
-                        rnnlm->vocab_size, rnnlm->layer2_size,
-                        0, rnnlm->layer1_size,
-                        0);
-        /*  forward to class node */
-    }
-
+    gemvKernel(ac2, w, ld, src, nvoc, rnnlm->layer2_size);
 
     /*-----------------------------------------------------------------------------
      *  direct connection -- part 1. to classes
@@ -2252,14 +2324,14 @@ rnnlm->layer0_size-rnnlm->layer1_size, rnnlm->layer0_size,  /*  src  statt id, s
              * (second part is reserved for history->words features) */
         }
 
-        for (a=rnnlm->vocab_size; a<rnnlm->layer2_size; a++)
+        for (a=nvoc; a<rnnlm->layer2_size; a++)
             /*  for each class node */
         {
             for (b=0; b<rnnlm->direct_order; b++)
             {
                 if (hash[b])
                 {
-                    rnnlm->neu2[a].ac+=rnnlm->syn_d[hash[b]];		/* apply current parameter and move to the next one */
+                    ac2[a]+=rnnlm->syn_d[hash[b]];		/* apply current parameter and move to the next one */
                     hash[b]++;
                 }
                 else
@@ -2271,77 +2343,25 @@ rnnlm->layer0_size-rnnlm->layer1_size, rnnlm->layer0_size,  /*  src  statt id, s
     /*-----------------------------------------------------------------------------
      *  layer 2.class -- softmax
      *-----------------------------------------------------------------------------*/
-    sum=0;
-    for (a=rnnlm->vocab_size; a<rnnlm->layer2_size; a++) {
-        if (rnnlm->neu2[a].ac>50) rnnlm->neu2[a].ac=50;  /* for numerical stability */
-        if (rnnlm->neu2[a].ac<-50) rnnlm->neu2[a].ac=-50;  /* for numerical stability */
-        val=FAST_EXP(rnnlm->neu2[a].ac);
-        sum+=val;
-        rnnlm->neu2[a].ac=val;
-    }
-    for (a=rnnlm->vocab_size; a<rnnlm->layer2_size; a++) rnnlm->neu2[a].ac/=sum;
+    ClassSoftmax(rnnlm, ac2);
     /* output layer activations now sum exactly to 1 */
 
     /*-----------------------------------------------------------------------------
      *  propagate 1 -> 2.word
      *-----------------------------------------------------------------------------*/
-
     if ( calcProbCache == FALSE ) {
         if (curword!=-1) {
             /*  not oov */
-            int classid=rnnlm->vocab[curword].class_index;
-            int wordInClass= rnnlm->class_cn[classid];
-            for (c=0; c< wordInClass; c++)
-            {
-                rnnlm->neu2[rnnlm->class_words[classid][c]].ac=0;
-            }
-            if (rnnlm->layerc_size>0) {
-                matrixXvector(rnnlm->neu2, rnnlm->neuc,                 /*  dest = neur2 ; src = neuc */
-                    rnnlm->sync, rnnlm->layerc_size,        /*  use sync matrix, width=layerc_size */
-                    rnnlm->class_words[classid][0],         /*  classid-th class start id */
-                    rnnlm->class_words[classid][0]+rnnlm->class_cn[classid], /*  classid-th class end id */
-                    0, rnnlm->layerc_size,
-                    0);
-            }
-            else
-            {
-                matrixXvector(rnnlm->neu2, rnnlm->neu1,
-                    rnnlm->syn1, rnnlm->layer1_size,
-                    rnnlm->class_words[classid][0],
-                    rnnlm->class_words[classid][0]+rnnlm->class_cn[classid],
-                    0, rnnlm->layer1_size,
-                    0);
-            }
+            ClassWords(rnnlm, rnnlm->vocab[curword].class_index, &from, &to);
+            gemvKernel(ac2, w, ld, src, from, to);
         }
     }
     else
     {
-        int classid, wordInClass = 0 ;
         for (classid = 0 ; classid < rnnlm->class_size; classid ++) {
-            wordInClass = rnnlm->class_cn[classid] ;
-            if ( wordInClass == 1 ) {   /*  no need to calculate  */
-
-            }
-            else
-            {
-                for (c=0; c<wordInClass; c++) rnnlm->neu2[rnnlm->class_words[classid][c]].ac = 0 ;
-                if (rnnlm->layerc_size>0) {
-                    matrixXvector(rnnlm->neu2, rnnlm->neuc,                 /*  dest = neur2 ; src = neuc */
-                        rnnlm->sync, rnnlm->layerc_size,        /*  use sync matrix, width=layerc_size */
-                        rnnlm->class_words[classid][0],         /*  classid-th class start id */
-                        rnnlm->class_words[classid][0]+rnnlm->class_cn[classid], /*  classid-th class end id */
-                        0, rnnlm->layerc_size,
-                        0);
-                }
-                else
-                {
-                    matrixXvector(rnnlm->neu2, rnnlm->neu1,
-                        rnnlm->syn1, rnnlm->layer1_size,
-                        rnnlm->class_words[classid][0],
-                        rnnlm->class_words[classid][0]+rnnlm->class_cn[classid],
-                        0, rnnlm->layer1_size,
-                        0);
-                }
+            if ( rnnlm->class_cn[classid] > 1 ) {   /*  single words need no calculation */
+                ClassWords(rnnlm, classid, &from, &to);
+                gemvKernel(ac2, w, ld, src, from, to);
             }
         }
     }
@@ -2373,7 +2393,7 @@ rnnlm->layer0_size-rnnlm->layer1_size, rnnlm->layer0_size,  /*  src  statt id, s
             {
                 if (hash[b])
                 {
-                    rnnlm->neu2[a].ac+=rnnlm->syn_d[hash[b]];
+                    ac2[a]+=rnnlm->syn_d[hash[b]];
                     hash[b]++;
                     hash[b]=hash[b]%rnnlm->direct_size;
                 } else
@@ -2382,53 +2402,17 @@ rnnlm->layer0_size-rnnlm->layer1_size, rnnlm->layer0_size,  /*  src  statt id, s
         }
     }
 
-
     /*-----------------------------------------------------------------------------
      *  layer 2.word -- softmax
      *-----------------------------------------------------------------------------*/
-    sum=0;
-
     if ( calcProbCache == FALSE  ) {
-        if (curword!=-1) {
-            classid =  rnnlm->vocab[curword].class_index;
-            for (c=0; c<rnnlm->class_cn[classid]; c++)
-            {
-                a=rnnlm->class_words[classid][c];
-                if (rnnlm->neu2[a].ac>50) rnnlm->neu2[a].ac=50;  /* for numerical stability */
-                if (rnnlm->neu2[a].ac<-50) rnnlm->neu2[a].ac=-50;  /* for numerical stability */
-                val=FAST_EXP(rnnlm->neu2[a].ac);
-                sum+=val;
-                rnnlm->neu2[a].ac=val;
-            }
-            for (c=0; c<rnnlm->class_cn[classid]; c++) {
-                int wordid=rnnlm->class_words[classid][c];
-                rnnlm->neu2[wordid].ac/=sum;
-            }
-        }
+        if (curword!=-1)
+            WordSoftmax(rnnlm, ac2, rnnlm->vocab[curword].class_index);
     }
     else
     {
-        for (classid=0; classid< rnnlm->class_size; classid++) {
-            if ( rnnlm->class_cn[classid] == 1 ) {
-                rnnlm->neu2[rnnlm->class_words[classid][0]].ac = 1.0f;
-            }
-            else{
-                sum=0;
-                for (c=0; c<rnnlm->class_cn[classid]; c++)
-                {
-                    a=rnnlm->class_words[classid][c];
-                    if (rnnlm->neu2[a].ac>50) rnnlm->neu2[a].ac=50;  /* for numerical stability */
-                    if (rnnlm->neu2[a].ac<-50) rnnlm->neu2[a].ac=-50;  /* for numerical stability */
-                    val=FAST_EXP(rnnlm->neu2[a].ac);
-                    sum+=val;
-                    rnnlm->neu2[a].ac=val;
-                }
-                for (c=0; c<rnnlm->class_cn[classid]; c++) {
-                    int wordid=rnnlm->class_words[classid][c];
-                    rnnlm->neu2[wordid].ac/=sum;
-                }
-            }
-        }
+        for (classid=0; classid< rnnlm->class_size; classid++)
+            WordSoftmax(rnnlm, ac2, classid);
     }
 
 
@@ -2436,42 +2420,7 @@ rnnlm->layer0_size-rnnlm->layer1_size, rnnlm->layer0_size,  /*  src  statt id, s
      *  prob table caching
      *-----------------------------------------------------------------------------*/
     if ( calcProbCache )
-    {
-        /* outP_arr stores the real probability value */
-        for (classid = 0 ; classid < rnnlm->class_size; classid ++)
-        {
-            float classprob = rnnlm->neu2[classid+rnnlm->vocab_size].ac;
-            for ( c=0; c<rnnlm->class_cn[classid] ; c++){
-                int wordid=rnnlm->class_words[classid][c];
-                rnnlm->outP_arr[wordid]=classprob * rnnlm->neu2[wordid].ac;
-            }
-        }
-        /*  special case : oos */
-        if ( oosNodeClass < 0 )
-            rnnlm->outP_arr[rnnlm->vocab_size-1] = rnnlm->neu2[rnnlm->layer2_size -1 ].ac ;
-        else
-            rnnlm->outP_arr[rnnlm->vocab_size-1] = rnnlm->neu2[rnnlm->vocab_size + oosNodeClass ].ac;
-
-
-#if 1
-        if (rnnlm->fulldict_size == 0)
-        {
-            HError(999,"In RNNLM: fulldict_size is not specified.");
-        }
-        if (rnnlm->fulldict_size < rnnlm->vocab_size)
-        {
-            HError(999, "In RNNLM, fulldict_size should not be less than vocab_size.");
-        }
-        rnnlm->outP_arr[rnnlm->vocab_size-1] = rnnlm->outP_arr[rnnlm->vocab_size-1] / (rnnlm->fulldict_size - rnnlm->vocab_size + 1);
-#endif
-#if 0
-        int iwrd= 0;
-        float probmass=0;
-        for ( iwrd =0; iwrd < rnnlm->vocab_size; iwrd++)
-            probmass+=rnnlm->outP_arr[iwrd] ;
-        printf("prob mass: %.3f\n", probmass);
-#endif
-    }
+        ClassProbTable(rnnlm, ac2, rnnlm->outP_arr);
 
     /*-----------------------------------------------------------------------------
      *  final, compute log10 probability
@@ -2479,9 +2428,9 @@ rnnlm->layer0_size-rnnlm->layer1_size, rnnlm->layer0_size,  /*  src  statt id, s
     if ( curword!=-1)
     {
         classid =  rnnlm->vocab[curword].class_index;
-        log10p = log10(rnnlm->neu2[curword].ac)
+        log10p = log10(ac2[curword])
                     +
-                 log10(rnnlm->neu2[classid+rnnlm->vocab_size].ac);
+                 log10(ac2[classid+nvoc]);
     }
     else
     {
@@ -2489,33 +2438,97 @@ rnnlm->layer0_size-rnnlm->layer1_size, rnnlm->layer0_size,  /*  src  statt id, s
         log10p = 0;
     }
 
-    /* cancel activation caused by lastword */
-    if ( lastword != -1 )
-        rnnlm->neu0[lastword].ac= 0.0 ;
-    for (a=MAX_NGRAM_ORDER-1; a>0; a--)
-       rnnlm->history[a]=rnnlm->history[a-1];
+    EndAcceptWord(rnnlm, keep);
+    return log10p;
+}
 
-    /*  curword is the id maps by out_vocab
-     *  need to convert to id in in_vocab,
-     *  update rnnlm->histroy[0] is moved to where this function is called */
+/* GemmRows: y[k][r] = sum_a w[r*ld+a]*x[k][a] for the n vectors x[k]
+   and r0<=r<r1, taking RNN_ROWBLK rows at a time through all the
+   vectors so that each block of weights is read from memory once */
+static void GemmRows(float **y, const float *w, int ld, float **x, int n, int r0, int r1)
+{
+    int k, r, re;
 
-    copyHiddenLayerToInput(rnnlm);
+    for (r=r0; r<r1; r=re) {
+        re = (r+RNN_ROWBLK<r1) ? r+RNN_ROWBLK : r1;
+        for (k=0; k<n; k++)
+            gemvKernel(y[k], w, ld, x[k], r, re);
+    }
+}
 
-#ifdef SAVEACTNOSIGMOID
-    for (b =0; b<rnnlm->layer1_size; b++)
-    {
-        rnnlm->neu1[b].ac =  acwithnosigmoid[b];
+/*  EXPORT-> RNNLMAcceptWordBatch */
+void RNNLMAcceptWordBatch(RNNLM* rnnlm, int n, float **hin, int *lastword, float **hout, float **outP)
+    /*
+     * accept lastword[k] from the hidden activation hin[k] for each
+     * k<n, as RNNLMAcceptWord with curword 0 from that state, leaving
+     * the new hidden activation in hout[k] and the probability table
+     * in outP[k].  The model's own state (hidden vector, history and
+     * outP_arr) is not changed.  Up to RNNBATCH inputs are evaluated
+     * together, so the output layer weights are streamed once per
+     * batch rather than once per input.
+     */
+{
+    int b, k, cl, nb, nmax, l1, ld, nrow, npad;
+    float **h0, **h1, **hc, **o, **src, *buf;
+    const float *w;
+
+    if (!calcProbCache)
+        HError(999, "RNNLMAcceptWordBatch: the probability table must be cached");
+    if (rnnlm->direct_size>0)
+        HError(999, "RNNLMAcceptWordBatch: direct connections not supported");
+    if (rnnlm->usefrnnlm && rnnlm->layerc_size>0)
+        HError(999, "RNNLMAcceptWordBatch: for the F-RNNLM, layerc_size is not implemented yet.");
+    if (n<=0) return;
+
+    l1 = rnnlm->layer1_size;
+    nrow = rnnlm->layer2_size;
+    npad = PadRow(nrow);
+    nmax = (n<rnnBatch) ? n : rnnBatch;
+    h0 = (float **)New(&gstack, 4*nmax*sizeof(float *));
+    h1 = h0+nmax; hc = h1+nmax; o = hc+nmax;
+    buf = (float *)New(&gstack, (size_t)nmax*(2*rnnlm->ld1+rnnlm->ldc+npad)*sizeof(float));
+    memset(buf, 0, (size_t)nmax*(2*rnnlm->ld1+rnnlm->ldc+npad)*sizeof(float));
+    for (k=0; k<nmax; k++) {
+        h0[k] = buf; buf += rnnlm->ld1;
+        h1[k] = buf; buf += rnnlm->ld1;
+        hc[k] = buf; buf += rnnlm->ldc;
+        o[k] = buf; buf += npad;
+    }
+    if (rnnlm->layerc_size>0 && !rnnlm->usefrnnlm) {
+        w = rnnlm->wc; ld = rnnlm->ldc; src = hc;
     }
-    free (acwithnosigmoid);
-#endif
-#ifdef SAVEACTWITHINPUTWEIGHTMATRIX
-    for (b =0; b<rnnlm->layer1_size; b++)
-    {
-        rnnlm->neu1[b].ac =  actforhist[b];
+    else {
+        w = rnnlm->w1; ld = rnnlm->ld1; src = h1;
     }
-    free (actforhist);
+
+    for (b=0; b<n; b+=nb) {
+        nb = (n-b<nmax) ? n-b : nmax;
+        /*  propagate 0->1, one input at a time */
+        for (k=0; k<nb; k++) {
+            memcpy(h0[k], hin[b+k], l1*sizeof(float));
+#if defined(SAVEACTNOSIGMOID) || defined(SAVEACTWITHINPUTWEIGHTMATRIX)
+            PropagateHidden(rnnlm, h0[k], lastword[b+k], h1[k], hc[k], hout[b+k]);
+#else
+            PropagateHidden(rnnlm, h0[k], lastword[b+k], h1[k], hc[k], NULL);
+            memcpy(hout[b+k], h1[k], l1*sizeof(float));
 #endif
-    return log10p;
+        }
+        /*  propagate 1->2 for the whole batch, then normalise each */
+        GemmRows(o, w, ld, src, nb, 0, nrow);
+        for (k=0; k<nb; k++) {
+            if (rnnlm->usefrnnlm) {
+                FullSoftmax(rnnlm, o[k]);
+                memcpy(outP[b+k], o[k], nrow*sizeof(float));
+            }
+            else {
+                ClassSoftmax(rnnlm, o[k]);
+                for (cl=0; cl<rnnlm->class_size; cl++)
+                    WordSoftmax(rnnlm, o[k], cl);
+                ClassProbTable(rnnlm, o[k], outP[b+k]);
+            }
+        }
+    }
+    Dispose(&gstack, h0);
 }
 
 
@@ -2538,6 +2551,7 @@ void RNNOutputLogProb(char* modelfn, char* textfn)
 
     RNNLM* rnnlm=CreateRNNLM(&rnnInfoStack);
     LoadRNNLM(modelfn, rnnlm);
+    PackRNNLM(rnnlm, NULL);
 
     fp = fopen(textfn, "rb");
     RNNLMStart(rnnlm);
@@ -2572,7 +2586,7 @@ void RNNOutputLogProb(char* modelfn, char* textfn)
             else
             {
                 int classid =rnnlm->vocab[curword].class_index ;
-                float f = rnnlm->neu2[curword].ac*rnnlm->neu2[classid+rnnlm->vocab_size].ac;
+                float f = rnnlm->ac2[curword]*rnnlm->ac2[classid+rnnlm->vocab_size];
                 printf("%d\t%.10f\t%s\n",curword, f , rnnlm->vocab[curword].word);
             }
         }
@@ -2626,19 +2640,17 @@ void GetRNNLMHistVector (RNNLM* lm, Vector v)
 {
     int i =0 ;
     int size= VectorSize(v);
-    int bias = lm->layer0_size - lm->layer1_size;
 
     for ( i = 1; i<= size; i++ )
-        v[i]=lm->neu0[bias + i-1].ac;
+        v[i]=lm->ac0[i-1];
 }
 
 void AssignRNNLMHistVector (RNNLM *lm, Vector v)
 {
     int i = 0;
     int size = VectorSize(v);
-    int bias = lm->layer0_size - lm->layer1_size;
     for (i = 1; i <= size; i ++)
-        lm->neu0[bias + i-1].ac = v[i];
+        lm->ac0[i-1] = v[i];
 }
 
 void GetRNNLMHiddenVector(RNNLM* lm, Vector v)
@@ -2649,7 +2661,7 @@ void GetRNNLMHiddenVector(RNNLM* lm, Vector v)
     int size= VectorSize(v);
 
     for ( i = 1; i<= size; i++ )
-        v[i]=lm->neu1[i-1].ac;
+        v[i]=lm->ac1[i-1];
 }
 
 void AssignRNNLMHiddenVector (RNNLM *lm, Vector v)
@@ -2657,7 +2669,7 @@ void AssignRNNLMHiddenVector (RNNLM *lm, Vector v)
     int i = 0;
     int size = VectorSize(v);
     for (i = 1; i <= size; i ++)
-        lm->neu1[i-1].ac = v[i];
+        lm->ac1[i-1] = v[i];
 }
 
 
@@ -2913,6 +2925,7 @@ void CloneRNNLM(RNNLM* src, RNNLM* tgt)
        }
 
        saveWeights(tgt);
+       PackRNNLM(tgt, src);
     }
 
 
@@ -2921,7 +2934,7 @@ void CloneRNNLM(RNNLM* src, RNNLM* tgt)
         tgt->history[i-1] = hist[i];
 
     for (i=1; i<=src->layer1_size; i++)
-        tgt->neu1[i-1].ac=hidd[i];
+        tgt->ac1[i-1]=hidd[i];
 
     copyHiddenLayerToInput(tgt);
 
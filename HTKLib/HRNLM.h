@@ -166,6 +166,18 @@ typedef struct _RNNLM{
     struct synapse *sync;		/*weights between hidden and compression layer */
     direct_t *syn_d;		/*direct parameters between input and output layer (similar to Maximum Entropy model parameters) */
 
+    /*  packed inference layout, built from the above by PackRNNLM */
+    int ld1;                        /*  padded row length of hidden layer weights */
+    int ldc;                        /*  padded row length of compression layer weights */
+    float *ac0;                     /*  delayed hidden activation (recurrent input) */
+    float *ac1;                     /*  hidden activation */
+    float *acc;                     /*  compression activation */
+    float *ac2;                     /*  output activation */
+    float *w0h;                     /*  w0h[b*ld1+a]: hidden a (t-1) -> hidden b */
+    float *w0x;                     /*  w0x[w*ld1+b]: input word w -> hidden b */
+    float *w1;                      /*  w1[r*ld1+a]: hidden a -> output (or compression) r */
+    float *wc;                      /*  wc[r*ldc+a]: compression a -> output r */
+
 
     /*  class-related variables */
     int class_size;
@@ -259,6 +271,10 @@ void RNNLMStart(RNNLM* rnnlm) ;
 void RNNLMEnd(RNNLM* rnnlm);
 float RNNLMAcceptWord(RNNLM* rnnlm, int lastword, int curword);
 float FRNNLMAcceptWord(RNNLM* rnnlm, int lastword, int curword);
+/*  accept lastword[k] from hidden activation hin[k], k<n, in batches;
+ *  hout[k] gets the new hidden activation, outP[k] the probability
+ *  table; the model state itself is left unchanged */
+void RNNLMAcceptWordBatch(RNNLM* rnnlm, int n, float **hin, int *lastword, float **hout, float **outP);
 
 
 /*-----------------------------------------------------------------------------
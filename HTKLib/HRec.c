@@ -47,6 +47,8 @@ char *hrec_vc_id = "$Id: HRec.c,v 1.2 2015/10/12 12:07:24 cx277 Exp $";
 #include "HLabel.h"
 #include "HANNet.h"
 #include "HModel.h"
+#include "HVQ.h"
+#include "HGSel.h"
 #include "HDict.h"
 #include "HNet.h"
 #include "HRec.h"
@@ -63,6 +65,11 @@ char *hrec_vc_id = "$Id: HRec.c,v 1.2 2015/10/12 12:07:24 cx277 Exp $";
 
 static int trace=0;
 static Boolean forceOutput=FALSE;
+static Boolean flatViterbi=TRUE;      /* Flattened 1-best model propagation */
+static int flatMin=8;                 /* Min instances per matrix to flatten */
+static char vitKernel[MAXSTRLEN]="AUTO";  /* Max-plus kernel */
+
+static void SelectMaxPlusKernel(void);
 
 const Token null_token={LZERO,0.0,NULL,NULL};
 
@@ -156,6 +163,7 @@ struct _NetInst
 
    Boolean pxd;         /* External propagation done this frame */
    Boolean ooo;         /* Instance potentially out of order */
+   int lane;            /* Lane in FlatGroup this frame (-1 none) */
 
 #ifdef SANITY
    int ipos;
@@ -188,8 +196,24 @@ struct psetinfo
 
    short stHeapNum;         /* Number of separate state heaps */
    short *stHeapIdx;        /* Array[1..max] of state to heap index */
+
+   GSIndex *gs;             /* Gaussian selection index (or NULL) */
 };
 
+/* Active instances sharing one transition matrix (see FlatMaxPlus) */
+typedef struct flatgroup
+{
+   HMMDef *hmm;             /* Any model using the matrix */
+   int N;                   /* Number of states */
+   int n;                   /* Number of lanes in use */
+   int size;                /* Number of lanes allocated */
+   NetInst **inst;          /* Array[0..size-1] of instances */
+   LogDouble *like;         /* Array[(i-1)*size+k] state i likelihood */
+   LogDouble *best;         /* Array[(j-2)*size+k] best entry into state j */
+   int *arg;                /* Array[(j-2)*size+k] state giving best */
+}
+FlatGroup;
+
 /* Private recognition information PRecInfo. (Not visible outside HRec) */
 /* Contains all status/network/allocation/pruning information for a     */
 /*  single network.                                                     */
@@ -199,6 +223,7 @@ struct precinfo {
    Observation *obs;         /* Current Observation */
 
    PSetInfo *psi;           /* HMMSet information */
+   GSSel gsel;              /* Gaussian selection for current frame */
    Network *net;            /* Recognition network */
    int nToks;               /* Maximum tokens to propagate (0==1) */
    Boolean models;          /* Keep track of model history */
@@ -253,6 +278,10 @@ struct precinfo {
    NetInst head;            /* Head (oldest) of Inst linked list */
    NetInst tail;            /* Tail (newest) of Inst linked list */
    NetInst *nxtInst;        /* Inst used to select next in step sequence */
+
+   FlatGroup *flat;         /* Array[1..psi->ntr] for flattened propagation */
+   int *flatUsed;           /* Matrices with active instances this frame */
+   int nFlatUsed;           /* Number of flatUsed */
 #ifdef SANITY
    NetInst *start_inst;     /* Inst that started a move */
    int ipos;                /* Current inst position */
@@ -280,13 +309,18 @@ void InitRec(void)
 {
    int i;
    Boolean b;
+   char buf[MAXSTRLEN];
 
    Register(hrec_version,hrec_vc_id);
    nParm = GetConfig("HREC", TRUE, cParm, MAXGLOBS);
    if (nParm>0){
       if (GetConfInt(cParm,nParm,"TRACE",&i)) trace = i;
       if (GetConfBool(cParm,nParm,"FORCEOUT",&b)) forceOutput = b;
+      if (GetConfBool(cParm,nParm,"FLATVITERBI",&b)) flatViterbi = b;
+      if (GetConfInt(cParm,nParm,"FLATMIN",&i)) flatMin = i;
+      if (GetConfStr(cParm,nParm,"VITKERNEL",buf)) strcpy(vitKernel,buf);
    }
+   SelectMaxPlusKernel();
 }
 
 
@@ -451,15 +485,70 @@ static void TokSetMerge(TokenSet *res,Token *cmp,TokenSet *src)
       nodes[i]->aux=0;
 }
 
+/* Caching version of MOutP used when mixPDFs shared */
+static LogFloat cMOutP(Vector v, MixPDF *mp, int id)
+{
+   PreComp *pre;
+   LogFloat px,det;
+
+   if (mp->mIdx>0 && mp->mIdx<=pri->psi->nmp)
+      pre=pri->psi->mPre+mp->mIdx;
+   else pre=NULL;
+   if (pre!=NULL && pre->id==id)
+      return pre->outp;
+   px= MOutP(ApplyCompFXForm(mp,v,inXForm,&det,id),mp);
+   px += det;
+   if (pre!=NULL) {
+      pre->id=id;
+      pre->outp=px;
+   }
+   return px;
+}
+
+/* Caching log prob of all mixtures in a multiple mixture stream */
+static LogFloat cMixOutP(HMMSet *hset, Vector v, StreamElem *se, int id)
+{
+   LogFloat bx,wt;
+   MixtureElem *me;
+   int m;
+
+   bx=LZERO;
+   for (m=1,me=se->spdf.cpdf+1; m<=se->nMix; m++,me++) {
+      wt = MixLogWeight(hset, me->weight);
+      if (wt>LMINMIX)
+         bx=LAdd(bx,wt+cMOutP(v,me->mpdf,id));
+   }
+   return bx;
+}
+
+/* Caching log prob of the shortlisted mixtures in a multiple mixture
+   stream, falling back to the selection floor if there are none */
+static LogFloat cSelOutP(HMMSet *hset, int s, Vector v, StreamElem *se,
+                         int sIdx, int id)
+{
+   LogFloat bx;
+   MixtureElem *me;
+   short *list;
+   int k,n;
+
+   list=GSelList(&pri->gsel,0,s,sIdx,&n);
+   bx=(n>0)?LZERO:GSelFloor(&pri->gsel);
+   for (k=0; k<n; k++) {
+      me=se->spdf.cpdf+list[k];
+      bx=LAdd(bx,MixLogWeight(hset,me->weight)+cMOutP(v,me->mpdf,id));
+   }
+   if (GSelCheckDue(&pri->gsel))
+      GSelAccError(&pri->gsel,cMixOutP(hset,v,se,id),bx);
+   return bx;
+}
+
 /* Caching version of SOutP used when mixPDFs shared */
 static LogFloat cSOutP(HMMSet *hset, int s, Observation *x, StreamElem *se,
-                       int id)
+                       int sIdx, int id)
 {
-   PreComp *pre;
-   LogFloat bx,px,wt,det;
+   LogFloat bx;
    int m,vSize;
    double sum;
-   MixtureElem *me;
    TMixRec *tr;
    TMProb *tm;
    Vector v,tv;
@@ -468,45 +557,12 @@ static LogFloat cSOutP(HMMSet *hset, int s, Observation *x, StreamElem *se,
    case PLAINHS:
    case SHAREDHS:
       v=x->fv[s];
-      me=se->spdf.cpdf+1;
-      if (se->nMix==1){     /* Single Mixture Case */
-         if (me->mpdf->mIdx>0 && me->mpdf->mIdx<=pri->psi->nmp)
-            pre=pri->psi->mPre+me->mpdf->mIdx;
-         else pre=NULL;
-         if (pre==NULL) {
-            bx= MOutP(ApplyCompFXForm(me->mpdf,v,inXForm,&det,id),me->mpdf);
-            bx += det;
-         } else if (pre->id!=id) {
-            bx= MOutP(ApplyCompFXForm(me->mpdf,v,inXForm,&det,id),me->mpdf);
-            bx += det;
-            pre->id=id;
-            pre->outp=bx;
-         }
-         else
-            bx=pre->outp;
-      } else {
-         bx=LZERO;                   /* Multi Mixture Case */
-         for (m=1; m<=se->nMix; m++,me++) {
-            wt = MixLogWeight(hset, me->weight);
-            if (wt>LMINMIX) {   
-               if (me->mpdf->mIdx>0 && me->mpdf->mIdx<=pri->psi->nmp)
-                  pre=pri->psi->mPre+me->mpdf->mIdx;
-               else pre=NULL;
-               if (pre==NULL) {
-                  px= MOutP(ApplyCompFXForm(me->mpdf,v,inXForm,&det,id),me->mpdf);
-                  px += det;
-               } else if (pre->id!=id) {
-                  px= MOutP(ApplyCompFXForm(me->mpdf,v,inXForm,&det,id),me->mpdf);
-                  px += det;
-                  pre->id=id;
-                  pre->outp=px;
-               }
-               else
-                  px=pre->outp;
-               bx=LAdd(bx,wt+px);
-            }
-         }
-      }
+      if (se->nMix==1)      /* Single Mixture Case */
+         bx=cMOutP(v,se->spdf.cpdf[1].mpdf,id);
+      else if (pri->gsel.gs!=NULL)  /* Gaussian selection */
+         bx=cSelOutP(hset,s,v,se,sIdx,id);
+      else                  /* Multi Mixture Case */
+         bx=cMixOutP(hset,v,se,id);
       return bx;
    case TIEDHS:
       v = x->fv[s];
@@ -556,14 +612,14 @@ static LogFloat cPOutP(PSetInfo *psi,Observation *obs,StateInfo *si,int id)
       else {
          S=obs->swidth[0];
          if (S==1 && si->weights==NULL){
-            outp=cSOutP(psi->hset,1,obs,si->pdf+1,id);
+            outp=cSOutP(psi->hset,1,obs,si->pdf+1,si->sIdx,id);
          }
          else {
             outp=0.0;
             se=si->pdf+1;
             w=si->weights;
             for (s=1;s<=S;s++,se++){
-               outp+=w[s]*cSOutP(psi->hset,s,obs,se,id);
+               outp+=w[s]*cSOutP(psi->hset,s,obs,se,si->sIdx,id);
             }
          }
       }
@@ -1237,6 +1293,7 @@ static void AttachInst(NetNode *node)
       HError(8592,"AttachInst: State heap not created for %d states",n);
 #endif
    inst->node=node;
+   inst->lane=-1;
    inst->state=(TokenSet*) New(pri->stHeap+pri->psi->stHeapIdx[n],0);
    inst->exit=(TokenSet*) New(pri->stHeap+pri->psi->stHeapIdx[1],0);
 
@@ -1370,11 +1427,283 @@ static void SetEntryState(NetNode *node,TokenSet *src)
       pri->wordMaxNode=node;
 }
 
+/* ----------------- Flattened 1-best model propagation ---------------- */
+
+/* In 1-best mode the max-plus step into the emitting states of all
+   active instances that share a transition matrix is done in one
+   sweep.  Before pass 1 the state likelihoods of these instances are
+   gathered into a structure-of-arrays buffer (one row per state, one
+   lane per instance), the best predecessor of every state is found
+   for all lanes at once and StepHMM1Flat then finishes each instance
+   (output probs, pruning, alignment, exit state) in list order.  The
+   comparisons are the same as in StepHMM1 so the results are
+   identical.  Matrices with fewer than flatMin active instances are
+   left to StepHMM1.
+
+   HREC: FLATVITERBI enables this, HREC: VITKERNEL selects the kernel
+   (AUTO, AVX2 or GENERIC).
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VIT_X86
+#include <immintrin.h>
+#endif
+
+#define VIT_VEC 4               /* lane padding */
+
+typedef void (*MaxPlusKernel)(FlatGroup *g, Matrix trP, short **seIndex);
+
+static MaxPlusKernel maxPlusKernel = NULL;
+
+/* MaxPlusGeneric: best predecessor of states 2..N-1 for all lanes */
+static void MaxPlusGeneric(FlatGroup *g, Matrix trP, short **seIndex)
+{
+   int i,j,k,lo,hi,*arg;
+   LogDouble t,c,*like,*best;
+
+   for (j=2;j<g->N;j++) {
+      lo=seIndex[j][0]; hi=seIndex[j][1];
+      best=g->best+(j-2)*g->size; arg=g->arg+(j-2)*g->size;
+      like=g->like+(lo-1)*g->size; t=trP[lo][j];
+      for (k=0;k<g->n;k++) {
+         best[k]=like[k]+t; arg[k]=lo;
+      }
+      for (i=lo+1;i<=hi;i++) {
+         like=g->like+(i-1)*g->size; t=trP[i][j];
+         for (k=0;k<g->n;k++) {
+            c=like[k]+t;
+            if (c>best[k]) {
+               best[k]=c; arg[k]=i;
+            }
+         }
+      }
+   }
+}
+
+#ifdef VIT_X86
+/* MaxPlusAVX2: as MaxPlusGeneric, four lanes at a time */
+__attribute__((target("avx2")))
+static void MaxPlusAVX2(FlatGroup *g, Matrix trP, short **seIndex)
+{
+   int i,j,k,lo,hi;
+   __m256d b,c,m,t;
+   __m256i lo32;
+   __m128i a,m32;
+
+   /* moves the low half of each 64 bit compare mask into 32 bit lanes */
+   lo32=_mm256_setr_epi32(0,2,4,6,0,2,4,6);
+   for (j=2;j<g->N;j++) {
+      lo=seIndex[j][0]; hi=seIndex[j][1];
+      for (k=0;k<g->n;k+=VIT_VEC) {
+         t=_mm256_set1_pd(trP[lo][j]);
+         b=_mm256_add_pd(_mm256_loadu_pd(g->like+(lo-1)*g->size+k),t);
+         a=_mm_set1_epi32(lo);
+         for (i=lo+1;i<=hi;i++) {
+            t=_mm256_set1_pd(trP[i][j]);
+            c=_mm256_add_pd(_mm256_loadu_pd(g->like+(i-1)*g->size+k),t);
+            m=_mm256_cmp_pd(c,b,_CMP_GT_OQ);
+            b=_mm256_blendv_pd(b,c,m);
+            m32=_mm256_castsi256_si128(
+               _mm256_permutevar8x32_epi32(_mm256_castpd_si256(m),lo32));
+            a=_mm_blendv_epi8(a,_mm_set1_epi32(i),m32);
+         }
+         _mm256_storeu_pd(g->best+(j-2)*g->size+k,b);
+         _mm_storeu_si128((__m128i *)(g->arg+(j-2)*g->size+k),a);
+      }
+   }
+}
+#endif
+
+/* SelectMaxPlusKernel: choose the kernel for this CPU and VITKERNEL */
+static void SelectMaxPlusKernel(void)
+{
+   maxPlusKernel = MaxPlusGeneric;
+#ifdef VIT_X86
+   if ((strcmp(vitKernel,"AUTO")==0 || strcmp(vitKernel,"AVX2")==0) &&
+       __builtin_cpu_supports("avx2")) {
+      maxPlusKernel = MaxPlusAVX2;
+      return;
+   }
+#endif
+   if (strcmp(vitKernel,"AUTO")!=0 && strcmp(vitKernel,"GENERIC")!=0)
+      HError(-8520,"SelectMaxPlusKernel: VITKERNEL %s not available, using GENERIC",
+             vitKernel);
+}
+
+/* GrowFlatGroup: make room for at least n lanes in g */
+static void GrowFlatGroup(FlatGroup *g, int n)
+{
+   int size,rows;
+
+   size=g->size;
+   while (size<n) size=(size==0)?64:2*size;
+   if (size==g->size) return;
+   if (g->size>0) {
+      Dispose(&gcheap,g->inst); Dispose(&gcheap,g->like);
+      Dispose(&gcheap,g->best); Dispose(&gcheap,g->arg);
+   }
+   rows=g->N-1;
+   g->size=size;
+   g->inst=(NetInst**) New(&gcheap,size*sizeof(NetInst*));
+   g->like=(LogDouble*) New(&gcheap,rows*size*sizeof(LogDouble));
+   g->best=(LogDouble*) New(&gcheap,rows*size*sizeof(LogDouble));
+   g->arg=(int*) New(&gcheap,rows*size*sizeof(int));
+}
+
+/* FlatMaxPlus: gather active HMM instances by transition matrix and 
+   compute the best predecessors of their emitting states */
+static void FlatMaxPlus(void)
+{
+   NetInst *inst;
+   HMMDef *hmm;
+   FlatGroup *g;
+   int i,k,n,u;
+
+   pri->nFlatUsed=0;
+   for (inst=pri->head.link;inst!=NULL;inst=inst->link) {
+      if (inst->node==NULL || !node_hmm(inst->node)) continue;
+      hmm=inst->node->info.hmm;
+      g=pri->flat+hmm->tIdx;
+      if (g->n==0) {
+         g->hmm=hmm; g->N=hmm->numStates;
+         pri->flatUsed[pri->nFlatUsed++]=hmm->tIdx;
+      }
+      inst->lane=g->n++;
+   }
+   for (u=0;u<pri->nFlatUsed;u++) {
+      g=pri->flat+pri->flatUsed[u];
+      if (g->n>g->size) GrowFlatGroup(g,g->n+VIT_VEC);
+      g->n=0;
+   }
+   /* lanes were counted above, now fill them in list order */
+   for (inst=pri->head.link;inst!=NULL;inst=inst->link) {
+      if (inst->node==NULL || !node_hmm(inst->node)) continue;
+      g=pri->flat+inst->node->info.hmm->tIdx;
+      k=g->n++;
+      g->inst[k]=inst;
+      for (i=1;i<g->N;i++)
+         g->like[(i-1)*g->size+k]=inst->state[i-1].tok.like;
+   }
+   for (u=0;u<pri->nFlatUsed;u++) {
+      g=pri->flat+pri->flatUsed[u];
+      if (g->n<flatMin) {
+         for (k=0;k<g->n;k++) g->inst[k]->lane=-1;
+      }
+      else {
+         /* pad to a whole number of vectors */
+         n=(g->n+VIT_VEC-1)/VIT_VEC*VIT_VEC;
+         for (i=1;i<g->N;i++)
+            for (k=g->n;k<n;k++) g->like[(i-1)*g->size+k]=LZERO;
+         maxPlusKernel(g,g->hmm->transP,pri->psi->seIndexes[g->hmm->tIdx]);
+      }
+      g->n=0;
+   }
+}
+
+/* StepHMM1Flat: StepHMM1 for 1-best using the result of FlatMaxPlus */
+static void StepHMM1Flat(NetNode *node)
+{
+   NetInst *inst;
+   HMMDef *hmm;
+   FlatGroup *g;
+   Token tok,max;
+   TokenSet *res,*cur;
+   Align *align;
+   int i,j,k,N,endi,off;
+   LogFloat outp;
+   LogDouble like;
+   Matrix trP;
+   short **seIndex;
+   
+   inst=node->inst;
+   max=null_token;
+   
+   hmm=node->info.hmm; 
+   N=hmm->numStates;
+   trP=hmm->transP;
+   seIndex=pri->psi->seIndexes[hmm->tIdx];
+   g=pri->flat+hmm->tIdx;
+   k=inst->lane;
+   
+   for (j=2,res=pri->psi->sBuf+2;j<N;j++,res++) {  /* Emitting states first */
+      off=(j-2)*g->size+k;
+      res->tok=inst->state[g->arg[off]-1].tok;
+      res->tok.like=g->best[off];
+      res->n=0;
+      if (res->tok.like>pri->genThresh) { /* State pruning */
+         outp=cPOutP(pri->psi,pri->obs,hmm->svec[j].info,pri->id);
+         res->tok.like+=outp;
+   
+         if (res->tok.like>max.like)
+            max=res->tok;
+         if (pri->states) {
+            if (res->tok.align==NULL?TRUE:
+                res->tok.align->state!=j || res->tok.align->node!=node) {
+               align=NewNRefAlign(node,j,
+                                  res->tok.like-outp-res->tok.lm*pri->scale,
+                                  pri->frame-1,res->tok.align);
+               res->tok.align=align;
+            }
+         }
+      } 
+      else
+         res->tok=null_token;
+   }
+   
+   /* Null entry state ready for external propagation */
+   /*  And copy tokens from buffer to instance */
+   for (i=1,res=pri->psi->sBuf+1,cur=inst->state;
+        i<N;i++,res++,cur++) {
+      cur->n=res->n; cur->tok=res->tok; 
+   }
+
+   /* Set up pruning limits */
+   if (max.like>pri->genMaxTok.like) {
+      pri->genMaxTok=max;
+      pri->genMaxNode=node;
+   }
+   inst->max=max.like;
+
+   i=seIndex[N][0]; /* Exit state (ignoring tee trP) */
+   endi=seIndex[N][1];
+   
+   res=inst->exit;
+   cur=inst->state+i-1;
+   res->n=0; 
+   res->tok=cur->tok; 
+   res->tok.like+=trP[i][N];
+   for (i++,cur++;i<=endi;i++,cur++) {
+      like=cur->tok.like+trP[i][N];
+      if (like > res->tok.like) {
+         res->tok=cur->tok;
+         res->tok.like=like;
+      }
+   }
+   if (res->tok.like>LSMALL){
+      tok.like=res->tok.like+inst->wdlk;
+      if (tok.like > pri->wordMaxTok.like) {
+         pri->wordMaxTok=tok;
+         pri->wordMaxNode=node;
+      }
+      if (!node_tr0(node) && pri->models) {
+         align=NewNRefAlign(node,-1,
+                            res->tok.like-res->tok.lm*pri->scale,
+                            pri->frame,res->tok.align);
+         res->tok.align=align;
+      }
+   } else
+      inst->exit->tok=null_token;
+}
+
 static void StepInst1(NetNode *node) /* First pass of token propagation (Internal) */
 {
-   if (node_hmm(node))
-      StepHMM1(node);   /* Advance tokens within HMM instance t => t-1 */
-                        /* Entry tokens valid for t-1, do states 2..N */
+   if (node_hmm(node)) {
+      if (node->inst->lane>=0)
+         StepHMM1Flat(node); /* Max-plus already done by FlatMaxPlus */
+      else
+         StepHMM1(node);   /* Advance tokens within HMM instance t => t-1 */
+                           /* Entry tokens valid for t-1, do states 2..N */
+   }
    else
       StepWord1(node);
    node->inst->pxd=FALSE;
@@ -1523,6 +1852,8 @@ PSetInfo *InitPSetInfo(HMMSet *hset)
          psi->stHeapIdx[n]=i++;
    psi->stHeapNum=i;
 
+   psi->gs=CreateGSIndex(&psi->heap,hset);
+
    return(psi);
 }
 
@@ -1835,6 +2166,7 @@ VRecInfo *InitVRecInfo(PSetInfo *psi,int nToks,Boolean models,Boolean states)
 
    /* Model set dependent */
    pri->psi=psi;
+   ResetGSel(&pri->gsel,psi->gs);
    /* pri->psi->sBuf[1].n=((pri->nToks>1)?1:0);  Needed every observation */
    for(i=1,pre=psi->sPre+1;i<=psi->nsp;i++,pre++) pre->id=-1;
    for(i=1,pre=psi->mPre+1;i<=psi->nmp;i++,pre++) pre->id=-1;
@@ -1862,6 +2194,16 @@ VRecInfo *InitVRecInfo(PSetInfo *psi,int nToks,Boolean models,Boolean states)
    CreateHeap(&pri->alignHeap,"Align Heap",
               MHEAP,sizeof(Align),1.0,200,3200);
 
+   /* Flattened propagation buffers, allocated when first used */
+   pri->flat=(FlatGroup*) New(&vri->heap,psi->ntr*sizeof(FlatGroup));
+   pri->flat--;
+   for (i=1;i<=psi->ntr;i++) {
+      pri->flat[i].n=pri->flat[i].size=0;
+      pri->flat[i].hmm=NULL; pri->flat[i].N=0;
+   }
+   pri->flatUsed=(int*) New(&vri->heap,psi->ntr*sizeof(int));
+   pri->nFlatUsed=0;
+
 
    /* Now set up instances */
 
@@ -1904,6 +2246,11 @@ void DeleteVRecInfo(VRecInfo *vri)
    DeleteHeap(&pri->rPthHeap);
    DeleteHeap(&pri->pathHeap);
    DeleteHeap(&pri->alignHeap);
+   for (i=1;i<=pri->psi->ntr;i++)
+      if (pri->flat[i].size>0) {
+         Dispose(&gcheap,pri->flat[i].inst); Dispose(&gcheap,pri->flat[i].like);
+         Dispose(&gcheap,pri->flat[i].best); Dispose(&gcheap,pri->flat[i].arg);
+      }
    DeleteHeap(&vri->heap);
    Dispose(&gcheap,vri);
 }
@@ -1987,6 +2334,7 @@ void ProcessObservation(VRecInfo *vri,Observation *obs,int id, AdaptXForm *xform
          if (VectorSize(obs->fv[j])!=pri->psi->hset->swidth[j])
             HError(8571,"ProcessObservatio: incompatible stream widths for %d (%d vs %d)",
                    j,VectorSize(obs->fv[j]),pri->psi->hset->swidth[j]);
+   GSelFrames(&pri->gsel,&obs,1,pri->frame);
 
 
    /* Max model pruning is done initially in a separate pass */
@@ -2016,6 +2364,8 @@ void ProcessObservation(VRecInfo *vri,Observation *obs,int id, AdaptXForm *xform
    /* Pass 1 must calculate top of all beams - inc word end !! */
    pri->genMaxTok=pri->wordMaxTok=null_token;
    pri->genMaxNode=pri->wordMaxNode=NULL;
+   if (flatViterbi && pri->nToks<=1)
+      FlatMaxPlus();
    for (inst=pri->head.link,j=0;inst!=NULL;inst=inst->link,j++)
       if (inst->node)
          StepInst1(inst->node);
@@ -2094,6 +2444,7 @@ Lattice *CompleteRecognition(VRecInfo *vri,HTime frameDur,MemHeap *heap)
       HError(8570,"CompleteRecognition: Recognition not started");
    if (pri->frame==0)
       HError(-8570,"CompleteRecognition: No observations processed");
+   ReportGSel(stdout,&pri->gsel);
 
    vri->frameDur=frameDur;
    
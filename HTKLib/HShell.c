@@ -49,6 +49,7 @@ char *hshell_vc_id = "$Id: HShell.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $";
 #ifdef UNIX
 #include <sys/ioctl.h>
 #endif
+#include <pthread.h>
 
 /* ------------------------ Trace Flags --------------------- */
 
@@ -72,16 +73,18 @@ Boolean vaxOrder = FALSE;
 
 #define MAXEFS 5                        /* max num ext files to remember */
 
-typedef struct {                        /* extended file name */
-   char logfile[1024];                  /* logical name */
-   char actfile[1024];                  /* actual file name */
-   long stindex;                        /* start sample to extract */
-   long enindex;                        /* end sample to extract */
-}ExtFile;
-
 static ExtFile extFiles[MAXEFS];        /* circ buf of ext file names */
 static int extFileNext = 0;             /* next slot to save into */
 static int extFileUsed = 0;             /* total ext files in buffer */
+static pthread_mutex_t extFileLock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {                        /* ext files pinned by a thread */
+   ExtFile *e;
+   int n;
+}ExtFilePin;
+
+static pthread_key_t pinKey;            /* per-thread ExtFilePin */
+static pthread_once_t pinKeyOnce = PTHREAD_ONCE_INIT;
 
 /* ------------- Extended File Name Handling ---------------- */
 
@@ -90,7 +93,7 @@ char * RegisterExtFileName(char *s)
 {
    char *eq,*rb,*lb,*co;
    char buf[MAXSTRLEN];
-   ExtFile *p;
+   ExtFile *p,e;
 
    if (!extendedFileNames)
       return s;
@@ -104,42 +107,52 @@ char * RegisterExtFileName(char *s)
    if (trace&T_EXF)
       printf("Ext File Name: %s\n",buf);
 
-   p = extFiles+extFileNext;
-   ++extFileNext; 
-   if (extFileNext==MAXEFS) 
-      extFileNext=0;
-   if (extFileUsed < MAXEFS) 
-      ++extFileUsed;
-   p->stindex = p->enindex = -1;
+   e.stindex = e.enindex = -1;
 
    if (lb!=NULL) {
       if ((co = strchr(buf,',')) == NULL)
          HError(5024,"RegisterExtFileName: comma missing in index spec");
       if ((rb = strchr(buf,']')) == NULL)
          HError(5024,"RegisterExtFileName: ] missing in index spec");
-      *rb = '\0'; p->enindex = atol(co+1);
-      *co = '\0'; p->stindex = atol(lb+1);
+      *rb = '\0'; e.enindex = atol(co+1);
+      *co = '\0'; e.stindex = atol(lb+1);
       *lb = '\0';
    }
 
    if (eq!=NULL) {
-      strcpy(p->actfile,eq+1); *eq = '\0';
-      strcpy(p->logfile,buf);
+      strcpy(e.actfile,eq+1); *eq = '\0';
+      strcpy(e.logfile,buf);
    } else {
-      strcpy(p->logfile,buf);
-      strcpy(p->actfile,buf);
+      strcpy(e.logfile,buf);
+      strcpy(e.actfile,buf);
    }
 
    if (trace&T_EXF) {
-      printf("%s=%s", p->logfile, p->actfile);
-      if(p->stindex >=0) 
-         printf("[%ld,%ld]", p->stindex, p->enindex);
+      printf("%s=%s", e.logfile, e.actfile);
+      if(e.stindex >=0) 
+         printf("[%ld,%ld]", e.stindex, e.enindex);
       printf("\n");
    }
 
+   pthread_mutex_lock(&extFileLock);
+   p = extFiles+extFileNext;
+   ++extFileNext; 
+   if (extFileNext==MAXEFS) 
+      extFileNext=0;
+   if (extFileUsed < MAXEFS) 
+      ++extFileUsed;
+   *p = e;
+   pthread_mutex_unlock(&extFileLock);
+
    return p->logfile;
 }
 
+/* MakePinKey: create the key holding each thread's pinned ext files */
+static void MakePinKey(void)
+{
+   pthread_key_create(&pinKey,free);
+}
+
 /* GetFileNameExt: return true if given file has extensions and return
    the extend info.  The problem with this routine is that the logical
    name can be repeated in the buffer.  This is normally handled by 
@@ -153,17 +166,35 @@ Boolean GetFileNameExt(char *logfn, char *actfn, long *st, long *en)
 {
    int i, noccs;
    ExtFile *p;
+   ExtFilePin *pin;
    Boolean found = FALSE;
    Boolean ambiguous = FALSE;
 
+   /* Names pinned by this thread take precedence over the ring */
+   pthread_once(&pinKeyOnce,MakePinKey);
+   pin = (ExtFilePin *) pthread_getspecific(pinKey);
+   if (pin != NULL)
+      for (i=0,p=pin->e; i<pin->n; i++,p++)
+         if (strcmp(logfn,p->logfile) == 0) {
+            strcpy(actfn,p->actfile);
+            *st = p->stindex; *en = p->enindex;
+            if (trace&T_EXF)
+               printf("Pinned File Ext found: %s=%s[%ld,%ld]\n",
+                      logfn, actfn, *st, *en);
+            return TRUE;
+         }
+
+   pthread_mutex_lock(&extFileLock);
    /* First count number of times logfn occurs in buffer */
    noccs = 0;
    for (i=0,p=extFiles; i<extFileUsed; i++,p++){
       if (strcmp(logfn,p->logfile) == 0 ) 
          ++noccs;
    }
-   if (noccs==0) 
+   if (noccs==0) {
+      pthread_mutex_unlock(&extFileLock);
       return FALSE;
+   }
 
    /* Try to find the logfn, by pointer first */
    for (i=0,p=extFiles; i<extFileUsed && !found; i++){
@@ -187,12 +218,15 @@ Boolean GetFileNameExt(char *logfn, char *actfn, long *st, long *en)
       }
    }
 
-   if (!found) 
+   if (!found) {
+      pthread_mutex_unlock(&extFileLock);
       return FALSE;
+   }
 
    /* Copy back info and warn if ambiguous */
    strcpy(actfn,p->actfile);
    *st = p->stindex; *en = p->enindex;
+   pthread_mutex_unlock(&extFileLock);
    if (trace&T_EXF)
       printf("%sFile Ext found: %s=%s[%ld,%ld]\n",
              (ambiguous) ? "Ambiguous " : "",
@@ -204,6 +238,33 @@ Boolean GetFileNameExt(char *logfn, char *actfn, long *st, long *en)
    return TRUE;
 }
 
+/* EXPORT->CopyExtFileName: copy the registered extensions of logfn to e */
+Boolean CopyExtFileName(char *logfn, ExtFile *e)
+{
+   if (strlen(logfn) >= sizeof(e->logfile))
+      HError(5024,"CopyExtFileName: file name %s too long",logfn);
+   if (!GetFileNameExt(logfn,e->actfile,&e->stindex,&e->enindex))
+      return FALSE;
+   strcpy(e->logfile,logfn);
+   return TRUE;
+}
+
+/* EXPORT->PinExtFiles: resolve the names in e[0..n-1] from e in this thread */
+void PinExtFiles(ExtFile *e, int n)
+{
+   ExtFilePin *pin;
+
+   pthread_once(&pinKeyOnce,MakePinKey);
+   pin = (ExtFilePin *) pthread_getspecific(pinKey);
+   if (pin == NULL) {
+      if (e == NULL) return;
+      if ((pin = (ExtFilePin *) malloc(sizeof(ExtFilePin))) == NULL)
+         HError(5099,"PinExtFiles: cannot allocate pin");
+      pthread_setspecific(pinKey,pin);
+   }
+   pin->e = e; pin->n = (e == NULL) ? 0 : n;
+}
+
 
 /* --------------------- Version Display -------------------- */
 
@@ -1755,29 +1816,65 @@ void Exit(int exitcode)
   return status is also printed in error message in this case.
 */
 
+static pthread_key_t msgKey;         /* per-thread MsgCapture */
+static pthread_once_t msgKeyOnce = PTHREAD_ONCE_INIT;
+
+/* MakeMsgKey: create the key holding each thread's MsgCapture */
+static void MakeMsgKey(void)
+{
+   pthread_key_create(&msgKey,NULL);
+}
+
+/* EXPORT->CaptureMessages: route calling thread's messages to mc */
+void CaptureMessages(MsgCapture *mc)
+{
+   pthread_once(&msgKeyOnce,MakeMsgKey);
+   pthread_setspecific(msgKey,mc);
+}
+
+/* CapturedMessages: return the calling thread's MsgCapture, if any */
+static MsgCapture *CapturedMessages(void)
+{
+   pthread_once(&msgKeyOnce,MakeMsgKey);
+   return (MsgCapture *) pthread_getspecific(msgKey);
+}
+
+/* EXPORT->MsgOut: stream for the calling thread's ordinary output */
+FILE *MsgOut(void)
+{
+   MsgCapture *mc = CapturedMessages();
+
+   return (mc != NULL) ? mc->out : stdout;
+}
+
 /* EXPORT->HError: print error message on stderr and abort if status<>0 */
 void HError(int errcode, char *message, ...)
 {
    va_list ap;             /* Pointer to unnamed args */
-   FILE *f;
+   FILE *f,*out,*err;
+   MsgCapture *mc;
 
-   fflush(stdout);        /* Flush any pending output */
+   mc = CapturedMessages();
+   out = (mc!=NULL) ? mc->out : stdout;
+   err = (mc!=NULL) ? mc->err : stderr;
+   fflush(out);           /* Flush any pending output */
    va_start(ap,message);
    if (errcode<=0) {
-      fprintf(stdout," WARNING [%+d]  ",errcode);
-      f = stdout;
+      fprintf(out," WARNING [%+d]  ",errcode);
+      f = out;
       vfprintf(f, message, ap);
       va_end(ap);
       fprintf(f," in %s\n", arglist[0]);
    }else{
-      fprintf(stderr,"  ERROR [%+d]  ",errcode);
-      f = stderr;
+      fprintf(err,"  ERROR [%+d]  ",errcode);
+      f = err;
       vfprintf(f, message, ap);
       va_end(ap);
       fprintf(f,"\n FATAL ERROR - Terminating program %s\n", arglist[0]);
    }
    fflush(f);
    if (errcode>0) {
+      if (mc!=NULL && mc->fatal!=NULL) mc->fatal(errcode);
       if (abortOnError) abort();
       else Exit(errcode);
    }
@@ -1787,19 +1884,23 @@ void HError(int errcode, char *message, ...)
 void HRError(int errcode, char *message, ...)
 {
    va_list ap;             /* Pointer to unnamed args */
-   FILE *f;
+   FILE *f,*out,*err;
+   MsgCapture *mc;
 
-   fflush(stdout);        /* Flush any pending output */
+   mc = CapturedMessages();
+   out = (mc!=NULL) ? mc->out : stdout;
+   err = (mc!=NULL) ? mc->err : stderr;
+   fflush(out);           /* Flush any pending output */
    va_start(ap,message);
    if (errcode<=0) {
-      fprintf(stdout," WARNING [%+d]  ",errcode);
-      f = stdout;
+      fprintf(out," WARNING [%+d]  ",errcode);
+      f = out;
       vfprintf(f, message, ap);
       va_end(ap);
       fprintf(f," in %s\n", arglist[0]);
    }else{
-      fprintf(stderr,"  ERROR [%+d]  ",errcode);
-      f = stderr;
+      fprintf(err,"  ERROR [%+d]  ",errcode);
+      f = err;
       vfprintf(f, message, ap);
       va_end(ap);
       fprintf(f,"\n");
@@ -1807,6 +1908,247 @@ void HRError(int errcode, char *message, ...)
    fflush(f);
 }
 
+/* ------------------------ Ordered Job Pool ------------------------ */
+
+#define MAXJOBOUT 2                  /* output segments per job */
+
+typedef struct {                     /* a job in the ring */
+   Boolean done;                     /* finished (or failed) */
+   int errcode;                      /* fatal error code, 0 if none */
+   char *outBuf[MAXJOBOUT];          /* captured ordinary output */
+   size_t outLen[MAXJOBOUT];
+   int nOut;                         /* segments started */
+   char *errBuf;                     /* captured errors */
+   size_t errLen;
+} PoolJob;
+
+typedef struct {                     /* a pool thread */
+   JobPool *pool;
+   int idx;                          /* worker number */
+   int job;                          /* ring index of job in progress */
+   pthread_t thread;
+   MsgCapture mc;
+} PoolWorker;
+
+struct _JobPool {
+   int nThreads;
+   int nJobs;                        /* size of the job ring */
+   PoolJob *job;
+   PoolWorker *worker;
+   JobRunFn run;
+   JobEmitFn emit;
+   int queued;                       /* total jobs queued */
+   int taken;                        /* total jobs started */
+   int emitted;                      /* total jobs reported */
+   int written;                      /* segments of oldest job reported */
+   Boolean stop;                     /* no more jobs will be queued */
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+};
+
+static pthread_key_t workerKey;      /* per-thread PoolWorker */
+static pthread_once_t workerKeyOnce = PTHREAD_ONCE_INIT;
+
+/* MakeWorkerKey: create the key holding each pool thread's PoolWorker */
+static void MakeWorkerKey(void)
+{
+   pthread_key_create(&workerKey,NULL);
+}
+
+/* ThisWorker: return the PoolWorker of the calling thread */
+static PoolWorker *ThisWorker(void)
+{
+   PoolWorker *w;
+
+   pthread_once(&workerKeyOnce,MakeWorkerKey);
+   if ((w = (PoolWorker *) pthread_getspecific(workerKey)) == NULL)
+      HError(5099,"ThisWorker: not a job pool thread");
+   return w;
+}
+
+/* OpenJobOutput: capture w's ordinary output in the next segment */
+static void OpenJobOutput(PoolWorker *w)
+{
+   PoolJob *j = w->pool->job + w->job;
+
+   if (j->nOut == MAXJOBOUT)
+      HError(5099,"OpenJobOutput: more than %d output segments",MAXJOBOUT);
+   if (w->mc.out != NULL)
+      fclose(w->mc.out);
+   w->mc.out = open_memstream(&j->outBuf[j->nOut],&j->outLen[j->nOut]);
+   if (w->mc.out == NULL)
+      HError(5099,"OpenJobOutput: cannot capture messages");
+   ++j->nOut;
+}
+
+/* FinishJob: close the message streams of w's job and mark it done */
+static void FinishJob(PoolWorker *w, int errcode)
+{
+   JobPool *p = w->pool;
+
+   CaptureMessages(NULL);
+   PinExtFiles(NULL,0);
+   if (w->mc.out != NULL) fclose(w->mc.out);
+   if (w->mc.err != NULL) fclose(w->mc.err);
+   w->mc.out = w->mc.err = NULL;
+   pthread_mutex_lock(&p->lock);
+   p->job[w->job].errcode = errcode;
+   p->job[w->job].done = TRUE;
+   pthread_cond_broadcast(&p->cond);
+   pthread_mutex_unlock(&p->lock);
+}
+
+/* JobFatal: fatal error in a pool thread.  The error is reported by
+   the main thread in queue order, this thread just stops */
+static void JobFatal(int errcode)
+{
+   FinishJob(ThisWorker(),errcode);
+   pthread_exit(NULL);
+}
+
+/* JobPoolThread: run queued jobs in turn, capturing all messages so
+   that the main thread can report them in queue order */
+static void *JobPoolThread(void *arg)
+{
+   PoolWorker *w = (PoolWorker *) arg;
+   JobPool *p = w->pool;
+
+   pthread_once(&workerKeyOnce,MakeWorkerKey);
+   pthread_setspecific(workerKey,w);
+   for (;;) {
+      pthread_mutex_lock(&p->lock);
+      while (p->taken == p->queued && !p->stop)
+         pthread_cond_wait(&p->cond,&p->lock);
+      if (p->taken == p->queued) {
+         pthread_mutex_unlock(&p->lock);
+         break;
+      }
+      w->job = p->taken % p->nJobs; ++p->taken;
+      pthread_mutex_unlock(&p->lock);
+      w->mc.err = open_memstream(&p->job[w->job].errBuf,&p->job[w->job].errLen);
+      if (w->mc.err == NULL)
+         HError(5099,"JobPoolThread: cannot capture messages");
+      OpenJobOutput(w);
+      CaptureMessages(&w->mc);
+      p->run(w->idx,w->job);
+      FinishJob(w,0);
+   }
+   return NULL;
+}
+
+/* EXPORT->CreateJobPool: start nThreads threads taking jobs from a ring */
+JobPool *CreateJobPool(int nThreads, int nJobs, JobRunFn run, JobEmitFn emit)
+{
+   JobPool *p;
+   PoolWorker *w;
+   int i;
+
+   p = (JobPool *) malloc(sizeof(JobPool));
+   if (p != NULL) {
+      p->job = (PoolJob *) malloc(nJobs*sizeof(PoolJob));
+      p->worker = (PoolWorker *) malloc(nThreads*sizeof(PoolWorker));
+   }
+   if (p == NULL || p->job == NULL || p->worker == NULL)
+      HError(5099,"CreateJobPool: cannot allocate pool");
+   p->nThreads = nThreads; p->nJobs = nJobs;
+   p->run = run; p->emit = emit;
+   p->queued = p->taken = p->emitted = 0;
+   p->stop = FALSE;
+   pthread_mutex_init(&p->lock,NULL);
+   pthread_cond_init(&p->cond,NULL);
+   for (i=0,w=p->worker; i<nThreads; i++,w++) {
+      w->pool = p; w->idx = i; w->job = -1;
+      w->mc.out = w->mc.err = NULL;
+      w->mc.fatal = JobFatal;
+   }
+   for (i=0; i<nThreads; i++)
+      if (pthread_create(&p->worker[i].thread,NULL,JobPoolThread,p->worker+i) != 0)
+         HError(5099,"CreateJobPool: cannot create thread %d",i);
+   return p;
+}
+
+/* EXPORT->NextJobOutput: capture the job's further output separately */
+void NextJobOutput(void)
+{
+   OpenJobOutput(ThisWorker());
+}
+
+/* EXPORT->EmitJobOutput: report output segments up to k of the job */
+void EmitJobOutput(JobPool *p, int k)
+{
+   PoolJob *j = p->job + p->emitted % p->nJobs;
+
+   for (; p->written <= k && p->written < j->nOut; ++p->written)
+      fwrite(j->outBuf[p->written],1,j->outLen[p->written],stdout);
+   fflush(stdout);
+}
+
+/* EmitJob: wait for the oldest queued job and report it; a fatal
+   error in it terminates the program at this point */
+static void EmitJob(JobPool *p)
+{
+   int i,n = p->emitted % p->nJobs;
+   PoolJob *j = p->job + n;
+
+   pthread_mutex_lock(&p->lock);
+   while (!j->done)
+      pthread_cond_wait(&p->cond,&p->lock);
+   pthread_mutex_unlock(&p->lock);
+   p->written = 0;
+   if (p->emit != NULL)
+      p->emit(n,j->errcode);
+   EmitJobOutput(p,MAXJOBOUT-1);
+   fwrite(j->errBuf,1,j->errLen,stderr); fflush(stderr);
+   for (i=0; i<j->nOut; i++) free(j->outBuf[i]);
+   free(j->errBuf);
+   if (j->errcode > 0) Exit(j->errcode);
+   ++p->emitted;
+}
+
+/* EXPORT->NextJob: return the ring index for the next job */
+int NextJob(JobPool *p)
+{
+   if (p->queued - p->emitted == p->nJobs) EmitJob(p);
+   return p->queued % p->nJobs;
+}
+
+/* EXPORT->QueueJob: start the job set up at NextJob's index */
+void QueueJob(JobPool *p)
+{
+   PoolJob *j = p->job + p->queued % p->nJobs;
+
+   j->done = FALSE; j->errcode = 0;
+   j->nOut = 0; j->errBuf = NULL; j->errLen = 0;
+   pthread_mutex_lock(&p->lock);
+   ++p->queued;
+   pthread_cond_signal(&p->cond);
+   pthread_mutex_unlock(&p->lock);
+}
+
+/* EXPORT->DrainJobs: wait for and report all queued jobs */
+void DrainJobs(JobPool *p)
+{
+   while (p->emitted < p->queued) EmitJob(p);
+}
+
+/* EXPORT->StopJobPool: finish all jobs, stop the threads and free p */
+void StopJobPool(JobPool *p)
+{
+   int i;
+
+   DrainJobs(p);
+   pthread_mutex_lock(&p->lock);
+   p->stop = TRUE;
+   pthread_cond_broadcast(&p->cond);
+   pthread_mutex_unlock(&p->lock);
+   for (i=0; i<p->nThreads; i++)
+      if (pthread_join(p->worker[i].thread,NULL) != 0)
+         HError(5099,"StopJobPool: cannot join thread %d",i);
+   pthread_mutex_destroy(&p->lock);
+   pthread_cond_destroy(&p->cond);
+   free(p->worker); free(p->job); free(p);
+}
+
 /* ------------------- Output Routines ----------------------- */
 
 /* EXPORT->WriteShort: write n shorts to f */
@@ -196,6 +196,88 @@ void HRError(int errcode, char *message, ...);
 New function - print error message on stderr and don't abort.
 */
 
+typedef struct {
+   FILE *out;                 /* receives warnings (normally stdout) */
+   FILE *err;                 /* receives errors (normally stderr) */
+   void (*fatal)(int errcode);/* called instead of Exit, must not return */
+} MsgCapture;
+
+void CaptureMessages(MsgCapture *mc);
+/*
+   Route the HError/HRError messages of the calling thread to the
+   streams in mc so that a tool running several threads can report
+   them in a deterministic order.  If mc->fatal is not NULL it is
+   called once a fatal error has been reported.  A NULL mc restores
+   normal reporting for the thread.
+*/
+
+FILE *MsgOut(void);
+/*
+   Return the stream for ordinary output of the calling thread: mc->out
+   while CaptureMessages(mc) is in effect, otherwise stdout.
+*/
+
+/* ------------------------ Ordered Job Pool ------------------------ */
+
+typedef struct _JobPool JobPool;
+
+typedef void (*JobRunFn)(int worker, int job);
+/*
+   Run job (an index into the tool's ring of job records) on pool
+   thread worker (0..nThreads-1) with its messages captured.
+*/
+
+typedef void (*JobEmitFn)(int job, int errcode);
+/*
+   Report job on the main thread in queue order.  errcode is the code
+   of a fatal error in the job or 0.
+*/
+
+JobPool *CreateJobPool(int nThreads, int nJobs, JobRunFn run, JobEmitFn emit);
+/*
+   Start nThreads threads running the jobs queued in a ring of nJobs
+   records kept by the tool.  Each job runs with its messages captured
+   (see CaptureMessages) and the main thread reports the jobs in queue
+   order: emit, if not NULL, is called once the job is done, then its
+   remaining output is written to stdout and its errors to stderr.  A
+   fatal error in a job terminates the program when that job is
+   reported, with the same code and message as a serial run.
+*/
+
+int NextJob(JobPool *p);
+/*
+   Return the ring index of the record for the next job, first
+   reporting the oldest job if the ring is full.
+*/
+
+void QueueJob(JobPool *p);
+/*
+   Queue the job whose record was set up at the index returned by
+   NextJob.
+*/
+
+void NextJobOutput(void);
+/*
+   Called by a running job: capture its further ordinary output in a
+   new segment (at most 2) so that emit can report something between.
+*/
+
+void EmitJobOutput(JobPool *p, int k);
+/*
+   Called by emit: write the output segments up to k of the job being
+   reported to stdout.
+*/
+
+void DrainJobs(JobPool *p);
+/*
+   Wait for and report all queued jobs.
+*/
+
+void StopJobPool(JobPool *p);
+/*
+   Report all queued jobs, stop the threads and free the pool.
+*/
+
 
 /* ------------------------ Initialisation --------------------------- */
 
@@ -345,6 +427,28 @@ Boolean GetFileNameExt(char *logfn, char *actfn, long *st, long *en);
    or        logfile=actfile[1,999]
      
    File extensions can be disabled by seting EXTENDFILENAMES to F
+*/
+
+typedef struct {                        /* extended file name */
+   char logfile[1024];                  /* logical name */
+   char actfile[1024];                  /* actual file name */
+   long stindex;                        /* start sample to extract */
+   long enindex;                        /* end sample to extract */
+}ExtFile;
+
+Boolean CopyExtFileName(char *logfn, ExtFile *e);
+/*
+   Return true if logfn has extensions and copy them into e.  Only the
+   last few extended names read are remembered, so a tool that opens
+   the file later, eg on another thread, copies them when the name is
+   read and pins them with PinExtFiles when the file is opened.
+*/
+
+void PinExtFiles(ExtFile *e, int n);
+/*
+   Make GetFileNameExt in the calling thread resolve the logical names
+   of e[0..n-1] from e before looking at the remembered names.  e must
+   stay valid until PinExtFiles(NULL,0) releases it.
 */       
 
 /* ---------------------- Input Handling ----------------------------- */
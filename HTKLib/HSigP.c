@@ -42,6 +42,7 @@ char *hsigp_vc_id = "$Id: HSigP.c,v 1.1.1.1 2006/10/11 09:54:58 jal58 Exp $";
 #include "HMem.h"
 #include "HMath.h"
 #include "HSigP.h"
+#include <pthread.h>
 
 /*
    This module provides a set of basic speech signal processing
@@ -58,6 +59,9 @@ static int trace = 0;
 static MemHeap sigpHeap;
 static ConfParam *cParm[MAXGLOBS];       /* config parameters */
 static int numParm = 0;
+static char fftKernel[MAXSTRLEN] = "AUTO"; /* FFT butterfly kernel */
+
+static void SelectFFTKernel(void);
 
 /* ---------------------- Initialisation -------------------------*/
 
@@ -70,8 +74,10 @@ void InitSigP(void)
    numParm = GetConfig("HSIGP", TRUE, cParm, MAXGLOBS);
    if (numParm>0){
       if (GetConfInt(cParm,numParm,"TRACE",&i)) trace = i;
+      GetConfStr(cParm,numParm,"FFTKERNEL",fftKernel);
    }
    CreateHeap(&sigpHeap,"sigpHeap",MSTAK,1,0.0,5000,5000);
+   SelectFFTKernel();
 }
 
 /* --------------- Windowing and PreEmphasis ---------------------*/
@@ -104,31 +110,64 @@ void ZeroMean(short *data, long nSamples)
       HError(-5322,"ZeroMean: %d samples too +ve\n",hiClip);
 }
 
-static int hamWinSize = 0;          /* Size of current Hamming window */
-static Vector hamWin = NULL;        /* Current Hamming window */
+/* Analysis windows (Hamming and cepstral lifter) are cached by shape so
+   that frames of different sizes, possibly coded by different threads,
+   never regenerate a window that another caller is using */
+typedef struct _SigWin {
+   int size;                  /* window length */
+   int lifter;                /* liftering coeff (0 for Hamming) */
+   Vector w;                  /* window values w[1..size] */
+   struct _SigWin *next;
+} SigWin;
+
+static SigWin *hamWins = NULL;      /* Hamming windows by frame size */
+static SigWin *cepWins = NULL;      /* cepstral weight windows */
+static pthread_mutex_t sigWinLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* AddSigWin: publish new window of given shape on list *head */
+static SigWin *AddSigWin(SigWin **head, int size, int lifter)
+{
+   SigWin *p;
+
+   p = (SigWin *) New(&sigpHeap,sizeof(SigWin));
+   p->size = size; p->lifter = lifter;
+   p->w = CreateVector(&sigpHeap,size);
+   p->next = *head;
+   return p;
+}
 
-/* GenHamWindow: generate precomputed Hamming window function */
-static void GenHamWindow (int frameSize)
+/* GetHamWindow: return precomputed Hamming window for frameSize */
+static Vector GetHamWindow (int frameSize)
 {
+   SigWin *p;
    int i;
    float a;
    
-   if (hamWin==NULL || VectorSize(hamWin) < frameSize)
-      hamWin = CreateVector(&sigpHeap,frameSize);
-   a = TPI / (frameSize - 1);
-   for (i=1;i<=frameSize;i++)
-      hamWin[i] = 0.54 - 0.46 * cos(a*(i-1));
-   hamWinSize = frameSize;
+   for (p=hamWins; p!=NULL; p=p->next)
+      if (p->size==frameSize) return p->w;
+   pthread_mutex_lock(&sigWinLock);
+   for (p=hamWins; p!=NULL; p=p->next)
+      if (p->size==frameSize) break;
+   if (p==NULL) {
+      p = AddSigWin(&hamWins,frameSize,0);
+      a = TPI / (frameSize - 1);
+      for (i=1;i<=frameSize;i++)
+         p->w[i] = 0.54 - 0.46 * cos(a*(i-1));
+      __sync_synchronize();     /* publish the window contents first */
+      hamWins = p;
+   }
+   pthread_mutex_unlock(&sigWinLock);
+   return p->w;
 }
 
 /* EXPORT->Ham: Apply Hamming Window to Speech frame s */
 void Ham (Vector s)
 {
    int i,frameSize;
+   Vector hamWin;
    
    frameSize=VectorSize(s);
-   if (hamWinSize != frameSize)
-      GenHamWindow(frameSize);
+   hamWin = GetHamWindow(frameSize);
    for (i=1;i<=frameSize;i++)
       s[i] *= hamWin[i];
 }
@@ -310,87 +349,502 @@ void FVec2Spectrum (float fzero, Vector f, Vector s)
    Realft(s);
 }
 
+/* 
+   The FFTs are driven by plans which are built once per size and
+   cached.  A plan holds the bit reversal permutation, the twiddles
+   of every radix-4 pass and the twiddles of the real-to-complex
+   split so that no trig functions are evaluated per frame.  The
+   transform itself runs on split real/imaginary arrays on the stack,
+   each radix-4 pass fusing two radix-2 decimation in time stages so
+   that the inner loop over butterflies is unit stride in both data
+   and twiddles.  Plans are immutable once built, so FFT and Realft
+   may be called from several threads.
+
+   The sign conventions of the original Numerical Recipes code are
+   kept: the forward transform uses exp(+2 pi i nk/N) and the inverse
+   scales by 1/N.
+*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FFT_X86
+#include <immintrin.h>
+#endif
+
+#define FFT_STACKMAX 16384    /* largest split buffer (complex points) on the stack */
+#define FFT_LANES 8           /* transforms interleaved by the multi-frame FFT */
+
+typedef struct _FFTPass {     /* a radix-4 (or leading radix-2) pass */
+   int L;                     /* quarter block length, blocks are 4L long */
+   float *w1r, *w1i;          /* array[0..L-1] of exp(2 pi i j/2L) */
+   float *w2r, *w2i;          /* array[0..L-1] of exp(2 pi i j/4L) */
+} FFTPass;
+
+typedef struct _FFTPlan {
+   int n;                     /* number of complex points, a power of 2 */
+   Boolean radix2;            /* leading radix-2 pass (log2 n odd) */
+   int nPass;                 /* number of radix-4 passes */
+   int *rev;                  /* array[0..n-1] bit reversal permutation */
+   FFTPass *pass;             /* array[0..nPass-1] of radix-4 passes */
+   float *rr, *ri;            /* array[0..n/2] of exp(i pi k/n) for Realft */
+   struct _FFTPlan *next;
+} FFTPlan;
+
+typedef void (*FFTPassKernel)(float *re, float *im, int n, FFTPass *p, float sgn);
+typedef void (*FFTLanesLoad)(float **x, int len, float *xt);
+
+static FFTPlan *fftPlans = NULL;                /* cache of built plans */
+static pthread_mutex_t fftPlanLock = PTHREAD_MUTEX_INITIALIZER;
+static FFTPassKernel fftPassKernel = NULL;
+static FFTPassKernel fftLanesKernel = NULL;
+static FFTLanesLoad fftLanesLoad = NULL;
+
+/* BuildFFTPlan: create the plan for an n point complex FFT */
+static FFTPlan *BuildFFTPlan(int n)
+{
+   FFTPlan *p;
+   FFTPass *ps;
+   int i,j,k,b,logn,L;
+   double a;
+
+   for (logn=0; (1<<logn)<n; logn++);
+   p = (FFTPlan *) New(&gcheap,sizeof(FFTPlan));
+   p->n = n; p->radix2 = (logn&1);
+   p->nPass = logn/2;
+   p->rev = (int *) New(&gcheap,n*sizeof(int));
+   for (i=0; i<n; i++) {
+      for (j=0,k=i,b=0; b<logn; b++,k>>=1) j = (j<<1)|(k&1);
+      p->rev[i] = j;
+   }
+   p->pass = (FFTPass *) New(&gcheap,(p->nPass+1)*sizeof(FFTPass));
+   for (k=0,L=p->radix2?2:1; k<p->nPass; k++,L*=4) {
+      ps = p->pass+k; ps->L = L;
+      ps->w1r = (float *) New(&gcheap,4*L*sizeof(float));
+      ps->w1i = ps->w1r+L; ps->w2r = ps->w1i+L; ps->w2i = ps->w2r+L;
+      for (j=0; j<L; j++) {
+         a = TPI*j/(2.0*L);
+         ps->w1r[j] = cos(a); ps->w1i[j] = sin(a);
+         a = TPI*j/(4.0*L);
+         ps->w2r[j] = cos(a); ps->w2i[j] = sin(a);
+      }
+   }
+   p->rr = (float *) New(&gcheap,(n+2)*sizeof(float));
+   p->ri = p->rr+n/2+1;
+   for (k=0; k<=n/2; k++) {
+      a = PI*k/n;
+      p->rr[k] = cos(a); p->ri[k] = sin(a);
+   }
+   return p;
+}
+
+/* GetFFTPlan: return the (cached) plan for an n point complex FFT */
+static FFTPlan *GetFFTPlan(int n)
+{
+   FFTPlan *p;
+
+   if (n<1 || (n&(n-1))!=0)
+      HError(5324,"GetFFTPlan: FFT size %d is not a power of 2",n);
+   for (p=fftPlans; p!=NULL; p=p->next)
+      if (p->n==n) return p;
+   pthread_mutex_lock(&fftPlanLock);
+   for (p=fftPlans; p!=NULL; p=p->next)
+      if (p->n==n) break;
+   if (p==NULL) {
+      p = BuildFFTPlan(n);
+      p->next = fftPlans;
+      __sync_synchronize();     /* publish the plan contents first */
+      fftPlans = p;
+   }
+   pthread_mutex_unlock(&fftPlanLock);
+   return p;
+}
+
+/* Radix4PassGeneric: one radix-4 pass over split data re/im.  Each
+   block of 4L points a,b,c,d (at offsets j, j+L, j+2L, j+3L) gets a
+   radix-2 stage with twiddle w1 followed by one with w2 and w2*(+-i) */
+static void Radix4PassGeneric(float *re, float *im, int n, FFTPass *p, float sgn)
+{
+   int g,j,L=p->L;
+   float *ar,*ai,*br,*bi,*cr,*ci,*dr,*di;
+   float w1r,w1i,w2r,w2i,tr,ti,a1r,a1i,b1r,b1i,c1r,c1i,d1r,d1i;
+
+   for (g=0; g<n; g+=4*L) {
+      ar = re+g; ai = im+g; br = ar+L; bi = ai+L;
+      cr = br+L; ci = bi+L; dr = cr+L; di = ci+L;
+      for (j=0; j<L; j++) {
+         w1r = p->w1r[j]; w1i = sgn*p->w1i[j];
+         w2r = p->w2r[j]; w2i = sgn*p->w2i[j];
+         tr = w1r*br[j] - w1i*bi[j]; ti = w1r*bi[j] + w1i*br[j];
+         a1r = ar[j]+tr; a1i = ai[j]+ti; b1r = ar[j]-tr; b1i = ai[j]-ti;
+         tr = w1r*dr[j] - w1i*di[j]; ti = w1r*di[j] + w1i*dr[j];
+         c1r = cr[j]+tr; c1i = ci[j]+ti; d1r = cr[j]-tr; d1i = ci[j]-ti;
+         tr = w2r*c1r - w2i*c1i; ti = w2r*c1i + w2i*c1r;
+         ar[j] = a1r+tr; ai[j] = a1i+ti; cr[j] = a1r-tr; ci[j] = a1i-ti;
+         tr = w2r*d1r - w2i*d1i; ti = w2r*d1i + w2i*d1r;
+         /* multiply by +-i */
+         br[j] = b1r-sgn*ti; bi[j] = b1i+sgn*tr;
+         dr[j] = b1r+sgn*ti; di[j] = b1i-sgn*tr;
+      }
+   }
+}
+
+/* Radix4PassLanesGeneric: as Radix4PassGeneric but applied to
+   FFT_LANES transforms stored interleaved, ie point j of transform l
+   is at re/im[j*FFT_LANES+l] */
+static void Radix4PassLanesGeneric(float *re, float *im, int n, FFTPass *p, float sgn)
+{
+   int g,j,l,L=p->L;
+   float *ar,*ai,*br,*bi,*cr,*ci,*dr,*di;
+   float w1r,w1i,w2r,w2i,tr,ti,a1r,a1i,b1r,b1i,c1r,c1i,d1r,d1i;
+
+   for (g=0; g<n; g+=4*L) {
+      ar = re+g*FFT_LANES; ai = im+g*FFT_LANES; 
+      br = ar+L*FFT_LANES; bi = ai+L*FFT_LANES;
+      cr = br+L*FFT_LANES; ci = bi+L*FFT_LANES; 
+      dr = cr+L*FFT_LANES; di = ci+L*FFT_LANES;
+      for (j=0; j<L; j++) {
+         w1r = p->w1r[j]; w1i = sgn*p->w1i[j];
+         w2r = p->w2r[j]; w2i = sgn*p->w2i[j];
+         for (l=0; l<FFT_LANES; l++) {
+            tr = w1r*br[l] - w1i*bi[l]; ti = w1r*bi[l] + w1i*br[l];
+            a1r = ar[l]+tr; a1i = ai[l]+ti; b1r = ar[l]-tr; b1i = ai[l]-ti;
+            tr = w1r*dr[l] - w1i*di[l]; ti = w1r*di[l] + w1i*dr[l];
+            c1r = cr[l]+tr; c1i = ci[l]+ti; d1r = cr[l]-tr; d1i = ci[l]-ti;
+            tr = w2r*c1r - w2i*c1i; ti = w2r*c1i + w2i*c1r;
+            ar[l] = a1r+tr; ai[l] = a1i+ti; cr[l] = a1r-tr; ci[l] = a1i-ti;
+            tr = w2r*d1r - w2i*d1i; ti = w2r*d1i + w2i*d1r;
+            br[l] = b1r-sgn*ti; bi[l] = b1i+sgn*tr;
+            dr[l] = b1r+sgn*ti; di[l] = b1i-sgn*tr;
+         }
+         ar += FFT_LANES; ai += FFT_LANES; br += FFT_LANES; bi += FFT_LANES;
+         cr += FFT_LANES; ci += FFT_LANES; dr += FFT_LANES; di += FFT_LANES;
+      }
+   }
+}
+
+/* LoadLanesGeneric: interleave samples x[l][1..len] of the
+   FFT_LANES frames into xt[k*FFT_LANES+l] */
+static void LoadLanesGeneric(float **x, int len, float *xt)
+{
+   int k,l;
+
+   for (k=0; k<len; k++)
+      for (l=0; l<FFT_LANES; l++) xt[k*FFT_LANES+l] = x[l][k+1];
+}
+
+#ifdef FFT_X86
+
+/* Radix4PassAVX2: as Radix4PassGeneric, 8 butterflies at a time */
+__attribute__((target("avx2,fma")))
+static void Radix4PassAVX2(float *re, float *im, int n, FFTPass *p, float sgn)
+{
+   int g,j,L=p->L;
+   float *ar,*ai,*br,*bi,*cr,*ci,*dr,*di;
+   __m256 vs,w1r,w1i,w2r,w2i,tr,ti,a1r,a1i,b1r,b1i,c1r,c1i,d1r,d1i,xr,xi;
+
+   if (L<8) {
+      Radix4PassGeneric(re,im,n,p,sgn); return;
+   }
+   vs = _mm256_set1_ps(sgn);
+   for (g=0; g<n; g+=4*L) {
+      ar = re+g; ai = im+g; br = ar+L; bi = ai+L;
+      cr = br+L; ci = bi+L; dr = cr+L; di = ci+L;
+      for (j=0; j<L; j+=8) {
+         w1r = _mm256_loadu_ps(p->w1r+j);
+         w1i = _mm256_mul_ps(vs,_mm256_loadu_ps(p->w1i+j));
+         w2r = _mm256_loadu_ps(p->w2r+j);
+         w2i = _mm256_mul_ps(vs,_mm256_loadu_ps(p->w2i+j));
+         xr = _mm256_loadu_ps(br+j); xi = _mm256_loadu_ps(bi+j);
+         tr = _mm256_fmsub_ps(w1r,xr,_mm256_mul_ps(w1i,xi));
+         ti = _mm256_fmadd_ps(w1r,xi,_mm256_mul_ps(w1i,xr));
+         xr = _mm256_loadu_ps(ar+j); xi = _mm256_loadu_ps(ai+j);
+         a1r = _mm256_add_ps(xr,tr); a1i = _mm256_add_ps(xi,ti);
+         b1r = _mm256_sub_ps(xr,tr); b1i = _mm256_sub_ps(xi,ti);
+         xr = _mm256_loadu_ps(dr+j); xi = _mm256_loadu_ps(di+j);
+         tr = _mm256_fmsub_ps(w1r,xr,_mm256_mul_ps(w1i,xi));
+         ti = _mm256_fmadd_ps(w1r,xi,_mm256_mul_ps(w1i,xr));
+         xr = _mm256_loadu_ps(cr+j); xi = _mm256_loadu_ps(ci+j);
+         c1r = _mm256_add_ps(xr,tr); c1i = _mm256_add_ps(xi,ti);
+         d1r = _mm256_sub_ps(xr,tr); d1i = _mm256_sub_ps(xi,ti);
+         tr = _mm256_fmsub_ps(w2r,c1r,_mm256_mul_ps(w2i,c1i));
+         ti = _mm256_fmadd_ps(w2r,c1i,_mm256_mul_ps(w2i,c1r));
+         _mm256_storeu_ps(ar+j,_mm256_add_ps(a1r,tr));
+         _mm256_storeu_ps(ai+j,_mm256_add_ps(a1i,ti));
+         _mm256_storeu_ps(cr+j,_mm256_sub_ps(a1r,tr));
+         _mm256_storeu_ps(ci+j,_mm256_sub_ps(a1i,ti));
+         tr = _mm256_fmsub_ps(w2r,d1r,_mm256_mul_ps(w2i,d1i));
+         ti = _mm256_fmadd_ps(w2r,d1i,_mm256_mul_ps(w2i,d1r));
+         tr = _mm256_mul_ps(vs,tr); ti = _mm256_mul_ps(vs,ti);
+         _mm256_storeu_ps(br+j,_mm256_sub_ps(b1r,ti));
+         _mm256_storeu_ps(bi+j,_mm256_add_ps(b1i,tr));
+         _mm256_storeu_ps(dr+j,_mm256_add_ps(b1r,ti));
+         _mm256_storeu_ps(di+j,_mm256_sub_ps(b1i,tr));
+      }
+   }
+}
+
+/* Radix4PassLanesAVX2: as Radix4PassLanesGeneric, one vector per
+   butterfly so that every pass runs at full width */
+__attribute__((target("avx2,fma")))
+static void Radix4PassLanesAVX2(float *re, float *im, int n, FFTPass *p, float sgn)
+{
+   int g,j,L=p->L;
+   float *ar,*ai,*br,*bi,*cr,*ci,*dr,*di;
+   __m256 vs,w1r,w1i,w2r,w2i,tr,ti,a1r,a1i,b1r,b1i,c1r,c1i,d1r,d1i,xr,xi;
+
+   vs = _mm256_set1_ps(sgn);
+   for (g=0; g<n; g+=4*L) {
+      ar = re+g*FFT_LANES; ai = im+g*FFT_LANES; 
+      br = ar+L*FFT_LANES; bi = ai+L*FFT_LANES;
+      cr = br+L*FFT_LANES; ci = bi+L*FFT_LANES; 
+      dr = cr+L*FFT_LANES; di = ci+L*FFT_LANES;
+      for (j=0; j<L*FFT_LANES; j+=FFT_LANES) {
+         w1r = _mm256_set1_ps(p->w1r[j/FFT_LANES]);
+         w1i = _mm256_set1_ps(sgn*p->w1i[j/FFT_LANES]);
+         w2r = _mm256_set1_ps(p->w2r[j/FFT_LANES]);
+         w2i = _mm256_set1_ps(sgn*p->w2i[j/FFT_LANES]);
+         xr = _mm256_loadu_ps(br+j); xi = _mm256_loadu_ps(bi+j);
+         tr = _mm256_fmsub_ps(w1r,xr,_mm256_mul_ps(w1i,xi));
+         ti = _mm256_fmadd_ps(w1r,xi,_mm256_mul_ps(w1i,xr));
+         xr = _mm256_loadu_ps(ar+j); xi = _mm256_loadu_ps(ai+j);
+         a1r = _mm256_add_ps(xr,tr); a1i = _mm256_add_ps(xi,ti);
+         b1r = _mm256_sub_ps(xr,tr); b1i = _mm256_sub_ps(xi,ti);
+         xr = _mm256_loadu_ps(dr+j); xi = _mm256_loadu_ps(di+j);
+         tr = _mm256_fmsub_ps(w1r,xr,_mm256_mul_ps(w1i,xi));
+         ti = _mm256_fmadd_ps(w1r,xi,_mm256_mul_ps(w1i,xr));
+         xr = _mm256_loadu_ps(cr+j); xi = _mm256_loadu_ps(ci+j);
+         c1r = _mm256_add_ps(xr,tr); c1i = _mm256_add_ps(xi,ti);
+         d1r = _mm256_sub_ps(xr,tr); d1i = _mm256_sub_ps(xi,ti);
+         tr = _mm256_fmsub_ps(w2r,c1r,_mm256_mul_ps(w2i,c1i));
+         ti = _mm256_fmadd_ps(w2r,c1i,_mm256_mul_ps(w2i,c1r));
+         _mm256_storeu_ps(ar+j,_mm256_add_ps(a1r,tr));
+         _mm256_storeu_ps(ai+j,_mm256_add_ps(a1i,ti));
+         _mm256_storeu_ps(cr+j,_mm256_sub_ps(a1r,tr));
+         _mm256_storeu_ps(ci+j,_mm256_sub_ps(a1i,ti));
+         tr = _mm256_fmsub_ps(w2r,d1r,_mm256_mul_ps(w2i,d1i));
+         ti = _mm256_fmadd_ps(w2r,d1i,_mm256_mul_ps(w2i,d1r));
+         tr = _mm256_mul_ps(vs,tr); ti = _mm256_mul_ps(vs,ti);
+         _mm256_storeu_ps(br+j,_mm256_sub_ps(b1r,ti));
+         _mm256_storeu_ps(bi+j,_mm256_add_ps(b1i,tr));
+         _mm256_storeu_ps(dr+j,_mm256_add_ps(b1r,ti));
+         _mm256_storeu_ps(di+j,_mm256_sub_ps(b1i,tr));
+      }
+   }
+}
+
+/* LoadLanesAVX2: as LoadLanesGeneric using 8x8 block transposes */
+__attribute__((target("avx2,fma")))
+static void LoadLanesAVX2(float **x, int len, float *xt)
+{
+   int k,l;
+   __m256 r0,r1,r2,r3,r4,r5,r6,r7,t0,t1,t2,t3,t4,t5,t6,t7;
+
+   for (k=0; k+8<=len; k+=8) {
+      r0 = _mm256_loadu_ps(x[0]+k+1); r1 = _mm256_loadu_ps(x[1]+k+1);
+      r2 = _mm256_loadu_ps(x[2]+k+1); r3 = _mm256_loadu_ps(x[3]+k+1);
+      r4 = _mm256_loadu_ps(x[4]+k+1); r5 = _mm256_loadu_ps(x[5]+k+1);
+      r6 = _mm256_loadu_ps(x[6]+k+1); r7 = _mm256_loadu_ps(x[7]+k+1);
+      t0 = _mm256_unpacklo_ps(r0,r1); t1 = _mm256_unpackhi_ps(r0,r1);
+      t2 = _mm256_unpacklo_ps(r2,r3); t3 = _mm256_unpackhi_ps(r2,r3);
+      t4 = _mm256_unpacklo_ps(r4,r5); t5 = _mm256_unpackhi_ps(r4,r5);
+      t6 = _mm256_unpacklo_ps(r6,r7); t7 = _mm256_unpackhi_ps(r6,r7);
+      r0 = _mm256_shuffle_ps(t0,t2,0x44); r1 = _mm256_shuffle_ps(t0,t2,0xEE);
+      r2 = _mm256_shuffle_ps(t1,t3,0x44); r3 = _mm256_shuffle_ps(t1,t3,0xEE);
+      r4 = _mm256_shuffle_ps(t4,t6,0x44); r5 = _mm256_shuffle_ps(t4,t6,0xEE);
+      r6 = _mm256_shuffle_ps(t5,t7,0x44); r7 = _mm256_shuffle_ps(t5,t7,0xEE);
+      _mm256_storeu_ps(xt+(k+0)*8,_mm256_permute2f128_ps(r0,r4,0x20));
+      _mm256_storeu_ps(xt+(k+1)*8,_mm256_permute2f128_ps(r1,r5,0x20));
+      _mm256_storeu_ps(xt+(k+2)*8,_mm256_permute2f128_ps(r2,r6,0x20));
+      _mm256_storeu_ps(xt+(k+3)*8,_mm256_permute2f128_ps(r3,r7,0x20));
+      _mm256_storeu_ps(xt+(k+4)*8,_mm256_permute2f128_ps(r0,r4,0x31));
+      _mm256_storeu_ps(xt+(k+5)*8,_mm256_permute2f128_ps(r1,r5,0x31));
+      _mm256_storeu_ps(xt+(k+6)*8,_mm256_permute2f128_ps(r2,r6,0x31));
+      _mm256_storeu_ps(xt+(k+7)*8,_mm256_permute2f128_ps(r3,r7,0x31));
+   }
+   for (; k<len; k++)
+      for (l=0; l<8; l++) xt[k*8+l] = x[l][k+1];
+}
+
+#endif
+
+/* SelectFFTKernel: choose the radix-4 pass kernel for this cpu */
+static void SelectFFTKernel(void)
+{
+   fftPassKernel = Radix4PassGeneric;
+   fftLanesKernel = Radix4PassLanesGeneric;
+   fftLanesLoad = LoadLanesGeneric;
+#ifdef FFT_X86
+   if ((strcmp(fftKernel,"AUTO")==0 || strcmp(fftKernel,"AVX2")==0) &&
+       __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      fftPassKernel = Radix4PassAVX2;
+      fftLanesKernel = Radix4PassLanesAVX2;
+      fftLanesLoad = LoadLanesAVX2;
+      return;
+   }
+#endif
+   if (strcmp(fftKernel,"AUTO")!=0 && strcmp(fftKernel,"GENERIC")!=0)
+      HError(-5324,"SelectFFTKernel: FFTKERNEL %s not available, using GENERIC",fftKernel);
+}
+
+/* SplitFFT: transform the n interleaved complex points x[0..2n-1]
+   into split arrays re/im[0..n-1] */
+static void SplitFFT(FFTPlan *p, float *x, float *re, float *im, Boolean invert)
+{
+   int i,k,n=p->n;
+   float sgn = invert ? -1.0 : 1.0;
+   float tr,ti;
+   int *rev = p->rev;
+
+   if (fftPassKernel==NULL) SelectFFTKernel();
+   if (p->radix2) {      /* leading radix-2 pass fused with reordering */
+      for (i=0; i<n; i+=2) {
+         k = rev[i]; tr = x[2*k]; ti = x[2*k+1];
+         k = rev[i+1];
+         re[i] = tr+x[2*k]; im[i] = ti+x[2*k+1];
+         re[i+1] = tr-x[2*k]; im[i+1] = ti-x[2*k+1];
+      }
+   } else
+      for (i=0; i<n; i++) {
+         k = rev[i]; re[i] = x[2*k]; im[i] = x[2*k+1];
+      }
+   for (i=0; i<p->nPass; i++)
+      fftPassKernel(re,im,n,p->pass+i,sgn);
+}
+
 /* EXPORT-> FFT: apply fft/invfft to complex s */
 void FFT(Vector s, int invert)
 {
-   int ii,jj,n,nn,limit,m,j,inc,i;
-   double wx,wr,wpr,wpi,wi,theta;
-   double xre,xri,x;
-   
-   n=VectorSize(s);
-   nn=n / 2; j = 1;
-   for (ii=1;ii<=nn;ii++) {
-      i = 2 * ii - 1;
-      if (j>i) {
-         xre = s[j]; xri = s[j + 1];
-         s[j] = s[i];  s[j + 1] = s[i + 1];
-         s[i] = xre; s[i + 1] = xri;
+   int i,n;
+   FFTPlan *p;
+   float *re,*im,scale;
+
+   n = VectorSize(s)/2;
+   p = GetFFTPlan(n);
+   if (n<=FFT_STACKMAX) {
+      float buf[2*n];
+      re = buf; im = buf+n;
+      SplitFFT(p,s+1,re,im,invert);
+      scale = invert ? 1.0/n : 1.0;
+      for (i=0; i<n; i++) {
+         s[2*i+1] = re[i]*scale; s[2*i+2] = im[i]*scale;
+      }
+   } else {
+      re = (float *) New(&gcheap,2*n*sizeof(float)); im = re+n;
+      SplitFFT(p,s+1,re,im,invert);
+      scale = invert ? 1.0/n : 1.0;
+      for (i=0; i<n; i++) {
+         s[2*i+1] = re[i]*scale; s[2*i+2] = im[i]*scale;
+      }
+      Dispose(&gcheap,re);
+   }
+}
+
+/* RealSplit: form the first n points of the spectrum of the 2n real
+   values whose n point complex FFT is re/im, storing them in s */
+static void RealSplit(FFTPlan *p, float *re, float *im, Vector s)
+{
+   int k,n=p->n,n2=n/2;
+   float xr1,xi1,xr2,xi2,wr,wi;
+
+   for (k=1; k<n2; k++) {
+      wr = p->rr[k]; wi = p->ri[k];
+      xr1 = 0.5*(re[k]+re[n-k]); xi1 = 0.5*(im[k]-im[n-k]);
+      xr2 = 0.5*(im[k]+im[n-k]); xi2 = 0.5*(re[n-k]-re[k]);
+      s[2*k+1] = xr1 + wr*xr2 - wi*xi2;
+      s[2*k+2] = xi1 + wr*xi2 + wi*xr2;
+      s[2*(n-k)+1] = xr1 - wr*xr2 + wi*xi2;
+      s[2*(n-k)+2] = -xi1 + wr*xi2 + wi*xr2;
+   }
+   if (n2>=1 && n>1) {
+      s[2*n2+1] = re[n2]; s[2*n2+2] = im[n2];
+   }
+   s[1] = re[0] + im[0];
+   s[2] = 0.0;
+}
+
+/* RealftLanes: transform the 2n real values x[l][1..2n] of each
+   of the FFT_LANES frames (zero padded beyond len) and store the
+   power (or magnitude) of spectral points klo-1..khi-1 of the first
+   nl frames in spec[k-klo+2][t0..t0+nl-1].  xt must hold 2n and 
+   re and im n points for each of the FFT_LANES frames */
+static void RealftLanes(FFTPlan *p, float **x, int len, float *xt,
+                        float *re, float *im, int klo, int khi, 
+                        Boolean usePower, Matrix spec, int t0, int nl)
+{
+   const int NL = FFT_LANES;
+   const float half = 0.5;
+   int i,j,k,l,n=p->n,n2=n/2;
+   float xr1,xi1,xr2,xi2,wr,wi,sr,si,*a,*b,*c,*d,*ek,e[FFT_LANES];
+   int *rev = p->rev;
+
+   if (fftLanesKernel==NULL) SelectFFTKernel();
+   /* Interleave the frames, then gather in bit reversed order with
+      the radix-2 pass fused as in SplitFFT */
+   if (len > 2*n) len = 2*n;
+   fftLanesLoad(x,len,xt);
+   for (k=len*NL; k<2*n*NL; k++) xt[k] = 0.0;
+   if (p->radix2) 
+      for (i=0; i<n; i+=2) {
+         a = xt+2*rev[i]*NL; b = xt+2*rev[i+1]*NL;
+         for (l=0; l<NL; l++) {
+            re[i*NL+l] = a[l]+b[l]; im[i*NL+l] = a[NL+l]+b[NL+l];
+            re[(i+1)*NL+l] = a[l]-b[l]; im[(i+1)*NL+l] = a[NL+l]-b[NL+l];
+         }
       }
-      m = n / 2;
-      while (m >= 2  && j > m) {
-         j -= m; m /= 2;
+   else
+      for (i=0; i<n; i++) {
+         a = xt+2*rev[i]*NL;
+         for (l=0; l<NL; l++) {
+            re[i*NL+l] = a[l]; im[i*NL+l] = a[NL+l];
+         }
       }
-      j += m;
-   };
-   limit = 2;
-   while (limit < n) {
-      inc = 2 * limit; theta = TPI / limit;
-      if (invert) theta = -theta;
-      x = sin(0.5 * theta);
-      wpr = -2.0 * x * x; wpi = sin(theta); 
-      wr = 1.0; wi = 0.0;
-      for (ii=1; ii<=limit/2; ii++) {
-         m = 2 * ii - 1;
-         for (jj = 0; jj<=(n - m) / inc;jj++) {
-            i = m + jj * inc;
-            j = i + limit;
-            xre = wr * s[j] - wi * s[j + 1];
-            xri = wr * s[j + 1] + wi * s[j];
-            s[j] = s[i] - xre; s[j + 1] = s[i + 1] - xri;
-            s[i] = s[i] + xre; s[i + 1] = s[i + 1] + xri;
+   for (i=0; i<p->nPass; i++)
+      fftLanesKernel(re,im,n,p->pass+i,1.0);
+   /* Real split of the required points only, as in RealSplit */
+   for (k=klo-1; k<=khi-1; k++) {
+      ek = spec[k-klo+2]+t0;
+      j = (k<n2) ? k : n-k;
+      a = re+j*NL; b = im+j*NL; c = re+(n-j)*NL; d = im+(n-j)*NL;
+      wr = p->rr[j]; wi = p->ri[j];
+      if (k==n2)
+         for (l=0; l<NL; l++) 
+            e[l] = a[l]*a[l] + b[l]*b[l];
+      else {
+         if (k>n2) {       /* mirrored point */
+            wr = -wr; wi = -wi; 
+         }
+         for (l=0; l<NL; l++) {
+            xr1 = half*(a[l]+c[l]); xi1 = half*(b[l]-d[l]);
+            xr2 = half*(b[l]+d[l]); xi2 = half*(c[l]-a[l]);
+            sr = xr1 + wr*xr2 - wi*xi2; si = xi1 + wr*xi2 + wi*xr2;
+            e[l] = sr*sr + si*si;
          }
-         wx = wr;
-         wr = wr * wpr - wi * wpi + wr;
-         wi = wi * wpr + wx * wpi + wi;
       }
-      limit = inc;
+      if (usePower)
+         for (l=0; l<nl; l++) ek[l] = e[l];
+      else
+         for (l=0; l<nl; l++) ek[l] = sqrt(e[l]);
    }
-   if (invert)
-      for (i = 1;i<=n;i++) 
-         s[i] = s[i] / nn;
-   
 }
 
 /* EXPORT-> Realft: apply fft to real s */
 void Realft (Vector s)
 {
-   int n, n2, i, i1, i2, i3, i4;
-   double xr1, xi1, xr2, xi2, wrs, wis;
-   double yr, yi, yr2, yi2, yr0, theta, x;
-
-   n=VectorSize(s) / 2; n2 = n/2;
-   theta = PI / n;
-   FFT(s, FALSE);
-   x = sin(0.5 * theta);
-   yr2 = -2.0 * x * x;
-   yi2 = sin(theta); yr = 1.0 + yr2; yi = yi2;
-   for (i=2; i<=n2; i++) {
-      i1 = i + i - 1;      i2 = i1 + 1;
-      i3 = n + n + 3 - i2; i4 = i3 + 1;
-      wrs = yr; wis = yi;
-      xr1 = (s[i1] + s[i3])/2.0; xi1 = (s[i2] - s[i4])/2.0;
-      xr2 = (s[i2] + s[i4])/2.0; xi2 = (s[i3] - s[i1])/2.0;
-      s[i1] = xr1 + wrs * xr2 - wis * xi2;
-      s[i2] = xi1 + wrs * xi2 + wis * xr2;
-      s[i3] = xr1 - wrs * xr2 + wis * xi2;
-      s[i4] = -xi1 + wrs * xi2 + wis * xr2;
-      yr0 = yr;
-      yr = yr * yr2 - yi  * yi2 + yr;
-      yi = yi * yr2 + yr0 * yi2 + yi;
-   }
-   xr1 = s[1];
-   s[1] = xr1 + s[2];
-   s[2] = 0.0;
+   int n;
+   FFTPlan *p;
+   float *re;
+
+   n = VectorSize(s)/2;
+   p = GetFFTPlan(n);
+   if (n<=FFT_STACKMAX) {
+      float buf[2*n];
+      SplitFFT(p,s+1,buf,buf+n,FALSE);
+      RealSplit(p,buf,buf+n,s);
+   } else {
+      re = (float *) New(&gcheap,2*n*sizeof(float));
+      SplitFFT(p,s+1,re,re+n,FALSE);
+      RealSplit(p,re,re+n,s);
+      Dispose(&gcheap,re);
+   }
 }
    
 /* EXPORT-> SpecModulus: store modulus of s in m */
@@ -660,6 +1114,140 @@ float FBank2C0(Vector fbank)
    return sum * mfnorm;
 }
 
+/* ----------------- Multi-Frame Filterbank Operations -------------- */
+
+/* EXPORT->InitFBankBlock: create workspace for block filterbank analysis */
+FBankBlock InitFBankBlock(MemHeap *x, FBankInfo info, int maxFrames)
+{
+   FBankBlock blk;
+
+   blk.maxFrames = maxFrames;
+   blk.nBins = info.khi - info.klo + 1;
+   if (blk.nBins<1) blk.nBins = 1;
+   blk.spec = CreateMatrix(x,blk.nBins,maxFrames);
+   blk.work = CreateVector(x,2*info.fftN*FFT_LANES);
+   blk.chan = CreateMatrix(x,info.numChans,maxFrames);
+   return blk;
+}
+
+/* EXPORT->Wave2FBankBlock: filterbank analysis of nFrames frames in s */
+void Wave2FBankBlock(Matrix s, Matrix fbank, Vector te, int nFrames,
+                     FBankInfo info, FBankBlock blk)
+{
+   const float melfloor = 1.0;
+   int i,k,t,l,nl,bin,nChan;
+   float t1,w,e,*sp,*lo,*hi;
+   float *x[FFT_LANES];
+   FFTPlan *p;
+
+   if (info.frameSize != NumCols(s))
+      HError(5321,"Wave2FBankBlock: frame size mismatch");
+   if (info.numChans != NumCols(fbank))
+      HError(5321,"Wave2FBankBlock: num channels mismatch");
+   if (nFrames > blk.maxFrames || nFrames > NumRows(s) || 
+       nFrames > NumRows(fbank))
+      HError(5321,"Wave2FBankBlock: block of %d frames too big",nFrames);
+   nChan = info.numChans;
+   if (te != NULL)
+      for (t=1; t<=nFrames; t++) {
+         sp = s[t]; e = 0.0;
+         for (k=1; k<=info.frameSize; k++) 
+            e += sp[k]*sp[k];
+         te[t] = e;
+      }
+   /* Power/magnitude spectra stored bin-major, FFT_LANES frames
+      transformed together */
+   p = GetFFTPlan(info.fftN/2);
+   for (t=1; t<=nFrames; t+=FFT_LANES) {
+      nl = nFrames-t+1; 
+      if (nl>FFT_LANES) nl = FFT_LANES;
+      for (l=0; l<FFT_LANES; l++) 
+         x[l] = s[(l<nl) ? t+l : t];
+      RealftLanes(p, x, info.frameSize, blk.work+1, 
+                  blk.work+1+2*p->n*FFT_LANES, blk.work+1+3*p->n*FFT_LANES,
+                  info.klo, info.khi, info.usePower, blk.spec, t, nl);
+   }
+   /* Sparse filterbank matrix applied to all frames at once: each
+      bin contributes to at most two adjacent channels */
+   for (bin=1; bin<=nChan; bin++)
+      for (t=1; t<=nFrames; t++) blk.chan[bin][t] = 0.0;
+   for (k=info.klo,i=1; k<=info.khi; k++,i++) {
+      bin = info.loChan[k]; w = info.loWt[k]; sp = blk.spec[i];
+      lo = (bin>0) ? blk.chan[bin] : NULL;
+      hi = (bin<nChan) ? blk.chan[bin+1] : NULL;
+      if (lo != NULL && hi != NULL)
+         for (t=1; t<=nFrames; t++) {
+            t1 = w*sp[t]; lo[t] += t1; hi[t] += sp[t] - t1;
+         }
+      else if (lo != NULL)
+         for (t=1; t<=nFrames; t++) lo[t] += w*sp[t];
+      else if (hi != NULL)
+         for (t=1; t<=nFrames; t++) hi[t] += sp[t] - w*sp[t];
+   }
+   /* Take logs and store frame-major */
+   for (bin=1; bin<=nChan; bin++) {
+      sp = blk.chan[bin];
+      for (t=1; t<=nFrames; t++) {
+         t1 = sp[t];
+         if (info.takeLogs) {
+            if (t1<melfloor) t1 = melfloor;
+            t1 = log(t1);
+         }
+         fbank[t][bin] = t1;
+      }
+   }
+}
+
+/* EXPORT->InitDCTMatrix: fill cm with the weighted DCT basis */
+void InitDCTMatrix(Matrix cm, int cepLiftering, float scale)
+{
+   int j,k,n,numChan;
+   float mfnorm,pi_factor,x,w;
+   
+   n = NumRows(cm); numChan = NumCols(cm);
+   mfnorm = sqrt(2.0/(float)numChan);
+   pi_factor = PI/(float)numChan;
+   for (j=1; j<=n; j++) {
+      x = (float)j * pi_factor;
+      w = mfnorm * scale;
+      if (cepLiftering > 0)
+         w *= 1.0 + (cepLiftering/2.0)*sin(j * PI/cepLiftering);
+      for (k=1; k<=numChan; k++)
+         cm[j][k] = w * cos(x*(k-0.5));
+   }
+}
+
+/* EXPORT->FBank2MFCCBlock: c[t] = cm * fbank[t] for t=1..nFrames */
+void FBank2MFCCBlock(Matrix fbank, Matrix c, int nFrames, Matrix cm)
+{
+   int j,k,t,n,numChan;
+   float *f0,*f1,*f2,*f3,*b,s0,s1,s2,s3;
+   
+   n = NumRows(cm); numChan = NumCols(cm);
+   if (numChan != NumCols(fbank) || n > NumCols(c))
+      HError(5321,"FBank2MFCCBlock: matrix size mismatch");
+   /* Four frames at a time so that each basis row is loaded once */
+   for (t=1; t+3<=nFrames; t+=4) {
+      f0 = fbank[t]; f1 = fbank[t+1]; f2 = fbank[t+2]; f3 = fbank[t+3];
+      for (j=1; j<=n; j++) {
+         b = cm[j]; s0 = s1 = s2 = s3 = 0.0;
+         for (k=1; k<=numChan; k++) {
+            s0 += b[k]*f0[k]; s1 += b[k]*f1[k];
+            s2 += b[k]*f2[k]; s3 += b[k]*f3[k];
+         }
+         c[t][j] = s0; c[t+1][j] = s1; c[t+2][j] = s2; c[t+3][j] = s3;
+      }
+   }
+   for (; t<=nFrames; t++) {
+      f0 = fbank[t];
+      for (j=1; j<=n; j++) {
+         b = cm[j]; s0 = 0.0;
+         for (k=1; k<=numChan; k++) s0 += b[k]*f0[k];
+         c[t][j] = s0;
+      }
+   }
+}
+
 /* --------------------- PLP Related Operations -------------------- */
 
 /* EXPORT->InitPLP: Initialise equal-loudness curve & IDT cosine matrix */
@@ -752,33 +1340,38 @@ void ASpec2LPCep (Vector as, Vector ac, Vector lp, Vector c, DMatrix cm)
 
 /* ------------------- Feature Level Operations -------------------- */
 
-static int cepWinSize=0;            /* Size of current cepstral weight window */
-static int cepWinL=0;               /* Current liftering coeff */
-static Vector cepWin = NULL;        /* Current cepstral weight window */
-
-/* GenCepWin: generate a new cep liftering vector */
-static void GenCepWin (int cepLiftering, int count)
+/* GetCepWin: return cep liftering vector of at least count coeffs */
+static Vector GetCepWin (int cepLiftering, int count)
 {
+   SigWin *p;
    int i;
    float a, Lby2;
    
-   if (cepWin==NULL || VectorSize(cepWin) < count)
-      cepWin = CreateVector(&sigpHeap,count);
-   a = PI/cepLiftering;
-   Lby2 = cepLiftering/2.0;
-   for (i=1;i<=count;i++)
-      cepWin[i] = 1.0 + Lby2*sin(i * a);
-   cepWinL = cepLiftering;
-   cepWinSize = count;
+   for (p=cepWins; p!=NULL; p=p->next)
+      if (p->lifter==cepLiftering && p->size>=count) return p->w;
+   pthread_mutex_lock(&sigWinLock);
+   for (p=cepWins; p!=NULL; p=p->next)
+      if (p->lifter==cepLiftering && p->size>=count) break;
+   if (p==NULL) {
+      p = AddSigWin(&cepWins,count,cepLiftering);
+      a = PI/cepLiftering;
+      Lby2 = cepLiftering/2.0;
+      for (i=1;i<=count;i++)
+         p->w[i] = 1.0 + Lby2*sin(i * a);
+      __sync_synchronize();     /* publish the window contents first */
+      cepWins = p;
+   }
+   pthread_mutex_unlock(&sigWinLock);
+   return p->w;
 }  
 
 /* EXPORT->WeightCepstrum: Apply cepstral weighting to c */
 void WeightCepstrum (Vector c, int start, int count, int cepLiftering)
 {
    int i,j;
+   Vector cepWin;
    
-   if (cepWinL != cepLiftering || count > cepWinSize)
-      GenCepWin(cepLiftering,count);
+   cepWin = GetCepWin(cepLiftering,count);
    j = start;
    for (i=1;i<=count;i++)
       c[j++] *= cepWin[i];
@@ -788,9 +1381,9 @@ void WeightCepstrum (Vector c, int start, int count, int cepLiftering)
 void UnWeightCepstrum(Vector c, int start, int count, int cepLiftering)
 {
    int i,j;
+   Vector cepWin;
    
-   if (cepWinL != cepLiftering || count > cepWinSize)
-      GenCepWin(cepLiftering,count);
+   cepWin = GetCepWin(cepLiftering,count);
    j = start;
    for (i=1;i<=count;i++)
       c[j++] /= cepWin[i];
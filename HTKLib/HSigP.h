@@ -106,7 +106,9 @@ void FFT(Vector s, int invert);
    When called s holds nn complex values stored in the
    sequence   [ r1 , i1 , r2 , i2 , .. .. , rn , in ] where
    n = VectorSize(s) DIV 2, n must be a power of 2. On exit s
-   holds the fft (or the inverse fft if invert == 1) 
+   holds the fft (or the inverse fft if invert == 1).  The bit
+   reversal and twiddle tables for each n are built on first use
+   and cached; FFT and Realft are safe to call from several threads.
 */
 
 void Realft (Vector s);
@@ -188,6 +190,47 @@ float FBank2C0(Vector fbank);
 */
 
 
+/* --------------- Multi-Frame Filterbank Operations --------------- */
+
+typedef struct{
+   int maxFrames;       /* max frames processed per call */
+   int nBins;           /* number of fft bins in passband */
+   Matrix spec;         /* [1..nBins][1..maxFrames] spectra, bin-major */
+   Matrix chan;         /* [1..numChans][1..maxFrames] channels, chan-major */
+   Vector work;         /* workspace for multi-frame fft */
+}FBankBlock;
+
+FBankBlock InitFBankBlock(MemHeap *x, FBankInfo info, int maxFrames);
+/*
+   Create workspace for Wave2FBankBlock to process up to maxFrames
+   frames at a time with filterbank info.
+*/
+
+void Wave2FBankBlock(Matrix s, Matrix fbank, Vector te, int nFrames,
+                     FBankInfo info, FBankBlock blk);
+/*
+   As Wave2FBank but for the nFrames speech frames held in rows
+   1..nFrames of s; the filterbank coefficients are stored in the
+   corresponding rows of fbank and, if te is not NULL, the frame 
+   energies in te[1..nFrames].  The ffts of several frames are done
+   together and the filterbank is applied to the whole block as a
+   sparse matrix multiply.
+*/
+
+void InitDCTMatrix(Matrix cm, int cepLiftering, float scale);
+/*
+   Fill cm[1..n][1..numChans] with the DCT basis used by FBank2MFCC
+   including its sqrt(2/numChans) normalisation.  Each row j is 
+   also multiplied by scale and, if cepLiftering>0, by the 
+   WeightCepstrum lifter weight for coefficient j.
+*/
+
+void FBank2MFCCBlock(Matrix fbank, Matrix c, int nFrames, Matrix cm);
+/*
+   Multiply rows 1..nFrames of fbank by the basis cm set up by
+   InitDCTMatrix, storing the cepstral coefficients in rows of c.
+*/
+
 /* ------------------- PLP Related Operations ---------------------- */
 
 void InitPLP(FBankInfo info, int lpcOrder, Vector eql, DMatrix cm);
@@ -1159,6 +1159,104 @@ void ZeroAccsParallel(HMMSet *hset, UPDSet uFlags, int nPara)
       TMZeroAccs(hset,start,end);
 }
 
+/* SumVaAcc: add accumulator slots 1..nPara-1 of va into slot 0 */
+static void SumVaAcc(VaAcc *va, CovKind ck, int nPara)
+{
+   int i,j,k,size;
+
+   for (i=1;i<nPara;i++){
+      switch(ck){
+      case DIAGC:
+      case INVDIAGC:
+         size = VectorSize(va[0].cov.var);
+         for (k=1;k<=size;k++)
+            va[0].cov.var[k] += va[i].cov.var[k];
+         break;
+      case FULLC:
+         size = TriMatSize(va[0].cov.inv);
+         for (k=1;k<=size;k++)
+            for (j=1;j<=k;j++)
+               va[0].cov.inv[k][j] += va[i].cov.inv[k][j];
+         break;
+      default:
+         HError(7170,"SumAccs: bad cov kind %d",ck);
+      }
+      va[0].occ += va[i].occ;
+   }
+}
+
+/* SumMuAcc: add accumulator slots 1..nPara-1 of ma into slot 0 */
+static void SumMuAcc(MuAcc *ma, int nPara)
+{
+   int i,k,size;
+
+   size = VectorSize(ma[0].mu);
+   for (i=1;i<nPara;i++){
+      for (k=1;k<=size;k++)
+         ma[0].mu[k] += ma[i].mu[k];
+      ma[0].occ += ma[i].occ;
+   }
+}
+
+/* EXPORT->SumAccsParallel: reduce accumulator slots into slot 0 */
+void SumAccsParallel(HMMSet *hset, UPDSet uFlags, int nPara)
+{
+   HMMScanState hss;
+   StreamElem *ste;
+   HLink hmm;
+   TrAcc *ta;
+   WtAcc *wa;
+   MixPDF *mp;
+   int i,j,k,m,s,N,M;
+
+   if (nPara<2) return;
+   NewHMMScan(hset,&hss);
+   do {
+      hmm = hss.hmm;
+      while (GoNextState(&hss,TRUE)) {
+         while (GoNextStream(&hss,TRUE)) {
+            ste = hss.ste;
+            wa = (WtAcc *)ste->hook; M = VectorSize(wa[0].c);
+            for (i=1;i<nPara;i++){
+               for (m=1;m<=M;m++) wa[0].c[m] += wa[i].c[m];
+               wa[0].occ += wa[i].occ;
+            }
+            if (hss.isCont)
+               while (GoNextMix(&hss,TRUE)) {
+                  if ((uFlags&UPMEANS) && (!IsSeenV(hss.mp->mean))) {
+                     SumMuAcc((MuAcc *)GetHook(hss.mp->mean),nPara);
+                     TouchV(hss.mp->mean);
+                  }
+                  if ((uFlags&(UPVARS|UPSEMIT)) && (!IsSeenV(hss.mp->cov.var))) {
+                     SumVaAcc((VaAcc *)GetHook(hss.mp->cov.var),
+                              (uFlags&UPSEMIT)?FULLC:hss.mp->ckind,nPara);
+                     TouchV(hss.mp->cov.var);
+                  }
+               }
+         }
+      }
+      if (!IsSeenV(hmm->transP)) {
+         ta = (TrAcc *)GetHook(hmm->transP); N = hmm->numStates;
+         for (i=1;i<nPara;i++){
+            for (j=1;j<=N;j++){
+               ta[0].occ[j] += ta[i].occ[j];
+               for (k=1;k<=N;k++)
+                  ta[0].tran[j][k] += ta[i].tran[j][k];
+            }
+         }
+         TouchV(hmm->transP);       
+      }
+   } while (GoNextHMM(&hss));
+   EndHMMScan(&hss);
+   if (hset->hsKind==TIEDHS)
+      for (s=1;s<=hset->swidth[0];s++)
+         for (m=1;m<=hset->tmRecs[s].nMix;m++){
+            mp = hset->tmRecs[s].mixes[m];
+            SumMuAcc((MuAcc *)GetHook(mp->mean),nPara);
+            SumVaAcc((VaAcc *)GetHook(mp->cov.var),mp->ckind,nPara);
+         }
+}
+
 /* TMShowAccs: show accs attached to tied mixes in hset */
 void TMShowAccs(HMMSet *hset, int index)
 {
@@ -1352,7 +1450,8 @@ void ResetHMMPreComps(HLink hmm, int nStreams)
 }
 
 /* EXPORT->ResetHMMWtAccs: reset the wt accs for the specified HMM */
-void ResetHMMWtAccs(HLink hmm, int nStreams)
+void ResetHMMWtAccs(HLink hmm, int nStreams){ ResetHMMWtAccsParallel(hmm,nStreams,0); }
+void ResetHMMWtAccsParallel(HLink hmm, int nStreams, int index)
 {
    StateElem *se;
    StreamElem *ste;
@@ -1366,7 +1465,7 @@ void ResetHMMWtAccs(HLink hmm, int nStreams)
       for (s=1;s<=nStreams; s++,ste++){
          wa = (WtAcc *)ste->hook;
          if (wa != NULL) {
-            wa->time = -1; wa->prob = NULL;
+            wa[index].time = -1; wa[index].prob = NULL;
          }
       }
    }
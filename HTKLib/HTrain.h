@@ -264,6 +264,12 @@ void ZeroAccs(HMMSet *hset, UPDSet uFlags);
    Zero all accumulators in given HMM set.
 */
 
+void SumAccsParallel(HMMSet *hset, UPDSet uFlags, int nPara);
+/*
+   Add accumulator slots 1..nPara-1 into slot 0, eg to merge the
+   per-thread shards of a multi-threaded accumulation pass.
+*/
+
 void ShowAccsParallel(HMMSet *hset, UPDSet uFlags, int index);
 void ShowAccs(HMMSet *hset, UPDSet uFlags);
 /*
@@ -287,6 +293,7 @@ void ResetHMMPreComps(HLink hmm, int nStreams);
    given HMM.
 */
 
+void ResetHMMWtAccsParallel(HLink hmm, int nStreams, int index);
 void ResetHMMWtAccs(HLink hmm, int nStreams);
 /*
    Reset all the wt accs associated with a
@@ -541,8 +541,11 @@ static long GetOGIHeaderInfo(FILE *f, Wave w, InputAction *ia)
 
 /* ---------------------- NIST Format Interface Routines --------------------- */
 
-static int cNIST;    /* current input char */
-static int cCount;   /* num bytes read */
+typedef struct {     /* NIST header scanner, one per header read */
+   FILE *f;          /* input file */
+   int c;            /* current input char */
+   int count;        /* num bytes read */
+} NISTScan;
 
 enum _CompressType{
    SHORTPACK,   /* MIT shortpack-v0 */
@@ -551,53 +554,53 @@ enum _CompressType{
 };
 typedef enum _CompressType CompressType;
 
-/* GetNISTToken: get next token delimited by white space from f */
-static char * GetNISTToken(FILE *f,char *buf)
+/* GetNISTToken: get next token delimited by white space from ns */
+static char * GetNISTToken(NISTScan *ns,char *buf)
 {
    int i=0;
    
-   while (isspace(cNIST)) {
-      cNIST=fgetc(f); ++cCount;
+   while (isspace(ns->c)) {
+      ns->c=fgetc(ns->f); ++ns->count;
    }
    do {
-      if (cNIST == EOF)
+      if (ns->c == EOF)
          HError(6250,"GetNISTToken: Unexpected end of file");
-      buf[i++] = cNIST; cNIST=fgetc(f); ++cCount;
-   } while(!isspace(cNIST) && i<99);
+      buf[i++] = ns->c; ns->c=fgetc(ns->f); ++ns->count;
+   } while(!isspace(ns->c) && i<99);
    buf[i] = '\0';
    return buf;
 }
 
-/* NISTSkipLine: skip to next input line of f */
-static void NISTSkipLine(FILE *f)
+/* NISTSkipLine: skip to next input line of ns */
+static void NISTSkipLine(NISTScan *ns)
 {
-   while (cNIST != '\012'){   /* new line is line feed on NIST ROM */
-      cNIST=fgetc(f); ++cCount;
-      if (cNIST == EOF)
+   while (ns->c != '\012'){   /* new line is line feed on NIST ROM */
+      ns->c=fgetc(ns->f); ++ns->count;
+      if (ns->c == EOF)
          HError(6250,"NISTSkipLine: Unexpected end of file");
    }  
-   cNIST=fgetc(f); ++cCount;
+   ns->c=fgetc(ns->f); ++ns->count;
 }
 
-/* GetNISTIVal: get int val from f (indicated by -i) */
-static int GetNISTIVal(FILE *f)
+/* GetNISTIVal: get int val from ns (indicated by -i) */
+static int GetNISTIVal(NISTScan *ns)
 {
    char buf[100];
    
-   if (strcmp(GetNISTToken(f,buf),"-i") != 0)
+   if (strcmp(GetNISTToken(ns,buf),"-i") != 0)
       HError(6251,"GetNISTIVal: NIST type indicator -i expected");
-   return atoi(GetNISTToken(f,buf));
+   return atoi(GetNISTToken(ns,buf));
 }
 
 /* GetNISTSVal: get string of lenth n into s (indicated by -sn) */
-static void GetNISTSVal(FILE *f, char *s)
+static void GetNISTSVal(NISTScan *ns, char *s)
 {
    char buf[100];
 
-   GetNISTToken(f,buf);
+   GetNISTToken(ns,buf);
    if (buf[0] != '-' || buf[1] != 's')
       HError(6251,"GetNISTSVal: NIST type indicator -s expected");
-   GetNISTToken(f,s);
+   GetNISTToken(ns,s);
    if (atoi(buf+2) != strlen(s))
       HError(6251,"GetNISTSVal: bad string length");
 }
@@ -609,43 +612,44 @@ static long GetNISTHeaderInfo(FILE *f, Wave w, InputAction *ia)
    Boolean interleaved = FALSE;
    long nS,sR,sS, cC;
    long dataBytes;
+   NISTScan ns;
    
-   cNIST = ' '; cCount = 0;
+   ns.f = f; ns.c = ' '; ns.count = 0;
    nS=sR=sS=-1; 
    byteFormat[0]='\0'; sampCoding[0]='\0';
-   lab = GetNISTToken(f,token);           /* Check NIST label */
+   lab = GetNISTToken(&ns,token);           /* Check NIST label */
    if (strlen(lab)>4) *(lab+4) = '\0';
    if (strcmp(lab,"NIST") !=0){
       HRError(6251,"GetNISTHeaderInfo: NIST header label missing");
       return -1;
    }
-   NISTSkipLine(f);
-   w->hdrSize = atoi(GetNISTToken(f,token)); /* header #bytes */
-   NISTSkipLine(f);
-   while (strcmp(GetNISTToken(f,token),"end_head")!=0){
+   NISTSkipLine(&ns);
+   w->hdrSize = atoi(GetNISTToken(&ns,token)); /* header #bytes */
+   NISTSkipLine(&ns);
+   while (strcmp(GetNISTToken(&ns,token),"end_head")!=0){
       if (strcmp(token,"sample_count") == 0)    /* objects */
-         nS = GetNISTIVal(f);
+         nS = GetNISTIVal(&ns);
       else if (strcmp(token,"sample_rate") == 0)
-         sR = GetNISTIVal(f);
+         sR = GetNISTIVal(&ns);
       else if (strcmp(token,"sample_n_bytes") == 0)
-         sS = GetNISTIVal(f);
+         sS = GetNISTIVal(&ns);
       else if (strcmp(token,"sample_byte_format") == 0)
-         GetNISTSVal(f,byteFormat);
+         GetNISTSVal(&ns,byteFormat);
       else if (strcmp(token,"sample_coding") == 0)
-         GetNISTSVal(f,sampCoding);
+         GetNISTSVal(&ns,sampCoding);
       else if (strcmp(token,"channels_interleaved") == 0){
-         GetNISTSVal(f,buf);
+         GetNISTSVal(&ns,buf);
          if (strcmp(buf,"TRUE") == 0)
             interleaved = TRUE;
       }
       else if (strcmp (token, "channel_count") == 0) {
-         cC = GetNISTIVal(f);
+         cC = GetNISTIVal(&ns);
          if (cC==2)
             interleaved = TRUE;
          else if (cC!=1)
             HError(6251,"GetNISTHeaderInfo: channel count = %d in NIST header",cC);
       }
-      NISTSkipLine(f);
+      NISTSkipLine(&ns);
    }
    if (sS < 1 || sS > 2){
       HRError(6251,"GetNISTHeaderInfo: Sample size = %d in NIST header",sS);
@@ -707,7 +711,7 @@ static long GetNISTHeaderInfo(FILE *f, Wave w, InputAction *ia)
       HRError(6251,"GetNISTHeaderInfo: unknown byte format in NIST header");
       return -1;
    }
-   ConsumeHeader(f,cCount,w->hdrSize);
+   ConsumeHeader(f,ns.count,w->hdrSize);
    return dataBytes;
 }
 
@@ -56,6 +56,7 @@ char *hcopy_vc_id = "$Id: HCopy.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $";
 #define T_KINDS   002           /* report file formats and parm kinds */
 #define T_SEGMENT 004           /* output segment label calculations */
 #define T_MEM     010           /* debug memory usage */
+#define T_THREAD  020           /* report thread set-up */
 
 static int  trace  = 0;         /* Trace level */
 typedef struct _TrList *TrPtr;  /* simple linked list for trace info */
@@ -66,6 +67,9 @@ typedef struct _TrList {
 static TrL trList;              /* 1st element in trace linked list */
 static TrPtr trStr = &trList;   /* ptr to it */
 
+void AppendTrace(MemHeap *x, TrPtr tr, char *str);
+void PrintTrace(FILE *f, TrPtr tr);
+
 static int traceWidth = 70;     /* print this many chars before wrapping ln */
 
 static ConfParam *cParm[MAXGLOBS];
@@ -119,6 +123,27 @@ static MemHeap cStack;          /* chop stack */
 static MemHeap lStack;          /* label i/o  stack */
 static MemHeap tStack;          /* trace list  stack */
 
+/* ---------------- Parallel Conversion ------------------------- */
+
+#define MAXTHREADS 256
+#define JOBSPERTHREAD 4         /* conversions queued ahead per thread */
+
+typedef struct {                /* a queued src -> tgt conversion */
+   char src[MAXFNAMELEN];       /* source file */
+   char tgt[MAXFNAMELEN];       /* target file */
+} CopyJob;
+
+typedef struct {                /* a conversion thread */
+   MemHeap iStack;              /* private input stack */
+   MemHeap oStack;              /* private output stack */
+} CopyWorker;
+
+static int nThreads = 1;        /* number of conversion threads */
+static CopyWorker *workers;     /* array[0..nThreads-1] of threads */
+static CopyJob *jobs;           /* ring of nJobs queued conversions */
+static int nJobs = 0;
+static JobPool *pool = NULL;    /* threads converting the queued jobs */
+
 /* ---------------- Process Command Line ------------------------- */
 
 #define MAXTIME 1E13            /* maximum HTime (1E6 secs) for GetChkdFlt */
@@ -130,6 +155,7 @@ void ReportUsage(void)
    printf(" -a i     Use level i labels                  1\n");
    printf(" -e t     End copy at time t                  EOF\n");
    printf(" -i mlf   Save labels to mlf s                null\n");
+   printf(" -j N     Convert N files in parallel         1\n");
    printf(" -l dir   Output target label files to dir    current\n");
    printf(" -m t     Set margin of t around x/n segs     0\n");
    printf(" -n i [j] Extract i'th [to j'th] label        off\n");
@@ -151,6 +177,7 @@ void SetConfParms(void)
       if (GetConfInt(cParm,nParm,"TRACE",&i)) trace = i;
       if (GetConfBool(cParm,nParm,"SAVEASVQ",&b)) saveAsVQ = b;
       if (GetConfInt(cParm,nParm,"NSTREAMS",&i)) swidth0 = i;
+      if (GetConfInt(cParm,nParm,"NUMTHREADS",&i)) nThreads = i;
       if (GetConfStr(cParm,nParm,"SOURCEFORMAT",buf))
          srcFF = Str2Format(buf);
       if (GetConfStr(cParm,nParm,"TARGETFORMAT",buf))
@@ -183,6 +210,13 @@ int main(int argc, char *argv[])
    void OpenSpeechFile(char *s);
    void AppendSpeechFile(char *s);
    void PutTargetFile(char *s);
+   void CheckThreadSetUp(void);
+   void StartCopyPool(void);
+   void QueueCopy(char *src, char *tgt);
+   void DrainCopies(void);
+   void StopCopyPool(void);
+   Boolean ExtFileName(char *s);
+   char src[MAXFNAMELEN];       /* deferred source of a parallel copy */
 
    if(InitShell(argc,argv,hcopy_version,hcopy_vc_id)<SUCCESS)
       HError(1000,"HCopy: InitShell failed");
@@ -227,6 +261,8 @@ int main(int argc, char *argv[])
          if(SaveToMasterfile(GetStrArg())<SUCCESS)
             HError(1014,"HCopy: Cannot write to MLF");
          useMLF = TRUE; labF = TRUE; break;
+      case 'j':
+         nThreads = GetChkedInt(1,MAXTHREADS,s); break;
       case 'l':
          if (NextArg() != STRINGARG)
             HError(1019,"HCopy: Target label file directory expected");
@@ -309,15 +345,38 @@ int main(int argc, char *argv[])
    if (NumArgs() == 1)  
       HError(1019,"HCopy: Target file or + operator expected");
    FixOptions();
+   CheckThreadSetUp();
+   if (nThreads>1) StartCopyPool();
    while (NumArgs()>1) { /* process group S1 + S2 + ... TGT */
       off = 0.0;
-      if (NextArg()!=STRINGARG)
+      if (NextArg()!=STRINGARG) {
+         DrainCopies();
          HError(1019,"HCopy: Source file name expected");    
+      }
       s = GetStrArg();     
-      OpenSpeechFile(s);               /* Load initial file  S1 */
-      if (NextArg()!=STRINGARG)
-         HError(1019,"HCopy: Target file or + operator expected");
-      s = GetStrArg();
+      if (nThreads>1 && !ExtFileName(s)) {
+         /* Defer S1 until the group is known to be a plain S1 TGT */
+         if (strlen(s)>=MAXFNAMELEN)
+            HError(1019,"HCopy: Source file name %s too long",s);
+         strcpy(src,s);
+         if (NextArg()!=STRINGARG) {
+            DrainCopies();
+            HError(1019,"HCopy: Target file or + operator expected");
+         }
+         s = GetStrArg();
+         if (strcmp(s,"+") != 0) {
+            QueueCopy(src,s);
+            continue;
+         }
+         DrainCopies();                /* Appends are done serially */
+         OpenSpeechFile(src);
+      } else {
+         DrainCopies();
+         OpenSpeechFile(s);            /* Load initial file  S1 */
+         if (NextArg()!=STRINGARG)
+            HError(1019,"HCopy: Target file or + operator expected");
+         s = GetStrArg();
+      }
       while (strcmp(s,"+") == 0) {     /* Append + S2 + S3 ... */
          if (NextArg()!=STRINGARG)
             HError(1019,"HCopy: Append file name expected");
@@ -337,6 +396,7 @@ int main(int argc, char *argv[])
       ResetHeap(&oStack);
       if(chopF) ResetHeap(&cStack);
    }
+   if (nThreads>1) StopCopyPool();
    if(useMLF) CloseMLFSaveFile();
    if (NumArgs() != 0) HError(-1019,"HCopy: Unused args ignored");
    Exit(0);
@@ -345,36 +405,36 @@ int main(int argc, char *argv[])
 
 /* ----------------- Trace linked list handling ------------------------ */
 
-/* AppendTrace: insert a string to trStr for basic tracing */
-void AppendTrace(char *str)
+/* AppendTrace: insert a string to tr (allocated in x) for basic tracing */
+void AppendTrace(MemHeap *x, TrPtr tr, char *str)
 {
-   TrPtr tmp = trStr;
+   TrPtr tmp = tr;
 
    /* Seek to end of list */
    while (tmp->str != NULL) tmp = tmp->next;
-   tmp->str =  CopyString(&tStack, str);
-   tmp->next = (TrPtr)New(&tStack,sizeof(trList));
+   tmp->str =  CopyString(x, str);
+   tmp->next = (TrPtr)New(x,sizeof(trList));
    tmp->next->str = NULL;
    tmp->next->next = NULL;
 }
 
-/* PrintTrace: Print trace linked list */
-void PrintTrace(void)
+/* PrintTrace: Print trace linked list tr to f */
+void PrintTrace(FILE *f, TrPtr tr)
 {
    int linelen = 0;
-   TrPtr tmp = trStr;
+   TrPtr tmp = tr;
 
    /* print all entries in list */
    while (tmp->next != NULL){
-      printf("%s ",tmp->str);
+      fprintf(f,"%s ",tmp->str);
       linelen += strlen(tmp->str) + 1;
       if (linelen > traceWidth && tmp->next->next!=NULL){
-         printf("\n    ");  /* wrap line where appropriate */
+         fprintf(f,"\n    ");  /* wrap line where appropriate */
          linelen = 0;
       }
       tmp = tmp->next;
    }
-   if(linelen > 0) printf("\n");
+   if(linelen > 0) fprintf(f,"\n");
 }
 
 /* ------------------- Utility Routines ------------------------ */
@@ -722,26 +782,19 @@ HTime AppendParm(char *src)
    return(i*info.tgtSampRate);
 }
 
-/* OpenParmFile: open source parm file and return length */
-HTime OpenParmFile(char *src)
+/* CopyToTable: copy all of buffer b into a new table buffer in x and
+   close b */
+ParmBuf CopyToTable(MemHeap *x, ParmBuf b, BufferInfo info)
 {
    int i;
-   ParmBuf b, cb;
+   ParmBuf tb;
    short swidth[SMAX];
    Boolean eSep;
    Observation o;
-   BufferInfo info;
 
-   if((b =  OpenBuffer(&iStack,src,0,srcFF,TRI_UNDEF,TRI_UNDEF))==NULL)
-      HError(1050,"OpenParmFile: Config parameters invalid");
-   GetBufferInfo(b,&info);
-   srcSampRate = info.srcSampRate;
-   tgtSampRate = info.tgtSampRate;
-   srcPK = info.srcPK; tgtPK = info.tgtPK;
-   cb = chopF?ChopParm(b,st,en,info.tgtSampRate):b;
    ZeroStreamWidths(swidth0,swidth);
    SetStreamWidths(info.tgtPK,info.tgtVecSize,swidth,&eSep);
-   o = MakeObservation(&oStack, swidth, info.tgtPK, saveAsVQ, eSep);
+   o = MakeObservation(x, swidth, info.tgtPK, saveAsVQ, eSep);
    if (saveAsVQ){
       if (info.tgtPK&HASNULLE){
          info.tgtPK=DISCRETE+HASNULLE;
@@ -749,12 +802,29 @@ HTime OpenParmFile(char *src)
          info.tgtPK=DISCRETE;
       }
    }
-   pb =  EmptyBuffer(&oStack, ObsInBuffer(cb), o, info);
-   for(i=0; i < ObsInBuffer(cb); i++){
-      ReadAsTable(cb, i, &o);
-      AddToBuffer(pb, o);
+   tb =  EmptyBuffer(x, ObsInBuffer(b), o, info);
+   for(i=0; i < ObsInBuffer(b); i++){
+      ReadAsTable(b, i, &o);
+      AddToBuffer(tb, o);
    }
-   CloseBuffer(cb);
+   CloseBuffer(b);
+   return tb;
+}
+
+/* OpenParmFile: open source parm file and return length */
+HTime OpenParmFile(char *src)
+{
+   ParmBuf b, cb;
+   BufferInfo info;
+
+   if((b =  OpenBuffer(&iStack,src,0,srcFF,TRI_UNDEF,TRI_UNDEF))==NULL)
+      HError(1050,"OpenParmFile: Config parameters invalid");
+   GetBufferInfo(b,&info);
+   srcSampRate = info.srcSampRate;
+   tgtSampRate = info.tgtSampRate;
+   srcPK = info.srcPK; tgtPK = info.tgtPK;
+   cb = chopF?ChopParm(b,st,en,info.tgtSampRate):b;
+   pb = CopyToTable(&oStack, cb, info);
    if( info.nSamples > 0 )
       return(info.nSamples*srcSampRate);
    else
@@ -775,7 +845,7 @@ void OpenSpeechFile(char *s)
    else  
       len = OpenParmFile(s);
    if(labF) AppendLabs(tr,len);
-   if (trace & T_TOP) AppendTrace(s);
+   if (trace & T_TOP) AppendTrace(&tStack,trStr,s);
    if (tgtPK == ANON) tgtPK = srcPK;      
    if(trace & T_KINDS){
       printf("Source file format: %s [%s]\n",
@@ -801,7 +871,7 @@ void AppendSpeechFile(char *s)
       AppendLabs(tr,len);
    }
    if (trace & T_TOP) { 
-      AppendTrace("+"); AppendTrace(s);
+      AppendTrace(&tStack,trStr,"+"); AppendTrace(&tStack,trStr,s);
    }
 }
 
@@ -818,8 +888,8 @@ void PutTargetFile(char *s)
       CloseBuffer(pb);
    }
    if (trace & T_TOP){
-      AppendTrace("->"); AppendTrace(s);
-      PrintTrace();     
+      AppendTrace(&tStack,trStr,"->"); AppendTrace(&tStack,trStr,s);
+      PrintTrace(stdout,trStr);     
       ResetHeap(&tStack);
       trList.str = NULL;
    }
@@ -827,6 +897,130 @@ void PutTargetFile(char *s)
       SaveLabs(s,trans);
 }
 
+/* --------------------- Parallel Conversion ---------------------- */
+
+/* CheckThreadSetUp: fall back to one thread if the options carry state
+   from one file to the next (labels, segments, VQ, waveform targets)
+   or the coding channel is not reentrant */
+void CheckThreadSetUp(void)
+{
+   char *why = NULL;
+
+   if (nThreads<1 || nThreads>MAXTHREADS)
+      HError(1019,"HCopy: NUMTHREADS must be in range 1..%d",MAXTHREADS);
+   if (nThreads==1) return;
+   if (labF || chopF)
+      why = "label or segment extraction";
+   else if (tgtPK == ANON || tgtPK == WAVEFORM)
+      why = "waveform or unspecified targets";
+   else if (saveAsVQ)
+      why = "SAVEASVQ";
+   else if (srcFF == ESIG || tgtFF == ESIG)
+      why = "ESIG files";
+   else if (trace & T_MEM)
+      why = "memory tracing";
+   else
+      ReentrantChannel(&why);
+   if (why != NULL) {
+      HError(-1019,"HCopy: %d threads not supported with %s, using 1",
+             nThreads,why);
+      nThreads = 1;
+   }
+}
+
+/* ExtFileName: true if s was given as an extended file name; these
+   are only held in a short ring by HShell so are copied serially */
+Boolean ExtFileName(char *s)
+{
+   char act[MAXFNAMELEN];
+   long stIdx,enIdx;
+
+   return GetFileNameExt(s,act,&stIdx,&enIdx);
+}
+
+/* CopyFile: convert job->src to job->tgt exactly as OpenSpeechFile
+   followed by PutTargetFile would for a plain src tgt pair */
+static void CopyFile(CopyWorker *w, CopyJob *job)
+{
+   ParmBuf b, tb;
+   BufferInfo info;
+   TrL tl;
+   char buf[MAXSTRLEN];
+   FILE *f = MsgOut();
+
+   if((b =  OpenBuffer(&w->iStack,job->src,0,srcFF,TRI_UNDEF,TRI_UNDEF))==NULL)
+      HError(1050,"OpenParmFile: Config parameters invalid");
+   GetBufferInfo(b,&info);
+   tb = CopyToTable(&w->oStack, b, info);
+   if(trace & T_KINDS){
+      fprintf(f,"Source file format: %s [%s]\n",
+              Format2Str(srcFF), ParmKind2Str(info.srcPK,buf));
+      fprintf(f,"Target file format: %s [%s]\n",
+              Format2Str(tgtFF), ParmKind2Str(info.tgtPK,buf));
+      fprintf(f,"Source rate: %.0f Target rate: %.0f \n",
+              info.srcSampRate,info.tgtSampRate);
+   }
+   if(SaveBuffer(tb,job->tgt,tgtFF)<SUCCESS)
+      HError(1014,"PutTargetFile: Could not save parm file %s", job->tgt);
+   CloseBuffer(tb);
+   if (trace & T_TOP){
+      tl.str = NULL;
+      AppendTrace(&w->iStack,&tl,job->src); 
+      AppendTrace(&w->iStack,&tl,"->"); AppendTrace(&w->iStack,&tl,job->tgt);
+      PrintTrace(f,&tl);
+   }
+}
+
+/* RunCopyJob: convert queued job j on pool thread w */
+static void RunCopyJob(int w, int j)
+{
+   CopyFile(workers+w,jobs+j);
+   ResetHeap(&workers[w].iStack);
+   ResetHeap(&workers[w].oStack);
+}
+
+/* StartCopyPool: create the job ring and start the conversion threads */
+void StartCopyPool(void)
+{
+   CopyWorker *w;
+   int i;
+
+   nJobs = nThreads*JOBSPERTHREAD;
+   jobs = (CopyJob *) New(&gcheap,nJobs*sizeof(CopyJob));
+   workers = (CopyWorker *) New(&gcheap,nThreads*sizeof(CopyWorker));
+   for (i=0,w=workers; i<nThreads; i++,w++) {
+      CreateHeap(&w->iStack, "InBuf",  MSTAK, 1, 0.0, STACKSIZE, LONG_MAX);
+      CreateHeap(&w->oStack, "OutBuf", MSTAK, 1, 0.0, STACKSIZE, LONG_MAX);
+   }
+   pool = CreateJobPool(nThreads,nJobs,RunCopyJob,NULL);
+   if (trace & T_THREAD)
+      printf("HCopy: converting with %d threads\n",nThreads);
+}
+
+/* QueueCopy: queue conversion of src to tgt */
+void QueueCopy(char *src, char *tgt)
+{
+   CopyJob *job;
+
+   if (strlen(tgt)>=MAXFNAMELEN)
+      HError(1019,"HCopy: Target file name %s too long",tgt);
+   job = jobs + NextJob(pool);
+   strcpy(job->src,src); strcpy(job->tgt,tgt);
+   QueueJob(pool);
+}
+
+/* DrainCopies: wait for and report all queued conversions */
+void DrainCopies(void)
+{
+   if (pool != NULL) DrainJobs(pool);
+}
+
+/* StopCopyPool: finish all conversions and stop the threads */
+void StopCopyPool(void)
+{
+   StopJobPool(pool);
+}
+
 /* ----------------------------------------------------------- */
 /*                      END:  HCopy.c                          */
 /* ----------------------------------------------------------- */
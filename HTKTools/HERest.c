@@ -74,6 +74,7 @@ char *herest_vc_id = "$Id: HERest.c,v 1.2 2006/12/07 11:09:08 mjfg Exp $";
 #include "HAdapt.h"
 #include "HMap.h"
 #include "HFB.h"
+#include <pthread.h>
 
 /* Trace Flags */
 #define T_TOP   0001    /* Top level tracing */
@@ -146,6 +147,32 @@ static float varFloorPercent = 0;
 
 static char *labFileMask = NULL;
 
+/* in-process parallel forward-backward */
+#define MAXTHREADS 256
+
+typedef struct {           /* an utterance queued for a worker */
+   char *datafn;           /* data file */
+   char *datafn2;          /* second data file (single pass retraining) */
+   ExtFile *ext;           /* extensions of extended data file names */
+   int nExt;
+} FBJob;
+
+typedef struct {           /* a forward-backward worker thread */
+   int idx;                /* worker number == accumulator slot */
+   FBInfo *fbInfo;         /* private alpha-beta storage for slot idx */
+   UttInfo *utt;           /* private utterance storage */
+   Boolean firstTime;      /* utterance observations not yet created */
+   LogDouble totalPr;      /* summed log prob of this worker's utterances */
+   int totalT;             /* summed frames of this worker's utterances */
+   pthread_t thread;
+} FBWorker;
+
+static int nThreads = 1;            /* number of forward-backward threads */
+static FBJob *fbJobs = NULL;        /* queued utterances */
+static int nJobs = 0, maxJobs = 0;
+static pthread_mutex_t loadLock = PTHREAD_MUTEX_INITIALIZER; /* serialises
+                                       label/data loading (HLabel, HParm) */
+
 /* ------------------ Process Command Line -------------------------- */
    
 /* SetConfParms: set conf parms relevant to HCompV  */
@@ -161,6 +188,7 @@ void SetConfParms(void)
       if (GetConfInt(cParm,nParm,"TRACE",&i)) trace = i;
       if (GetConfFlt(cParm,nParm,"VARFLOORPERCENTILE",&f)) varFloorPercent = f;
       if (GetConfBool(cParm,nParm,"SAVEBINARY",&b)) saveBinary = b;
+      if (GetConfInt(cParm,nParm,"NUMTHREADS",&i)) nThreads = i;
       /* 2-model reestimation alignment model set */
       if (GetConfStr(cParm,nParm,"ALIGNMODELMMF",buf)) {
           strcpy(al_hmmMMF,buf); al_hmmUsed = TRUE;
@@ -213,6 +241,7 @@ void ReportUsage(void)
    printf(" -d s    dir to find hmm definitions          current\n");
    printf(" -h s    set output speaker name pattern   *.%%%%%%\n");
    printf("         to s, optionally set input and parent patterns\n");
+   printf(" -j N    forward-backward worker threads      1\n");
    printf(" -l N    set max files per speaker            off\n");
    printf(" -m N    set min examples needed per model    3\n");
    printf(" -o s    extension for new hmm files          as src\n");
@@ -316,6 +345,8 @@ int main(int argc, char *argv[])
 
    void Initialise(FBInfo *fbInfo, MemHeap *x, HMMSet *hset, char *hmmListFn);
    void DoForwardBackward(FBInfo *fbInfo, UttInfo *utt, char *datafn, char *datafn2);
+   void QueueForwardBackward(char *datafn, char *datafn2);
+   void RunForwardBackward(FBInfo *fbInfo, UttInfo *utt, MemHeap *x);
    void UpdateModels(HMMSet *hset, ParmBuf pbuf2);
    void StatReport(HMMSet *hset);
    
@@ -458,6 +489,8 @@ int main(int argc, char *argv[])
 	  HError(1,"Speaker name pattern expected");
 	xfInfo.outSpkrPat = GetStrArg();
 	break;
+      case 'j':
+         nThreads = GetChkedInt(1,MAXTHREADS,s); break;
       case 'l':
          maxSpUtt = GetChkedInt(0,0100000,s);
          break;
@@ -539,11 +572,17 @@ int main(int argc, char *argv[])
          fbInfo->inXForm = xfInfo.inXForm;
          fbInfo->al_inXForm = xfInfo.al_inXForm;
          fbInfo->paXForm = xfInfo.paXForm;
-         if ((maxSpUtt==0) || (spUtt<maxSpUtt))
-            DoForwardBackward(fbInfo, utt, datafn, datafn2) ;
+         if ((maxSpUtt==0) || (spUtt<maxSpUtt)) {
+            if (nThreads>1)
+               QueueForwardBackward(datafn, datafn2);
+            else
+               DoForwardBackward(fbInfo, utt, datafn, datafn2) ;
+         }
          numUtt += 1; spUtt++;
       }
    } while (NumArgs()>0);
+   if (nThreads>1)
+      RunForwardBackward(fbInfo, utt, &fbInfoStack);
 
    if (uFlags&UPXFORM) {/* ensure final speaker correctly handled */ 
       UpdateSpkrStats(&hset,&xfInfo, NULL); 
@@ -578,6 +617,31 @@ int main(int argc, char *argv[])
 
 /* -------------------------- Initialisation ----------------------- */
 
+/* CheckThreadSetUp: fall back to one thread if the set-up shares 
+   per-utterance state between utterances (transforms, tied mixtures,
+   2-model re-estimation) or accumulators are just being merged */
+void CheckThreadSetUp(HMMSet *hset)
+{
+   char *why = NULL;
+
+   if (nThreads<1 || nThreads>MAXTHREADS)
+      HError(2319,"HERest: NUMTHREADS must be in range 1..%d",MAXTHREADS);
+   if (nThreads==1) return;
+   if (parMode==0)
+      why = "loaded accumulators (-p 0)";
+   else if (hset->hsKind==TIEDHS)
+      why = "tied-mixture systems";
+   else if (al_hmmUsed)
+      why = "2-model re-estimation";
+   else if ((uFlags&UPXFORM) || xfInfo.useInXForm || xfInfo.usePaXForm)
+      why = "adaptation transforms";
+   if (why != NULL) {
+      HError(-2319,"HERest: %d threads not supported with %s, using 1",
+             nThreads,why);
+      nThreads = 1;
+   }
+}
+
 void Initialise(FBInfo *fbInfo, MemHeap *x, HMMSet *hset, char *hmmListFn)
 {   
    HSetKind hsKind;
@@ -589,8 +653,9 @@ void Initialise(FBInfo *fbInfo, MemHeap *x, HMMSet *hset, char *hmmListFn)
    if(LoadHMMSet( hset,hmmDir,hmmExt)<SUCCESS)
       HError(2321,"Initialise: LoadHMMSet failed");
    if (uFlags&UPSEMIT) uFlags = uFlags|UPMEANS|UPVARS;
-   AttachAccs(hset, &accStack, uFlags);
-   ZeroAccs(hset, uFlags);
+   CheckThreadSetUp(hset);
+   AttachAccsParallel(hset, &accStack, uFlags, nThreads);
+   ZeroAccsParallel(hset, uFlags, nThreads);
    P = hset->numPhyHMM;
    L = hset->numLogHMM;
    vSize = hset->vecSize;
@@ -615,6 +680,7 @@ void Initialise(FBInfo *fbInfo, MemHeap *x, HMMSet *hset, char *hmmListFn)
       printf("\n\n ");
     
       if (parMode>=0) printf("Parallel-Mode[%d] ",parMode);
+      if (nThreads>1) printf("Threads[%d] ",nThreads);
 
       printf("System is ");
       switch (hsKind){
@@ -648,8 +714,8 @@ void Initialise(FBInfo *fbInfo, MemHeap *x, HMMSet *hset, char *hmmListFn)
 
    
    /* initialise and  pass information to the forward backward library */
-   InitialiseForBack(fbInfo, x, hset, uFlags, pruneInit, pruneInc,
-                     pruneLim, minFrwdP);
+   InitialiseForBackParallel(fbInfo, x, hset, uFlags, pruneInit, pruneInc,
+                             pruneLim, minFrwdP, nThreads);
 
    if (parMode != 0) {
       ConvLogWt(hset);
@@ -760,8 +826,9 @@ void StatReport(HMMSet *hset)
 /* -------------------- Top Level of F-B Updating ---------------- */
 
 
-/* Load data and call FBFile: apply forward-backward to given utterance */
-void DoForwardBackward(FBInfo *fbInfo, UttInfo *utt, char * datafn, char * datafn2)
+/* LoadUtterance: load labels and data of given utterance into utt */
+static void LoadUtterance(FBInfo *fbInfo, UttInfo *utt, char * datafn, 
+                          char * datafn2, Boolean *first)
 {
    char datafn_lab[MAXFNAMELEN];
 
@@ -780,10 +847,16 @@ void DoForwardBackward(FBInfo *fbInfo, UttInfo *utt, char * datafn, char * dataf
    /* Load the data */
    LoadData(fbInfo->al_hset, utt, dff, datafn, datafn2);
 
-   if (firstTime) {
+   if (*first) {
       InitUttObservations(utt, fbInfo->al_hset, datafn, fbInfo->maxMixInS);
-      firstTime = FALSE;
+      *first = FALSE;
    }
+}
+
+/* Load data and call FBFile: apply forward-backward to given utterance */
+void DoForwardBackward(FBInfo *fbInfo, UttInfo *utt, char * datafn, char * datafn2)
+{
+   LoadUtterance(fbInfo, utt, datafn, datafn2, &firstTime);
   
    /* fill the alpha beta and otprobs (held in fbInfo) */
    if (FBFile(fbInfo, utt, datafn)) {
@@ -798,6 +871,106 @@ void DoForwardBackward(FBInfo *fbInfo, UttInfo *utt, char * datafn, char * dataf
    }
 }
 
+/* QueueForwardBackward: add an utterance to the worker job list.  The
+   extensions of extended file names are copied now since HShell only
+   keeps the last few */
+void QueueForwardBackward(char *datafn, char *datafn2)
+{
+   FBJob *jobs, *job;
+   ExtFile ext[2];
+   int n;
+
+   if (nJobs==maxJobs) {
+      maxJobs = (maxJobs==0) ? 1024 : 2*maxJobs;
+      jobs = (FBJob *) New(&gcheap, maxJobs*sizeof(FBJob));
+      if (nJobs>0) {
+         memcpy(jobs, fbJobs, nJobs*sizeof(FBJob));
+         Dispose(&gcheap, fbJobs);
+      }
+      fbJobs = jobs;
+   }
+   job = fbJobs+nJobs;
+   job->datafn = CopyString(&uttStack, datafn);
+   job->datafn2 = (datafn2==NULL) ? NULL : CopyString(&uttStack, datafn2);
+   n = 0;
+   if (CopyExtFileName(datafn, ext+n)) n++;
+   if (datafn2!=NULL && CopyExtFileName(datafn2, ext+n)) n++;
+   job->nExt = n;
+   job->ext = NULL;
+   if (n>0) {
+      job->ext = (ExtFile *) New(&uttStack, n*sizeof(ExtFile));
+      memcpy(job->ext, ext, n*sizeof(ExtFile));
+   }
+   nJobs++;
+}
+
+/* FBWorkerThread: forward-backward over utterances idx, idx+nThreads, ... 
+   accumulating into slot idx.  The fixed assignment of utterances to
+   slots makes the summed accumulators independent of thread timing. */
+static void *FBWorkerThread(void *arg)
+{
+   FBWorker *w = (FBWorker *) arg;
+   UttInfo *utt = w->utt;
+   FBJob *job;
+   int i;
+
+   for (i=w->idx; i<nJobs; i+=nThreads) {
+      job = fbJobs+i;
+      pthread_mutex_lock(&loadLock);
+      PinExtFiles(job->ext, job->nExt);
+      LoadUtterance(w->fbInfo, utt, job->datafn, job->datafn2, &w->firstTime);
+      PinExtFiles(NULL, 0);
+      pthread_mutex_unlock(&loadLock);
+      if (FBFile(w->fbInfo, utt, job->datafn)) {
+         w->totalT += utt->T;
+         w->totalPr += utt->pr;
+         if (w->fbInfo->al_hset->xf != NULL)
+            w->totalPr += utt->T*0.5*w->fbInfo->al_hset->xf->xform->det;
+      }
+   }
+   return NULL;
+}
+
+/* RunForwardBackward: process the queued utterances with nThreads
+   workers, each with its own accumulator slot, then reduce the slots.
+   The buffers of the last utterance are passed back in utt. */
+void RunForwardBackward(FBInfo *fbInfo, UttInfo *utt, MemHeap *x)
+{
+   FBWorker *w;
+   int i;
+
+   w = (FBWorker *) New(x, nThreads*sizeof(FBWorker));
+   for (i=0; i<nThreads; i++) {
+      w[i].idx = i;
+      w[i].fbInfo = (FBInfo *) New(x, sizeof(FBInfo));
+      CloneForBack(w[i].fbInfo, fbInfo, x, i);
+      w[i].utt = (UttInfo *) New(x, sizeof(UttInfo));
+      InitUttInfo(w[i].utt, twoDataFiles);
+      w[i].utt->twoDataFiles = twoDataFiles;
+      w[i].utt->S = fbInfo->al_hset->swidth[0];
+      w[i].firstTime = TRUE;
+      w[i].totalPr = 0.0; w[i].totalT = 0;
+   }
+   for (i=0; i<nThreads; i++)
+      if (pthread_create(&w[i].thread, NULL, FBWorkerThread, w+i) != 0)
+         HError(2300,"RunForwardBackward: cannot create thread %d",i);
+   for (i=0; i<nThreads; i++) {
+      if (pthread_join(w[i].thread, NULL) != 0)
+         HError(2300,"RunForwardBackward: cannot join thread %d",i);
+      totalT += w[i].totalT;
+      totalPr += w[i].totalPr;
+   }
+   SumAccsParallel(fbInfo->up_hset, uFlags, nThreads);
+   if (nJobs>0) {
+      utt->pbuf = w[(nJobs-1)%nThreads].utt->pbuf;
+      utt->pbuf2 = w[(nJobs-1)%nThreads].utt->pbuf2;
+   }
+   if (trace&T_TOP) {
+      printf("%d utterances processed by %d threads\n",nJobs,nThreads);
+      fflush(stdout);
+   }
+}
+
 /* --------------------------- Model Update --------------------- */
 
 static int nFloorVar = 0;     /* # of floored variance comps */
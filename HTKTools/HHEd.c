@@ -59,12 +59,14 @@ char *hhed_vc_id = "$Id: HHEd.c,v 1.3 2015/10/12 12:07:24 cz277 Exp $";
 #include "HUtil.h"
 #include "HTrain.h"
 #include "HAdapt.h"
+#include <pthread.h>
 /* cz277 - aug */
 /*#include "HNCache.h"*/
 
 #define FLOAT_MAX 1E10      /* Limit for float arguments */
 #define BIG_FLOAT 1E20      /* Limit for float arguments */
 #define MAX_ITER  500        /* Maximum number of iterations */
+#define MAXTHREADS 256      /* Maximum number of TB scoring threads */
 
                              /* Lowest level of tracing reset at end of each command block */
 #define T_BAS 0x0001        /* Basic progess tracing */
@@ -157,6 +159,7 @@ static char mmfIdMask[MAXSTRLEN] = "*"; /* MMF Id Mask for baseclass */
 static Boolean useLeafStats = TRUE; /* Use leaf stats to init macros */
 static Boolean applyVFloor = TRUE; /* apply modfied varFloors to vars in model set */ 
 static Boolean rankMixUp = FALSE; /* use rank-based mixture splitting*/
+static int nThreads = 1;         /* threads used to score TB questions */
 
 /* ------------------ Process Command Line -------------------------- */
 
@@ -178,7 +181,10 @@ void SetConfParms(void)
       /* rank-based mixture splitting*/
       if (GetConfBool(cParm,nParm,"RANKMIXUP",&b)) rankMixUp = b;
       if (GetConfFlt(cParm,nParm,"MINMIXUPOCC",&f)) minMixUpOcc = f;
+      if (GetConfInt(cParm,nParm,"NUMTHREADS",&i)) nThreads = i;
    }
+   if (nThreads<1 || nThreads>MAXTHREADS)
+      HError(2698,"SetConfParms: NUMTHREADS must be in range 1..%d",MAXTHREADS);
 }
 
 void Summary(void)
@@ -2877,14 +2883,245 @@ void AnswerQuestion(CLink clist,QLink q)
             p->ans=TRUE;
 }
 
+/* ------------------ Tree Statistics Engine -------------------- */
+
+/* During TB the statistics of every item are copied into contiguous
+   arrays and each question is reduced to a bitset over the items.  A
+   split is then scored by summing the member rows under the question
+   bitset, with the questions shared out between NUMTHREADS threads.
+   Members are visited in clist order so the sums, and hence the trees,
+   are identical to those given by ClusterLogL. */
+
+#define MINTHREADWORK 4096      /* min member x question pairs to thread */
+
+typedef struct _TreeStats {     /* statistics of the tree being built */
+   int nItem;                   /* number of items */
+   int nState;                  /* states per item (1 for state trees) */
+   int vSize;                   /* vector size */
+   float *occ;                  /* [i*nState+j] occupation counts */
+   float *sum;                  /* [(i*nState+j)*vSize+k] sums */
+   float *sqr;                  /* [(i*nState+j)*vSize+k] sums of squares */
+   int nQuest;                  /* number of questions */
+   int nWord;                   /* words per question bitset */
+   unsigned int *bits;          /* [q*nWord+w] items answering yes to q */
+   int nMember;                 /* number of items in node being scored */
+   int *member;                 /* [0..nMember-1] items in clist order */
+   float *qProb;                /* [q] split logL of node for q */
+   float *qOcc;                 /* [2*q+ans] split occupation counts */
+} TreeStats;
+
+typedef struct {                /* a question scoring thread */
+   int idx;                     /* thread number, scores idx,idx+nThreads.. */
+   int job;                     /* last job seen */
+   AccSum no,yes;               /* private accumulators */
+   pthread_t thread;
+} TBWorker;
+
+static TreeStats tStats;        /* stats of tree being built */
+static TBWorker *tbWorkers = NULL;   /* array[1..nThreads-1] of workers */
+static pthread_mutex_t tbLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tbWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tbDone = PTHREAD_COND_INITIALIZER;
+static int tbJob = 0;           /* incremented for each node scored */
+static int tbBusy = 0;          /* workers still scoring current node */
+static Boolean tbQuit = FALSE;  /* set to terminate workers */
+
+/* InitTreeStats: copy the AccSums hooked onto the items in clHead into 
+   tStats and build the question bitsets.  Question items must already
+   point to their CRec */
+void InitTreeStats(CLink clHead, int nItem, int l)
+{
+   TreeStats *ts = &tStats;
+   StateElem *se;
+   AccSum *acc;
+   CLink cl;
+   ILink p;
+   QLink q;
+   int i,j,row,n;
+
+   ts->nItem = nItem; ts->vSize = l;
+   if (clHead->item->item == clHead->item->owner)
+      ts->nState = clHead->item->owner->numStates-2;
+   else
+      ts->nState = 1;
+   n = nItem*ts->nState;
+   ts->occ = (float *) New(&tmpHeap,n*sizeof(float));
+   ts->sum = (float *) New(&tmpHeap,n*l*sizeof(float));
+   ts->sqr = (float *) New(&tmpHeap,n*l*sizeof(float));
+   for (cl=clHead; cl!=NULL; cl=cl->next) {
+      i = cl->idx-1;
+      for (j=0; j<ts->nState; j++) {
+         if (cl->item->item == cl->item->owner)
+            se = cl->item->owner->svec+j+2;
+         else
+            se = (StateElem *) cl->item->item;
+         acc = (AccSum *) se->info->pdf[1].spdf.cpdf[1].mpdf->hook;
+         row = i*ts->nState+j;
+         if (acc == NULL) {
+            ts->occ[row] = 0.0;
+            memset(ts->sum+row*l,0,l*sizeof(float));
+            memset(ts->sqr+row*l,0,l*sizeof(float));
+         }
+         else {
+            ts->occ[row] = acc->occ;
+            memcpy(ts->sum+row*l,acc->sum+1,l*sizeof(float));
+            memcpy(ts->sqr+row*l,acc->sqr+1,l*sizeof(float));
+         }
+      }
+   }
+   for (q=qHead,n=0; q!=NULL; q=q->next) n++;
+   ts->nQuest = n;
+   ts->nWord = (nItem+31)/32;
+   ts->bits = (unsigned int *) New(&tmpHeap,n*ts->nWord*sizeof(unsigned int));
+   memset(ts->bits,0,n*ts->nWord*sizeof(unsigned int));
+   for (q=qHead,n=0; q!=NULL; q=q->next,n++)
+      for (p=q->ilist; p!=NULL; p=p->next)
+         if ((cl=(CLink) p->item)!=NULL) {
+            i = cl->idx-1;
+            ts->bits[n*ts->nWord+(i>>5)] |= 1u<<(i&31);
+         }
+   ts->member = (int *) New(&tmpHeap,nItem*sizeof(int));
+   ts->nMember = 0;
+   ts->qProb = (float *) New(&tmpHeap,(ts->nQuest+1)*sizeof(float));
+   ts->qOcc = (float *) New(&tmpHeap,2*(ts->nQuest+1)*sizeof(float));
+}
+
+/* StatsLogL: as ClusterLogL for the current members of tStats, with
+   answers taken from the question bitset (NULL = all no) */
+float StatsLogL(TreeStats *ts, unsigned int *bits, 
+                AccSum *no, AccSum *yes, float *occs)
+{
+   AccSum *tacc;
+   float prob,*dst,*src;
+   int i,j,k,l,m,row;
+
+   l = ts->vSize; prob = 0.0;
+   occs[FALSE] = 0.0; occs[TRUE] = 0.0;
+   for (j=0; j<ts->nState; j++) {
+      ZeroAccSum(no);
+      if (yes != NULL) ZeroAccSum(yes);
+      for (m=0; m<ts->nMember; m++) {
+         i = ts->member[m];
+         row = i*ts->nState+j;
+         if (ts->occ[row] <= 0.0) continue;
+         tacc = (yes != NULL && bits != NULL && 
+                 (bits[i>>5] & (1u<<(i&31)))) ? yes : no;
+         tacc->occ += ts->occ[row];
+         dst = tacc->sum+1; src = ts->sum+row*l;
+         for (k=0; k<l; k++) dst[k] += src[k];
+         dst = tacc->sqr+1; src = ts->sqr+row*l;
+         for (k=0; k<l; k++) dst[k] += src[k];
+      }
+      prob += AccSumProb(no);
+      if (yes != NULL) prob += AccSumProb(yes);
+      occs[FALSE] += no->occ;
+      if (yes != NULL) occs[TRUE] += yes->occ;
+   }
+   return(prob);
+}
+
+/* ScoreQuestions: score questions first, first+step, ... for the
+   current members of tStats using the given accumulators */
+void ScoreQuestions(int first, int step, AccSum *no, AccSum *yes)
+{
+   TreeStats *ts = &tStats;
+   int q;
+
+   for (q=first; q<ts->nQuest; q+=step)
+      ts->qProb[q] = StatsLogL(ts,ts->bits+q*ts->nWord,no,yes,ts->qOcc+2*q);
+}
+
+/* TBWorkerThread: wait for a node to be posted and score its share
+   of the questions */
+static void *TBWorkerThread(void *arg)
+{
+   TBWorker *w = (TBWorker *) arg;
+
+   for (;;) {
+      pthread_mutex_lock(&tbLock);
+      while (!tbQuit && tbJob == w->job)
+         pthread_cond_wait(&tbWork,&tbLock);
+      if (tbQuit) {
+         pthread_mutex_unlock(&tbLock);
+         return NULL;
+      }
+      w->job = tbJob;
+      pthread_mutex_unlock(&tbLock);
+      ScoreQuestions(w->idx,nThreads,&w->no,&w->yes);
+      pthread_mutex_lock(&tbLock);
+      if (--tbBusy == 0) pthread_cond_signal(&tbDone);
+      pthread_mutex_unlock(&tbLock);
+   }
+}
+
+/* StartTBWorkers: create nThreads-1 scoring threads, the main thread
+   takes the remaining share */
+void StartTBWorkers(int l)
+{
+   TBWorker *w;
+   int i;
+
+   if (nThreads<=1) return;
+   tbWorkers = (TBWorker *) New(&tmpHeap,nThreads*sizeof(TBWorker));
+   tbQuit = FALSE;
+   for (i=1; i<nThreads; i++) {
+      w = tbWorkers+i;
+      w->idx = i; w->job = tbJob;
+      w->yes.sum=CreateVector(&tmpHeap,l); w->yes.sqr=CreateVector(&tmpHeap,l);
+      w->no.sum=CreateVector(&tmpHeap,l);  w->no.sqr=CreateVector(&tmpHeap,l);
+      if (pthread_create(&w->thread,NULL,TBWorkerThread,w) != 0)
+         HError(2698,"StartTBWorkers: cannot create thread %d",i);
+   }
+}
+
+/* StopTBWorkers: terminate the scoring threads */
+void StopTBWorkers(void)
+{
+   int i;
+
+   if (tbWorkers == NULL) return;
+   pthread_mutex_lock(&tbLock);
+   tbQuit = TRUE;
+   pthread_cond_broadcast(&tbWork);
+   pthread_mutex_unlock(&tbLock);
+   for (i=1; i<nThreads; i++)
+      if (pthread_join(tbWorkers[i].thread,NULL) != 0)
+         HError(2698,"StopTBWorkers: cannot join thread %d",i);
+   tbWorkers = NULL;
+}
+
+/* ScoreAllQuestions: fill tStats.qProb and qOcc for the current
+   members, in parallel if the node is big enough */
+void ScoreAllQuestions(void)
+{
+   if (tbWorkers == NULL || tStats.nMember*tStats.nQuest < MINTHREADWORK) {
+      ScoreQuestions(0,1,&no,&yes);
+      return;
+   }
+   pthread_mutex_lock(&tbLock);
+   tbBusy = nThreads-1; tbJob++;
+   pthread_cond_broadcast(&tbWork);
+   pthread_mutex_unlock(&tbLock);
+   ScoreQuestions(0,nThreads,&no,&yes);
+   pthread_mutex_lock(&tbLock);
+   while (tbBusy > 0)
+      pthread_cond_wait(&tbDone,&tbLock);
+   pthread_mutex_unlock(&tbLock);
+}
+
 /* ValidProbNode: set tProb and sProb of given node according to best
    possible question which is stored in quest field.  */
 void ValidProbNode(Node *node,float thresh)
 {
    QLink q,qbest;
    float best,sProb;
+   CLink cl;
+   int n;
    
-   node->tProb = ClusterLogL(node->clist,&no,NULL,occs);
+   for (cl=node->clist,n=0; cl!=NULL; cl=cl->next)
+      tStats.member[n++] = cl->idx-1;
+   tStats.nMember = n;
+   node->tProb = StatsLogL(&tStats,NULL,&no,NULL,occs);
    node->occ = occs[FALSE];
    if (trace & T_TREE_BESTQ) {
       char buf[20];
@@ -2900,9 +3137,10 @@ void ValidProbNode(Node *node,float thresh)
    }
    qbest = NULL;
    best = node->tProb;
-   for (q=qHead;q!=NULL;q=q->next) {
-      AnswerQuestion(node->clist,q);
-      sProb = ClusterLogL(node->clist,&no,&yes,occs);
+   ScoreAllQuestions();
+   for (q=qHead,n=0;q!=NULL;q=q->next,n++) {
+      sProb = tStats.qProb[n];
+      occs[FALSE] = tStats.qOcc[2*n]; occs[TRUE] = tStats.qOcc[2*n+1];
       if (node->occ<=0.0 || (outlierThresh >= 0.0 &&  
                              (occs[FALSE]<outlierThresh || occs[TRUE]<outlierThresh)))
          sProb=node->tProb;
@@ -3232,8 +3470,10 @@ void BuildTree(ILink ilist,float threshold, char *macRoot)
    for (q=qHead; q!=NULL; q=q->next)
       for (p=q->ilist; p!=NULL; p=p->next)
          p->item = p->owner->hook;
+   InitTreeStats(clHead,i-1,l);
    for (p=ilist;p!=NULL;p=p->next,i++)
       p->owner->hook=NULL;
+   StartTBWorkers(l);
 
    /* Create the root of the tree */
    node = tree->leaf = tree->root = CreateTreeNode(clHead,NULL);
@@ -3296,6 +3536,7 @@ void BuildTree(ILink ilist,float threshold, char *macRoot)
       }
       MergeLeaves(tree,threshold);
    }
+   StopTBWorkers();
    
    /* Finally assign a macro to each leaf node and do tie */
    totalItems += numItems; totalClust += numTreeClust;
@@ -94,6 +94,7 @@ static int trace = 0;               /* Trace level */
 static ConfParam *cParm[MAXGLOBS];   /* configuration parameters */
 static int nParm = 0;               /* total num params */
 static Vector vFloor[SMAX];         /* variance floor - default is all zero */
+static int gaussBlock = 16;         /* frames per GaussScorer block, 0 = per frame */
 
 /* Major Data Structures plus related global vars*/
 static HMMSet hset;              /* The current unitary hmm set */
@@ -114,6 +115,8 @@ static ParmBuf pbuf;             /* Currently input parm buffer */
 /* Storage for Viterbi Decoding */
 static Vector   thisP,lastP;     /* Columns of log probabilities */
 static short   **traceBack;      /* array[1..segLen][2..numStates-1] */
+static GaussScorer *scorer = NULL; /* batched output probs (PLAINHS/SHAREDHS) */
+static MemHeap scorerStack;      /* For storage of the scorer */
    
 
 /* ---------------- Process Conf File & Command Line ----------------- */
@@ -126,6 +129,7 @@ void SetConfParms(void)
    nParm = GetConfig("HINIT", TRUE, cParm, MAXGLOBS);
    if (nParm>0) {
       if (GetConfInt(cParm,nParm,"TRACE",&i)) trace = i;
+      if (GetConfInt(cParm,nParm,"GAUSSBLOCK",&i)) gaussBlock = i;
    }
 }
 
@@ -336,6 +340,7 @@ void Initialise(void)
    CreateHeap(&transStack,"TransStore", MSTAK, 1, 0.0, 1000, 1000);
    CreateHeap(&traceBackStack,"TraceBackStore", MSTAK, 1, 0.0, 1000, 1000);
    CreateHeap(&bufferStack,"BufferStore", MSTAK, 1, 0.0, 1000, 1000);
+   CreateHeap(&scorerStack,"ScorerStore", MSTAK, 1, 0.0, 10000, LONG_MAX);
 
    /* Load HMM def */
    if(MakeOneHMM( &hset, BaseOf(hmmfn,base))<SUCCESS)
@@ -793,6 +798,32 @@ void FindBestMixes(int segNum, int segLen, IntVec states, IntVec *mixes)
    }
 }
 
+/* BlockOutP: set outP[j][1..segLen] to the output prob of each emitting
+   state j for every frame of the segNum'th segment */
+void BlockOutP(int segNum, int segLen, Matrix outP)
+{
+   Observation *obs,**optr;
+   Vector bp;
+   int t,i,j,n;
+
+   obs = (Observation *)New(&traceBackStack, gaussBlock*sizeof(Observation));
+   optr = (Observation **)New(&traceBackStack, gaussBlock*sizeof(Observation *));
+   bp = CreateVector(&traceBackStack,gaussBlock);
+   for (t=1; t<=segLen; t+=n) {
+      n = (segLen-t+1 < gaussBlock) ? segLen-t+1 : gaussBlock;
+      for (i=0; i<n; i++) {
+         obs[i] = GetSegObs(segStore, segNum, t+i);
+         optr[i] = obs+i;
+      }
+      LoadGaussBlock(scorer,optr,n);
+      for (j=2; j<nStates; j++) {
+         GaussBlockOutP(scorer,hmmLink->svec[j].info,bp);
+         for (i=1; i<=n; i++)
+            outP[j][t+i-1] = bp[i];
+      }
+   }
+}
+
 /* ViterbiAlign: align the segNum'th segment.  For each frame k, store aligned
    state in states and mostly likely mix comp in mixes.  Return logP. */
 LogFloat ViterbiAlign(int segNum,int segLen, IntVec states, IntVec *mixes)
@@ -801,10 +832,15 @@ LogFloat ViterbiAlign(int segNum,int segLen, IntVec states, IntVec *mixes)
    int segIdx;
    LogFloat  bestP,currP,tranP,prevP;
    Observation obs;
+   Matrix outP = NULL;
 
    if (trace & T_VIT)
       printf(" Aligning Segment Number %d\n",segNum);
    MakeTraceBack(segLen);
+   if (scorer != NULL) {
+      outP = CreateMatrix(&traceBackStack,nStates,segLen);
+      BlockOutP(segNum,segLen,outP);
+   }
    
    /* From entry state 1: Column 1 */
    obs = GetSegObs(segStore, segNum, 1);
@@ -815,7 +851,8 @@ LogFloat ViterbiAlign(int segNum,int segLen, IntVec states, IntVec *mixes)
       if (tranP<LSMALL) 
          lastP[currState] = LZERO;
       else
-         lastP[currState] = tranP + OutP(&obs,hmmLink,currState);
+         lastP[currState] = tranP + ((outP!=NULL) ? outP[currState][1] :
+                                     OutP(&obs,hmmLink,currState));
       traceBack[1][currState] = 1;
    }
    if (trace & T_VIT) ShowP(1,lastP);  
@@ -840,7 +877,8 @@ LogFloat ViterbiAlign(int segNum,int segLen, IntVec states, IntVec *mixes)
          if (bestP<LSMALL)
             currP = thisP[currState] = LZERO;
          else {
-            currP = OutP(&obs,hmmLink,currState);
+            currP = (outP!=NULL) ? outP[currState][segIdx] :
+               OutP(&obs,hmmLink,currState);
             thisP[currState] = bestP+currP;
          }
          if (trace&T_OBP)
@@ -1210,6 +1248,10 @@ void EstimateModel(void)
    totalP=LZERO;
    for (iter=1; !converged && iter<=maxIter; iter++){
       ZeroAccs(&hset, uFlags);              /* Clear all accumulators */
+      if (gaussBlock>0 && (hset.hsKind==PLAINHS || hset.hsKind==SHAREDHS)) {
+         ResetHeap(&scorerStack);           /* repack the updated parameters */
+         scorer = CreateGaussScorer(&scorerStack,&hset,gaussBlock);
+      }
       numSegs = NumSegs(segStore);
       /* Align on each training segment and accumulate stats */
       for (newP=0.0,i=1;i<=numSegs;i++) {
@@ -0,0 +1,262 @@
+/* ----------------------------------------------------------- */
+/*                                                             */
+/*                          ___                                */
+/*                       |_| | |_/   SPEECH                    */
+/*                       | | | | \   RECOGNITION               */
+/*                       =========   SOFTWARE                  */
+/*                                                             */
+/*                                                             */
+/* ----------------------------------------------------------- */
+/*           Copyright: Cambridge University                   */
+/*                      Engineering Department                 */
+/*            2013-2015 Cambridge, Cambridgeshire UK           */
+/*                      http://www.eng.cam.ac.uk               */
+/*                                                             */
+/*   Use of this software is governed by a License Agreement   */
+/*    ** See the file License for the Conditions of Use  **    */
+/*    **     This banner notice must not be removed      **    */
+/*                                                             */
+/* ----------------------------------------------------------- */
+/*    File: HNBench.c  ANN matrix product benchmark program    */
+/* ----------------------------------------------------------- */
+
+char *hnbench_version = "!HVER!HNBench:   3.5.0 [CUED 12/10/15]";
+char *hnbench_vc_id = "$Id: HNBench.c,v 1.0 2015/10/12 12:07:24 Exp $";
+
+/*
+  This program times the HNBlas??gemm products used by HNForward and
+  HNTrainSGD against the plain triple loops they replaced, reporting
+  GFLOP/s and the largest relative difference for each product type
+  and layer shape.  Shapes are given as m n k triples (C is m x n,
+  inner dimension k), e.g. output nodes, minibatch and input nodes.
+*/
+
+#include "HShell.h"
+#include "HMem.h"
+#include "HMath.h"
+
+#include <time.h>
+#include <math.h>
+
+/* -------------------------- Trace Flags & Vars ------------------------ */
+
+#define T_TOP  0001     /* Top level tracing */
+
+static int trace = 0;
+
+/* ---------------- Configuration Parameters --------------------- */
+
+static ConfParam *cParm[MAXGLOBS];
+static int nParm = 0;
+
+/* -------------------------- Global Variables etc ---------------------- */
+
+#define MAXSHAPES 64
+
+typedef enum { GEMM_NN, GEMM_NT, GEMM_TN } GemmType;
+
+static char *gemmTypeName[] = { "NN", "NT", "TN" };
+
+/* typical DNN layers: hidden x minibatch x input */
+static int defShapes[][3] = {
+   {1024, 256, 440}, {2048, 256, 2048}, {4000, 256, 2048}, {2048, 800, 2048}
+};
+
+static int nShapes = 0;
+static int shapes[MAXSHAPES][3];
+static int nReps = 3;                   /* timed runs of the HNBlas products */
+static Boolean useLoops = TRUE;         /* also time the reference loops */
+
+static MemHeap benchHeap;
+
+/* ---------------- Process Command Line ------------------------- */
+
+/* SetConfParms: set conf parms relevant to this tool */
+void SetConfParms(void)
+{
+   int i;
+
+   nParm = GetConfig("HNBENCH", TRUE, cParm, MAXGLOBS);
+   if (nParm > 0) {
+      if (GetConfInt(cParm, nParm, "TRACE", &i)) trace = i;
+   }
+}
+
+void ReportUsage(void)
+{
+   printf("\nUSAGE: HNBench [options] [m n k ...]\n\n");
+   printf(" Option                                       Default\n\n");
+   printf(" -n      Do not time the reference loops      off\n");
+   printf(" -r n    Number of timed runs per product     3\n");
+   PrintStdOpts("");
+   printf("\n\n");
+}
+
+/* ------------------------ Reference loops ------------------------- */
+
+/* LoopGemm: the column major triple loops that HNBlas??gemm used before
+   the blocked engine, C = alpha * op(A) * op(B) + beta * C */
+static void LoopGemm(GemmType type, int m, int n, int k, NFloat alpha, NFloat *A, NFloat *B, NFloat beta, NFloat *C)
+{
+   int i, j, l;
+
+   for (i = 0; i < n; ++i) {
+      for (j = 0; j < m; ++j) {
+         C[i * m + j] *= beta;
+         for (l = 0; l < k; ++l) {
+            switch (type) {
+            case GEMM_NN: C[i * m + j] += alpha * A[l * m + j] * B[i * k + l]; break;
+            case GEMM_NT: C[i * m + j] += alpha * A[l * m + j] * B[l * n + i]; break;
+            case GEMM_TN: C[i * m + j] += alpha * A[j * k + l] * B[i * k + l]; break;
+            }
+         }
+      }
+   }
+}
+
+/* ------------------------ Benchmark ------------------------- */
+
+/* WallTime: elapsed seconds, includes the time of GEMM threads */
+static double WallTime(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+/* FillNMatrix: set the first n elements of m to uniform noise */
+static void FillNMatrix(NMatrix *m, size_t n)
+{
+   size_t i;
+
+   for (i = 0; i < n; ++i)
+      m->matElems[i] = RandomValue() - 0.5;
+}
+
+/* BlasGemm: the HNBlas product of the given type */
+static void BlasGemm(GemmType type, int m, int n, int k, NMatrix *A, NMatrix *B, NMatrix *C)
+{
+   switch (type) {
+   case GEMM_NN: HNBlasNNgemm(m, n, k, 1.0, A, B, 0.0, C); break;
+   case GEMM_NT: HNBlasNTgemm(m, n, k, 1.0, A, B, 0.0, C); break;
+   case GEMM_TN: HNBlasTNgemm(m, n, k, 1.0, A, B, 0.0, C); break;
+   }
+}
+
+/* BenchShape: time all product types for C = m x n, inner dimension k */
+static void BenchShape(int m, int n, int k)
+{
+   NMatrix *A, *B, *C, *R;
+   GemmType type;
+   double flops, t, best, loopRate, err, ref;
+   size_t i;
+   int r;
+
+   A = CreateNMatrix(&benchHeap, m, k);
+   B = CreateNMatrix(&benchHeap, k, n);
+   C = CreateNMatrix(&benchHeap, m, n);
+   R = CreateNMatrix(&benchHeap, m, n);
+   FillNMatrix(A, (size_t) m * k);
+   FillNMatrix(B, (size_t) k * n);
+   flops = 2.0 * m * n * k;
+
+   for (type = GEMM_NN; type <= GEMM_TN; ++type) {
+      best = -1.0;
+      for (r = 0; r < nReps; ++r) {
+         t = WallTime();
+         BlasGemm(type, m, n, k, A, B, C);
+         t = WallTime() - t;
+         if (best < 0.0 || t < best)
+            best = t;
+      }
+      printf("%-4s %5d %5d %5d  %8.2f", gemmTypeName[type], m, n, k, flops / best * 1.0e-9);
+      if (useLoops) {
+         for (i = 0; i < (size_t) m * n; ++i)
+            R->matElems[i] = 0.0;
+         t = WallTime();
+         LoopGemm(type, m, n, k, 1.0, A->matElems, B->matElems, 0.0, R->matElems);
+         t = WallTime() - t;
+         loopRate = flops / t * 1.0e-9;
+         err = ref = 0.0;
+         for (i = 0; i < (size_t) m * n; ++i) {
+            if (fabs(C->matElems[i] - R->matElems[i]) > err)
+               err = fabs(C->matElems[i] - R->matElems[i]);
+            if (fabs(R->matElems[i]) > ref)
+               ref = fabs(R->matElems[i]);
+         }
+         printf("  %8.2f  %7.1fx  %9.2e", loopRate, flops / best * 1.0e-9 / loopRate, (ref > 0.0) ? err / ref : err);
+      }
+      printf("\n");
+      fflush(stdout);
+   }
+   ResetHeap(&benchHeap);
+}
+
+/* ----------------------------------------------------------- */
+
+int main(int argc, char *argv[])
+{
+   char *s;
+   int i, j;
+
+   if (InitShell(argc, argv, hnbench_version, hnbench_vc_id) < SUCCESS)
+      HError(4400, "HNBench: InitShell failed");
+   InitMem();
+   InitMath();
+
+   if (!InfoPrinted() && NumArgs() == 0)
+      ReportUsage();
+   SetConfParms();
+
+   while (NextArg() == SWITCHARG) {
+      s = GetSwtArg();
+      if (strlen(s) != 1)
+         HError(4419, "HNBench: Bad switch %s; must be single letter", s);
+      switch (s[0]) {
+      case 'n':
+         useLoops = FALSE; break;
+      case 'r':
+         nReps = GetChkedInt(1, 1000, s); break;
+      case 'T':
+         trace = GetChkedInt(0, 0777, s); break;
+      default:
+         HError(4419, "HNBench: Unknown switch %s", s);
+      }
+   }
+   while (NumArgs() > 0) {
+      if (nShapes == MAXSHAPES)
+         HError(4419, "HNBench: Too many shapes, max %d", MAXSHAPES);
+      for (j = 0; j < 3; ++j) {
+         if (NextArg() != INTARG)
+            HError(4419, "HNBench: Shapes must be given as m n k integer triples");
+         shapes[nShapes][j] = GetIntArg();
+         if (shapes[nShapes][j] < 1)
+            HError(4419, "HNBench: Shape dimensions must be positive");
+      }
+      ++nShapes;
+   }
+   if (nShapes == 0) {
+      nShapes = sizeof(defShapes) / sizeof(defShapes[0]);
+      for (i = 0; i < nShapes; ++i)
+         for (j = 0; j < 3; ++j)
+            shapes[i][j] = defShapes[i][j];
+   }
+
+   CreateHeap(&benchHeap, "bench heap", MSTAK, 1, 0.0, 100000000, ULONG_MAX);
+   if (trace & T_TOP)
+      printf("HNBench: %d shape(s), best of %d run(s)\n", nShapes, nReps);
+   printf("type     m     n     k    GFLOP/s");
+   if (useLoops)
+      printf("   loops    speedup  rel. diff");
+   printf("\n");
+   for (i = 0; i < nShapes; ++i)
+      BenchShape(shapes[i][0], shapes[i][1], shapes[i][2]);
+
+   Exit(0);
+   return (0);          /* never reached -- make compiler happy */
+}
+
+/* ----------------------------------------------------------- */
+/*                      END:  HNBench.c                        */
+/* ----------------------------------------------------------- */
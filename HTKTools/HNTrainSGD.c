@@ -236,6 +236,9 @@ static FILE *scriptFLabHV = NULL;
 static int scriptCntFLabHV = 0;
 static int tSampCntFLabHV = 0;
 
+static char *corpusTr = NULL;                   /* packed corpus file for the train set */
+static char *corpusHV = NULL;                   /* packed corpus file for the held-out validation set */
+
 static LabelKind labelKind = NULLLK;            /* the kind of the labels */
 static LabelInfo *labelInfo = NULL;             /* the structure for the labels */
 static BatchUpdateKind updtKind = BATLEVEL;     /* the update kind */  
@@ -750,6 +753,11 @@ void SetConfParms(void)
             useLLF = boolVal;
         if (GetConfBool(cParm, nParm, "INCNUMLATINDENLAT", &boolVal)) 
             optIncNumInDen = boolVal;
+        /* packed corpora, created by the first run that names them */
+        if (GetConfStr(cParm, nParm, "TRAINCORPUS", buf)) 
+            corpusTr = CopyString(&gcheap, buf);
+        if (GetConfStr(cParm, nParm, "VALIDCORPUS", buf)) 
+            corpusHV = CopyString(&gcheap, buf);
     }
     /* HParm: HNTrainSGD */
     SetChannel("HPARMLABEL");
@@ -1250,10 +1258,19 @@ void CheckFitMaxNorm(ANNSet *annSet) {
 }
 
 
+/* the packed corpus file of stream s: name itself for one stream, name.s otherwise */
+static char *MakeCorpusName(char *name, int s, char *buf) {
+    if (hset.swidth[0] == 1) 
+        return name;
+    sprintf(buf, "%s.%d", name, s);
+    return buf;
+}
+
 void Initialise(void) {
     Boolean eSep;
     /*int s, tSampCntTr, tSampCntHV;*/
     int s;
+    char buf[MAXSTRLEN];
     VisitKind visitKindTr=GetDefaultVisitKind();
     short swidth[SMAX];
 
@@ -1397,6 +1414,8 @@ void Initialise(void) {
         visitKindTr = GetDefaultVisitKind();
         labelInfo->dimFLab = swidth[s];
         cacheTr[s] = CreateCache(&cacheHeap, scriptTr, scriptCntTr, &hset, &obs, s, GetDefaultNCacheSamples(), visitKindTr, &xfInfo, labelInfo, TRUE);
+        if (corpusTr != NULL) 
+            AttachCacheCorpus(cacheTr[s], MakeCorpusName(corpusTr, s, buf));
     }
     if (scriptHV != NULL) {
         /*tSampCntHV = GetScpSampCnt(scriptHV);
@@ -1413,6 +1432,8 @@ void Initialise(void) {
                 visitKindHV = PLNONEVK;
             labelInfo->dimFLab = swidth[s];
             cacheHV[s] = CreateCache(&cacheHeap, scriptHV, scriptCntHV, (Ptr) &hset, &obs, s, GetDefaultNCacheSamples(), visitKindHV, &xfInfo, labelInfo, TRUE);
+            if (corpusHV != NULL) 
+                AttachCacheCorpus(cacheHV[s], MakeCorpusName(corpusHV, s, buf));
         }
     }
     /* set need2Unload flag */
@@ -56,6 +56,7 @@ char *hvite_vc_id = "$Id: HVite.c,v 1.2 2015/10/12 12:07:24 cz277 Exp $";
 #include "HLabel.h"
 #include "HANNet.h"
 #include "HModel.h"
+#include "HGSel.h"
 #include "HUtil.h"
 #include "HTrain.h"
 #include "HAdapt.h"
@@ -259,6 +260,7 @@ int main(int argc, char *argv[])
    InitMath();  InitSigP();
    InitWave();  InitAudio();
    InitVQ();    InitModel();
+   InitGSel();
 /* cz277 - ANN */
 #ifdef CUDA
     InitCUDA();